@@ -8,6 +8,9 @@
 /* Define to 1 to enable message logging. */
 #define ENABLE_LOGGING 1
 
+/* Define to 1 to collect transfer statistics. */
+#define ENABLE_STATS 1
+
 /* On 10.12 and later, use newly available clock_*() functions */
 #if MAC_OS_X_VERSION_MIN_REQUIRED >= 101200
 /* Define to 1 if you have the `clock_gettime' function. */
@@ -26,6 +26,9 @@
 /* Define to 1 to enable message logging. */
 #define ENABLE_LOGGING 1
 
+/* Define to 1 to collect transfer statistics. */
+#define ENABLE_STATS 1
+
 /* Define to 1 if you have the <asm/types.h> header file. */
 #define HAVE_ASM_TYPES_H 1
 
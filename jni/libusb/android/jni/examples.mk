@@ -125,6 +125,23 @@ LOCAL_MODULE := sam3u_benchmark
 
 include $(BUILD_EXECUTABLE)
 
+# submit_benchmark
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+  $(LIBUSB_ROOT_REL)/examples/submit_benchmark.c
+
+LOCAL_C_INCLUDES += \
+  $(LOCAL_PATH)/.. \
+  $(LIBUSB_ROOT_ABS)
+
+LOCAL_SHARED_LIBRARIES += libusb1.0
+
+LOCAL_MODULE := submit_benchmark
+
+include $(BUILD_EXECUTABLE)
+
 # xusb
 
 include $(CLEAR_VARS)
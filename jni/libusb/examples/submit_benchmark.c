@@ -0,0 +1,199 @@
+/*
+ * libusb example program to compare single and batched transfer submission
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Usage: submit_benchmark VID:PID INTERFACE ENDPOINT [TRANSFERS] [ROUNDS]
+ *
+ * ENDPOINT must be a bulk or interrupt IN endpoint of INTERFACE which does
+ * not complete transfers on its own quickly (an idle endpoint is ideal).
+ * Every round submits TRANSFERS transfers, once with a libusb_submit_transfer()
+ * loop and once with a single libusb_submit_transfers() call, and then
+ * cancels them again. Only the time spent submitting is measured.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "libusb.h"
+
+#define MAX_TRANSFERS	64
+#define BUFFER_SIZE	512
+
+static struct libusb_transfer *transfers[MAX_TRANSFERS];
+static int num_flying;
+
+static double get_time_us(void)
+{
+#if defined(HAVE_CLOCK_GETTIME)
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+#endif
+}
+
+static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr)
+{
+	(void)xfr;
+	num_flying--;
+}
+
+static int cancel_all(libusb_context *ctx, int count)
+{
+	int i, r;
+
+	for (i = 0; i < count; i++)
+		libusb_cancel_transfer(transfers[i]);
+
+	while (num_flying > 0) {
+		r = libusb_handle_events(ctx);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int run_round(libusb_context *ctx, int count, int batched, double *elapsed)
+{
+	double start;
+	int i, r = 0;
+
+	start = get_time_us();
+	if (batched) {
+		r = libusb_submit_transfers(transfers, count);
+		if (r > 0)
+			num_flying = r;
+	} else {
+		for (i = 0; i < count; i++) {
+			r = libusb_submit_transfer(transfers[i]);
+			if (r < 0)
+				break;
+			num_flying++;
+		}
+		if (r == 0)
+			r = count;
+	}
+	*elapsed += get_time_us() - start;
+
+	if (r != count) {
+		fprintf(stderr, "submitted %d of %d transfers: %s\n", num_flying,
+			count, r < 0 ? libusb_error_name(r) : "short batch");
+		cancel_all(ctx, num_flying);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return cancel_all(ctx, count);
+}
+
+int main(int argc, char **argv)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *devh = NULL;
+	unsigned int vid, pid;
+	int intf, ep, count = 16, rounds = 1000;
+	double single = 0.0, batched = 0.0;
+	int i, r;
+
+	if (argc < 4 || sscanf(argv[1], "%x:%x", &vid, &pid) != 2) {
+		fprintf(stderr, "usage: %s VID:PID INTERFACE ENDPOINT [TRANSFERS] [ROUNDS]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+	intf = (int)strtol(argv[2], NULL, 0);
+	ep = (int)strtol(argv[3], NULL, 0);
+	if (argc > 4)
+		count = atoi(argv[4]);
+	if (argc > 5)
+		rounds = atoi(argv[5]);
+	if (count < 1 || count > MAX_TRANSFERS || rounds < 1 || !(ep & LIBUSB_ENDPOINT_IN)) {
+		fprintf(stderr, "invalid arguments\n");
+		return EXIT_FAILURE;
+	}
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %s\n", libusb_error_name(r));
+		return EXIT_FAILURE;
+	}
+
+	devh = libusb_open_device_with_vid_pid(ctx, (uint16_t)vid, (uint16_t)pid);
+	if (!devh) {
+		fprintf(stderr, "could not open device %04x:%04x\n", vid, pid);
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	libusb_set_auto_detach_kernel_driver(devh, 1);
+	r = libusb_claim_interface(devh, intf);
+	if (r < 0) {
+		fprintf(stderr, "could not claim interface %d: %s\n", intf, libusb_error_name(r));
+		goto out;
+	}
+
+	/* Bulk and interrupt transfers are submitted the same way by every
+	 * backend, so a bulk transfer can be used for either endpoint type. */
+	for (i = 0; i < count; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out_release;
+		}
+		libusb_fill_bulk_transfer(transfers[i], devh, (unsigned char)ep,
+			malloc(BUFFER_SIZE), BUFFER_SIZE, cb_xfr, NULL, 0);
+		if (!transfers[i]->buffer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out_release;
+		}
+		transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	for (i = 0; i < rounds; i++) {
+		r = run_round(ctx, count, 0, &single);
+		if (r < 0)
+			goto out_release;
+		r = run_round(ctx, count, 1, &batched);
+		if (r < 0)
+			goto out_release;
+	}
+
+	printf("%d rounds of %d transfers\n", rounds, count);
+	printf("libusb_submit_transfer loop: %.2f us per round\n", single / rounds);
+	printf("libusb_submit_transfers:     %.2f us per round\n", batched / rounds);
+
+out_release:
+	for (i = 0; i < count; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_release_interface(devh, intf);
+out:
+	if (devh)
+		libusb_close(devh);
+	libusb_exit(ctx);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
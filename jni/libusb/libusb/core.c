@@ -47,6 +47,11 @@ static libusb_log_cb log_handler;
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
 
+#ifdef ENABLE_MOCK_BACKEND
+const struct usbi_os_backend *usbi_active_backend = &usbi_platform_backend;
+static int use_mock_backend;
+#endif
+
 /**
  * \mainpage libusb-1.0 API Reference
  *
@@ -367,6 +372,8 @@ if (cfg != desired)
   * - libusb_claim_interface()
   * - libusb_clear_halt()
   * - libusb_close()
+  * - libusb_config_view_next_endpoint()
+  * - libusb_config_view_next_interface()
   * - libusb_control_transfer()
   * - libusb_control_transfer_get_data()
   * - libusb_control_transfer_get_setup()
@@ -374,6 +381,11 @@ if (cfg != desired)
   * - libusb_detach_kernel_driver()
   * - libusb_dev_mem_alloc()
   * - libusb_dev_mem_free()
+  * - libusb_dev_mem_pool_create()
+  * - libusb_dev_mem_pool_destroy()
+  * - libusb_dev_mem_pool_get()
+  * - libusb_dev_mem_pool_is_dev_mem()
+  * - libusb_dev_mem_pool_put()
   * - libusb_error_name()
   * - libusb_event_handler_active()
   * - libusb_event_handling_ok()
@@ -395,11 +407,14 @@ if (cfg != desired)
   * - libusb_free_transfer()
   * - libusb_free_usb_2_0_extension_descriptor()
   * - libusb_get_active_config_descriptor()
+  * - libusb_get_active_config_view()
   * - libusb_get_bos_descriptor()
   * - libusb_get_bus_number()
   * - libusb_get_config_descriptor()
   * - libusb_get_config_descriptor_by_value()
+  * - libusb_get_config_view()
   * - libusb_get_configuration()
+  * - libusb_get_context_stats()
   * - libusb_get_container_id_descriptor()
   * - libusb_get_descriptor()
   * - libusb_get_device()
@@ -1020,31 +1035,6 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return dev->speed;
 }
 
-static const struct libusb_endpoint_descriptor *find_endpoint(
-	struct libusb_config_descriptor *config, unsigned char endpoint)
-{
-	int iface_idx;
-	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
-		const struct libusb_interface *iface = &config->interface[iface_idx];
-		int altsetting_idx;
-
-		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
-				altsetting_idx++) {
-			const struct libusb_interface_descriptor *altsetting
-				= &iface->altsetting[altsetting_idx];
-			int ep_idx;
-
-			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
-				const struct libusb_endpoint_descriptor *ep =
-					&altsetting->endpoint[ep_idx];
-				if (ep->bEndpointAddress == endpoint)
-					return ep;
-			}
-		}
-	}
-	return NULL;
-}
-
 /** \ingroup libusb_dev
  * Convenience function to retrieve the wMaxPacketSize value for a particular
  * endpoint in the active device configuration.
@@ -1064,28 +1054,14 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
 int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
+	struct usbi_endpoint_sizes sizes;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	r = ep->wMaxPacketSize;
+	r = usbi_get_endpoint_sizes(dev, endpoint, &sizes);
+	if (r < 0)
+		return r;
 
-out:
-	libusb_free_config_descriptor(config);
-	return r;
+	return sizes.max_packet_size;
 }
 
 /** \ingroup libusb_dev
@@ -1119,50 +1095,14 @@ out:
 int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
-	struct libusb_ss_endpoint_companion_descriptor *ss_ep_cmp;
-	enum libusb_endpoint_transfer_type ep_type;
-	uint16_t val;
+	struct usbi_endpoint_sizes sizes;
 	int r;
-	int speed;
-
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	speed = libusb_get_device_speed(dev);
-	if (speed >= LIBUSB_SPEED_SUPER) {
-		r = libusb_get_ss_endpoint_companion_descriptor(dev->ctx, ep, &ss_ep_cmp);
-		if (r == LIBUSB_SUCCESS) {
-			r = ss_ep_cmp->wBytesPerInterval;
-			libusb_free_ss_endpoint_companion_descriptor(ss_ep_cmp);
-		}
-	}
-
-	/* If the device isn't a SuperSpeed device or retrieving the SS endpoint didn't worked. */
-	if (speed < LIBUSB_SPEED_SUPER || r < 0) {
-		val = ep->wMaxPacketSize;
-		ep_type = (enum libusb_endpoint_transfer_type) (ep->bmAttributes & 0x3);
 
-		r = val & 0x07ff;
-		if (ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS
-		    || ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT)
-			r *= (1 + ((val >> 11) & 3));
-	}
+	r = usbi_get_endpoint_sizes(dev, endpoint, &sizes);
+	if (r < 0)
+		return r;
 
-out:
-	libusb_free_config_descriptor(config);
-	return r;
+	return sizes.max_iso_packet_size;
 }
 
 /** \ingroup libusb_dev
@@ -1208,6 +1148,7 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 			usbi_disconnect_device(dev);
 		}
 
+		usbi_free_desc_cache(dev);
 		usbi_mutex_destroy(&dev->lock);
 		free(dev);
 	}
@@ -1329,6 +1270,10 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return r;
 	}
 
+	/* the configuration may have been changed while the device was closed,
+	 * possibly by another process */
+	usbi_invalidate_endpoint_sizes(dev);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_add(&_dev_handle->list, &ctx->open_devs);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
@@ -1422,6 +1367,7 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		list_del(&itransfer->list);
+		usbi_stats_flying_del(ctx);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -1437,6 +1383,9 @@ static void do_close(struct libusb_context *ctx,
 	list_del(&dev_handle->list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
+	if (dev_handle->sync_transfer)
+		libusb_free_transfer(dev_handle->sync_transfer);
+
 	usbi_backend.close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
@@ -1499,8 +1448,7 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 		usbi_mutex_lock(&ctx->event_data_lock);
 		if (!--ctx->device_close)
 			ctx->event_flags &= ~USBI_EVENT_DEVICE_CLOSE;
-		if (!ctx->event_flags)
-			usbi_clear_event(&ctx->event);
+		usbi_clear_event_if_idle(ctx);
 		usbi_mutex_unlock(&ctx->event_data_lock);
 
 		/* Release event handling lock and wake up event waiters */
@@ -1630,10 +1578,14 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev_handle,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev_handle,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg("configuration %d", configuration);
 	if (configuration < -1 || configuration > (int)UINT8_MAX)
 		return LIBUSB_ERROR_INVALID_PARAM;
-	return usbi_backend.set_configuration(dev_handle, configuration);
+	r = usbi_backend.set_configuration(dev_handle, configuration);
+	usbi_invalidate_endpoint_sizes(dev_handle->dev);
+	return r;
 }
 
 /** \ingroup libusb_dev
@@ -1826,14 +1778,18 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev_handle,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev_handle)
 {
+	int r;
+
 	usbi_dbg(" ");
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.reset_device)
-		return usbi_backend.reset_device(dev_handle);
-	else
+	if (!usbi_backend.reset_device)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend.reset_device(dev_handle);
+	usbi_invalidate_endpoint_sizes(dev_handle->dev);
+	return r;
 }
 
 /** \ingroup libusb_asyncio
@@ -1959,6 +1915,180 @@ int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+/* Buffers handed out by a pool are kept on separate cache lines, so that
+ * the application touching one buffer does not disturb a transfer using
+ * its neighbour. */
+#define DEV_MEM_POOL_ALIGN	64
+
+struct libusb_dev_mem_pool {
+	struct libusb_device_handle *dev_handle;
+	usbi_mutex_t lock;
+	unsigned char *region;
+	size_t region_size;
+	size_t buffer_stride;
+	int is_dev_mem;
+	int num_buffers;
+	int num_free;
+	unsigned char *free_buffers[ZERO_SIZED_ARRAY];
+};
+
+/** \ingroup libusb_asyncio
+ * Create a pool of equally sized transfer buffers for the given device.
+ *
+ * All buffers are carved out of a single block obtained with
+ * libusb_dev_mem_alloc(), so applications which continuously resubmit
+ * transfers can recycle DMA-able buffers without paying for an mmap() and
+ * munmap() per buffer. On systems without device memory support the pool
+ * transparently falls back to regular heap memory; use
+ * libusb_dev_mem_pool_is_dev_mem() to find out which one was used.
+ *
+ * The pool must be destroyed with libusb_dev_mem_pool_destroy() before the
+ * device handle is closed. Buffers obtained from the pool must not be freed
+ * with the \ref LIBUSB_TRANSFER_FREE_BUFFER flag.
+ *
+ * Available if \ref LIBUSB_HAS_DEV_MEM_POOL is defined
+ *
+ * \param dev_handle a device handle
+ * \param buffer_size size of each buffer in the pool
+ * \param num_buffers number of buffers in the pool
+ * \param pool output location for the newly created pool
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if buffer_size or num_buffers is 0
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_dev_mem_pool_create(libusb_device_handle *dev_handle,
+	size_t buffer_size, int num_buffers, struct libusb_dev_mem_pool **pool)
+{
+	struct libusb_dev_mem_pool *_pool;
+	size_t stride;
+	int i;
+
+	if (!buffer_size || num_buffers <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	stride = (buffer_size + DEV_MEM_POOL_ALIGN - 1) & ~(size_t)(DEV_MEM_POOL_ALIGN - 1);
+	if (stride > SIZE_MAX / (size_t)num_buffers)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_pool = calloc(1, sizeof(*_pool) + (size_t)num_buffers * sizeof(_pool->free_buffers[0]));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_pool->dev_handle = dev_handle;
+	_pool->region_size = stride * (size_t)num_buffers;
+	_pool->buffer_stride = stride;
+	_pool->num_buffers = num_buffers;
+
+	_pool->region = libusb_dev_mem_alloc(dev_handle, _pool->region_size);
+	if (_pool->region) {
+		_pool->is_dev_mem = 1;
+	} else {
+		usbi_dbg("device memory unavailable, using heap for %d buffers", num_buffers);
+		_pool->region = malloc(_pool->region_size);
+		if (!_pool->region) {
+			free(_pool);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+
+	for (i = 0; i < num_buffers; i++)
+		_pool->free_buffers[i] = _pool->region + (size_t)i * stride;
+	_pool->num_free = num_buffers;
+
+	usbi_mutex_init(&_pool->lock);
+	*pool = _pool;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a buffer pool created with libusb_dev_mem_pool_create(). All
+ * buffers handed out by the pool become invalid, so none of them may be in
+ * use by a transfer anymore. It is legal to pass a NULL pointer.
+ *
+ * Available if \ref LIBUSB_HAS_DEV_MEM_POOL is defined
+ *
+ * \param pool the pool to destroy
+ */
+void API_EXPORTED libusb_dev_mem_pool_destroy(struct libusb_dev_mem_pool *pool)
+{
+	if (!pool)
+		return;
+
+	if (pool->num_free != pool->num_buffers)
+		usbi_warn(HANDLE_CTX(pool->dev_handle), "destroying pool with %d buffers still in use",
+			  pool->num_buffers - pool->num_free);
+
+	if (pool->is_dev_mem)
+		libusb_dev_mem_free(pool->dev_handle, pool->region, pool->region_size);
+	else
+		free(pool->region);
+	usbi_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/** \ingroup libusb_asyncio
+ * Take a buffer from a pool. The buffer is at least as large as the
+ * buffer_size the pool was created with. This function may be called from
+ * any thread, including from within a transfer callback.
+ *
+ * Available if \ref LIBUSB_HAS_DEV_MEM_POOL is defined
+ *
+ * \param pool the pool to take a buffer from
+ * \returns a buffer, or NULL if all buffers of the pool are in use
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_pool_get(struct libusb_dev_mem_pool *pool)
+{
+	unsigned char *buffer = NULL;
+
+	usbi_mutex_lock(&pool->lock);
+	if (pool->num_free)
+		buffer = pool->free_buffers[--pool->num_free];
+	usbi_mutex_unlock(&pool->lock);
+
+	return buffer;
+}
+
+/** \ingroup libusb_asyncio
+ * Return a buffer obtained with libusb_dev_mem_pool_get() to its pool.
+ *
+ * Available if \ref LIBUSB_HAS_DEV_MEM_POOL is defined
+ *
+ * \param pool the pool the buffer was taken from
+ * \param buffer the buffer to return
+ */
+void API_EXPORTED libusb_dev_mem_pool_put(struct libusb_dev_mem_pool *pool,
+	unsigned char *buffer)
+{
+	if (!buffer)
+		return;
+
+	if (buffer < pool->region || buffer >= pool->region + pool->region_size ||
+	    (size_t)(buffer - pool->region) % pool->buffer_stride) {
+		usbi_err(HANDLE_CTX(pool->dev_handle), "buffer %p does not belong to pool %p",
+			 (void *)buffer, (void *)pool);
+		return;
+	}
+
+	usbi_mutex_lock(&pool->lock);
+	pool->free_buffers[pool->num_free++] = buffer;
+	usbi_mutex_unlock(&pool->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Check whether the buffers of a pool live in device memory, or whether the
+ * pool had to fall back to regular heap memory.
+ *
+ * Available if \ref LIBUSB_HAS_DEV_MEM_POOL is defined
+ *
+ * \param pool the pool to check
+ * \returns 1 if the pool uses device memory, 0 otherwise
+ */
+int API_EXPORTED libusb_dev_mem_pool_is_dev_mem(struct libusb_dev_mem_pool *pool)
+{
+	return pool->is_dev_mem;
+}
+
 /** \ingroup libusb_dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -2186,6 +2316,9 @@ int API_EXPORTED libusb_set_option(libusb_context *ctx,
 	enum libusb_option option, ...)
 {
 	int arg, r = LIBUSB_SUCCESS;
+#ifdef ENABLE_MOCK_BACKEND
+	const char *str;
+#endif
 	va_list ap;
 
 	ctx = usbi_get_context(ctx);
@@ -2204,6 +2337,28 @@ int API_EXPORTED libusb_set_option(libusb_context *ctx,
 #endif
 		break;
 
+	case LIBUSB_OPTION_HOTPLUG_COALESCE_WINDOW:
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > 1000) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			break;
+		}
+		ctx->hotplug_coalesce_ms = arg;
+		break;
+
+	case LIBUSB_OPTION_MOCK_BACKEND:
+#ifdef ENABLE_MOCK_BACKEND
+		usbi_mutex_static_lock(&default_context_lock);
+		str = va_arg(ap, const char *);
+		r = usbi_mock_set_devices(str);
+		if (r == LIBUSB_SUCCESS)
+			use_mock_backend = str != NULL;
+		usbi_mutex_static_unlock(&default_context_lock);
+#else
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+		break;
+
 	/* Handle all backend-specific options here */
 	case LIBUSB_OPTION_USE_USBDK:
 	case LIBUSB_OPTION_WEAK_AUTHORITY:
@@ -2221,6 +2376,60 @@ int API_EXPORTED libusb_set_option(libusb_context *ctx,
 	return r;
 }
 
+/** \ingroup libusb_lib
+ * Get a snapshot of the transfer and event handling statistics of a context.
+ *
+ * The statistics are gathered with relaxed atomic operations and are cheap
+ * enough to always be enabled, so they can be used to watch production
+ * systems without turning on debug logging. The individual counters are
+ * read one by one, so a snapshot taken while transfers are active may be
+ * slightly inconsistent between counters.
+ *
+ * Pass sizeof(struct libusb_context_stats) as stats_size. Only that many
+ * bytes are written, so an application built against an older, shorter
+ * version of the structure keeps working. Counters which this version of
+ * the library does not have are set to 0.
+ *
+ * Available if \ref LIBUSB_HAS_CONTEXT_STATS is defined
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \param stats_size size of the structure stats points to
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if stats_size is not a whole
+ * number of counters
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if libusb was built without
+ * statistics support
+ */
+int API_EXPORTED libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_context_stats *stats, size_t stats_size)
+{
+#ifdef ENABLE_STATS
+	uint64_t *src, *dst = (uint64_t *)stats;
+	size_t i, count;
+#endif
+
+	if (stats_size % sizeof(uint64_t))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	memset(stats, 0, stats_size);
+
+#ifdef ENABLE_STATS
+	ctx = usbi_get_context(ctx);
+	src = (uint64_t *)&ctx->stats;
+
+	/* the structure consists of nothing but counters */
+	count = MIN(stats_size, sizeof(ctx->stats)) / sizeof(uint64_t);
+	for (i = 0; i < count; i++)
+		dst[i] = usbi_atomic64_load_relaxed(&src[i]);
+
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 /* returns the log level as defined in the LIBUSB_DEBUG environment variable.
  * if LIBUSB_DEBUG is not present or not a number, returns LIBUSB_LOG_LEVEL_NONE.
@@ -2241,6 +2450,28 @@ static enum libusb_log_level get_env_debug_level(void)
 }
 #endif
 
+/* Choose the backend for a new context. Devices and transfers of all contexts
+ * must come from the same backend, so it can only change while there are no
+ * contexts. Must be called with default_context_lock held. */
+static void select_backend(void)
+{
+#ifdef ENABLE_MOCK_BACKEND
+	int idle;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	idle = !active_contexts_list.next || list_empty(&active_contexts_list);
+	usbi_mutex_static_unlock(&active_contexts_lock);
+	if (!idle)
+		return;
+
+	if (use_mock_backend)
+		usbi_active_backend = &usbi_mock_backend;
+	else
+		usbi_active_backend = &usbi_platform_backend;
+	usbi_dbg("using %s", usbi_backend.name);
+#endif
+}
+
 /** \ingroup libusb_lib
  * Initialize libusb. This function must be called before calling any other
  * libusb function.
@@ -2257,10 +2488,10 @@ static enum libusb_log_level get_env_debug_level(void)
 int API_EXPORTED libusb_init(libusb_context **context)
 {
 	struct libusb_device *dev, *next;
-	size_t priv_size = usbi_backend.context_priv_size;
+	size_t priv_size;
 	struct libusb_context *ctx;
 	static int first_init = 1;
-	int r = 0;
+	int i, r = 0;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -2274,6 +2505,8 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		return 0;
 	}
 
+	select_backend();
+	priv_size = usbi_backend.context_priv_size;
 	ctx = calloc(1, PTR_ALIGN(sizeof(*ctx)) + priv_size);
 	if (!ctx) {
 		r = LIBUSB_ERROR_NO_MEM;
@@ -2302,6 +2535,9 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	list_init(&ctx->usb_devs);
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
+	for (i = 0; i < USBI_HOTPLUG_VENDOR_BUCKETS; i++)
+		list_init(&ctx->hotplug_cbs_by_vendor[i]);
+	list_init(&ctx->hotplug_cbs_any);
 	ctx->next_hotplug_cb_handle = 1;
 
 	usbi_mutex_static_lock(&active_contexts_lock);
@@ -40,41 +40,86 @@
 	 ((uint32_t)((p)[1]) <<  8) |	\
 	 ((uint32_t)((p)[0]))))
 
-static void parse_descriptor(const void *source, const char *descriptor, void *dest)
-{
-	const uint8_t *sp = source;
-	uint8_t *dp = dest;
-	char field_type;
-
-	while (*descriptor) {
-		field_type = *descriptor++;
-		switch (field_type) {
-		case 'b':	/* 8-bit byte */
-			*dp++ = *sp++;
-			break;
-		case 'w':	/* 16-bit word, convert from little endian to CPU */
-			dp += ((uintptr_t)dp & 1);	/* Align to 16-bit word boundary */
-
-			*((uint16_t *)dp) = READ_LE16(sp);
-			sp += 2;
-			dp += 2;
-			break;
-		case 'd':	/* 32-bit word, convert from little endian to CPU */
-			dp += 4 - ((uintptr_t)dp & 3);	/* Align to 32-bit word boundary */
-
-			*((uint32_t *)dp) = READ_LE32(sp);
-			sp += 4;
-			dp += 4;
-			break;
-		case 'u':	/* 16 byte UUID */
-			memcpy(dp, sp, 16);
-			sp += 16;
-			dp += 16;
-			break;
-		}
-	}
+/* index into a table of all 32 possible endpoints */
+#define ENDPOINT_INDEX(addr) ((((addr) & 0x80) >> 3) | ((addr) & 0x0f))
+
+/* Descriptor layouts, as lists of (field type, field name, offset) where the
+ * field type is b (8-bit), w (16-bit little endian), d (32-bit little endian)
+ * or u (16 byte UUID). A decoder is generated for each layout, so parsing a
+ * descriptor is just a sequence of loads and stores. */
+#define ENDPOINT_DESC_LAYOUT(F)						\
+	F(b, bLength, 0) F(b, bDescriptorType, 1) F(b, bEndpointAddress, 2)	\
+	F(b, bmAttributes, 3) F(w, wMaxPacketSize, 4) F(b, bInterval, 6)
+
+#define ENDPOINT_AUDIO_DESC_LAYOUT(F)					\
+	ENDPOINT_DESC_LAYOUT(F) F(b, bRefresh, 7) F(b, bSynchAddress, 8)
+
+#define INTERFACE_DESC_LAYOUT(F)					\
+	F(b, bLength, 0) F(b, bDescriptorType, 1) F(b, bInterfaceNumber, 2)	\
+	F(b, bAlternateSetting, 3) F(b, bNumEndpoints, 4)			\
+	F(b, bInterfaceClass, 5) F(b, bInterfaceSubClass, 6)		\
+	F(b, bInterfaceProtocol, 7) F(b, iInterface, 8)
+
+#define CONFIG_DESC_LAYOUT(F)						\
+	F(b, bLength, 0) F(b, bDescriptorType, 1) F(w, wTotalLength, 2)	\
+	F(b, bNumInterfaces, 4) F(b, bConfigurationValue, 5)		\
+	F(b, iConfiguration, 6) F(b, bmAttributes, 7) F(b, MaxPower, 8)
+
+#define SS_EP_COMP_DESC_LAYOUT(F)					\
+	F(b, bLength, 0) F(b, bDescriptorType, 1) F(b, bMaxBurst, 2)	\
+	F(b, bmAttributes, 3) F(w, wBytesPerInterval, 4)
+
+#define BOS_DESC_LAYOUT(F)						\
+	F(b, bLength, 0) F(b, bDescriptorType, 1) F(w, wTotalLength, 2)	\
+	F(b, bNumDeviceCaps, 4)
+
+#define USB_2_0_EXT_DESC_LAYOUT(F)					\
+	F(b, bLength, 0) F(b, bDescriptorType, 1)			\
+	F(b, bDevCapabilityType, 2) F(d, bmAttributes, 3)
+
+#define SS_USB_DEV_CAP_DESC_LAYOUT(F)					\
+	F(b, bLength, 0) F(b, bDescriptorType, 1)			\
+	F(b, bDevCapabilityType, 2) F(b, bmAttributes, 3)		\
+	F(w, wSpeedSupported, 4) F(b, bFunctionalitySupport, 6)		\
+	F(b, bU1DevExitLat, 7) F(w, bU2DevExitLat, 8)
+
+#define CONTAINER_ID_DESC_LAYOUT(F)					\
+	F(b, bLength, 0) F(b, bDescriptorType, 1)			\
+	F(b, bDevCapabilityType, 2) F(b, bReserved, 3) F(u, ContainerID, 4)
+
+#define DECODE_FIELD_b(dest, field, sp)	(dest)->field = *(sp)
+#define DECODE_FIELD_w(dest, field, sp)	(dest)->field = READ_LE16(sp)
+#define DECODE_FIELD_d(dest, field, sp)	(dest)->field = READ_LE32(sp)
+#define DECODE_FIELD_u(dest, field, sp)	memcpy((dest)->field, (sp), 16)
+
+#define DECODE_FIELD(type, field, offset)				\
+	DECODE_FIELD_##type(dest, field, source + (offset));
+
+#define DEFINE_DESC_DECODER(name, desc_type, layout)			\
+static void name(const uint8_t *source, desc_type *dest)		\
+{									\
+	layout(DECODE_FIELD)						\
 }
 
+DEFINE_DESC_DECODER(decode_endpoint_desc,
+	struct libusb_endpoint_descriptor, ENDPOINT_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_endpoint_audio_desc,
+	struct libusb_endpoint_descriptor, ENDPOINT_AUDIO_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_interface_desc,
+	struct libusb_interface_descriptor, INTERFACE_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_config_desc,
+	struct libusb_config_descriptor, CONFIG_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_ss_ep_comp_desc,
+	struct libusb_ss_endpoint_companion_descriptor, SS_EP_COMP_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_bos_desc,
+	struct libusb_bos_descriptor, BOS_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_usb_2_0_ext_desc,
+	struct libusb_usb_2_0_extension_descriptor, USB_2_0_EXT_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_ss_usb_dev_cap_desc,
+	struct libusb_ss_usb_device_capability_descriptor, SS_USB_DEV_CAP_DESC_LAYOUT)
+DEFINE_DESC_DECODER(decode_container_id_desc,
+	struct libusb_container_id_descriptor, CONTAINER_ID_DESC_LAYOUT)
+
 static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
 {
 	free((void *)endpoint->extra);
@@ -110,9 +155,9 @@ static int parse_endpoint(struct libusb_context *ctx,
 	}
 
 	if (header->bLength >= LIBUSB_DT_ENDPOINT_AUDIO_SIZE)
-		parse_descriptor(buffer, "bbbbwbbb", endpoint);
+		decode_endpoint_audio_desc(buffer, endpoint);
 	else
-		parse_descriptor(buffer, "bbbbwb", endpoint);
+		decode_endpoint_desc(buffer, endpoint);
 
 	buffer += header->bLength;
 	size -= header->bLength;
@@ -212,7 +257,7 @@ static int parse_interface(libusb_context *ctx,
 		usb_interface->altsetting = altsetting;
 
 		ifp = altsetting + usb_interface->num_altsetting;
-		parse_descriptor(buffer, "bbbbbbbbb", ifp);
+		decode_interface_desc(buffer, ifp);
 		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
 			usbi_err(ctx, "unexpected descriptor 0x%x (expected 0x%x)",
 				 ifp->bDescriptorType, LIBUSB_DT_INTERFACE);
@@ -260,6 +305,8 @@ static int parse_interface(libusb_context *ctx,
 				usbi_warn(ctx,
 					  "short extra intf desc read %d/%u",
 					  size, header->bLength);
+				/* none of its endpoints follow */
+				ifp->bNumEndpoints = 0;
 				return parsed;
 			}
 
@@ -358,7 +405,7 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	parse_descriptor(buffer, "bbwbbbbb", config);
+	decode_config_desc(buffer, config);
 	if (config->bDescriptorType != LIBUSB_DT_CONFIG) {
 		usbi_err(ctx, "unexpected descriptor 0x%x (expected 0x%x)",
 			 config->bDescriptorType, LIBUSB_DT_CONFIG);
@@ -689,6 +736,437 @@ void API_EXPORTED libusb_free_config_descriptor(
 	free(config);
 }
 
+/* Return the cached raw descriptor of configuration config_idx, reading it
+ * from the backend on first use. Called with dev->lock held. */
+static int get_cached_config(struct libusb_device *dev, uint8_t config_idx,
+	const struct usbi_raw_config **raw_config)
+{
+	struct usbi_desc_cache *cache = dev->desc_cache;
+	struct usbi_raw_config *config;
+	union usbi_config_desc_buf _config;
+	uint16_t config_len;
+	uint8_t *buf;
+	int r;
+
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (!cache)
+			return LIBUSB_ERROR_NO_MEM;
+		cache->configs = calloc(dev->device_descriptor.bNumConfigurations,
+					sizeof(cache->configs[0]));
+		if (!cache->configs) {
+			free(cache);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		dev->desc_cache = cache;
+	}
+
+	config = &cache->configs[config_idx];
+	if (config->data) {
+		*raw_config = config;
+		return LIBUSB_SUCCESS;
+	}
+
+	r = get_config_descriptor(dev, config_idx, _config.buf, sizeof(_config.buf));
+	if (r < 0)
+		return r;
+
+	config_len = libusb_le16_to_cpu(_config.desc.wTotalLength);
+	if (config_len < LIBUSB_DT_CONFIG_SIZE) {
+		usbi_err(DEVICE_CTX(dev), "invalid wTotalLength %u", config_len);
+		return LIBUSB_ERROR_IO;
+	}
+
+	buf = malloc(config_len);
+	if (!buf)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = get_config_descriptor(dev, config_idx, buf, config_len);
+	if (r < 0) {
+		free(buf);
+		return r;
+	}
+
+	config->data = buf;
+	config->length = r;
+	*raw_config = config;
+	return LIBUSB_SUCCESS;
+}
+
+static void fill_config_view(const struct usbi_raw_config *raw_config,
+	struct libusb_config_view *view)
+{
+	const struct usbi_configuration_descriptor *desc =
+		(const struct usbi_configuration_descriptor *)raw_config->data;
+
+	view->data = raw_config->data;
+	view->length = raw_config->length;
+	view->bConfigurationValue = desc->bConfigurationValue;
+	view->bNumInterfaces = desc->bNumInterfaces;
+}
+
+void usbi_free_desc_cache(struct libusb_device *dev)
+{
+	struct usbi_desc_cache *cache = dev->desc_cache;
+	uint8_t i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < dev->device_descriptor.bNumConfigurations; i++)
+		free(cache->configs[i].data);
+	free(cache->configs);
+	free(cache);
+	dev->desc_cache = NULL;
+}
+
+/** \ingroup libusb_desc
+ * Get a read-only view of a USB configuration descriptor based on its index.
+ * Unlike libusb_get_config_descriptor(), the descriptors are not parsed into
+ * newly allocated structures. The raw descriptors are read once and kept
+ * with the device, so this function is cheap to call repeatedly.
+ *
+ * This is a non-blocking function which does not involve any requests being
+ * sent to the device.
+ *
+ * Available if \ref LIBUSB_HAS_CONFIG_VIEW is defined
+ *
+ * \param dev a device
+ * \param config_index the index of the configuration you wish to retrieve
+ * \param view output location for the view. Only valid if 0 was returned.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the configuration does not exist
+ * \returns another LIBUSB_ERROR code on error
+ * \see libusb_config_view_next_interface()
+ */
+int API_EXPORTED libusb_get_config_view(libusb_device *dev,
+	uint8_t config_index, struct libusb_config_view *view)
+{
+	const struct usbi_raw_config *raw_config;
+	int r;
+
+	if (config_index >= dev->device_descriptor.bNumConfigurations)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&dev->lock);
+	r = get_cached_config(dev, config_index, &raw_config);
+	if (r == LIBUSB_SUCCESS)
+		fill_config_view(raw_config, view);
+	usbi_mutex_unlock(&dev->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_desc
+ * Get a read-only view of the USB configuration descriptor for the currently
+ * active configuration. See libusb_get_config_view().
+ *
+ * This is a non-blocking function which does not involve any requests being
+ * sent to the device.
+ *
+ * Available if \ref LIBUSB_HAS_CONFIG_VIEW is defined
+ *
+ * \param dev a device
+ * \param view output location for the view. Only valid if 0 was returned.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the device is in unconfigured state
+ * \returns another LIBUSB_ERROR code on error
+ */
+int API_EXPORTED libusb_get_active_config_view(libusb_device *dev,
+	struct libusb_config_view *view)
+{
+	union usbi_config_desc_buf _config;
+	const struct usbi_configuration_descriptor *desc;
+	const struct usbi_raw_config *raw_config;
+	uint8_t idx;
+	int r;
+
+	/* only the header is needed to identify the configuration */
+	r = get_active_config_descriptor(dev, _config.buf, sizeof(_config.buf));
+	if (r < 0)
+		return r;
+
+	usbi_mutex_lock(&dev->lock);
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for (idx = 0; idx < dev->device_descriptor.bNumConfigurations; idx++) {
+		r = get_cached_config(dev, idx, &raw_config);
+		if (r < 0)
+			break;
+
+		desc = (const struct usbi_configuration_descriptor *)raw_config->data;
+		if (desc->bConfigurationValue == _config.desc.bConfigurationValue) {
+			fill_config_view(raw_config, view);
+			break;
+		}
+		r = LIBUSB_ERROR_NOT_FOUND;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	return r;
+}
+
+/* Find the next descriptor of type desc_type and at least min_length bytes,
+ * starting at *offset. Returns its offset, or LIBUSB_ERROR_NOT_FOUND if there
+ * is none or a descriptor of type stop_type comes first. */
+static int view_find_descriptor(const struct libusb_config_view *view,
+	int offset, uint8_t desc_type, uint8_t min_length, uint8_t stop_type)
+{
+	const uint8_t *data = view->data;
+
+	if (offset == 0) {
+		if (view->length < LIBUSB_DT_CONFIG_SIZE || data[0] < LIBUSB_DT_CONFIG_SIZE)
+			return LIBUSB_ERROR_IO;
+		offset = data[0];
+	}
+
+	while (offset + DESC_HEADER_LENGTH <= view->length) {
+		const struct usbi_descriptor_header *header =
+			(const struct usbi_descriptor_header *)(data + offset);
+
+		if (header->bLength < DESC_HEADER_LENGTH ||
+		    header->bLength > view->length - offset)
+			return LIBUSB_ERROR_IO;
+
+		if (header->bDescriptorType == stop_type)
+			break;
+		if (header->bDescriptorType == desc_type && header->bLength >= min_length)
+			return offset;
+
+		offset += header->bLength;
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* Return the offset of the first "proper" descriptor at or after offset,
+ * everything before it is class or vendor specific */
+static int view_skip_extra(const struct libusb_config_view *view, int offset)
+{
+	const uint8_t *data = view->data;
+
+	while (offset + DESC_HEADER_LENGTH <= view->length) {
+		const struct usbi_descriptor_header *header =
+			(const struct usbi_descriptor_header *)(data + offset);
+
+		if (header->bLength < DESC_HEADER_LENGTH ||
+		    header->bLength > view->length - offset ||
+		    header->bDescriptorType == LIBUSB_DT_ENDPOINT ||
+		    header->bDescriptorType == LIBUSB_DT_INTERFACE ||
+		    header->bDescriptorType == LIBUSB_DT_CONFIG ||
+		    header->bDescriptorType == LIBUSB_DT_DEVICE)
+			break;
+
+		offset += header->bLength;
+	}
+
+	return offset;
+}
+
+/** \ingroup libusb_desc
+ * Find the next interface descriptor in a configuration view. Every
+ * alternate setting has its own interface descriptor. No memory is
+ * allocated: the extra field points into the view, and the endpoint field
+ * is set to NULL. Use libusb_config_view_next_endpoint() with the updated
+ * offset to get the endpoints of the interface.
+ *
+ * Available if \ref LIBUSB_HAS_CONFIG_VIEW is defined
+ *
+ * \param view a view obtained from libusb_get_config_view()
+ * \param offset position in the view. Set it to 0 to start at the first
+ * interface; it is advanced past the returned descriptor on success.
+ * \param interface output location for the interface descriptor
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if there are no more interfaces
+ * \returns LIBUSB_ERROR_IO if the descriptors are malformed
+ */
+int API_EXPORTED libusb_config_view_next_interface(
+	const struct libusb_config_view *view, int *offset,
+	struct libusb_interface_descriptor *interface)
+{
+	const uint8_t *desc;
+	int r;
+
+	r = view_find_descriptor(view, *offset, LIBUSB_DT_INTERFACE,
+				 LIBUSB_DT_INTERFACE_SIZE, 0);
+	if (r < 0)
+		return r;
+
+	desc = view->data + r;
+	decode_interface_desc(desc, interface);
+	interface->endpoint = NULL;
+
+	r += desc[0];
+	*offset = view_skip_extra(view, r);
+	interface->extra = *offset > r ? view->data + r : NULL;
+	interface->extra_length = *offset - r;
+
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_desc
+ * Find the next endpoint descriptor of the current interface in a
+ * configuration view. No memory is allocated: the extra field, which holds
+ * any class specific or SuperSpeed companion descriptors, points into the
+ * view.
+ *
+ * Available if \ref LIBUSB_HAS_CONFIG_VIEW is defined
+ *
+ * \param view a view obtained from libusb_get_config_view()
+ * \param offset position in the view, as updated by the last call to
+ * libusb_config_view_next_interface() or this function. It is advanced past
+ * the returned descriptor on success.
+ * \param endpoint output location for the endpoint descriptor
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the interface has no more endpoints
+ * \returns LIBUSB_ERROR_IO if the descriptors are malformed
+ */
+int API_EXPORTED libusb_config_view_next_endpoint(
+	const struct libusb_config_view *view, int *offset,
+	struct libusb_endpoint_descriptor *endpoint)
+{
+	const uint8_t *desc;
+	int r;
+
+	r = view_find_descriptor(view, *offset, LIBUSB_DT_ENDPOINT,
+				 LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_INTERFACE);
+	if (r < 0)
+		return r;
+
+	desc = view->data + r;
+	if (desc[0] >= LIBUSB_DT_ENDPOINT_AUDIO_SIZE) {
+		decode_endpoint_audio_desc(desc, endpoint);
+	} else {
+		decode_endpoint_desc(desc, endpoint);
+		endpoint->bRefresh = 0;
+		endpoint->bSynchAddress = 0;
+	}
+
+	r += desc[0];
+	*offset = view_skip_extra(view, r);
+	endpoint->extra = *offset > r ? view->data + r : NULL;
+	endpoint->extra_length = *offset - r;
+
+	return LIBUSB_SUCCESS;
+}
+
+static uint16_t endpoint_max_iso_packet_size(struct libusb_device *dev,
+	const struct libusb_endpoint_descriptor *ep)
+{
+	enum libusb_endpoint_transfer_type ep_type;
+	uint16_t val;
+	int i;
+
+	/* For SuperSpeed devices, use the companion descriptor if there is one */
+	if (dev->speed >= LIBUSB_SPEED_SUPER) {
+		for (i = 0; i + LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE <= ep->extra_length;
+		     i += ep->extra[i]) {
+			if (ep->extra[i] < DESC_HEADER_LENGTH)
+				break;
+			if (ep->extra[i + 1] == LIBUSB_DT_SS_ENDPOINT_COMPANION &&
+			    ep->extra[i] >= LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE)
+				return READ_LE16(ep->extra + i + 4);
+		}
+	}
+
+	val = ep->wMaxPacketSize;
+	ep_type = (enum libusb_endpoint_transfer_type) (ep->bmAttributes & 0x3);
+	if (ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS
+	    || ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT)
+		return (uint16_t)((val & 0x07ff) * (1 + ((val >> 11) & 3)));
+
+	return val & 0x07ff;
+}
+
+/* Fill in the endpoint sizes of a configuration. The first endpoint
+ * descriptor found for an address wins. Called with dev->lock held. */
+static int fill_endpoint_sizes(struct libusb_device *dev,
+	const struct libusb_config_view *view)
+{
+	struct usbi_desc_cache *cache = dev->desc_cache;
+	struct libusb_interface_descriptor interface;
+	struct libusb_endpoint_descriptor ep;
+	int offset = 0, r;
+
+	memset(cache->endpoints, 0, sizeof(cache->endpoints));
+
+	while ((r = libusb_config_view_next_interface(view, &offset, &interface)) == 0) {
+		while ((r = libusb_config_view_next_endpoint(view, &offset, &ep)) == 0) {
+			struct usbi_endpoint_sizes *sizes =
+				&cache->endpoints[ENDPOINT_INDEX(ep.bEndpointAddress)];
+
+			if (sizes->found)
+				continue;
+
+			sizes->found = 1;
+			sizes->max_packet_size = ep.wMaxPacketSize;
+			sizes->max_iso_packet_size = endpoint_max_iso_packet_size(dev, &ep);
+		}
+		if (r != LIBUSB_ERROR_NOT_FOUND)
+			break;
+	}
+	if (r != LIBUSB_ERROR_NOT_FOUND)
+		return r;
+
+	cache->endpoints_config = view->bConfigurationValue;
+	return LIBUSB_SUCCESS;
+}
+
+/* Look up the sizes of an endpoint in the active configuration. The table
+ * of endpoint sizes is kept with the device, so only the first lookup after
+ * the active configuration may have changed asks the backend for it.
+ * Returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist and
+ * LIBUSB_ERROR_OTHER on any other failure. */
+int usbi_get_endpoint_sizes(struct libusb_device *dev, unsigned char endpoint,
+	struct usbi_endpoint_sizes *sizes)
+{
+	struct libusb_config_view view;
+	unsigned int generation;
+	int r;
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->desc_cache && dev->desc_cache->endpoints_config) {
+		*sizes = dev->desc_cache->endpoints[ENDPOINT_INDEX(endpoint)];
+		usbi_mutex_unlock(&dev->lock);
+		return sizes->found ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+	}
+	generation = dev->endpoints_generation;
+	usbi_mutex_unlock(&dev->lock);
+
+	r = libusb_get_active_config_view(dev, &view);
+	if (r < 0)
+		goto err;
+
+	usbi_mutex_lock(&dev->lock);
+	r = fill_endpoint_sizes(dev, &view);
+	if (r == LIBUSB_SUCCESS) {
+		*sizes = dev->desc_cache->endpoints[ENDPOINT_INDEX(endpoint)];
+		/* the configuration may have changed since it was read */
+		if (generation != dev->endpoints_generation)
+			dev->desc_cache->endpoints_config = 0;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	if (r < 0)
+		goto err;
+
+	return sizes->found ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+
+err:
+	usbi_err(DEVICE_CTX(dev), "could not retrieve active config descriptor");
+	return LIBUSB_ERROR_OTHER;
+}
+
+/* Drop the table of endpoint sizes, for when the active configuration may
+ * have changed */
+void usbi_invalidate_endpoint_sizes(struct libusb_device *dev)
+{
+	usbi_mutex_lock(&dev->lock);
+	dev->endpoints_generation++;
+	if (dev->desc_cache)
+		dev->desc_cache->endpoints_config = 0;
+	usbi_mutex_unlock(&dev->lock);
+}
+
 /** \ingroup libusb_desc
  * Get an endpoints superspeed endpoint companion descriptor (if any)
  *
@@ -737,7 +1215,7 @@ int API_EXPORTED libusb_get_ss_endpoint_companion_descriptor(
 		*ep_comp = malloc(sizeof(**ep_comp));
 		if (!*ep_comp)
 			return LIBUSB_ERROR_NO_MEM;
-		parse_descriptor(buffer, "bbbbw", *ep_comp);
+		decode_ss_ep_comp_desc(buffer, *ep_comp);
 		return LIBUSB_SUCCESS;
 	}
 	return LIBUSB_ERROR_NOT_FOUND;
@@ -790,7 +1268,7 @@ static int parse_bos(struct libusb_context *ctx,
 	if (!_bos)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(buffer, "bbwb", _bos);
+	decode_bos_desc(buffer, _bos);
 	buffer += _bos->bLength;
 	size -= _bos->bLength;
 
@@ -940,7 +1418,7 @@ int API_EXPORTED libusb_get_usb_2_0_extension_descriptor(
 	if (!_usb_2_0_extension)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(dev_cap, "bbbd", _usb_2_0_extension);
+	decode_usb_2_0_ext_desc((const uint8_t *)dev_cap, _usb_2_0_extension);
 
 	*usb_2_0_extension = _usb_2_0_extension;
 	return LIBUSB_SUCCESS;
@@ -995,7 +1473,7 @@ int API_EXPORTED libusb_get_ss_usb_device_capability_descriptor(
 	if (!_ss_usb_device_cap)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(dev_cap, "bbbbwbbw", _ss_usb_device_cap);
+	decode_ss_usb_dev_cap_desc((const uint8_t *)dev_cap, _ss_usb_device_cap);
 
 	*ss_usb_device_cap = _ss_usb_device_cap;
 	return LIBUSB_SUCCESS;
@@ -1050,7 +1528,7 @@ int API_EXPORTED libusb_get_container_id_descriptor(libusb_context *ctx,
 	if (!_container_id)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(dev_cap, "bbbbu", _container_id);
+	decode_container_id_desc((const uint8_t *)dev_cap, _container_id);
 
 	*container_id = _container_id;
 	return LIBUSB_SUCCESS;
@@ -150,9 +150,11 @@ int main (void) {
 #define VALID_HOTPLUG_FLAGS			\
 	 (LIBUSB_HOTPLUG_ENUMERATE)
 
-static int usbi_hotplug_match_cb(struct libusb_context *ctx,
-	struct libusb_device *dev, libusb_hotplug_event event,
-	struct libusb_hotplug_callback *hotplug_cb)
+#define for_each_hotplug_cb_index_safe(head, c, n) \
+	list_for_each_entry_safe(c, n, head, index_list, struct libusb_hotplug_callback)
+
+static int usbi_hotplug_filter_cb(struct libusb_device *dev,
+	libusb_hotplug_event event, struct libusb_hotplug_callback *hotplug_cb)
 {
 	if (!(hotplug_cb->flags & event)) {
 		return 0;
@@ -173,34 +175,100 @@ static int usbi_hotplug_match_cb(struct libusb_context *ctx,
 		return 0;
 	}
 
+	return 1;
+}
+
+static int usbi_hotplug_match_cb(struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event,
+	struct libusb_hotplug_callback *hotplug_cb)
+{
+	if (!usbi_hotplug_filter_cb(dev, event, hotplug_cb)) {
+		return 0;
+	}
+
 	return hotplug_cb->cb(ctx, dev, event, hotplug_cb->user_data);
 }
 
-void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
-	libusb_hotplug_event event)
+static struct list_head *usbi_hotplug_vendor_list(struct libusb_context *ctx,
+	uint16_t vendor_id)
 {
-	struct libusb_hotplug_callback *hotplug_cb, *next;
-	int ret;
+	return &ctx->hotplug_cbs_by_vendor[vendor_id % USBI_HOTPLUG_VENDOR_BUCKETS];
+}
 
-	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+/* Called with hotplug_cbs_lock held. The lock is only dropped while a
+ * matching callback runs. Both lists are ordered from the most recently
+ * registered callback on, like ctx->hotplug_cbs, and are merged by
+ * registration sequence so that callbacks run in the same order as if all
+ * of them were looked at in ctx->hotplug_cbs. */
+static void usbi_hotplug_match_lists(struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event,
+	struct list_head *vendor_list, struct list_head *any_list)
+{
+	struct list_head *heads[2] = { vendor_list, any_list };
+	struct list_head *pos[2] = { vendor_list->next, any_list->next };
+	struct libusb_hotplug_callback *hotplug_cb, *other;
+	int i, ret;
+
+	while (pos[0] != heads[0] || pos[1] != heads[1]) {
+		if (pos[1] == heads[1]) {
+			i = 0;
+		} else if (pos[0] == heads[0]) {
+			i = 1;
+		} else {
+			hotplug_cb = list_entry(pos[0], struct libusb_hotplug_callback, index_list);
+			other = list_entry(pos[1], struct libusb_hotplug_callback, index_list);
+			i = hotplug_cb->seq > other->seq ? 0 : 1;
+		}
+
+		hotplug_cb = list_entry(pos[i], struct libusb_hotplug_callback, index_list);
+		pos[i] = pos[i]->next;
 
-	for_each_hotplug_cb_safe(ctx, hotplug_cb, next) {
 		if (hotplug_cb->flags & USBI_HOTPLUG_NEEDS_FREE) {
 			/* process deregistration in usbi_hotplug_deregister() */
 			continue;
 		}
 
+		if (!usbi_hotplug_filter_cb(dev, event, hotplug_cb)) {
+			continue;
+		}
+
 		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
-		ret = usbi_hotplug_match_cb(ctx, dev, event, hotplug_cb);
+		ret = hotplug_cb->cb(ctx, dev, event, hotplug_cb->user_data);
 		usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 
 		if (ret) {
 			list_del(&hotplug_cb->list);
+			list_del(&hotplug_cb->index_list);
 			free(hotplug_cb);
 		}
 	}
+}
+
+/* Deliver a batch of hotplug messages to the registered callbacks and free
+ * the messages. Only the callbacks which may match the vendor ID of each
+ * device are looked at, in the order they would run in without the index. */
+void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_msgs)
+{
+	struct libusb_hotplug_message *message, *next;
 
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+	for_each_safe_helper(message, next, hotplug_msgs, struct libusb_hotplug_message) {
+		struct libusb_device *dev = message->device;
+
+		usbi_hotplug_match_lists(ctx, dev, message->event,
+			usbi_hotplug_vendor_list(ctx, dev->device_descriptor.idVendor),
+			&ctx->hotplug_cbs_any);
+	}
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+
+	for_each_safe_helper(message, next, hotplug_msgs, struct libusb_hotplug_message) {
+		/* the device left, dereference the device */
+		if (message->event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+			libusb_unref_device(message->device);
+
+		list_del(&message->list);
+		free(message);
+	}
 }
 
 void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
@@ -218,16 +286,68 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	message->device = dev;
 
 	/* Take the event data lock and add this message to the list.
-	 * Only signal an event if there are no prior pending events. */
+	 * Only signal an event if there are no prior pending events, and
+	 * leave that to usbi_hotplug_end_batch() during a burst. */
 	usbi_mutex_lock(&ctx->event_data_lock);
-	event_flags = ctx->event_flags;
-	ctx->event_flags |= USBI_EVENT_HOTPLUG_MSG_PENDING;
 	list_add_tail(&message->list, &ctx->hotplug_msgs);
-	if (!event_flags)
-		usbi_signal_event(&ctx->event);
+	if (!ctx->hotplug_batch) {
+		event_flags = ctx->event_flags;
+		ctx->event_flags |= USBI_EVENT_HOTPLUG_MSG_PENDING;
+		if (!event_flags)
+			usbi_signal_event(&ctx->event);
+	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 }
 
+/* Called by backends when a hotplug event arrives, to hold back delivery
+ * until the rest of a burst has arrived as well. Returns the coalescing
+ * window in milliseconds, or 0 if no context wants events coalesced, in
+ * which case usbi_hotplug_end_batch() must not be called. */
+int usbi_hotplug_begin_batch(void)
+{
+	struct libusb_context *ctx;
+	int window_ms = 0;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	for_each_context(ctx) {
+		if (ctx->hotplug_coalesce_ms > window_ms)
+			window_ms = ctx->hotplug_coalesce_ms;
+	}
+
+	if (window_ms) {
+		for_each_context(ctx) {
+			usbi_mutex_lock(&ctx->event_data_lock);
+			ctx->hotplug_batch = 1;
+			usbi_mutex_unlock(&ctx->event_data_lock);
+		}
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	return window_ms;
+}
+
+/* Deliver the hotplug messages collected since usbi_hotplug_begin_batch() */
+void usbi_hotplug_end_batch(void)
+{
+	struct libusb_context *ctx;
+	unsigned int event_flags;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	for_each_context(ctx) {
+		usbi_mutex_lock(&ctx->event_data_lock);
+		ctx->hotplug_batch = 0;
+		if (!list_empty(&ctx->hotplug_msgs) &&
+		    !(ctx->event_flags & USBI_EVENT_HOTPLUG_MSG_PENDING)) {
+			event_flags = ctx->event_flags;
+			ctx->event_flags |= USBI_EVENT_HOTPLUG_MSG_PENDING;
+			if (!event_flags)
+				usbi_signal_event(&ctx->event);
+		}
+		usbi_mutex_unlock(&ctx->event_data_lock);
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+}
+
 int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	int events, int flags,
 	int vendor_id, int product_id, int dev_class,
@@ -278,12 +398,18 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 
 	/* protect the handle by the context hotplug lock */
 	new_callback->handle = ctx->next_hotplug_cb_handle++;
+	new_callback->seq = ctx->next_hotplug_cb_seq++;
 
 	/* handle the unlikely case of overflow */
 	if (ctx->next_hotplug_cb_handle < 0)
 		ctx->next_hotplug_cb_handle = 1;
 
 	list_add(&new_callback->list, &ctx->hotplug_cbs);
+	if (new_callback->flags & USBI_HOTPLUG_VENDOR_ID_VALID)
+		list_add(&new_callback->index_list,
+			 usbi_hotplug_vendor_list(ctx, new_callback->vendor_id));
+	else
+		list_add(&new_callback->index_list, &ctx->hotplug_cbs_any);
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 
@@ -390,6 +516,7 @@ void usbi_hotplug_deregister(struct libusb_context *ctx, int forced)
 			usbi_dbg("freeing hotplug cb %p with handle %d", hotplug_cb,
 				 hotplug_cb->handle);
 			list_del(&hotplug_cb->list);
+			list_del(&hotplug_cb->index_list);
 			free(hotplug_cb);
 		}
 	}
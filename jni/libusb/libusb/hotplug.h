@@ -72,11 +72,19 @@ struct libusb_hotplug_callback {
 	/** Handle for this callback (used to match on deregister) */
 	libusb_hotplug_callback_handle handle;
 
+	/** Registration sequence number, used to run the callbacks from the
+	 * vendor index and the match-any list in a single order */
+	uint64_t seq;
+
 	/** User data that will be passed to the callback function */
 	void *user_data;
 
 	/** List this callback is registered in (ctx->hotplug_cbs) */
 	struct list_head list;
+
+	/** Index list this callback is in (ctx->hotplug_cbs_by_vendor or
+	 * ctx->hotplug_cbs_any) */
+	struct list_head index_list;
 };
 
 struct libusb_hotplug_message {
@@ -97,8 +105,7 @@ struct libusb_hotplug_message {
 	for_each_safe_helper(c, n, &(ctx)->hotplug_cbs, struct libusb_hotplug_callback)
 
 void usbi_hotplug_deregister(struct libusb_context *ctx, int forced);
-void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
-	libusb_hotplug_event event);
+void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_msgs);
 void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
 	libusb_hotplug_event event);
 
@@ -1169,6 +1169,7 @@ int usbi_io_init(struct libusb_context *ctx)
 	list_init(&ctx->removed_event_sources);
 	list_init(&ctx->hotplug_msgs);
 	list_init(&ctx->completed_transfers);
+	ctx->completed_transfers_stack = NULL;
 
 	r = usbi_create_event(&ctx->event);
 	if (r < 0)
@@ -1239,7 +1240,10 @@ void usbi_io_exit(struct libusb_context *ctx)
 	free(ctx->event_data);
 }
 
-static void calculate_timeout(struct usbi_transfer *itransfer)
+/* now is the submission time. It is read on first use so that a batch of
+ * transfers only needs to read the clock once. */
+static void calculate_timeout(struct usbi_transfer *itransfer,
+	struct timespec *now)
 {
 	unsigned int timeout =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout;
@@ -1249,7 +1253,9 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
 		return;
 	}
 
-	usbi_get_monotonic_time(&itransfer->timeout);
+	if (!TIMESPEC_IS_SET(now))
+		usbi_get_monotonic_time(now);
+	itransfer->timeout = *now;
 
 	itransfer->timeout.tv_sec += timeout / 1000U;
 	itransfer->timeout.tv_nsec += (timeout % 1000U) * 1000000L;
@@ -1345,6 +1351,8 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		free(transfer->buffer);
 
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (usbi_backend.destroy_transfer)
+		usbi_backend.destroy_transfer(itransfer);
 	usbi_mutex_destroy(&itransfer->lock);
 
 	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
@@ -1392,18 +1400,49 @@ static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
 }
 #endif
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * This function will return non 0 if fails to update the timer,
- * in which case the transfer is *not* on the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *itransfer)
+/* rearm the timer for a transfer which has become the first one in line to
+ * time out.
+ * must be called with flying_list locked.
+ * returns 0 on success or a LIBUSB_ERROR code on failure.
+ */
+#ifdef HAVE_OS_TIMER
+static int arm_timer_for_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+
+	if (!usbi_using_timer(ctx))
+		return 0;
+
+	usbi_dbg("arm timer for timeout in %ums (first in line)",
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
+	return usbi_arm_timer(&ctx->timer, &itransfer->timeout);
+}
+#else
+static inline int arm_timer_for_transfer(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+	return 0;
+}
+#endif
+
+/* insert a transfer into the (timeout-sorted) active transfers list.
+ * returns 1 if the transfer now has the earliest timeout of all active
+ * transfers, in which case the caller must rearm the timer. */
+static int insert_into_flying_list(struct usbi_transfer *itransfer,
+	struct timespec *now)
 {
 	struct usbi_transfer *cur;
 	struct timespec *timeout = &itransfer->timeout;
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r = 0;
 	int first = 1;
 
-	calculate_timeout(itransfer);
+#ifdef ENABLE_STATS
+	if (!TIMESPEC_IS_SET(now))
+		usbi_get_monotonic_time(now);
+	itransfer->submit_time = *now;
+	usbi_stats_flying_add(ctx);
+#endif
+	calculate_timeout(itransfer, now);
 
 	/* if we have no other flying transfers, start the list with this one */
 	if (list_empty(&ctx->flying_transfers)) {
@@ -1434,20 +1473,28 @@ static int add_to_flying_list(struct usbi_transfer *itransfer)
 	/* otherwise we need to be inserted at the end */
 	list_add_tail(&itransfer->list, &ctx->flying_transfers);
 out:
-#ifdef HAVE_OS_TIMER
-	if (first && usbi_using_timer(ctx) && TIMESPEC_IS_SET(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timer with this transfer's timeout */
-		usbi_dbg("arm timer for timeout in %ums (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-		r = usbi_arm_timer(&ctx->timer, timeout);
-	}
-#else
-	UNUSED(first);
-#endif
+	return first && TIMESPEC_IS_SET(timeout);
+}
 
-	if (r)
+/* add a transfer to the (timeout-sorted) active transfers list.
+ * This function will return non 0 if fails to update the timer,
+ * in which case the transfer is *not* on the flying_transfers list. */
+static int add_to_flying_list(struct usbi_transfer *itransfer)
+{
+	struct timespec now;
+	int r = 0;
+
+	TIMESPEC_CLEAR(&now);
+
+	/* if this transfer has the lowest timeout of all active transfers,
+	 * rearm the timer with this transfer's timeout */
+	if (insert_into_flying_list(itransfer, &now))
+		r = arm_timer_for_transfer(itransfer);
+
+	if (r) {
 		list_del(&itransfer->list);
+		usbi_stats_flying_del(ITRANSFER_CTX(itransfer));
+	}
 
 	return r;
 }
@@ -1466,6 +1513,7 @@ static int remove_from_flying_list(struct usbi_transfer *itransfer)
 	rearm_timer = (TIMESPEC_IS_SET(&itransfer->timeout) &&
 		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == itransfer);
 	list_del(&itransfer->list);
+	usbi_stats_flying_del(ctx);
 	if (rearm_timer)
 		r = arm_timer_for_next_timeout(ctx);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
@@ -1542,6 +1590,7 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	if (r) {
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 		usbi_mutex_unlock(&itransfer->lock);
+		usbi_stats_inc(ctx, submit_errors);
 		return r;
 	}
 	/*
@@ -1550,6 +1599,8 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	 */
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
+	usbi_probe(submit, transfer, transfer->endpoint, transfer->type,
+		transfer->length);
 	r = usbi_backend.submit_transfer(itransfer);
 	if (r == LIBUSB_SUCCESS) {
 		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
@@ -1558,12 +1609,142 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	}
 	usbi_mutex_unlock(&itransfer->lock);
 
-	if (r != LIBUSB_SUCCESS)
+	if (r != LIBUSB_SUCCESS) {
 		remove_from_flying_list(itransfer);
+		usbi_stats_inc(ctx, submit_errors);
+	} else {
+		usbi_stats_inc(ctx, transfers_submitted);
+	}
 
 	return r;
 }
 
+/** \ingroup libusb_asyncio
+ * Submit several transfers at once. This behaves like calling
+ * libusb_submit_transfer() on each transfer in array order, but the
+ * context-wide locking and timeout bookkeeping is done once for the whole
+ * batch rather than once per transfer. This is intended for streaming
+ * applications which queue a number of transfers up front.
+ *
+ * The transfers are handed to the backend in array order. If a transfer
+ * cannot be submitted, none of the transfers following it are submitted
+ * either, so the transfers that are in flight are always a prefix of the
+ * array. Resubmit the first transfer that was not submitted with
+ * libusb_submit_transfer() to find out why it failed.
+ *
+ * All transfers must belong to the same context and each transfer may
+ * only appear once in the array.
+ *
+ * Available if \ref LIBUSB_HAS_SUBMIT_TRANSFERS is defined
+ *
+ * \param transfers array of the transfers to submit
+ * \param num_transfers number of transfers in the array
+ * \returns the number of transfers submitted, which is less than
+ * num_transfers if a transfer failed to submit
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the array is empty, mixes contexts
+ * or contains a transfer twice
+ * \returns another LIBUSB_ERROR code if the first transfer failed to
+ * submit, see libusb_submit_transfer()
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers)
+{
+	struct libusb_context *ctx;
+	struct usbi_transfer *itransfer;
+	struct usbi_transfer *first_in_line = NULL;
+	struct timespec now;
+	int num_added, num_submitted = 0;
+	int i, j, r = 0;
+
+	if (!transfers || num_transfers <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = TRANSFER_CTX(transfers[0]);
+	for (i = 0; i < num_transfers; i++) {
+		if (TRANSFER_CTX(transfers[i]) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		/* a duplicate would deadlock on its own lock below */
+		for (j = 0; j < i; j++) {
+			if (transfers[j] == transfers[i])
+				return LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
+	usbi_dbg("%d transfers", num_transfers);
+	TIMESPEC_CLEAR(&now);
+
+	/* The locking follows libusb_submit_transfer(), except that the
+	 * flying_transfers_lock is held while all transfers are locked and
+	 * added to the flying_transfers list, and that the timer is armed
+	 * at most once for the whole batch. */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	for (num_added = 0; num_added < num_transfers; num_added++) {
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[num_added]);
+		usbi_mutex_lock(&itransfer->lock);
+		if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+			usbi_mutex_unlock(&itransfer->lock);
+			r = LIBUSB_ERROR_BUSY;
+			break;
+		}
+		itransfer->transferred = 0;
+		itransfer->state_flags = 0;
+		itransfer->timeout_flags = 0;
+		if (insert_into_flying_list(itransfer, &now))
+			first_in_line = itransfer;
+	}
+
+	if (first_in_line) {
+		int rt = arm_timer_for_transfer(first_in_line);
+
+		if (rt) {
+			for (i = 0; i < num_added; i++) {
+				itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+				list_del(&itransfer->list);
+				usbi_stats_flying_del(ctx);
+				usbi_mutex_unlock(&itransfer->lock);
+			}
+			usbi_mutex_unlock(&ctx->flying_transfers_lock);
+			usbi_stats_inc(ctx, submit_errors);
+			return rt;
+		}
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	for (i = 0; i < num_added; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+		if (num_submitted == i) {
+			usbi_probe(submit, transfer, transfer->endpoint,
+				transfer->type, transfer->length);
+			r = usbi_backend.submit_transfer(itransfer);
+			if (r == LIBUSB_SUCCESS) {
+				itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+				/* keep a reference to this device */
+				libusb_ref_device(transfer->dev_handle->dev);
+				num_submitted++;
+			}
+		}
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+
+	usbi_stats_add(ctx, transfers_submitted, (uint64_t)num_submitted);
+	if (num_submitted < num_added) {
+		usbi_stats_inc(ctx, submit_errors);
+		usbi_mutex_lock(&ctx->flying_transfers_lock);
+		for (i = num_submitted; i < num_added; i++) {
+			itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+			list_del(&itransfer->list);
+			usbi_stats_flying_del(ctx);
+		}
+		if (arm_timer_for_next_timeout(ctx) < 0)
+			usbi_err(ctx, "failed to set timer for next timeout");
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	}
+
+	return num_submitted ? num_submitted : r;
+}
+
 /** \ingroup libusb_asyncio
  * Asynchronously cancel a previously submitted transfer.
  * This function returns immediately, but this does not indicate cancellation
@@ -1665,6 +1846,9 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	uint8_t flags;
 	int r;
 
+	usbi_probe(reap, transfer, transfer->endpoint, (int)status,
+		itransfer->transferred);
+
 	r = remove_from_flying_list(itransfer);
 	if (r < 0)
 		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout");
@@ -1684,10 +1868,27 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
+#ifdef ENABLE_STATS
+	{
+		struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+		struct timespec now, latency;
+		uint64_t latency_us;
+		unsigned int bucket;
+
+		usbi_get_monotonic_time(&now);
+		TIMESPEC_SUB(&now, &itransfer->submit_time, &latency);
+		latency_us = (uint64_t)latency.tv_sec * 1000000 + (uint64_t)latency.tv_nsec / 1000;
+		bucket = MIN(usbi_stats_log2(latency_us), LIBUSB_STATS_LATENCY_BUCKETS - 1);
+		usbi_stats_inc(ctx, transfers_completed[status]);
+		usbi_stats_inc(ctx, latency[transfer->type][bucket]);
+	}
+#endif
+
 	flags = transfer->flags;
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
 	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	usbi_probe(callback, transfer, transfer->endpoint, (int)status);
 	if (transfer->callback)
 		transfer->callback(transfer);
 	/* transfer might have been freed by the above call, do not use from
@@ -1723,27 +1924,78 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
-/* Add a completed transfer to the completed_transfers list of the
+/* Push a completed transfer onto the completed_transfers_stack of the
  * context and signal the event. The backend's handle_transfer_completion()
- * function will be called the next time an event handler runs. */
+ * function will be called the next time an event handler runs.
+ *
+ * This does not take any context lock, so that backends completing transfers
+ * from their own threads do not contend with submission or event handling.
+ * Only the push that finds the stack empty needs to signal the event; the
+ * event stays signalled for as long as the stack is not empty (see
+ * usbi_clear_event_if_idle()). */
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 {
 	libusb_device_handle *dev_handle = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
 
 	if (dev_handle) {
 		struct libusb_context *ctx = HANDLE_CTX(dev_handle);
-		unsigned int event_flags;
+		void *head = usbi_atomic_ptr_load(&ctx->completed_transfers_stack);
+
+		do {
+			itransfer->completed_next = head;
+		} while (!usbi_atomic_ptr_cas(&ctx->completed_transfers_stack, &head, itransfer));
 
-		usbi_mutex_lock(&ctx->event_data_lock);
-		event_flags = ctx->event_flags;
-		ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
-		list_add_tail(&itransfer->completed_list, &ctx->completed_transfers);
-		if (!event_flags)
+		if (!head)
 			usbi_signal_event(&ctx->event);
-		usbi_mutex_unlock(&ctx->event_data_lock);
 	}
 }
 
+/* Take everything off the completed_transfers_stack and append it, in
+ * completion order, to the completed_transfers list. Must be called with
+ * the event handling lock held. */
+static void take_completed_transfers(struct libusb_context *ctx)
+{
+	struct usbi_transfer *itransfer, *prev = NULL, *next;
+	struct list_head *tail = ctx->completed_transfers.prev;
+
+	itransfer = usbi_atomic_ptr_exchange(&ctx->completed_transfers_stack, NULL);
+	if (!itransfer)
+		return;
+
+	/* the stack is newest first, so insert each one in front of the
+	 * previous (newer) one, keeping the oldest at the list head */
+	for (; itransfer; itransfer = next) {
+		next = itransfer->completed_next;
+		itransfer->completed_next = NULL;
+		if (prev)
+			list_add_tail(&itransfer->completed_list, &prev->completed_list);
+		else
+			list_add(&itransfer->completed_list, tail);
+		prev = itransfer;
+	}
+}
+
+/* Clear the event. Completed transfers are pushed without holding
+ * event_data_lock, so after clearing we check the stack once more and
+ * signal again if a transfer was pushed in the meantime. Must be called
+ * with event_data_lock held. */
+static void clear_event(struct libusb_context *ctx)
+{
+	usbi_clear_event(&ctx->event);
+	if (usbi_atomic_ptr_load(&ctx->completed_transfers_stack))
+		usbi_signal_event(&ctx->event);
+}
+
+/* Clear the event if there is nothing left for the event handler to do.
+ * Must be called with event_data_lock held. */
+void usbi_clear_event_if_idle(struct libusb_context *ctx)
+{
+	if (ctx->event_flags || !list_empty(&ctx->completed_transfers))
+		return;
+
+	clear_event(ctx);
+}
+
 /** \ingroup libusb_poll
  * Attempt to acquire the event handling lock. This lock is used to ensure that
  * only one thread is monitoring libusb event sources at any one time.
@@ -2029,13 +2281,15 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 			"async cancel failed %d", r);
 }
 
-static void handle_timeouts_locked(struct libusb_context *ctx)
+/* returns the number of transfers that timed out */
+static unsigned int handle_timeouts_locked(struct libusb_context *ctx)
 {
 	struct timespec systime;
 	struct usbi_transfer *itransfer;
+	unsigned int expired = 0;
 
 	if (list_empty(&ctx->flying_transfers))
-		return;
+		return 0;
 
 	/* get current time */
 	usbi_get_monotonic_time(&systime);
@@ -2047,7 +2301,7 @@ static void handle_timeouts_locked(struct libusb_context *ctx)
 
 		/* if we've reached transfers of infinite timeout, we're all done */
 		if (!TIMESPEC_IS_SET(cur_ts))
-			return;
+			break;
 
 		/* ignore timeouts we've already handled */
 		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
@@ -2055,11 +2309,14 @@ static void handle_timeouts_locked(struct libusb_context *ctx)
 
 		/* if transfer has non-expired timeout, nothing more to do */
 		if (TIMESPEC_CMP(cur_ts, &systime, >))
-			return;
+			break;
 
 		/* otherwise, we've got an expired timeout to handle */
 		handle_timeout(itransfer);
+		expired++;
 	}
+
+	return expired;
 }
 
 static void handle_timeouts(struct libusb_context *ctx)
@@ -2073,6 +2330,7 @@ static void handle_timeouts(struct libusb_context *ctx)
 static int handle_event_trigger(struct libusb_context *ctx)
 {
 	struct list_head hotplug_msgs;
+	int hotplug_cb_deregistered = 0;
 	int r = 0;
 
 	usbi_dbg("event triggered");
@@ -2091,6 +2349,13 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		ctx->event_flags &= ~USBI_EVENT_USER_INTERRUPT;
 	}
 
+	/* check if someone unregistered a hotplug cb */
+	if (ctx->event_flags & USBI_EVENT_HOTPLUG_CB_DEREGISTERED) {
+		usbi_dbg("someone unregistered a hotplug cb");
+		ctx->event_flags &= ~USBI_EVENT_HOTPLUG_CB_DEREGISTERED;
+		hotplug_cb_deregistered = 1;
+	}
+
 	/* check if someone is closing a device */
 	if (ctx->event_flags & USBI_EVENT_DEVICE_CLOSE)
 		usbi_dbg("someone is closing a device");
@@ -2103,16 +2368,25 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		list_cut(&hotplug_msgs, &ctx->hotplug_msgs);
 	}
 
+	/* take the completed transfers before clearing the event, otherwise
+	 * the non-empty stack signals it again right away. They are all
+	 * completed below, so they do not keep the event signalled. */
+	take_completed_transfers(ctx);
+
+	/* if no further pending events, clear the event */
+	if (!ctx->event_flags)
+		clear_event(ctx);
+
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	if (hotplug_cb_deregistered)
+		usbi_hotplug_deregister(ctx, 0);
+
 	/* complete any pending transfers */
-	if (ctx->event_flags & USBI_EVENT_TRANSFER_COMPLETED) {
+	if (!list_empty(&ctx->completed_transfers)) {
 		struct usbi_transfer *itransfer, *tmp;
-		struct list_head completed_transfers;
-
-		assert(!list_empty(&ctx->completed_transfers));
-		list_cut(&completed_transfers, &ctx->completed_transfers);
-		usbi_mutex_unlock(&ctx->event_data_lock);
 
-		__for_each_completed_transfer_safe(&completed_transfers, itransfer, tmp) {
+		__for_each_completed_transfer_safe(&ctx->completed_transfers, itransfer, tmp) {
 			list_del(&itransfer->completed_list);
 			r = usbi_backend.handle_transfer_completion(itransfer);
 			if (r) {
@@ -2121,48 +2395,28 @@ static int handle_event_trigger(struct libusb_context *ctx)
 			}
 		}
 
-		usbi_mutex_lock(&ctx->event_data_lock);
-		if (!list_empty(&completed_transfers)) {
-			/* an error occurred, put the remaining transfers back on the list */
-			list_splice_front(&completed_transfers, &ctx->completed_transfers);
-		} else if (list_empty(&ctx->completed_transfers)) {
-			ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
-		}
+		/* an error occurred, keep the event signalled so that the
+		 * remaining transfers are retried on the next iteration */
+		if (!list_empty(&ctx->completed_transfers))
+			usbi_signal_event(&ctx->event);
 	}
 
-	/* if no further pending events, clear the event */
-	if (!ctx->event_flags)
-		usbi_clear_event(&ctx->event);
-
-	usbi_mutex_unlock(&ctx->event_data_lock);
-
 	/* process the hotplug messages, if any */
-	while (!list_empty(&hotplug_msgs)) {
-		struct libusb_hotplug_message *message =
-			list_first_entry(&hotplug_msgs, struct libusb_hotplug_message, list);
-
-		usbi_hotplug_match(ctx, message->device, message->event);
-
-		/* the device left, dereference the device */
-		if (message->event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
-			libusb_unref_device(message->device);
-
-		list_del(&message->list);
-		free(message);
-	}
+	if (!list_empty(&hotplug_msgs))
+		usbi_hotplug_process(ctx, &hotplug_msgs);
 
 	return r;
 }
 
 #ifdef HAVE_OS_TIMER
-static int handle_timer_trigger(struct libusb_context *ctx)
+static int handle_timer_trigger(struct libusb_context *ctx, unsigned int *expired)
 {
 	int r;
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
 	/* process the timeout that just happened */
-	handle_timeouts_locked(ctx);
+	*expired = handle_timeouts_locked(ctx);
 
 	/* arm for next timeout */
 	r = arm_timer_for_next_timeout(ctx);
@@ -2175,9 +2429,26 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
+#ifdef ENABLE_STATS
+static uint64_t count_completed_transfers(struct libusb_context *ctx)
+{
+	uint64_t count = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(ctx->stats.transfers_completed); i++)
+		count += usbi_atomic64_load_relaxed(&ctx->stats.transfers_completed[i]);
+
+	return count;
+}
+#endif
+
 static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 {
 	struct usbi_reported_events reported_events;
+#ifdef ENABLE_STATS
+	uint64_t completed_before = UINT64_MAX;
+	int timed_out = 0;
+#endif
 	int r, timeout_ms;
 
 	/* prevent attempts to recursively handle events (e.g. calling into
@@ -2206,8 +2477,7 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 		/* if no further pending events, clear the event so that we do
 		 * not immediately return from the wait function */
-		if (!ctx->event_flags)
-			usbi_clear_event(&ctx->event);
+		usbi_clear_event_if_idle(ctx);
 	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
@@ -2224,12 +2494,23 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	r = usbi_wait_for_events(ctx, &reported_events, timeout_ms);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_TIMEOUT) {
+			usbi_stats_inc(ctx, event_timeouts);
 			handle_timeouts(ctx);
 			r = LIBUSB_SUCCESS;
 		}
 		goto done;
 	}
 
+	/* timer configurations report a poll() timeout as success */
+	if (!reported_events.event_bits && !reported_events.num_ready) {
+		usbi_stats_inc(ctx, event_timeouts);
+		goto done;
+	}
+
+#ifdef ENABLE_STATS
+	completed_before = count_completed_transfers(ctx);
+#endif
+
 	if (reported_events.event_triggered) {
 		r = handle_event_trigger(ctx);
 		if (r) {
@@ -2240,11 +2521,20 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 #ifdef HAVE_OS_TIMER
 	if (reported_events.timer_triggered) {
-		r = handle_timer_trigger(ctx);
+		unsigned int expired;
+
+		r = handle_timer_trigger(ctx, &expired);
 		if (r) {
 			/* return error code */
 			goto done;
 		}
+
+#ifdef ENABLE_STATS
+		/* a timer expiry that finds no transfer to time out, e.g.
+		 * because it completed in the meantime, is a timeout too */
+		timed_out = !expired && !reported_events.event_triggered &&
+			!reported_events.num_ready;
+#endif
 	}
 #endif
 
@@ -2257,6 +2547,17 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
 done:
+#ifdef ENABLE_STATS
+	if (timed_out) {
+		usbi_stats_inc(ctx, event_timeouts);
+	} else if (completed_before != UINT64_MAX) {
+		uint64_t completed = count_completed_transfers(ctx) - completed_before;
+		unsigned int bucket = completed ? usbi_stats_log2(completed) + 1 : 0;
+
+		usbi_stats_inc(ctx, event_wakeups);
+		usbi_stats_inc(ctx, completions_per_wakeup[MIN(bucket, LIBUSB_STATS_BATCH_BUCKETS - 1)]);
+	}
+#endif
 	usbi_end_event_handling(ctx);
 	return r;
 }
@@ -2372,6 +2673,93 @@ already_done:
 	return 0;
 }
 
+/* Upper bound for a single wait on one device in
+ * usbi_handle_device_events_completed(). Threads which start waiting for
+ * transfers to other devices meanwhile get the event handling back after
+ * at most this long. */
+#define DEVICE_EVENTS_SLICE_MS	10
+
+/* Returns 1 if transfers to devices other than dev_handle are in flight */
+static int other_transfers_in_flight(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_transfer *itransfer;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	for_each_transfer(ctx, itransfer) {
+		if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle != dev_handle) {
+			r = 1;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	return r;
+}
+
+/* Like libusb_handle_events_completed(), but for a thread waiting for a
+ * transfer to dev_handle. When no other thread is handling events, no
+ * transfers to other devices are in flight and the backend supports it,
+ * only the device itself and the internal event sources of the context are
+ * waited on, which saves polling every other event source for
+ * request/response style synchronous I/O. The wait is cut into slices of
+ * DEVICE_EVENTS_SLICE_MS, so that the events lock is not held for long
+ * while only one device is serviced. */
+int usbi_handle_device_events_completed(struct libusb_device_handle *dev_handle,
+	int *completed)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct timeval tv, poll_timeout;
+	int r, timeout_ms;
+
+	if (!usbi_backend.handle_device_events)
+		return libusb_handle_events_completed(ctx, completed);
+
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	if (get_next_timeout(ctx, &tv, &poll_timeout)) {
+		/* timeout already expired */
+		handle_timeouts(ctx);
+		return 0;
+	}
+
+	/* transfers to other devices are only reaped by the regular event
+	 * handling, do not hold them off */
+	if (other_transfers_in_flight(dev_handle) ||
+	    libusb_try_lock_events(ctx) != 0)
+		return libusb_handle_events_completed(ctx, completed);
+
+	if (*completed) {
+		libusb_unlock_events(ctx);
+		return 0;
+	}
+
+	timeout_ms = (int)(poll_timeout.tv_sec * 1000) +
+		(int)((poll_timeout.tv_usec + 999) / 1000);
+	if (timeout_ms > DEVICE_EVENTS_SLICE_MS)
+		timeout_ms = DEVICE_EVENTS_SLICE_MS;
+
+	usbi_start_event_handling(ctx);
+	r = usbi_backend.handle_device_events(dev_handle, timeout_ms);
+	usbi_end_event_handling(ctx);
+
+	if (r == LIBUSB_SUCCESS) {
+		usbi_stats_inc(ctx, event_wakeups);
+	} else if (r == LIBUSB_ERROR_TIMEOUT) {
+		usbi_stats_inc(ctx, event_timeouts);
+		handle_timeouts(ctx);
+		r = LIBUSB_SUCCESS;
+	} else if (r == LIBUSB_ERROR_BUSY) {
+		usbi_dbg("falling back to regular event handling");
+		tv.tv_sec = 0;
+		r = handle_events(ctx, &tv);
+	}
+
+	libusb_unlock_events(ctx);
+	return r;
+}
+
 /** \ingroup libusb_poll
  * Handle any pending events
  *
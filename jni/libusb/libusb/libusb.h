@@ -141,6 +141,48 @@ typedef SSIZE_T ssize_t;
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
 
+/** \ingroup libusb_misc
+ * Defined if libusb_submit_transfers() is available. This call is not part
+ * of upstream libusb and does not change \ref LIBUSB_API_VERSION, so check
+ * for this macro instead of the API version.
+ */
+#define LIBUSB_HAS_SUBMIT_TRANSFERS 1
+
+/** \ingroup libusb_misc
+ * Defined if libusb_dev_mem_pool_create() and the other device memory pool
+ * calls are available. Like \ref LIBUSB_HAS_SUBMIT_TRANSFERS, these are not
+ * part of upstream libusb.
+ */
+#define LIBUSB_HAS_DEV_MEM_POOL 1
+
+/** \ingroup libusb_misc
+ * Defined if libusb_get_context_stats() and \ref libusb_context_stats are
+ * available. Like \ref LIBUSB_HAS_SUBMIT_TRANSFERS, these are not part of
+ * upstream libusb.
+ */
+#define LIBUSB_HAS_CONTEXT_STATS 1
+
+/** \ingroup libusb_misc
+ * Defined if \ref libusb_config_view and the calls to get and walk it are
+ * available. Like \ref LIBUSB_HAS_SUBMIT_TRANSFERS, these are not part of
+ * upstream libusb.
+ */
+#define LIBUSB_HAS_CONFIG_VIEW 1
+
+/** \ingroup libusb_misc
+ * Defined if the \ref LIBUSB_OPTION_HOTPLUG_COALESCE_WINDOW option exists.
+ * Like \ref LIBUSB_HAS_SUBMIT_TRANSFERS, this is not part of upstream
+ * libusb.
+ */
+#define LIBUSB_HAS_HOTPLUG_COALESCE 1
+
+/** \ingroup libusb_misc
+ * Defined if the \ref LIBUSB_OPTION_MOCK_BACKEND option exists. The mock
+ * backend itself is only built with --enable-mock-backend, otherwise setting
+ * the option returns LIBUSB_ERROR_NOT_SUPPORTED.
+ */
+#define LIBUSB_HAS_MOCK_BACKEND 1
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -732,6 +774,33 @@ struct libusb_config_descriptor {
 	int extra_length;
 };
 
+/** \ingroup libusb_desc
+ * A read-only view of the raw descriptors of a configuration, obtained with
+ * libusb_get_config_view() or libusb_get_active_config_view(). The data is
+ * owned by the device and remains valid for as long as a reference to the
+ * device is held, so no memory needs to be freed after use. Multiple-byte
+ * fields in the data are little-endian, as they were sent by the device.
+ *
+ * Use libusb_config_view_next_interface() and
+ * libusb_config_view_next_endpoint() to walk the descriptors.
+ *
+ * Available if \ref LIBUSB_HAS_CONFIG_VIEW is defined
+ */
+struct libusb_config_view {
+	/** The configuration descriptor, followed by all descriptors which
+	 * belong to the configuration */
+	const unsigned char *data;
+
+	/** Length of data in bytes */
+	int length;
+
+	/** Identifier value for this configuration */
+	uint8_t  bConfigurationValue;
+
+	/** Number of interfaces supported by this configuration */
+	uint8_t  bNumInterfaces;
+};
+
 /** \ingroup libusb_desc
  * A structure representing the superspeed endpoint companion
  * descriptor. This descriptor is documented in section 9.6.7 of
@@ -943,6 +1012,7 @@ struct libusb_control_setup {
 struct libusb_context;
 struct libusb_device;
 struct libusb_device_handle;
+struct libusb_dev_mem_pool;
 
 /** \ingroup libusb_lib
  * Structure providing the version of the libusb runtime
@@ -1376,6 +1446,16 @@ int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t bConfigurationValue, struct libusb_config_descriptor **config);
 void LIBUSB_CALL libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config);
+int LIBUSB_CALL libusb_get_active_config_view(libusb_device *dev,
+	struct libusb_config_view *view);
+int LIBUSB_CALL libusb_get_config_view(libusb_device *dev,
+	uint8_t config_index, struct libusb_config_view *view);
+int LIBUSB_CALL libusb_config_view_next_interface(
+	const struct libusb_config_view *view, int *offset,
+	struct libusb_interface_descriptor *interface);
+int LIBUSB_CALL libusb_config_view_next_endpoint(
+	const struct libusb_config_view *view, int *offset,
+	struct libusb_endpoint_descriptor *endpoint);
 int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(
 	libusb_context *ctx,
 	const struct libusb_endpoint_descriptor *endpoint,
@@ -1446,6 +1526,14 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
 	unsigned char *buffer, size_t length);
 
+int LIBUSB_CALL libusb_dev_mem_pool_create(libusb_device_handle *dev_handle,
+	size_t buffer_size, int num_buffers, struct libusb_dev_mem_pool **pool);
+void LIBUSB_CALL libusb_dev_mem_pool_destroy(struct libusb_dev_mem_pool *pool);
+unsigned char * LIBUSB_CALL libusb_dev_mem_pool_get(struct libusb_dev_mem_pool *pool);
+void LIBUSB_CALL libusb_dev_mem_pool_put(struct libusb_dev_mem_pool *pool,
+	unsigned char *buffer);
+int LIBUSB_CALL libusb_dev_mem_pool_is_dev_mem(struct libusb_dev_mem_pool *pool);
+
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle,
 	int interface_number);
 int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
@@ -1530,6 +1618,8 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
@@ -2101,11 +2191,107 @@ enum libusb_option {
 	 *
 	 * Only valid on Linux-based operating system, such as Android.
 	 */
-	LIBUSB_OPTION_WEAK_AUTHORITY = 2
+	LIBUSB_OPTION_WEAK_AUTHORITY = 2,
+
+	/* The options below are not part of upstream libusb. They are numbered
+	 * from 0x10000 so that they never clash with options upstream adds. */
+
+	/** Coalesce bursts of hotplug events, such as a hub with many devices
+	 * being plugged in. The argument is a window in milliseconds (0 to
+	 * 1000, 0 disables coalescing, which is the default). Events arriving
+	 * within the window of the first event of a burst are delivered to the
+	 * hotplug callbacks together, at the cost of that much added latency
+	 * for the first event.
+	 *
+	 * Only has an effect on Linux. When several contexts set different
+	 * windows, the largest is used for all of them.
+	 *
+	 * Available if \ref LIBUSB_HAS_HOTPLUG_COALESCE is defined
+	 */
+	LIBUSB_OPTION_HOTPLUG_COALESCE_WINDOW = 0x10000,
+
+	/** Use the in-process mock backend, which simulates devices so that
+	 * applications can be tested and benchmarked without hardware. The
+	 * argument is a string describing the devices, see os/mock_usb.c for
+	 * the syntax, or NULL to go back to the platform backend.
+	 *
+	 * The backend is shared by all contexts, so the option must be set with
+	 * a NULL context before calling libusb_init() and only takes effect
+	 * once no contexts exist.
+	 *
+	 * Only available if libusb was configured with --enable-mock-backend,
+	 * otherwise LIBUSB_ERROR_NOT_SUPPORTED is returned.
+	 *
+	 * Available if \ref LIBUSB_HAS_MOCK_BACKEND is defined
+	 */
+	LIBUSB_OPTION_MOCK_BACKEND = 0x10001
 };
 
 int LIBUSB_CALL libusb_set_option(libusb_context *ctx, enum libusb_option option, ...);
 
+/** \ingroup libusb_lib
+ * Number of buckets in each latency histogram of \ref libusb_context_stats.
+ * Bucket n counts transfers which took between 2^n and 2^(n+1) microseconds
+ * from submission to completion. The first bucket also counts anything
+ * faster, the last one anything slower.
+ */
+#define LIBUSB_STATS_LATENCY_BUCKETS	24
+
+/** \ingroup libusb_lib
+ * Number of buckets in the completions_per_wakeup histogram of
+ * \ref libusb_context_stats. Bucket 0 counts event handler wakeups which
+ * completed no transfer, bucket n (n > 0) those which completed between
+ * 2^(n-1) and 2^n - 1 transfers. The last bucket also counts anything larger.
+ */
+#define LIBUSB_STATS_BATCH_BUCKETS	8
+
+/** \ingroup libusb_lib
+ * Statistics about the transfers and event handling of a context, see
+ * libusb_get_context_stats(). All counters start at zero when the context
+ * is created and only ever increase, except for transfers_in_flight.
+ *
+ * Later versions only add counters at the end of the structure, so the
+ * size passed to libusb_get_context_stats() tells the library which of
+ * them the caller knows about.
+ *
+ * Available if \ref LIBUSB_HAS_CONTEXT_STATS is defined
+ */
+struct libusb_context_stats {
+	/** Number of transfers successfully submitted */
+	uint64_t transfers_submitted;
+
+	/** Number of transfer submissions which failed */
+	uint64_t submit_errors;
+
+	/** Number of completed transfers, indexed by \ref libusb_transfer_status */
+	uint64_t transfers_completed[LIBUSB_TRANSFER_OVERFLOW + 1];
+
+	/** Number of times the event handler was woken up by an event */
+	uint64_t event_wakeups;
+
+	/** Number of times the event handler ran into its timeout, including
+	 * timer expiries that found no transfer to time out */
+	uint64_t event_timeouts;
+
+	/** Histogram of the number of transfers completed per event handler
+	 * wakeup, see \ref LIBUSB_STATS_BATCH_BUCKETS */
+	uint64_t completions_per_wakeup[LIBUSB_STATS_BATCH_BUCKETS];
+
+	/** Number of transfers currently in flight, which is the length of the
+	 * list libusb keeps to track transfer timeouts */
+	uint64_t transfers_in_flight;
+
+	/** Largest value transfers_in_flight has had */
+	uint64_t max_transfers_in_flight;
+
+	/** Submission to completion latency histograms, indexed by
+	 * \ref libusb_transfer_type, see \ref LIBUSB_STATS_LATENCY_BUCKETS */
+	uint64_t latency[LIBUSB_TRANSFER_TYPE_BULK_STREAM + 1][LIBUSB_STATS_LATENCY_BUCKETS];
+};
+
+int LIBUSB_CALL libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_context_stats *stats, size_t stats_size);
+
 #if defined(__cplusplus)
 }
 #endif
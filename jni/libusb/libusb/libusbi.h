@@ -92,6 +92,36 @@
 #include "os/threads_windows.h"
 #endif
 
+/* Atomic operations. The _ptr variants operate on pointers and are
+ * sequentially consistent, the atomic64 variants operate on statistics
+ * counters and are relaxed. */
+#if defined(_MSC_VER)
+typedef void * volatile usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)		(*(a))
+#define usbi_atomic_ptr_exchange(a, v)	InterlockedExchangePointer((a), (v))
+#define usbi_atomic64_add_relaxed(a, v)	((void)InterlockedExchangeAdd64((volatile LONG64 *)(a), (LONG64)(v)))
+#define usbi_atomic64_load_relaxed(a)	((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(a), 0, 0))
+#define usbi_atomic64_store_relaxed(a, v) ((void)InterlockedExchange64((volatile LONG64 *)(a), (LONG64)(v)))
+static inline int usbi_atomic_ptr_cas(usbi_atomic_ptr_t *a, void **expected, void *desired)
+{
+	void *old = InterlockedCompareExchangePointer(a, desired, *expected);
+
+	if (old == *expected)
+		return 1;
+	*expected = old;
+	return 0;
+}
+#else
+typedef void *usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)		__atomic_load_n((a), __ATOMIC_SEQ_CST)
+#define usbi_atomic_ptr_exchange(a, v)	__atomic_exchange_n((a), (v), __ATOMIC_SEQ_CST)
+#define usbi_atomic_ptr_cas(a, e, v) \
+	__atomic_compare_exchange_n((a), (e), (v), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define usbi_atomic64_add_relaxed(a, v)	((void)__atomic_fetch_add((a), (v), __ATOMIC_RELAXED))
+#define usbi_atomic64_load_relaxed(a)	__atomic_load_n((a), __ATOMIC_RELAXED)
+#define usbi_atomic64_store_relaxed(a, v) __atomic_store_n((a), (v), __ATOMIC_RELAXED)
+#endif
+
 /* Inside the libusb code, mark all public functions as follows:
  *   return_type API_EXPORTED function_name(params) { ... }
  * But if the function returns a pointer, mark it as follows:
@@ -109,6 +139,9 @@ extern "C" {
 #define USB_MAXINTERFACES	32
 #define USB_MAXCONFIG		8
 
+/* Number of buckets hotplug callbacks are hashed into by vendor ID */
+#define USBI_HOTPLUG_VENDOR_BUCKETS	32
+
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS			0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
@@ -340,6 +373,20 @@ struct libusb_context {
 	libusb_hotplug_callback_handle next_hotplug_cb_handle;
 	usbi_mutex_t hotplug_cbs_lock;
 
+	/* The registered hotplug callbacks again, indexed by the vendor ID they
+	 * match on. Callbacks matching any vendor are in hotplug_cbs_any.
+	 * Protected by hotplug_cbs_lock. */
+	struct list_head hotplug_cbs_by_vendor[USBI_HOTPLUG_VENDOR_BUCKETS];
+	struct list_head hotplug_cbs_any;
+
+	/* Registration sequence number of the next hotplug callback, which
+	 * unlike the handle never wraps. Protected by hotplug_cbs_lock. */
+	uint64_t next_hotplug_cb_seq;
+
+	/* Hotplug events arriving within this many milliseconds of each other
+	 * are delivered together, see LIBUSB_OPTION_HOTPLUG_COALESCE_WINDOW */
+	int hotplug_coalesce_ms;
+
 	/* this is a list of in-flight transfer handles, sorted by timeout
 	 * expiration. URBs to timeout the soonest are placed at the beginning of
 	 * the list, URBs that will time out later are placed after, and urbs with
@@ -397,7 +444,25 @@ struct libusb_context {
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
-	/* A list of pending completed transfers. Protected by event_data_lock. */
+	/* Set while the backend is collecting a burst of hotplug events. The
+	 * messages are queued without signalling the event until the burst
+	 * ends. Protected by event_data_lock. */
+	int hotplug_batch;
+
+	/* A lock-free stack of completed transfers, pushed by backends through
+	 * usbi_signal_transfer_completion() and taken as a whole by the event
+	 * handler. Linked through usbi_transfer->completed_next. */
+	usbi_atomic_ptr_t completed_transfers_stack;
+
+#ifdef ENABLE_STATS
+	/* Statistics returned by libusb_get_context_stats(). Updated with
+	 * relaxed atomic operations, see usbi_stats_inc() and friends. */
+	struct libusb_context_stats stats;
+#endif
+
+	/* A list of completed transfers taken off completed_transfers_stack,
+	 * in completion order, that still need to be handed to the backend.
+	 * Only accessed while holding the event handling lock. */
 	struct list_head completed_transfers;
 
 	struct list_head list;
@@ -426,13 +491,67 @@ enum usbi_event_flags {
 	/* One or more hotplug messages are pending */
 	USBI_EVENT_HOTPLUG_MSG_PENDING = 1U << 3,
 
-	/* One or more completed transfers are pending */
-	USBI_EVENT_TRANSFER_COMPLETED = 1U << 4,
-
 	/* A device is in the process of being closed */
-	USBI_EVENT_DEVICE_CLOSE = 1U << 5,
+	USBI_EVENT_DEVICE_CLOSE = 1U << 4,
 };
 
+/* Statistics helpers for libusb_get_context_stats(). Without ENABLE_STATS
+ * these compile to nothing. The counters are only ever written with relaxed
+ * atomic operations, so they never order anything; except for the
+ * in-flight gauge, which is only modified with flying_transfers_lock held. */
+#ifdef ENABLE_STATS
+#define usbi_stats_add(ctx, field, v) \
+	usbi_atomic64_add_relaxed(&(ctx)->stats.field, (v))
+
+static inline void usbi_stats_flying_add(struct libusb_context *ctx)
+{
+	uint64_t n = usbi_atomic64_load_relaxed(&ctx->stats.transfers_in_flight) + 1;
+
+	usbi_atomic64_store_relaxed(&ctx->stats.transfers_in_flight, n);
+	if (n > usbi_atomic64_load_relaxed(&ctx->stats.max_transfers_in_flight))
+		usbi_atomic64_store_relaxed(&ctx->stats.max_transfers_in_flight, n);
+}
+
+static inline void usbi_stats_flying_del(struct libusb_context *ctx)
+{
+	uint64_t n = usbi_atomic64_load_relaxed(&ctx->stats.transfers_in_flight);
+
+	usbi_atomic64_store_relaxed(&ctx->stats.transfers_in_flight, n - 1);
+}
+#else
+#define usbi_stats_add(ctx, field, v)	do { } while (0)
+#define usbi_stats_flying_add(ctx)	do { } while (0)
+#define usbi_stats_flying_del(ctx)	do { } while (0)
+#endif
+#define usbi_stats_inc(ctx, field)	usbi_stats_add(ctx, field, 1)
+
+/* Static tracepoints (USDT) for perf / bpftrace. Without ENABLE_USDT these
+ * compile to nothing, with it a probe nobody is attached to is a single nop.
+ * The probes of the "libusb" provider are:
+ *  submit(transfer, endpoint, type, length): right before a transfer is
+ *    handed to the backend
+ *  reap(transfer, endpoint, status, actual_length): when the backend has
+ *    completed a transfer
+ *  callback(transfer, endpoint, status): right before the transfer callback
+ *    gets called */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define usbi_probe(name, ...)	STAP_PROBEV(libusb, name, __VA_ARGS__)
+#else
+#define usbi_probe(name, ...)	do { } while (0)
+#endif
+
+/* Index of the highest bit set in v, used to pick a histogram bucket */
+static inline unsigned int usbi_stats_log2(uint64_t v)
+{
+	unsigned int n = 0;
+
+	while (v >>= 1)
+		n++;
+
+	return n;
+}
+
 /* Macros for managing event handling state */
 static inline int usbi_handling_events(struct libusb_context *ctx)
 {
@@ -449,9 +568,33 @@ static inline void usbi_end_event_handling(struct libusb_context *ctx)
 	usbi_tls_key_set(ctx->event_handling_key, NULL);
 }
 
+/* Descriptor data cached on a device the first time it is needed */
+struct usbi_raw_config {
+	uint8_t *data;
+	int length;
+};
+
+struct usbi_endpoint_sizes {
+	uint8_t found;
+	uint16_t max_packet_size;
+	uint16_t max_iso_packet_size;
+};
+
+struct usbi_desc_cache {
+	/* raw configuration descriptors, by index */
+	struct usbi_raw_config *configs;
+
+	/* sizes of the endpoints of the configuration with bConfigurationValue
+	 * endpoints_config (0 if not filled in), by endpoint index. Looked up
+	 * without asking the backend for the active configuration until
+	 * usbi_invalidate_endpoint_sizes() is called. */
+	uint8_t endpoints_config;
+	struct usbi_endpoint_sizes endpoints[32];
+};
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt and desc_cache, everything else is finalized at
+	 * initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
 
@@ -468,13 +611,21 @@ struct libusb_device {
 
 	struct libusb_device_descriptor device_descriptor;
 	int attached;
+
+	struct usbi_desc_cache *desc_cache;
+
+	/* bumped by usbi_invalidate_endpoint_sizes(), protected by lock */
+	unsigned int endpoints_generation;
 };
 
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces and sync_transfer */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* idle transfer kept for reuse by the synchronous I/O functions */
+	struct libusb_transfer *sync_transfer;
+
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
@@ -528,7 +679,11 @@ struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
 	struct list_head completed_list;
+	struct usbi_transfer *completed_next;
 	struct timespec timeout;
+#ifdef ENABLE_STATS
+	struct timespec submit_time;
+#endif
 	int transferred;
 	uint32_t stream_id;
 	uint32_t state_flags;   /* Protected by usbi_transfer->lock */
@@ -674,16 +829,26 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
+void usbi_free_desc_cache(struct libusb_device *dev);
+int usbi_get_endpoint_sizes(struct libusb_device *dev, unsigned char endpoint,
+	struct usbi_endpoint_sizes *sizes);
+void usbi_invalidate_endpoint_sizes(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *dev_handle);
 
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer);
+int usbi_handle_device_events_completed(struct libusb_device_handle *dev_handle,
+	int *completed);
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer);
+void usbi_clear_event_if_idle(struct libusb_context *ctx);
 
 void usbi_connect_device(struct libusb_device *dev);
 void usbi_disconnect_device(struct libusb_device *dev);
 
+int usbi_hotplug_begin_batch(void);
+void usbi_hotplug_end_batch(void);
+
 struct usbi_event_source {
 	struct usbi_event_source_data {
 		usbi_os_handle_t os_handle;
@@ -1241,6 +1406,15 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Destroy a transfer. Optional.
+	 *
+	 * This function is called from libusb_free_transfer(). It should free
+	 * any resources that the backend retains in the transfer's private data
+	 * across submissions (e.g. URBs cached for resubmission). It is never
+	 * called for a transfer that is in flight.
+	 */
+	void (*destroy_transfer)(struct usbi_transfer *itransfer);
+
 	/* Handle any pending events on event sources. Optional.
 	 *
 	 * Provide this function when event sources directly indicate device
@@ -1277,6 +1451,28 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		void *event_data, unsigned int count, unsigned int num_ready);
 
+	/* Wait for and handle events of a single device. Optional.
+	 *
+	 * This is used by the synchronous I/O functions when the calling
+	 * thread is the only one handling events, so that waiting for a
+	 * transfer does not involve the event sources of every other device
+	 * in the context.
+	 *
+	 * The function should wait up to timeout_ms milliseconds for activity
+	 * on the device, the context's internal event or its timer, and then
+	 * process completed transfers for the device like handle_events does.
+	 * It is called with the events lock held.
+	 *
+	 * Return:
+	 * - 0 if events for the device were handled
+	 * - LIBUSB_ERROR_TIMEOUT if there was no activity before the timeout
+	 * - LIBUSB_ERROR_BUSY if anything else needs to be handled, in which
+	 *   case the library falls back to the regular event handling
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*handle_device_events)(struct libusb_device_handle *dev_handle,
+		int timeout_ms);
+
 	/* Handle transfer completion. Optional.
 	 *
 	 * Provide this function when there are no event sources available that
@@ -1327,7 +1523,22 @@ struct usbi_os_backend {
 	size_t transfer_priv_size;
 };
 
-extern const struct usbi_os_backend usbi_backend;
+/* The backend compiled in for the platform */
+extern const struct usbi_os_backend usbi_platform_backend;
+
+#ifdef ENABLE_MOCK_BACKEND
+/* In-process backend simulating devices, see os/mock_usb.c */
+extern const struct usbi_os_backend usbi_mock_backend;
+
+int usbi_mock_set_devices(const char *spec);
+
+/* The backend used by all contexts. This is only changed while there are no
+ * contexts, see libusb_init(). */
+extern const struct usbi_os_backend *usbi_active_backend;
+#define usbi_backend		(*usbi_active_backend)
+#else
+#define usbi_backend		usbi_platform_backend
+#endif
 
 #define for_each_context(c) \
 	for_each_helper(c, &active_contexts_list, struct libusb_context)
@@ -2262,7 +2262,7 @@ static int darwin_free_streams (struct libusb_device_handle *dev_handle, unsigne
 }
 #endif
 
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
         .name = "Darwin",
         .caps = 0,
         .init = darwin_init,
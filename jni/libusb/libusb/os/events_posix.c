@@ -55,6 +55,7 @@ int usbi_create_event(usbi_event_t *event)
 
 	return 0;
 #else
+	int i;
 #if defined(HAVE_PIPE2)
 	int ret = pipe2(event->pipefd, O_CLOEXEC);
 #else
@@ -90,15 +91,19 @@ int usbi_create_event(usbi_event_t *event)
 	}
 #endif
 
-	ret = fcntl(event->pipefd[1], F_GETFL);
-	if (ret == -1) {
-		usbi_err(NULL, "failed to get pipe fd status flags, errno=%d", errno);
-		goto err_close_pipe;
-	}
-	ret = fcntl(event->pipefd[1], F_SETFL, ret | O_NONBLOCK);
-	if (ret == -1) {
-		usbi_err(NULL, "failed to set pipe fd status flags, errno=%d", errno);
-		goto err_close_pipe;
+	/* both ends are non-blocking, a signalled event may be signalled again
+	 * and usbi_clear_event() drains the pipe like an eventfd read would */
+	for (i = 0; i < 2; i++) {
+		ret = fcntl(event->pipefd[i], F_GETFL);
+		if (ret == -1) {
+			usbi_err(NULL, "failed to get pipe fd status flags, errno=%d", errno);
+			goto err_close_pipe;
+		}
+		ret = fcntl(event->pipefd[i], F_SETFL, ret | O_NONBLOCK);
+		if (ret == -1) {
+			usbi_err(NULL, "failed to set pipe fd status flags, errno=%d", errno);
+			goto err_close_pipe;
+		}
 	}
 
 	return 0;
@@ -135,12 +140,24 @@ void usbi_signal_event(usbi_event_t *event)
 
 void usbi_clear_event(usbi_event_t *event)
 {
+#ifdef HAVE_EVENTFD
 	uint64_t dummy;
 	ssize_t r;
 
 	r = read(EVENT_READ_FD(event), &dummy, sizeof(dummy));
 	if (r != sizeof(dummy))
 		usbi_warn(NULL, "event read failed");
+#else
+	uint64_t dummy[8];
+	ssize_t r;
+
+	/* the event may have been signalled more than once */
+	do {
+		r = read(EVENT_READ_FD(event), dummy, sizeof(dummy));
+	} while (r == (ssize_t)sizeof(dummy));
+	if (r == -1 && errno != EAGAIN)
+		usbi_warn(NULL, "event read failed");
+#endif
 }
 
 #ifdef HAVE_TIMERFD
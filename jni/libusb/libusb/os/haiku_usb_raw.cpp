@@ -179,7 +179,7 @@ haiku_handle_transfer_completion(struct usbi_transfer *itransfer)
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
 	/*.name =*/ "Haiku usbfs",
 	/*.caps =*/ 0,
 	/*.init =*/ haiku_init,
@@ -220,6 +220,7 @@ const struct usbi_os_backend usbi_backend = {
 	/*.submit_transfer =*/ haiku_submit_transfer,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
 	/*.clear_transfer_priv =*/ NULL,
+	/*.destroy_transfer =*/ NULL,
 
 	/*.handle_events =*/ NULL,
 	/*.handle_transfer_completion =*/ haiku_handle_transfer_completion,
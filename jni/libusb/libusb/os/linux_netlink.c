@@ -378,9 +378,18 @@ static void *linux_netlink_event_thread_main(void *arg)
 			break;
 		}
 		if (fds[1].revents) {
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			linux_netlink_read_message();
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
+			int window_ms = usbi_hotplug_begin_batch();
+			struct timespec deadline;
+
+			linux_hotplug_batch_deadline(window_ms, &deadline);
+			do {
+				usbi_mutex_static_lock(&linux_hotplug_lock);
+				linux_netlink_read_message();
+				usbi_mutex_static_unlock(&linux_hotplug_lock);
+			} while (window_ms && linux_hotplug_wait_batch(fds, &deadline));
+
+			if (window_ms)
+				usbi_hotplug_end_batch();
 		}
 	}
 
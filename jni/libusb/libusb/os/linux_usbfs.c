@@ -92,6 +92,10 @@ static unsigned int max_iso_packet_len = 0;
 /* is sysfs available (mounted) ? */
 static int sysfs_available = -1;
 
+/* where the sysfs device directories are, see linux_set_sysfs_root() */
+static char sysfs_device_path[256] = SYSFS_DEVICE_PATH;
+static int sysfs_root_is_fake = 0;
+
 /* how many times have we initted (and not exited) ? */
 static int init_count = 0;
 
@@ -167,6 +171,18 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* URBs retained across submissions so that resubmitting the same
+	 * transfer does not allocate. iso URBs are sized by their packet count,
+	 * so that cache is only reused for the same number of iso packets. */
+	union {
+		struct usbfs_urb *cached_urbs;
+		struct usbfs_urb **cached_iso_urbs;
+	};
+	int num_cached_urbs;
+	int num_cached_iso_packets; /* 0 if the cache holds non-iso URBs */
+	unsigned int urb_cache_hits;
+	unsigned int urb_cache_misses;
 };
 
 static int get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
@@ -288,10 +304,23 @@ static const char *find_usbfs_path(void)
 #if defined(HAVE_LIBUDEV) || defined(__ANDROID__)
 	return USB_DEVTMPFS_PATH;
 #else
-	return NULL;
+	/* a fake sysfs tree has no usbfs behind it, which enumeration from
+	 * sysfs does not need */
+	return sysfs_root_is_fake ? USB_DEVTMPFS_PATH : NULL;
 #endif
 }
 
+/* Read sysfs from a fake tree under root instead of SYSFS_MOUNT_PATH, for
+ * the enumeration benchmark. This is not part of the API and must be called
+ * before the first context is initialized. The device directories are
+ * expected in root/bus/usb/devices. */
+void linux_set_sysfs_root(const char *root)
+{
+	snprintf(sysfs_device_path, sizeof(sysfs_device_path), "%s" SYSFS_DEVICE_DIR, root);
+	sysfs_root_is_fake = 1;
+	sysfs_available = 1;
+}
+
 static int get_kernel_version(struct libusb_context *ctx,
 	struct kernel_version *ver)
 {
@@ -467,10 +496,10 @@ static void op_hotplug_poll(void)
 static int open_sysfs_attr(struct libusb_context *ctx,
 	const char *sysfs_dir, const char *attr)
 {
-	char filename[256];
+	char filename[PATH_MAX];
 	int fd;
 
-	snprintf(filename, sizeof(filename), SYSFS_DEVICE_PATH "/%s/%s", sysfs_dir, attr);
+	snprintf(filename, sizeof(filename), "%s/%s/%s", sysfs_device_path, sysfs_dir, attr);
 	fd = open(filename, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		if (errno == ENOENT) {
@@ -552,6 +581,35 @@ static int read_sysfs_attr(struct libusb_context *ctx,
 	return 0;
 }
 
+/* Root hubs are named "usbN" and all other devices "N-port[.port...]",
+ * where N is the bus number */
+static int sysfs_parse_busnum(const char *sys_name, uint8_t *busnum)
+{
+	const char *p = sys_name;
+	char terminator = '-';
+	unsigned int num = 0;
+
+	if (!strncmp(p, "usb", 3)) {
+		p += 3;
+		terminator = '\0';
+	}
+
+	if (!isdigit(*p))
+		return 0;
+
+	while (isdigit(*p)) {
+		num = num * 10 + (unsigned int)(*p++ - '0');
+		if (num > UINT8_MAX)
+			return 0;
+	}
+
+	if (*p != terminator)
+		return 0;
+
+	*busnum = (uint8_t)num;
+	return 1;
+}
+
 static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
 {
 	uint8_t busnum, devaddr;
@@ -621,10 +679,14 @@ int linux_get_device_address(struct libusb_context *ctx, int detached,
 
 	usbi_dbg("scan %s", sys_name);
 
-	r = read_sysfs_attr(ctx, sys_name, "busnum", UINT8_MAX, &sysfs_val);
-	if (r < 0)
-		return r;
-	*busnum = (uint8_t)sysfs_val;
+	/* the bus number is part of the sysfs name, which saves reading the
+	 * busnum attribute for every device */
+	if (!sysfs_parse_busnum(sys_name, busnum)) {
+		r = read_sysfs_attr(ctx, sys_name, "busnum", UINT8_MAX, &sysfs_val);
+		if (r < 0)
+			return r;
+		*busnum = (uint8_t)sysfs_val;
+	}
 
 	r = read_sysfs_attr(ctx, sys_name, "devnum", UINT8_MAX, &sysfs_val);
 	if (r < 0)
@@ -884,84 +946,133 @@ static enum libusb_speed usbfs_get_speed(struct libusb_context *ctx, int fd)
 	return LIBUSB_SPEED_UNKNOWN;
 }
 
+/* read a complete descriptors file into a newly allocated buffer */
+static int read_descriptors(struct libusb_context *ctx, int fd, int has_holes,
+	void **descriptors, size_t *descriptors_len)
+{
+	const size_t desc_read_length = 256;
+	uint8_t *buffer = NULL;
+	size_t alloc_len = 0, len = 0;
+	ssize_t nb;
+
+	do {
+		alloc_len += desc_read_length;
+		buffer = usbi_reallocf(buffer, alloc_len);
+		if (!buffer)
+			return LIBUSB_ERROR_NO_MEM;
+		/* usbfs has holes in the file */
+		if (has_holes)
+			memset(buffer + len, 0, desc_read_length);
+		nb = read(fd, buffer + len, desc_read_length);
+		if (nb < 0) {
+			usbi_err(ctx, "read descriptor failed, errno=%d", errno);
+			free(buffer);
+			return LIBUSB_ERROR_IO;
+		}
+		len += (size_t)nb;
+	} while (len == alloc_len);
+
+	*descriptors = buffer;
+	*descriptors_len = len;
+	return LIBUSB_SUCCESS;
+}
+
+/* Everything enumeration needs from the sysfs directory of a device, so
+ * that a hotplug event can read it once and share it between all
+ * contexts */
+struct sysfs_device_info {
+	int speed;		/* in Mbps, or -1 if unknown */
+	void *descriptors;
+	size_t descriptors_len;
+};
+
+static int sysfs_read_device_info(struct libusb_context *ctx,
+	const char *sysfs_dir, struct sysfs_device_info *info)
+{
+	int fd, r;
+
+	/* Note speed can contain 1.5, in this case read_sysfs_attr()
+	   will stop parsing at the '.' and return 1 */
+	if (read_sysfs_attr(ctx, sysfs_dir, "speed", INT_MAX, &info->speed) < 0)
+		info->speed = -1;
+
+	fd = open_sysfs_attr(ctx, sysfs_dir, "descriptors");
+	if (fd < 0)
+		return fd;
+
+	r = read_descriptors(ctx, fd, 0, &info->descriptors, &info->descriptors_len);
+	close(fd);
+
+	return r;
+}
+
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
-	uint8_t devaddr, const char *sysfs_dir, int wrapped_fd)
+	uint8_t devaddr, const char *sysfs_dir, const struct sysfs_device_info *info,
+	int wrapped_fd)
 {
 	struct linux_device_priv *priv = usbi_get_device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
-	size_t alloc_len;
-	int fd, speed, r;
-	ssize_t nb;
+	int fd, r;
 
 	dev->bus_number = busnum;
 	dev->device_address = devaddr;
 
 	if (sysfs_dir) {
+		struct sysfs_device_info local_info;
+
 		priv->sysfs_dir = strdup(sysfs_dir);
 		if (!priv->sysfs_dir)
 			return LIBUSB_ERROR_NO_MEM;
 
-		/* Note speed can contain 1.5, in this case read_sysfs_attr()
-		   will stop parsing at the '.' and return 1 */
-		if (read_sysfs_attr(ctx, sysfs_dir, "speed", INT_MAX, &speed) == 0) {
-			switch (speed) {
-			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
-			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
-			case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
-			case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
-			case 10000: dev->speed = LIBUSB_SPEED_SUPER_PLUS; break;
-			default:
-				usbi_warn(ctx, "unknown device speed: %d Mbps", speed);
-			}
-		}
-	} else if (wrapped_fd >= 0) {
-		dev->speed = usbfs_get_speed(ctx, wrapped_fd);
-	}
-
-	/* cache descriptors in memory */
-	if (sysfs_dir) {
-		fd = open_sysfs_attr(ctx, sysfs_dir, "descriptors");
-	} else if (wrapped_fd < 0) {
-		fd = get_usbfs_fd(dev, O_RDONLY, 0);
-	} else {
-		fd = wrapped_fd;
-		r = lseek(fd, 0, SEEK_SET);
-		if (r < 0) {
-			usbi_err(ctx, "lseek failed, errno=%d", errno);
-			return LIBUSB_ERROR_IO;
+		if (info) {
+			/* the information may be shared with other contexts */
+			priv->descriptors = malloc(info->descriptors_len);
+			if (!priv->descriptors)
+				return LIBUSB_ERROR_NO_MEM;
+			memcpy(priv->descriptors, info->descriptors, info->descriptors_len);
+			priv->descriptors_len = info->descriptors_len;
+		} else {
+			memset(&local_info, 0, sizeof(local_info));
+			r = sysfs_read_device_info(ctx, sysfs_dir, &local_info);
+			if (r < 0)
+				return r;
+			priv->descriptors = local_info.descriptors;
+			priv->descriptors_len = local_info.descriptors_len;
+			info = &local_info;
 		}
-	}
-	if (fd < 0)
-		return fd;
-
-	alloc_len = 0;
-	do {
-		const size_t desc_read_length = 256;
-		uint8_t *read_ptr;
 
-		alloc_len += desc_read_length;
-		priv->descriptors = usbi_reallocf(priv->descriptors, alloc_len);
-		if (!priv->descriptors) {
-			if (fd != wrapped_fd)
-				close(fd);
-			return LIBUSB_ERROR_NO_MEM;
+		switch (info->speed) {
+		case    -1: break;
+		case     1: dev->speed = LIBUSB_SPEED_LOW; break;
+		case    12: dev->speed = LIBUSB_SPEED_FULL; break;
+		case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
+		case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
+		case 10000: dev->speed = LIBUSB_SPEED_SUPER_PLUS; break;
+		default:
+			usbi_warn(ctx, "unknown device speed: %d Mbps", info->speed);
 		}
-		read_ptr = (uint8_t *)priv->descriptors + priv->descriptors_len;
-		/* usbfs has holes in the file */
-		if (!sysfs_dir)
-			memset(read_ptr, 0, desc_read_length);
-		nb = read(fd, read_ptr, desc_read_length);
-		if (nb < 0) {
-			usbi_err(ctx, "read descriptor failed, errno=%d", errno);
-			if (fd != wrapped_fd)
-				close(fd);
-			return LIBUSB_ERROR_IO;
+	} else {
+		/* cache descriptors in memory */
+		if (wrapped_fd < 0) {
+			fd = get_usbfs_fd(dev, O_RDONLY, 0);
+		} else {
+			dev->speed = usbfs_get_speed(ctx, wrapped_fd);
+			fd = wrapped_fd;
+			r = lseek(fd, 0, SEEK_SET);
+			if (r < 0) {
+				usbi_err(ctx, "lseek failed, errno=%d", errno);
+				return LIBUSB_ERROR_IO;
+			}
 		}
-		priv->descriptors_len += (size_t)nb;
-	} while (priv->descriptors_len == alloc_len);
+		if (fd < 0)
+			return fd;
 
-	if (fd != wrapped_fd)
-		close(fd);
+		r = read_descriptors(ctx, fd, 1, &priv->descriptors, &priv->descriptors_len);
+		if (fd != wrapped_fd)
+			close(fd);
+		if (r < 0)
+			return r;
+	}
 
 	if (priv->descriptors_len < LIBUSB_DT_DEVICE_SIZE) {
 		usbi_err(ctx, "short descriptor read (%zu)", priv->descriptors_len);
@@ -1073,8 +1184,11 @@ retry:
 	return LIBUSB_SUCCESS;
 }
 
-int linux_enumerate_device(struct libusb_context *ctx,
-	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+/* Add the device to the context unless it is already known. For sysfs
+ * devices, info (if not NULL) caches the device's sysfs attributes; it is
+ * filled in by the first context that needs it and reused by the others. */
+static int enumerate_device(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir, struct sysfs_device_info *info)
 {
 	unsigned long session_id;
 	struct libusb_device *dev;
@@ -1088,10 +1202,29 @@ int linux_enumerate_device(struct libusb_context *ctx,
 
 	dev = usbi_get_device_by_session_id(ctx, session_id);
 	if (dev) {
-		/* device already exists in the context */
-		usbi_dbg("session_id %lu already exists", session_id);
+		struct linux_device_priv *priv = usbi_get_device_priv(dev);
+
+		/* the same address on a different port means that the removal
+		 * of the old device was missed */
+		if (!sysfs_dir || !priv->sysfs_dir || !strcmp(priv->sysfs_dir, sysfs_dir)) {
+			/* device already exists in the context, but it may
+			 * have been reconfigured */
+			usbi_dbg("session_id %lu already exists", session_id);
+			usbi_invalidate_endpoint_sizes(dev);
+			libusb_unref_device(dev);
+			return LIBUSB_SUCCESS;
+		}
+
+		usbi_dbg("session_id %lu moved from %s to %s", session_id,
+			 priv->sysfs_dir, sysfs_dir);
+		usbi_disconnect_device(dev);
 		libusb_unref_device(dev);
-		return LIBUSB_SUCCESS;
+	}
+
+	if (sysfs_dir && info && !info->descriptors) {
+		r = sysfs_read_device_info(ctx, sysfs_dir, info);
+		if (r < 0)
+			return r;
 	}
 
 	usbi_dbg("allocating new device for %u/%u (session %lu)",
@@ -1100,7 +1233,7 @@ int linux_enumerate_device(struct libusb_context *ctx,
 	if (!dev)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = initialize_device(dev, busnum, devaddr, sysfs_dir, -1);
+	r = initialize_device(dev, busnum, devaddr, sysfs_dir, info, -1);
 	if (r < 0)
 		goto out;
 	r = usbi_sanitize_device(dev);
@@ -1119,15 +1252,60 @@ out:
 	return r;
 }
 
+int linux_enumerate_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+{
+	return enumerate_device(ctx, busnum, devaddr, sysfs_dir, NULL);
+}
+
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name)
 {
+	struct sysfs_device_info info;
 	struct libusb_context *ctx;
 
+	/* read the sysfs attributes at most once, however many contexts
+	 * there are */
+	memset(&info, 0, sizeof(info));
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	for_each_context(ctx) {
-		linux_enumerate_device(ctx, busnum, devaddr, sys_name);
+		enumerate_device(ctx, busnum, devaddr, sys_name, &info);
 	}
 	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	free(info.descriptors);
+}
+
+void linux_hotplug_batch_deadline(int window_ms, struct timespec *deadline)
+{
+	usbi_get_monotonic_time(deadline);
+	deadline->tv_sec += window_ms / 1000;
+	deadline->tv_nsec += (window_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= NSEC_PER_SEC) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= NSEC_PER_SEC;
+	}
+}
+
+/* Wait for the next hotplug event of a burst on fds[1], until deadline.
+ * fds[0] is the control event of the monitor thread. Returns 1 if there is
+ * another event to read. */
+int linux_hotplug_wait_batch(struct pollfd *fds, const struct timespec *deadline)
+{
+	struct timespec now, remaining;
+	int timeout_ms, r;
+
+	do {
+		usbi_get_monotonic_time(&now);
+		if (!TIMESPEC_CMP(&now, deadline, <))
+			return 0;
+
+		TIMESPEC_SUB(deadline, &now, &remaining);
+		timeout_ms = (int)(remaining.tv_sec * 1000 + (remaining.tv_nsec + 999999) / 1000000);
+		r = poll(fds, 2, timeout_ms);
+	} while (r == -1 && errno == EINTR);
+
+	return r > 0 && !fds[0].revents && (fds[1].revents & POLLIN);
 }
 
 void linux_device_disconnected(uint8_t busnum, uint8_t devaddr)
@@ -1256,7 +1434,7 @@ static int usbfs_get_device_list(struct libusb_context *ctx)
 
 static int sysfs_get_device_list(struct libusb_context *ctx)
 {
-	DIR *devices = opendir(SYSFS_DEVICE_PATH);
+	DIR *devices = opendir(sysfs_device_path);
 	struct dirent *entry;
 	int num_devices = 0;
 	int num_enumerated = 0;
@@ -1353,7 +1531,7 @@ static int op_wrap_sys_device(struct libusb_context *ctx,
 	if (!dev)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = initialize_device(dev, busnum, devaddr, NULL, fd);
+	r = initialize_device(dev, busnum, devaddr, NULL, NULL, fd);
 	if (r < 0)
 		goto out;
 	r = usbi_sanitize_device(dev);
@@ -1861,20 +2039,84 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+static void free_cached_urbs(struct linux_transfer_priv *tpriv)
 {
 	int i;
 
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+	if (tpriv->num_cached_iso_packets) {
+		for (i = 0; i < tpriv->num_cached_urbs; i++)
+			free(tpriv->cached_iso_urbs[i]);
+	}
 
-		if (!urb)
-			break;
-		free(urb);
+	free(tpriv->cached_urbs);
+	tpriv->cached_urbs = NULL;
+	tpriv->num_cached_urbs = 0;
+	tpriv->num_cached_iso_packets = 0;
+}
+
+/* get num_urbs zeroed control/bulk/interrupt URBs, reusing the ones from a
+ * previous submission of this transfer if there are enough of them */
+static struct usbfs_urb *get_urbs(struct linux_transfer_priv *tpriv, int num_urbs)
+{
+	if (tpriv->num_cached_iso_packets || tpriv->num_cached_urbs < num_urbs) {
+		free_cached_urbs(tpriv);
+		tpriv->cached_urbs = malloc(num_urbs * sizeof(*tpriv->cached_urbs));
+		if (!tpriv->cached_urbs)
+			return NULL;
+		tpriv->num_cached_urbs = num_urbs;
+		tpriv->urb_cache_misses++;
+	} else {
+		tpriv->urb_cache_hits++;
 	}
 
-	free(tpriv->iso_urbs);
-	tpriv->iso_urbs = NULL;
+	memset(tpriv->cached_urbs, 0, num_urbs * sizeof(*tpriv->cached_urbs));
+	return tpriv->cached_urbs;
+}
+
+/* get zeroed iso URBs for num_packets packets, reusing the ones from a previous
+ * submission of this transfer if it had the same number of packets */
+static struct usbfs_urb **get_iso_urbs(struct linux_transfer_priv *tpriv,
+	int num_packets, int num_urbs)
+{
+	struct usbfs_urb **urbs;
+	int num_packets_remaining = num_packets;
+	int reuse = tpriv->num_cached_iso_packets == num_packets;
+	int i;
+
+	if (reuse) {
+		urbs = tpriv->cached_iso_urbs;
+		tpriv->urb_cache_hits++;
+	} else {
+		free_cached_urbs(tpriv);
+		urbs = calloc(num_urbs, sizeof(*urbs));
+		if (!urbs)
+			return NULL;
+		tpriv->urb_cache_misses++;
+	}
+
+	for (i = 0; i < num_urbs; i++) {
+		int num_packets_in_urb = MIN(num_packets_remaining, MAX_ISO_PACKETS_PER_URB);
+		size_t alloc_size = sizeof(struct usbfs_urb)
+			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc));
+
+		if (reuse) {
+			memset(urbs[i], 0, alloc_size);
+		} else {
+			urbs[i] = calloc(1, alloc_size);
+			if (!urbs[i]) {
+				while (--i >= 0)
+					free(urbs[i]);
+				free(urbs);
+				return NULL;
+			}
+		}
+		num_packets_remaining -= num_packets_in_urb;
+	}
+
+	tpriv->cached_iso_urbs = urbs;
+	tpriv->num_cached_urbs = num_urbs;
+	tpriv->num_cached_iso_packets = num_packets;
+	return urbs;
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
@@ -1943,7 +2185,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		num_urbs++;
 	}
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs, transfer->length);
-	urbs = calloc(num_urbs, sizeof(*urbs));
+	urbs = get_urbs(tpriv, num_urbs);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urbs;
@@ -2008,7 +2250,6 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg("first URB failed, easy peasy");
-			free(urbs);
 			tpriv->urbs = NULL;
 			return r;
 		}
@@ -2094,7 +2335,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs, transfer->length);
 
-	urbs = calloc(num_urbs, sizeof(*urbs));
+	urbs = get_iso_urbs(tpriv, num_packets, num_urbs);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -2104,23 +2345,13 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	tpriv->reap_action = NORMAL;
 	tpriv->iso_packet_offset = 0;
 
-	/* allocate + initialize each URB with the correct number of packets */
+	/* initialize each URB with the correct number of packets */
 	num_packets_remaining = num_packets;
 	for (i = 0, j = 0; i < num_urbs; i++) {
 		int num_packets_in_urb = MIN(num_packets_remaining, MAX_ISO_PACKETS_PER_URB);
-		struct usbfs_urb *urb;
-		size_t alloc_size;
+		struct usbfs_urb *urb = urbs[i];
 		int k;
 
-		alloc_size = sizeof(*urb)
-			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
-		urbs[i] = urb;
-
 		/* populate packet lengths */
 		for (k = 0; k < num_packets_in_urb; j++, k++) {
 			packet_len = transfer->iso_packet_desc[j].length;
@@ -2164,7 +2395,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg("first URB failed, easy peasy");
-			free_iso_urbs(tpriv);
+			tpriv->iso_urbs = NULL;
 			return r;
 		}
 
@@ -2209,7 +2440,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(*urb));
+	urb = get_urbs(tpriv, 1);
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2224,7 +2455,6 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -2289,27 +2519,33 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 
+	/* the URBs themselves stay cached for the next submission */
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		if (tpriv->urbs) {
-			free(tpriv->urbs);
-			tpriv->urbs = NULL;
-		}
+		tpriv->urbs = NULL;
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		if (tpriv->iso_urbs) {
-			free_iso_urbs(tpriv);
-			tpriv->iso_urbs = NULL;
-		}
+		tpriv->iso_urbs = NULL;
 		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer), "unknown transfer type %u", transfer->type);
 	}
 }
 
+static void op_destroy_transfer(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	if (tpriv->urb_cache_hits || tpriv->urb_cache_misses)
+		usbi_dbg("transfer %p: URB cache %u hits, %u misses",
+			 USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer),
+			 tpriv->urb_cache_hits, tpriv->urb_cache_misses);
+	free_cached_urbs(tpriv);
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
@@ -2439,7 +2675,6 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return tpriv->reap_action == CANCELLED ?
@@ -2526,7 +2761,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg("CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
+			tpriv->iso_urbs = NULL;
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
 				return usbi_handle_transfer_cancellation(itransfer);
@@ -2557,7 +2792,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we've reaped all urbs then we're done */
 	if (tpriv->num_retired == num_urbs) {
 		usbi_dbg("all URBs in transfer reaped --> complete!");
-		free_iso_urbs(tpriv);
+		tpriv->iso_urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
@@ -2582,7 +2817,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer), "cancel: unrecognised urb status %d",
 				  urb->status);
-		free(tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
@@ -2622,7 +2856,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
@@ -2667,6 +2900,50 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+static int op_handle_device_events(struct libusb_device_handle *handle,
+	int timeout_ms)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct pollfd fds[3];
+	nfds_t nfds = 0;
+	int r, reap_count;
+
+	if (hpriv->fd_removed)
+		return LIBUSB_ERROR_BUSY;
+
+	fds[nfds].fd = hpriv->fd;
+	fds[nfds++].events = POLLOUT;
+	fds[nfds].fd = USBI_EVENT_OS_HANDLE(&ctx->event);
+	fds[nfds++].events = POLLIN;
+#ifdef HAVE_OS_TIMER
+	if (usbi_using_timer(ctx)) {
+		fds[nfds].fd = USBI_TIMER_OS_HANDLE(&ctx->timer);
+		fds[nfds++].events = POLLIN;
+	}
+#endif
+
+	r = poll(fds, nfds, timeout_ms);
+	if (r == -1)
+		return errno == EINTR ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_IO;
+	else if (r == 0)
+		return LIBUSB_ERROR_TIMEOUT;
+
+	/* leave internal events, timeouts and disconnects to op_handle_events() */
+	if (fds[1].revents || (nfds > 2 && fds[2].revents) ||
+	    (fds[0].revents & POLLERR))
+		return LIBUSB_ERROR_BUSY;
+
+	reap_count = 0;
+	do {
+		r = reap_for_handle(handle);
+	} while (r == 0 && ++reap_count <= 25);
+
+	if (r == LIBUSB_ERROR_NO_DEVICE)
+		return LIBUSB_ERROR_BUSY;
+	return r < 0 ? r : 0;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	void *event_data, unsigned int count, unsigned int num_ready)
 {
@@ -2739,7 +3016,7 @@ out:
 	return r;
 }
 
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
 	.name = "Linux usbfs",
 	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
 	.init = op_init,
@@ -2777,8 +3054,10 @@ const struct usbi_os_backend usbi_backend = {
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.destroy_transfer = op_destroy_transfer,
 
 	.handle_events = op_handle_events,
+	.handle_device_events = op_handle_device_events,
 
 	.device_priv_size = sizeof(struct linux_device_priv),
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
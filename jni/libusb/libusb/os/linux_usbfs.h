@@ -25,7 +25,8 @@
 #include <linux/types.h>
 
 #define SYSFS_MOUNT_PATH	"/sys"
-#define SYSFS_DEVICE_PATH	SYSFS_MOUNT_PATH "/bus/usb/devices"
+#define SYSFS_DEVICE_DIR	"/bus/usb/devices"
+#define SYSFS_DEVICE_PATH	SYSFS_MOUNT_PATH SYSFS_DEVICE_DIR
 
 struct usbfs_ctrltransfer {
 	/* keep in sync with usbdevice_fs.h:usbdevfs_ctrltransfer */
@@ -200,6 +201,8 @@ static inline void linux_hotplug_poll(void)
 }
 
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name);
+void linux_hotplug_batch_deadline(int window_ms, struct timespec *deadline);
+int linux_hotplug_wait_batch(struct pollfd *fds, const struct timespec *deadline);
 void linux_device_disconnected(uint8_t busnum, uint8_t devaddr);
 
 int linux_get_device_address(struct libusb_context *ctx, int detached,
@@ -207,5 +210,6 @@ int linux_get_device_address(struct libusb_context *ctx, int detached,
 	const char *sys_name, int fd);
 int linux_enumerate_device(struct libusb_context *ctx,
 	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir);
+void linux_set_sysfs_root(const char *root);
 
 #endif
@@ -0,0 +1,968 @@
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * In-process mock backend for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The mock backend simulates devices entirely in-process, so that the I/O
+ * paths of libusb and the code built on top of it can be exercised and
+ * benchmarked without any hardware.
+ *
+ * The backend is only built with --enable-mock-backend. The simulated
+ * devices are described by a string, passed through
+ * libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, spec). Devices are
+ * separated by ';', each device is a ',' separated list of key=value pairs:
+ *
+ *   vid=<n>            idVendor (default 0x1209)
+ *   pid=<n>            idProduct (default 0x0001)
+ *   speed=<s>          low, full, high (default) or super
+ *   ep=<addr>:<type>[:<max packet size>]
+ *                      an endpoint of interface 0, type is bulk, int or iso
+ *   latency=<n>        microseconds from submission to completion
+ *   rate=<n>           bus throughput in bytes per second, shared by all
+ *                      endpoints of the device (default 0, unlimited)
+ *   stall=<n>          stall every n-th data transfer, the endpoint stays
+ *                      halted until it is cleared
+ *   disconnect=<n>     disconnect the device on the n-th data transfer
+ *   inline=<n>         if non-zero, complete transfers from the submitting
+ *                      thread, ignoring latency and rate
+ *
+ * A device without any endpoints gets a bulk in/out pair, an interrupt in
+ * and an isochronous in/out pair. IN transfers are filled with a counting
+ * byte pattern, OUT data is discarded. Standard control requests are
+ * answered from the simulated descriptors, vendor and class requests
+ * succeed with a counting pattern for IN.
+ */
+
+#include "libusbi.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOCK_MAX_DEVICES	16
+#define MOCK_MAX_ENDPOINTS	30
+#define MOCK_BUS_NUMBER		1
+#define MOCK_CONFIG_DESC_SIZE	(LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE + \
+				 MOCK_MAX_ENDPOINTS * LIBUSB_DT_ENDPOINT_SIZE)
+
+/* Bit for an endpoint address in mock_device_priv.halted */
+#define MOCK_EP_BIT(ep)		(1U << (((ep) & 0x0f) | (((ep) & 0x80) >> 3)))
+
+struct mock_endpoint {
+	uint8_t address;
+	uint8_t type;
+	uint16_t max_packet_size;
+};
+
+struct mock_device_config {
+	uint16_t vid;
+	uint16_t pid;
+	enum libusb_speed speed;
+	unsigned int latency_us;
+	unsigned long bytes_per_sec;
+	unsigned int stall_every;
+	unsigned int disconnect_after;
+	unsigned int inline_completion;
+	unsigned int num_endpoints;
+	struct mock_endpoint endpoints[MOCK_MAX_ENDPOINTS];
+};
+
+struct mock_context_priv {
+	/* lock protects everything below as well as the mutable state of
+	 * all devices and transfers of the context */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	pthread_t thread;
+	int stop;
+
+	/* submitted transfers, in order of completion time */
+	struct list_head pending;
+};
+
+struct mock_device_priv {
+	struct mock_device_config config;
+	unsigned char config_desc[MOCK_CONFIG_DESC_SIZE];
+	size_t config_desc_len;
+
+	uint8_t configuration;
+	uint32_t halted;
+	unsigned int transfers;
+	struct timespec bus_idle;
+	int disconnected;
+};
+
+struct mock_transfer_priv {
+	struct list_head list;
+	struct usbi_transfer *itransfer;
+	struct libusb_device_handle *handle;
+	struct timespec due;
+	enum libusb_transfer_status status;
+	int transferred;
+	uint8_t queued;
+	uint8_t cancelled;
+	uint8_t disconnect;
+};
+
+/* Device spec set through libusb_set_option(), protected by the default
+ * context lock in core.c */
+static char *mock_spec;
+
+static const char mock_default_spec[] =
+	"ep=0x81:bulk,ep=0x02:bulk,ep=0x83:int,ep=0x84:iso,ep=0x05:iso";
+
+int usbi_mock_set_devices(const char *spec)
+{
+	char *copy = NULL;
+
+	if (spec) {
+		copy = strdup(spec);
+		if (!copy)
+			return LIBUSB_ERROR_NO_MEM;
+	}
+
+	free(mock_spec);
+	mock_spec = copy;
+	return LIBUSB_SUCCESS;
+}
+
+static uint16_t mock_default_max_packet_size(enum libusb_speed speed,
+	uint8_t type)
+{
+	switch (speed) {
+	case LIBUSB_SPEED_LOW:
+		return 8;
+	case LIBUSB_SPEED_FULL:
+		return type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? 1023 : 64;
+	case LIBUSB_SPEED_HIGH:
+		return type == LIBUSB_TRANSFER_TYPE_BULK ? 512 : 1024;
+	default:
+		return 1024;
+	}
+}
+
+static int mock_parse_endpoint(struct mock_device_config *config,
+	char *value)
+{
+	struct mock_endpoint *ep;
+	unsigned long addr, maxp = 0;
+	char *type, *end;
+
+	if (config->num_endpoints == MOCK_MAX_ENDPOINTS)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ep = &config->endpoints[config->num_endpoints];
+
+	addr = strtoul(value, &end, 0);
+	if (*end != ':' || addr > 0xff || (addr & 0x70) || !(addr & 0x0f))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	type = end + 1;
+
+	end = strchr(type, ':');
+	if (end) {
+		*end++ = '\0';
+		maxp = strtoul(end, &end, 0);
+		if (*end || !maxp || maxp > 1024)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (!strcmp(type, "bulk"))
+		ep->type = LIBUSB_TRANSFER_TYPE_BULK;
+	else if (!strcmp(type, "int"))
+		ep->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	else if (!strcmp(type, "iso"))
+		ep->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+	else
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ep->address = (uint8_t)addr;
+	ep->max_packet_size = (uint16_t)maxp;
+	config->num_endpoints++;
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_parse_device(struct mock_device_config *config, char *spec)
+{
+	char *field, *value, *end, *saveptr;
+	unsigned long n;
+	unsigned int i;
+	int r;
+
+	memset(config, 0, sizeof(*config));
+	config->vid = 0x1209;
+	config->pid = 0x0001;
+	config->speed = LIBUSB_SPEED_HIGH;
+
+	for (field = strtok_r(spec, ",", &saveptr); field;
+	     field = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(field, '=');
+		if (!value)
+			goto invalid;
+		*value++ = '\0';
+
+		if (!strcmp(field, "ep")) {
+			r = mock_parse_endpoint(config, value);
+			if (r < 0)
+				goto invalid;
+			continue;
+		} else if (!strcmp(field, "speed")) {
+			if (!strcmp(value, "low"))
+				config->speed = LIBUSB_SPEED_LOW;
+			else if (!strcmp(value, "full"))
+				config->speed = LIBUSB_SPEED_FULL;
+			else if (!strcmp(value, "high"))
+				config->speed = LIBUSB_SPEED_HIGH;
+			else if (!strcmp(value, "super"))
+				config->speed = LIBUSB_SPEED_SUPER;
+			else
+				goto invalid;
+			continue;
+		}
+
+		n = strtoul(value, &end, 0);
+		if (*end)
+			goto invalid;
+
+		if (!strcmp(field, "vid") && n <= 0xffff)
+			config->vid = (uint16_t)n;
+		else if (!strcmp(field, "pid") && n <= 0xffff)
+			config->pid = (uint16_t)n;
+		else if (!strcmp(field, "latency"))
+			config->latency_us = (unsigned int)n;
+		else if (!strcmp(field, "rate"))
+			config->bytes_per_sec = n;
+		else if (!strcmp(field, "stall"))
+			config->stall_every = (unsigned int)n;
+		else if (!strcmp(field, "disconnect"))
+			config->disconnect_after = (unsigned int)n;
+		else if (!strcmp(field, "inline"))
+			config->inline_completion = (unsigned int)n;
+		else
+			goto invalid;
+	}
+
+	if (!config->num_endpoints) {
+		char default_spec[sizeof(mock_default_spec)];
+
+		strcpy(default_spec, mock_default_spec);
+		for (field = strtok_r(default_spec, ",", &saveptr); field;
+		     field = strtok_r(NULL, ",", &saveptr))
+			mock_parse_endpoint(config, field + strlen("ep="));
+	}
+
+	for (i = 0; i < config->num_endpoints; i++) {
+		struct mock_endpoint *ep = &config->endpoints[i];
+
+		if (!ep->max_packet_size)
+			ep->max_packet_size = mock_default_max_packet_size(config->speed, ep->type);
+	}
+
+	return LIBUSB_SUCCESS;
+
+invalid:
+	usbi_err(NULL, "invalid mock device field '%s'", field);
+	return LIBUSB_ERROR_INVALID_PARAM;
+}
+
+static int mock_parse_devices(const char *spec,
+	struct mock_device_config *configs)
+{
+	char *copy, *device, *saveptr;
+	int r, count = 0;
+
+	copy = strdup(spec);
+	if (!copy)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* strtok_r() would skip empty devices, which stand for the defaults */
+	for (device = copy; device; device = saveptr) {
+		saveptr = strchr(device, ';');
+		if (saveptr)
+			*saveptr++ = '\0';
+
+		if (count == MOCK_MAX_DEVICES) {
+			usbi_err(NULL, "too many mock devices");
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			goto out;
+		}
+
+		r = mock_parse_device(&configs[count], device);
+		if (r < 0)
+			goto out;
+
+		count++;
+	}
+	r = count;
+
+out:
+	free(copy);
+	return r;
+}
+
+static void mock_build_descriptors(struct libusb_device *dev)
+{
+	struct mock_device_priv *dpriv = usbi_get_device_priv(dev);
+	struct mock_device_config *config = &dpriv->config;
+	struct libusb_device_descriptor *desc = &dev->device_descriptor;
+	unsigned char *p = dpriv->config_desc;
+	unsigned int i;
+
+	desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType = LIBUSB_DT_DEVICE;
+	switch (config->speed) {
+	case LIBUSB_SPEED_LOW:
+	case LIBUSB_SPEED_FULL:
+		desc->bcdUSB = 0x0110;
+		desc->bMaxPacketSize0 = config->speed == LIBUSB_SPEED_LOW ? 8 : 64;
+		break;
+	case LIBUSB_SPEED_HIGH:
+		desc->bcdUSB = 0x0200;
+		desc->bMaxPacketSize0 = 64;
+		break;
+	default:
+		desc->bcdUSB = 0x0300;
+		desc->bMaxPacketSize0 = 9;
+	}
+	desc->idVendor = config->vid;
+	desc->idProduct = config->pid;
+	desc->bcdDevice = 0x0100;
+	desc->bNumConfigurations = 1;
+
+	dpriv->config_desc_len = LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE +
+		config->num_endpoints * LIBUSB_DT_ENDPOINT_SIZE;
+
+	/* configuration */
+	*p++ = LIBUSB_DT_CONFIG_SIZE;
+	*p++ = LIBUSB_DT_CONFIG;
+	*p++ = (unsigned char)(dpriv->config_desc_len & 0xff);
+	*p++ = (unsigned char)(dpriv->config_desc_len >> 8);
+	*p++ = 1;	/* bNumInterfaces */
+	*p++ = 1;	/* bConfigurationValue */
+	*p++ = 0;	/* iConfiguration */
+	*p++ = 0x80;	/* bmAttributes: bus powered */
+	*p++ = 50;	/* bMaxPower: 100mA */
+
+	/* interface */
+	*p++ = LIBUSB_DT_INTERFACE_SIZE;
+	*p++ = LIBUSB_DT_INTERFACE;
+	*p++ = 0;	/* bInterfaceNumber */
+	*p++ = 0;	/* bAlternateSetting */
+	*p++ = (unsigned char)config->num_endpoints;
+	*p++ = LIBUSB_CLASS_VENDOR_SPEC;
+	*p++ = 0;	/* bInterfaceSubClass */
+	*p++ = 0;	/* bInterfaceProtocol */
+	*p++ = 0;	/* iInterface */
+
+	for (i = 0; i < config->num_endpoints; i++) {
+		struct mock_endpoint *ep = &config->endpoints[i];
+
+		*p++ = LIBUSB_DT_ENDPOINT_SIZE;
+		*p++ = LIBUSB_DT_ENDPOINT;
+		*p++ = ep->address;
+		*p++ = ep->type;
+		*p++ = (unsigned char)(ep->max_packet_size & 0xff);
+		*p++ = (unsigned char)(ep->max_packet_size >> 8);
+		*p++ = ep->type == LIBUSB_TRANSFER_TYPE_BULK ? 0 : 1;	/* bInterval */
+	}
+}
+
+static int mock_add_device(struct libusb_context *ctx,
+	const struct mock_device_config *config, uint8_t devaddr)
+{
+	struct libusb_device *dev;
+	struct mock_device_priv *dpriv;
+	int r;
+
+	dev = usbi_alloc_device(ctx, MOCK_BUS_NUMBER << 8 | devaddr);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	dpriv = usbi_get_device_priv(dev);
+	dpriv->config = *config;
+	dpriv->configuration = 1;
+
+	dev->bus_number = MOCK_BUS_NUMBER;
+	dev->device_address = devaddr;
+	dev->speed = config->speed;
+	mock_build_descriptors(dev);
+
+	r = usbi_sanitize_device(dev);
+	if (r < 0) {
+		libusb_unref_device(dev);
+		return r;
+	}
+
+	usbi_dbg("mock device %u.%u %04x:%04x with %u endpoints", MOCK_BUS_NUMBER,
+		 devaddr, config->vid, config->pid, config->num_endpoints);
+	usbi_connect_device(dev);
+	return LIBUSB_SUCCESS;
+}
+
+static void mock_disconnect_device(struct libusb_context *ctx,
+	struct libusb_device *dev)
+{
+	/* only once, and only if it is still on the list */
+	dev = usbi_get_device_by_session_id(ctx, dev->session_data);
+	if (!dev)
+		return;
+
+	usbi_dbg("disconnecting mock device %u.%u", dev->bus_number,
+		 dev->device_address);
+	usbi_disconnect_device(dev);
+	libusb_unref_device(dev);
+}
+
+/* Completes transfers once they are due, like a device and host controller
+ * would, and reports them to the event handling through
+ * usbi_signal_transfer_completion() */
+static void *mock_event_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct mock_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct mock_transfer_priv *tpriv;
+	struct libusb_device *dev;
+	struct timespec now, delay;
+	struct timeval tv;
+	int disconnect;
+
+	usbi_mutex_lock(&cpriv->lock);
+	while (!cpriv->stop) {
+		if (list_empty(&cpriv->pending)) {
+			usbi_cond_wait(&cpriv->cond, &cpriv->lock);
+			continue;
+		}
+
+		tpriv = list_first_entry(&cpriv->pending, struct mock_transfer_priv, list);
+		usbi_get_monotonic_time(&now);
+		if (TIMESPEC_CMP(&tpriv->due, &now, >)) {
+			TIMESPEC_SUB(&tpriv->due, &now, &delay);
+			TIMESPEC_TO_TIMEVAL(&tv, &delay);
+			if (!tv.tv_sec && !tv.tv_usec)
+				tv.tv_usec = 1;
+			usbi_cond_timedwait(&cpriv->cond, &cpriv->lock, &tv);
+			continue;
+		}
+
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+		disconnect = tpriv->disconnect;
+		dev = disconnect ? libusb_ref_device(tpriv->handle->dev) : NULL;
+		usbi_mutex_unlock(&cpriv->lock);
+
+		usbi_signal_transfer_completion(tpriv->itransfer);
+		if (dev) {
+			mock_disconnect_device(ctx, dev);
+			libusb_unref_device(dev);
+		}
+
+		usbi_mutex_lock(&cpriv->lock);
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return NULL;
+}
+
+static int mock_init(struct libusb_context *ctx)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct mock_device_config *configs;
+	const char *spec;
+	int i, count, r;
+
+	spec = mock_spec;
+	if (!spec)
+		spec = getenv("LIBUSB_MOCK_DEVICES");
+	if (!spec)
+		spec = "";
+
+	configs = calloc(MOCK_MAX_DEVICES, sizeof(*configs));
+	if (!configs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	count = mock_parse_devices(spec, configs);
+	if (count < 0) {
+		free(configs);
+		return count;
+	}
+
+	usbi_mutex_init(&cpriv->lock);
+	usbi_cond_init(&cpriv->cond);
+	list_init(&cpriv->pending);
+	cpriv->stop = 0;
+
+	for (i = 0, r = 0; i < count && r == 0; i++)
+		r = mock_add_device(ctx, &configs[i], (uint8_t)(i + 1));
+	free(configs);
+	if (r < 0)
+		goto err;
+
+	r = pthread_create(&cpriv->thread, NULL, mock_event_thread_main, ctx);
+	if (r) {
+		usbi_err(ctx, "failed to create mock event thread (%d)", r);
+		r = LIBUSB_ERROR_OTHER;
+		goto err;
+	}
+
+	return LIBUSB_SUCCESS;
+
+err:
+	usbi_cond_destroy(&cpriv->cond);
+	usbi_mutex_destroy(&cpriv->lock);
+	return r;
+}
+
+static void mock_exit(struct libusb_context *ctx)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(ctx);
+
+	usbi_mutex_lock(&cpriv->lock);
+	cpriv->stop = 1;
+	usbi_cond_broadcast(&cpriv->cond);
+	usbi_mutex_unlock(&cpriv->lock);
+
+	pthread_join(cpriv->thread, NULL);
+	usbi_cond_destroy(&cpriv->cond);
+	usbi_mutex_destroy(&cpriv->lock);
+}
+
+static int mock_open(struct libusb_device_handle *handle)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct mock_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (dpriv->disconnected)
+		r = LIBUSB_ERROR_NO_DEVICE;
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return r;
+}
+
+static void mock_close(struct libusb_device_handle *handle)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct mock_transfer_priv *tpriv, *tmp;
+
+	/* forget transfers the application left behind */
+	usbi_mutex_lock(&cpriv->lock);
+	for_each_safe_helper(tpriv, tmp, &cpriv->pending, struct mock_transfer_priv) {
+		if (tpriv->handle != handle)
+			continue;
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+}
+
+static int mock_get_active_config_descriptor(struct libusb_device *dev,
+	void *buf, size_t len)
+{
+	struct mock_device_priv *dpriv = usbi_get_device_priv(dev);
+
+	if (!dpriv->configuration)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	len = MIN(len, dpriv->config_desc_len);
+	memcpy(buf, dpriv->config_desc, len);
+	return (int)len;
+}
+
+static int mock_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, void *buf, size_t len)
+{
+	struct mock_device_priv *dpriv = usbi_get_device_priv(dev);
+
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	len = MIN(len, dpriv->config_desc_len);
+	memcpy(buf, dpriv->config_desc, len);
+	return (int)len;
+}
+
+static int mock_get_configuration(struct libusb_device_handle *handle,
+	uint8_t *config)
+{
+	struct mock_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+
+	*config = dpriv->configuration;
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_set_configuration(struct libusb_device_handle *handle,
+	int config)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct mock_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+
+	if (config == -1)
+		config = 0;
+	if (config != 0 && config != 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&cpriv->lock);
+	dpriv->configuration = (uint8_t)config;
+	dpriv->halted = 0;
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_claim_interface(struct libusb_device_handle *handle,
+	uint8_t interface_number)
+{
+	struct mock_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+
+	if (!dpriv->configuration || interface_number != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_release_interface(struct libusb_device_handle *handle,
+	uint8_t interface_number)
+{
+	UNUSED(handle);
+	UNUSED(interface_number);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_set_interface_altsetting(struct libusb_device_handle *handle,
+	uint8_t interface_number, uint8_t altsetting)
+{
+	UNUSED(handle);
+
+	if (interface_number != 0 || altsetting != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct mock_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+
+	usbi_mutex_lock(&cpriv->lock);
+	dpriv->halted &= ~MOCK_EP_BIT(endpoint);
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_reset_device(struct libusb_device_handle *handle)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct mock_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+
+	usbi_mutex_lock(&cpriv->lock);
+	dpriv->halted = 0;
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static void mock_fill_pattern(unsigned char *buf, int len, unsigned int seed)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (unsigned char)(seed + i);
+}
+
+/* Answer a control transfer the way a simple vendor specific device would.
+ * Must be called with the context lock held. */
+static enum libusb_transfer_status mock_control_transfer(
+	struct mock_device_priv *dpriv, struct libusb_device *dev,
+	struct libusb_transfer *transfer, int *transferred)
+{
+	struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+	unsigned char *data = libusb_control_transfer_get_data(transfer);
+	uint16_t value = libusb_le16_to_cpu(setup->wValue);
+	uint16_t index = libusb_le16_to_cpu(setup->wIndex);
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	struct libusb_device_descriptor *desc = &dev->device_descriptor;
+	unsigned char buf[LIBUSB_DT_DEVICE_SIZE];
+	const unsigned char *reply = buf;
+	size_t reply_len;
+
+	*transferred = 0;
+
+	if ((setup->bmRequestType & (0x03 << 5)) != LIBUSB_REQUEST_TYPE_STANDARD) {
+		if (setup->bmRequestType & LIBUSB_ENDPOINT_IN)
+			mock_fill_pattern(data, length, dpriv->transfers);
+		*transferred = length;
+		return LIBUSB_TRANSFER_COMPLETED;
+	}
+
+	switch (setup->bRequest) {
+	case LIBUSB_REQUEST_GET_DESCRIPTOR:
+		switch (value >> 8) {
+		case LIBUSB_DT_DEVICE:
+			buf[0] = desc->bLength;
+			buf[1] = desc->bDescriptorType;
+			buf[2] = desc->bcdUSB & 0xff;
+			buf[3] = desc->bcdUSB >> 8;
+			buf[4] = desc->bDeviceClass;
+			buf[5] = desc->bDeviceSubClass;
+			buf[6] = desc->bDeviceProtocol;
+			buf[7] = desc->bMaxPacketSize0;
+			buf[8] = desc->idVendor & 0xff;
+			buf[9] = desc->idVendor >> 8;
+			buf[10] = desc->idProduct & 0xff;
+			buf[11] = desc->idProduct >> 8;
+			buf[12] = desc->bcdDevice & 0xff;
+			buf[13] = desc->bcdDevice >> 8;
+			buf[14] = desc->iManufacturer;
+			buf[15] = desc->iProduct;
+			buf[16] = desc->iSerialNumber;
+			buf[17] = desc->bNumConfigurations;
+			reply_len = LIBUSB_DT_DEVICE_SIZE;
+			break;
+		case LIBUSB_DT_CONFIG:
+			if ((value & 0xff) != 0)
+				return LIBUSB_TRANSFER_STALL;
+			reply = dpriv->config_desc;
+			reply_len = dpriv->config_desc_len;
+			break;
+		default:
+			return LIBUSB_TRANSFER_STALL;
+		}
+		break;
+	case LIBUSB_REQUEST_GET_CONFIGURATION:
+		buf[0] = dpriv->configuration;
+		reply_len = 1;
+		break;
+	case LIBUSB_REQUEST_GET_STATUS:
+		buf[0] = buf[1] = 0;
+		if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT &&
+		    (dpriv->halted & MOCK_EP_BIT(index)))
+			buf[0] = 1;
+		reply_len = 2;
+		break;
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		if (value > 1)
+			return LIBUSB_TRANSFER_STALL;
+		dpriv->configuration = (uint8_t)value;
+		dpriv->halted = 0;
+		return LIBUSB_TRANSFER_COMPLETED;
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+		if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT)
+			dpriv->halted &= ~MOCK_EP_BIT(index);
+		return LIBUSB_TRANSFER_COMPLETED;
+	case LIBUSB_REQUEST_SET_INTERFACE:
+		return (index == 0 && value == 0) ? LIBUSB_TRANSFER_COMPLETED : LIBUSB_TRANSFER_STALL;
+	default:
+		return LIBUSB_TRANSFER_COMPLETED;
+	}
+
+	reply_len = MIN(reply_len, length);
+	memcpy(data, reply, reply_len);
+	*transferred = (int)reply_len;
+	return LIBUSB_TRANSFER_COMPLETED;
+}
+
+/* Must be called with the context lock held */
+static enum libusb_transfer_status mock_data_transfer(
+	struct mock_device_priv *dpriv, struct usbi_transfer *itransfer,
+	int *transferred, uint8_t *disconnect)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	uint32_t ep_bit = MOCK_EP_BIT(transfer->endpoint);
+	int i, in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
+
+	*transferred = 0;
+	if (dpriv->halted & ep_bit)
+		return LIBUSB_TRANSFER_STALL;
+
+	dpriv->transfers++;
+	if (dpriv->config.disconnect_after &&
+	    dpriv->transfers >= dpriv->config.disconnect_after) {
+		dpriv->disconnected = 1;
+		*disconnect = 1;
+		return LIBUSB_TRANSFER_NO_DEVICE;
+	}
+	if (dpriv->config.stall_every &&
+	    (dpriv->transfers % dpriv->config.stall_every) == 0) {
+		dpriv->halted |= ep_bit;
+		return LIBUSB_TRANSFER_STALL;
+	}
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		unsigned char *buf = transfer->buffer;
+
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+
+			if (in)
+				mock_fill_pattern(buf, (int)pkt->length, dpriv->transfers + i);
+			pkt->actual_length = pkt->length;
+			pkt->status = LIBUSB_TRANSFER_COMPLETED;
+			buf += pkt->length;
+			*transferred += (int)pkt->length;
+		}
+	} else {
+		if (in)
+			mock_fill_pattern(transfer->buffer, transfer->length, dpriv->transfers);
+		*transferred = transfer->length;
+	}
+
+	return LIBUSB_TRANSFER_COMPLETED;
+}
+
+static void mock_timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += (uint64_t)ts->tv_nsec;
+	ts->tv_sec += (time_t)(ns / NSEC_PER_SEC);
+	ts->tv_nsec = (long)(ns % NSEC_PER_SEC);
+}
+
+static int mock_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	struct mock_context_priv *cpriv = usbi_get_context_priv(HANDLE_CTX(handle));
+	struct mock_device_priv *dpriv = usbi_get_device_priv(handle->dev);
+	struct mock_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct mock_transfer_priv *iter;
+	struct timespec now;
+	size_t len;
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (dpriv->disconnected) {
+		usbi_mutex_unlock(&cpriv->lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	tpriv->itransfer = itransfer;
+	tpriv->handle = handle;
+	tpriv->cancelled = 0;
+	tpriv->disconnect = 0;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		tpriv->status = mock_control_transfer(dpriv, handle->dev, transfer,
+						      &tpriv->transferred);
+		len = LIBUSB_CONTROL_SETUP_SIZE + (size_t)tpriv->transferred;
+	} else {
+		tpriv->status = mock_data_transfer(dpriv, itransfer,
+						   &tpriv->transferred, &tpriv->disconnect);
+		len = (size_t)tpriv->transferred;
+	}
+
+	/* signal the completion right away, so that several threads can push
+	 * completions concurrently; disconnects still go through the thread */
+	if (dpriv->config.inline_completion && !tpriv->disconnect) {
+		tpriv->queued = 0;
+		usbi_mutex_unlock(&cpriv->lock);
+		usbi_signal_transfer_completion(itransfer);
+		return LIBUSB_SUCCESS;
+	}
+
+	/* transfers share the bus of the device, then take the latency */
+	usbi_get_monotonic_time(&now);
+	if (TIMESPEC_CMP(&dpriv->bus_idle, &now, <))
+		dpriv->bus_idle = now;
+	if (dpriv->config.bytes_per_sec)
+		mock_timespec_add_ns(&dpriv->bus_idle,
+			(uint64_t)len * NSEC_PER_SEC / dpriv->config.bytes_per_sec);
+	tpriv->due = dpriv->bus_idle;
+	mock_timespec_add_ns(&tpriv->due, (uint64_t)dpriv->config.latency_us * 1000);
+
+	/* keep the list ordered, most transfers go to the end */
+	for_each_helper(iter, &cpriv->pending, struct mock_transfer_priv) {
+		if (TIMESPEC_CMP(&iter->due, &tpriv->due, >))
+			break;
+	}
+	list_add_tail(&tpriv->list, &iter->list);
+	tpriv->queued = 1;
+	usbi_cond_broadcast(&cpriv->cond);
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(ITRANSFER_CTX(itransfer));
+	struct mock_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (!tpriv->queued) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	} else {
+		/* complete it right away */
+		tpriv->cancelled = 1;
+		list_del(&tpriv->list);
+		usbi_get_monotonic_time(&tpriv->due);
+		list_add(&tpriv->list, &cpriv->pending);
+		usbi_cond_broadcast(&cpriv->cond);
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return r;
+}
+
+static void mock_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct mock_context_priv *cpriv = usbi_get_context_priv(ITRANSFER_CTX(itransfer));
+	struct mock_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	usbi_mutex_lock(&cpriv->lock);
+	if (tpriv->queued) {
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+}
+
+static int mock_handle_transfer_completion(struct usbi_transfer *itransfer)
+{
+	struct mock_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	if (tpriv->cancelled)
+		return usbi_handle_transfer_cancellation(itransfer);
+
+	itransfer->transferred = tpriv->transferred;
+	return usbi_handle_transfer_completion(itransfer, tpriv->status);
+}
+
+const struct usbi_os_backend usbi_mock_backend = {
+	.name = "Mock backend",
+	.caps = 0,
+	.init = mock_init,
+	.exit = mock_exit,
+	.open = mock_open,
+	.close = mock_close,
+	.get_active_config_descriptor = mock_get_active_config_descriptor,
+	.get_config_descriptor = mock_get_config_descriptor,
+	.get_configuration = mock_get_configuration,
+	.set_configuration = mock_set_configuration,
+	.claim_interface = mock_claim_interface,
+	.release_interface = mock_release_interface,
+	.set_interface_altsetting = mock_set_interface_altsetting,
+	.clear_halt = mock_clear_halt,
+	.reset_device = mock_reset_device,
+	.submit_transfer = mock_submit_transfer,
+	.cancel_transfer = mock_cancel_transfer,
+	.clear_transfer_priv = mock_clear_transfer_priv,
+	.handle_transfer_completion = mock_handle_transfer_completion,
+	.context_priv_size = sizeof(struct mock_context_priv),
+	.device_priv_size = sizeof(struct mock_device_priv),
+	.transfer_priv_size = sizeof(struct mock_transfer_priv),
+};
@@ -80,7 +80,7 @@ static int _sync_control_transfer(struct usbi_transfer *);
 static int _sync_gen_transfer(struct usbi_transfer *);
 static int _access_endpoint(struct libusb_transfer *);
 
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
 	.name = "Synchronous NetBSD backend",
 	.caps = 0,
 	.get_device_list = netbsd_get_device_list,
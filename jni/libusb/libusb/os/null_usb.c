@@ -93,7 +93,7 @@ null_cancel_transfer(struct usbi_transfer *itransfer)
 	return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
 	.name = "Null backend",
 	.caps = 0,
 	.get_device_list = null_get_device_list,
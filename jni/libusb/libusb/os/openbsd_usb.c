@@ -83,7 +83,7 @@ static int _access_endpoint(struct libusb_transfer *);
 static int _bus_open(int);
 
 
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
 	.name = "Synchronous OpenBSD backend",
 	.get_device_list = obsd_get_device_list,
 	.open = obsd_open,
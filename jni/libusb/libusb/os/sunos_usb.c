@@ -1582,7 +1582,7 @@ sunos_usb_get_status(int fd)
 	return (status);
 }
 
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
         .name = "Solaris",
         .caps = 0,
         .get_device_list = sunos_get_device_list,
@@ -845,7 +845,7 @@ void usbi_get_monotonic_time(struct timespec *tp)
 }
 
 // NB: MSVC6 does not support named initializers.
-const struct usbi_os_backend usbi_backend = {
+const struct usbi_os_backend usbi_platform_backend = {
 	"Windows",
 	USBI_CAP_HAS_HID_ACCESS,
 	windows_init,
@@ -877,6 +877,7 @@ const struct usbi_os_backend usbi_backend = {
 	windows_submit_transfer,
 	windows_cancel_transfer,
 	NULL,	/* clear_transfer_priv */
+	NULL,	/* destroy_transfer */
 	NULL,	/* handle_events */
 	windows_handle_transfer_completion,
 	sizeof(struct windows_context_priv),
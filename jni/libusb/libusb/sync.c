@@ -40,13 +40,51 @@ static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 	/* caller interprets result and frees transfer */
 }
 
+/* Each device handle keeps one idle transfer around, so that back-to-back
+ * synchronous requests do not need to allocate a new transfer (and the
+ * backend resources that come with it) every time. */
+static struct libusb_transfer *sync_transfer_get(
+	struct libusb_device_handle *dev_handle)
+{
+	struct libusb_transfer *transfer;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	transfer = dev_handle->sync_transfer;
+	dev_handle->sync_transfer = NULL;
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (!transfer)
+		return libusb_alloc_transfer(0);
+
+	transfer->flags = 0;
+	return transfer;
+}
+
+static void sync_transfer_put(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer *transfer)
+{
+	/* the handle is gone if it was closed while the transfer was pending */
+	if (transfer->dev_handle) {
+		usbi_mutex_lock(&dev_handle->lock);
+		if (!dev_handle->sync_transfer) {
+			dev_handle->sync_transfer = transfer;
+			transfer = NULL;
+		}
+		usbi_mutex_unlock(&dev_handle->lock);
+	}
+
+	if (transfer)
+		libusb_free_transfer(transfer);
+}
+
 static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 {
 	int r, *completed = transfer->user_data;
 	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
 
 	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+		r = usbi_handle_device_events_completed(transfer->dev_handle,
+			completed);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
@@ -106,13 +144,13 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
+	transfer = sync_transfer_get(dev_handle);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
 	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
 	if (!buffer) {
-		libusb_free_transfer(transfer);
+		sync_transfer_put(dev_handle, transfer);
 		return LIBUSB_ERROR_NO_MEM;
 	}
 
@@ -123,10 +161,10 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
 		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		free(buffer);
+		sync_transfer_put(dev_handle, transfer);
 		return r;
 	}
 
@@ -162,7 +200,9 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	free(buffer);
+	transfer->buffer = NULL;
+	sync_transfer_put(dev_handle, transfer);
 	return r;
 }
 
@@ -177,7 +217,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
+	transfer = sync_transfer_get(dev_handle);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -187,7 +227,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		sync_transfer_put(dev_handle, transfer);
 		return r;
 	}
 
@@ -222,7 +262,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	sync_transfer_put(dev_handle, transfer);
 	return r;
 }
 
@@ -47,6 +47,9 @@
 /* Define to 1 to enable message logging. */
 #define ENABLE_LOGGING 1
 
+/* Define to 1 to collect transfer statistics. */
+#define ENABLE_STATS 1
+
 /* Define to 1 if compiling for a Windows platform. */
 #define PLATFORM_WINDOWS 1
 
@@ -0,0 +1,503 @@
+/*
+ * libusb descriptor decoding tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The descriptor decoders are static, so this test builds descriptor.c into
+ * itself rather than linking against the library, and provides the few
+ * library internals descriptor.c refers to. The decoders are checked against
+ * the format string parser they replaced. */
+#include "descriptor.c"
+
+#include <stdio.h>
+
+#include "libusb_testlib.h"
+
+#ifdef ENABLE_MOCK_BACKEND
+const struct usbi_os_backend *usbi_active_backend;
+#else
+const struct usbi_os_backend usbi_platform_backend;
+#endif
+
+#ifdef ENABLE_LOGGING
+void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
+	const char *function, const char *format, ...)
+{
+	UNUSED(ctx);
+	UNUSED(level);
+	UNUSED(function);
+	UNUSED(format);
+}
+#endif
+
+int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	UNUSED(dev_handle);
+	UNUSED(bmRequestType);
+	UNUSED(bRequest);
+	UNUSED(wValue);
+	UNUSED(wIndex);
+	UNUSED(data);
+	UNUSED(wLength);
+	UNUSED(timeout);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/* The parser the decoders replaced, as the reference */
+static void ref_parse_descriptor(const void *source, const char *descriptor, void *dest)
+{
+	const uint8_t *sp = source;
+	uint8_t *dp = dest;
+	char field_type;
+
+	while (*descriptor) {
+		field_type = *descriptor++;
+		switch (field_type) {
+		case 'b':	/* 8-bit byte */
+			*dp++ = *sp++;
+			break;
+		case 'w':	/* 16-bit word, convert from little endian to CPU */
+			dp += ((uintptr_t)dp & 1);	/* Align to 16-bit word boundary */
+
+			*((uint16_t *)dp) = READ_LE16(sp);
+			sp += 2;
+			dp += 2;
+			break;
+		case 'd':	/* 32-bit word, convert from little endian to CPU */
+			dp += 4 - ((uintptr_t)dp & 3);	/* Align to 32-bit word boundary */
+
+			*((uint32_t *)dp) = READ_LE32(sp);
+			sp += 4;
+			dp += 4;
+			break;
+		case 'u':	/* 16 byte UUID */
+			memcpy(dp, sp, 16);
+			sp += 16;
+			dp += 16;
+			break;
+		}
+	}
+}
+
+#define DEFINE_DECODER_WRAPPER(name, desc_type)				\
+static void name##_any(const uint8_t *source, void *dest)		\
+{									\
+	name(source, (desc_type *)dest);				\
+}
+
+DEFINE_DECODER_WRAPPER(decode_endpoint_desc, struct libusb_endpoint_descriptor)
+DEFINE_DECODER_WRAPPER(decode_endpoint_audio_desc, struct libusb_endpoint_descriptor)
+DEFINE_DECODER_WRAPPER(decode_interface_desc, struct libusb_interface_descriptor)
+DEFINE_DECODER_WRAPPER(decode_config_desc, struct libusb_config_descriptor)
+DEFINE_DECODER_WRAPPER(decode_ss_ep_comp_desc, struct libusb_ss_endpoint_companion_descriptor)
+DEFINE_DECODER_WRAPPER(decode_bos_desc, struct libusb_bos_descriptor)
+DEFINE_DECODER_WRAPPER(decode_usb_2_0_ext_desc, struct libusb_usb_2_0_extension_descriptor)
+DEFINE_DECODER_WRAPPER(decode_ss_usb_dev_cap_desc, struct libusb_ss_usb_device_capability_descriptor)
+DEFINE_DECODER_WRAPPER(decode_container_id_desc, struct libusb_container_id_descriptor)
+
+static const struct decoder {
+	const char *name;
+	const char *format;
+	size_t size;
+	void (*decode)(const uint8_t *source, void *dest);
+} decoders[] = {
+	{ "endpoint", "bbbbwb",
+	  sizeof(struct libusb_endpoint_descriptor), decode_endpoint_desc_any },
+	{ "audio endpoint", "bbbbwbbb",
+	  sizeof(struct libusb_endpoint_descriptor), decode_endpoint_audio_desc_any },
+	{ "interface", "bbbbbbbbb",
+	  sizeof(struct libusb_interface_descriptor), decode_interface_desc_any },
+	{ "config", "bbwbbbbb",
+	  sizeof(struct libusb_config_descriptor), decode_config_desc_any },
+	{ "ss endpoint companion", "bbbbw",
+	  sizeof(struct libusb_ss_endpoint_companion_descriptor), decode_ss_ep_comp_desc_any },
+	{ "bos", "bbwb",
+	  sizeof(struct libusb_bos_descriptor), decode_bos_desc_any },
+	{ "usb 2.0 extension", "bbbd",
+	  sizeof(struct libusb_usb_2_0_extension_descriptor), decode_usb_2_0_ext_desc_any },
+	{ "ss usb device capability", "bbbbwbbw",
+	  sizeof(struct libusb_ss_usb_device_capability_descriptor), decode_ss_usb_dev_cap_desc_any },
+	{ "container id", "bbbbu",
+	  sizeof(struct libusb_container_id_descriptor), decode_container_id_desc_any },
+};
+
+static uint32_t rand_state = 0x12345678;
+
+/* xorshift32, so that failures are reproducible */
+static uint32_t rand_next(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static unsigned int rand_range(unsigned int min, unsigned int max)
+{
+	return min + rand_next() % (max - min + 1);
+}
+
+/** Tests that every decoder gives the same result as the reference parser
+ * on random input. */
+static libusb_testlib_result test_decode_random(void)
+{
+	union {
+		struct libusb_config_descriptor config;
+		struct libusb_container_id_descriptor container_id;
+		struct libusb_ss_usb_device_capability_descriptor ss_usb_device_cap;
+		uint8_t bytes[64];
+	} got, expected;
+	uint8_t buf[32];
+	size_t i, j;
+	int n;
+
+	for (i = 0; i < ARRAYSIZE(decoders); i++) {
+		for (n = 0; n < 10000; n++) {
+			for (j = 0; j < sizeof(buf); j++)
+				buf[j] = (uint8_t)rand_next();
+
+			memset(&got, 0x5a, sizeof(got));
+			memset(&expected, 0x5a, sizeof(expected));
+			decoders[i].decode(buf, &got);
+			ref_parse_descriptor(buf, decoders[i].format, &expected);
+			if (memcmp(&got, &expected, decoders[i].size)) {
+				libusb_testlib_logf("%s descriptor decoded differently on iteration %d",
+					decoders[i].name, n);
+				return TEST_STATUS_FAILURE;
+			}
+		}
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+#define MAX_TEST_DESCS	64
+
+/* A generated configuration descriptor, with the offsets of its interface
+ * and endpoint descriptors in the order they appear */
+struct test_config {
+	uint8_t data[4096];
+	int length;
+	int num_descs;
+	struct {
+		uint8_t type;
+		int offset;
+	} descs[MAX_TEST_DESCS];
+};
+
+static void add_extra_descs(struct test_config *tc)
+{
+	unsigned int count = rand_range(0, 2);
+
+	while (count--) {
+		uint8_t len = (uint8_t)rand_range(2, 12);
+		uint8_t *p = tc->data + tc->length;
+		int i;
+
+		p[0] = len;
+		p[1] = (uint8_t)rand_range(0x21, 0x30);	/* class specific */
+		for (i = 2; i < len; i++)
+			p[i] = (uint8_t)rand_next();
+		tc->length += len;
+	}
+}
+
+static void add_desc(struct test_config *tc, uint8_t type, uint8_t len)
+{
+	uint8_t *p = tc->data + tc->length;
+	int i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (uint8_t)rand_next();
+	p[0] = len;
+	p[1] = type;
+	tc->descs[tc->num_descs].type = type;
+	tc->descs[tc->num_descs].offset = tc->length;
+	tc->num_descs++;
+	tc->length += len;
+}
+
+static void generate_config(struct test_config *tc)
+{
+	uint8_t num_interfaces = (uint8_t)rand_range(1, 4);
+	uint8_t i, j, k;
+
+	tc->length = 0;
+	tc->num_descs = 0;
+	add_desc(tc, LIBUSB_DT_CONFIG, LIBUSB_DT_CONFIG_SIZE);
+	tc->data[4] = num_interfaces;
+	add_extra_descs(tc);
+
+	for (i = 0; i < num_interfaces; i++) {
+		uint8_t num_altsettings = (uint8_t)rand_range(1, 3);
+
+		for (j = 0; j < num_altsettings; j++) {
+			uint8_t num_endpoints = (uint8_t)rand_range(0, 3);
+			uint8_t *intf = tc->data + tc->length;
+
+			add_desc(tc, LIBUSB_DT_INTERFACE, LIBUSB_DT_INTERFACE_SIZE);
+			intf[2] = i;
+			intf[3] = j;
+			intf[4] = num_endpoints;
+			add_extra_descs(tc);
+
+			for (k = 0; k < num_endpoints; k++) {
+				add_desc(tc, LIBUSB_DT_ENDPOINT, rand_next() & 1 ?
+					LIBUSB_DT_ENDPOINT_AUDIO_SIZE : LIBUSB_DT_ENDPOINT_SIZE);
+				add_extra_descs(tc);
+			}
+		}
+	}
+
+	tc->data[2] = (uint8_t)(tc->length & 0xff);
+	tc->data[3] = (uint8_t)(tc->length >> 8);
+}
+
+/* Compare the fields that are decoded from the descriptor at offset */
+#define COMPARE_FIELD(type, field, offset)				\
+	if (memcmp(&got->field, &expected.field, sizeof(got->field)))	\
+		return 0;
+
+static int interface_matches(const struct test_config *tc, int desc,
+	int length, const struct libusb_interface_descriptor *got)
+{
+	struct libusb_interface_descriptor expected;
+	int offset = tc->descs[desc].offset;
+
+	if (tc->descs[desc].type != LIBUSB_DT_INTERFACE ||
+	    offset + LIBUSB_DT_INTERFACE_SIZE > length)
+		return 0;
+	ref_parse_descriptor(tc->data + offset, "bbbbbbbbb", &expected);
+	/* the parser only counts the endpoints it found */
+	if (got->bNumEndpoints > expected.bNumEndpoints)
+		return 0;
+	expected.bNumEndpoints = got->bNumEndpoints;
+	INTERFACE_DESC_LAYOUT(COMPARE_FIELD)
+	return 1;
+}
+
+static int endpoint_matches(const struct test_config *tc, int desc,
+	int length, const struct libusb_endpoint_descriptor *got)
+{
+	struct libusb_endpoint_descriptor expected;
+	int offset = tc->descs[desc].offset;
+
+	if (tc->descs[desc].type != LIBUSB_DT_ENDPOINT ||
+	    offset + tc->data[offset] > length)
+		return 0;
+	memset(&expected, 0, sizeof(expected));
+	if (tc->data[offset] >= LIBUSB_DT_ENDPOINT_AUDIO_SIZE)
+		ref_parse_descriptor(tc->data + offset, "bbbbwbbb", &expected);
+	else
+		ref_parse_descriptor(tc->data + offset, "bbbbwb", &expected);
+	ENDPOINT_AUDIO_DESC_LAYOUT(COMPARE_FIELD)
+	return 1;
+}
+
+static int config_matches(const struct test_config *tc,
+	const struct libusb_config_descriptor *got)
+{
+	struct libusb_config_descriptor expected;
+
+	ref_parse_descriptor(tc->data, "bbwbbbbb", &expected);
+	/* the parser only counts the interfaces it found */
+	if (got->bNumInterfaces > expected.bNumInterfaces)
+		return 0;
+	expected.bNumInterfaces = got->bNumInterfaces;
+	CONFIG_DESC_LAYOUT(COMPARE_FIELD)
+	return 1;
+}
+
+/* Checks the parsed configuration, which may stop short for truncated
+ * input, against the reference. Returns the number of interface and
+ * endpoint descriptors parsed, or -1 on a mismatch. */
+static int check_parsed_config(const struct test_config *tc, int length,
+	const struct libusb_config_descriptor *config)
+{
+	int desc = 1;
+	uint8_t i, j;
+	int k;
+
+	if (!config_matches(tc, config))
+		return -1;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *intf = &config->interface[i];
+
+		for (k = 0; k < intf->num_altsetting; k++) {
+			const struct libusb_interface_descriptor *altsetting = &intf->altsetting[k];
+
+			if (desc >= tc->num_descs ||
+			    !interface_matches(tc, desc++, length, altsetting))
+				return -1;
+			for (j = 0; j < altsetting->bNumEndpoints; j++) {
+				if (desc >= tc->num_descs ||
+				    !endpoint_matches(tc, desc++, length, &altsetting->endpoint[j]))
+					return -1;
+			}
+		}
+	}
+
+	return desc - 1;
+}
+
+/* Walks a view of the first length bytes, which must only return complete
+ * descriptors matching the reference */
+static int check_config_view(const struct test_config *tc, const uint8_t *data,
+	int length)
+{
+	struct libusb_config_view view;
+	struct libusb_interface_descriptor intf;
+	struct libusb_endpoint_descriptor ep;
+	int offset = 0, desc = 1;
+
+	view.data = data;
+	view.length = length;
+	while (libusb_config_view_next_interface(&view, &offset, &intf) == LIBUSB_SUCCESS) {
+		while (desc < tc->num_descs && tc->descs[desc].type != LIBUSB_DT_INTERFACE)
+			desc++;
+		if (desc >= tc->num_descs || !interface_matches(tc, desc++, length, &intf))
+			return -1;
+		while (libusb_config_view_next_endpoint(&view, &offset, &ep) == LIBUSB_SUCCESS) {
+			if (desc >= tc->num_descs || !endpoint_matches(tc, desc++, length, &ep))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Tests that parsing generated configuration descriptors, and every
+ * truncation of them, only decodes complete descriptors and decodes them
+ * like the reference parser. */
+static libusb_testlib_result test_parse_truncated(void)
+{
+	static struct test_config tc;
+	int n, length;
+
+	for (n = 0; n < 200; n++) {
+		generate_config(&tc);
+
+		for (length = tc.length; length >= 0; length--) {
+			struct libusb_config_descriptor config;
+			uint8_t *data;
+			int r, parsed;
+
+			/* an exact copy, so that memory checkers catch reads past the end */
+			data = malloc(length ? (size_t)length : 1);
+			if (!data)
+				return TEST_STATUS_ERROR;
+			memcpy(data, tc.data, (size_t)length);
+
+			memset(&config, 0, sizeof(config));
+			r = parse_configuration(NULL, &config, data, length);
+			if (r < 0) {
+				/* truncated input may be rejected as malformed */
+				if (length == tc.length || r != LIBUSB_ERROR_IO) {
+					libusb_testlib_logf("Failed to parse %d of %d bytes: %d",
+						length, tc.length, r);
+					free(data);
+					return TEST_STATUS_FAILURE;
+				}
+			} else {
+				parsed = check_parsed_config(&tc, length, &config);
+				clear_configuration(&config);
+				if (parsed < 0 || (length == tc.length && parsed != tc.num_descs - 1)) {
+					libusb_testlib_logf("Wrong parse of %d of %d bytes on iteration %d",
+						length, tc.length, n);
+					free(data);
+					return TEST_STATUS_FAILURE;
+				}
+			}
+
+			r = check_config_view(&tc, data, length);
+			free(data);
+			if (r < 0) {
+				libusb_testlib_logf("Wrong view of %d of %d bytes on iteration %d",
+					length, tc.length, n);
+				return TEST_STATUS_FAILURE;
+			}
+		}
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	usbi_get_monotonic_time(&now);
+	return (double)(now.tv_sec - start->tv_sec) * 1e9 +
+		(double)(now.tv_nsec - start->tv_nsec);
+}
+
+/** Reports how long the decoders and the reference parser take per
+ * descriptor, this always succeeds. */
+static libusb_testlib_result test_decode_speed(void)
+{
+	union {
+		struct libusb_config_descriptor config;
+		struct libusb_container_id_descriptor container_id;
+		uint8_t bytes[64];
+	} dest;
+	uint8_t buf[32];
+	volatile uint8_t sink = 0;
+	struct timespec start;
+	double decode_ns, ref_ns;
+	size_t i, j;
+	int n;
+
+	for (j = 0; j < sizeof(buf); j++)
+		buf[j] = (uint8_t)rand_next();
+
+	for (i = 0; i < ARRAYSIZE(decoders); i++) {
+		usbi_get_monotonic_time(&start);
+		for (n = 0; n < 1000000; n++) {
+			buf[0] = (uint8_t)n;
+			decoders[i].decode(buf, &dest);
+			sink = (uint8_t)(sink + dest.bytes[0]);
+		}
+		decode_ns = elapsed_ns(&start) / n;
+
+		usbi_get_monotonic_time(&start);
+		for (n = 0; n < 1000000; n++) {
+			buf[0] = (uint8_t)n;
+			ref_parse_descriptor(buf, decoders[i].format, &dest);
+			sink = (uint8_t)(sink + dest.bytes[0]);
+		}
+		ref_ns = elapsed_ns(&start) / n;
+
+		libusb_testlib_logf("%-26s %6.2f ns, reference %6.2f ns",
+			decoders[i].name, decode_ns, ref_ns);
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "decode_random", &test_decode_random },
+	{ "parse_truncated", &test_parse_truncated },
+	{ "decode_speed", &test_decode_speed },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -19,7 +19,14 @@
 
 #include <config.h>
 
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef ENABLE_MOCK_BACKEND
+#include <pthread.h>
+#endif
 
 #include "libusb.h"
 #include "libusb_testlib.h"
@@ -151,16 +158,559 @@ static libusb_testlib_result test_default_context_change(void)
 	return TEST_STATUS_SUCCESS;
 }
 
+/** Tests that interrupting the event handler always wakes it up, and that
+ * the event is cleared again afterwards, 1000 times. */
+static libusb_testlib_result test_interrupt_event_handler(void)
+{
+	libusb_context *ctx;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (int i = 0; i < 1000; ++i) {
+		struct timeval tv = { 10, 0 };
+		int completed = 0;
+		time_t start = time(NULL);
+
+		libusb_interrupt_event_handler(ctx);
+		r = libusb_handle_events_timeout_completed(ctx, &tv, &completed);
+		if (r != LIBUSB_SUCCESS || time(NULL) - start > 5) {
+			libusb_testlib_logf("Event handler was not woken up on iteration %d: %d",
+				i, r);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+
+		/* Poll once more, which must find nothing left to do */
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		r = libusb_handle_events_timeout_completed(ctx, &tv, &completed);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events on iteration %d: %d",
+				i, r);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+	}
+
+	libusb_exit(ctx);
+	return result;
+}
+
+#ifdef ENABLE_MOCK_BACKEND
+#define COMPLETION_THREADS	4
+#define COMPLETION_DEPTH	8
+#define COMPLETION_ROUNDS	500
+
+struct completion_worker {
+	libusb_device_handle *handle;
+	pthread_mutex_t *lock;
+	pthread_cond_t *cond;
+	pthread_t thread;
+	int completed;
+	int failed;
+	unsigned char buf[COMPLETION_DEPTH][64];
+};
+
+static void LIBUSB_CALL count_completion_cb(struct libusb_transfer *transfer)
+{
+	struct completion_worker *worker = transfer->user_data;
+
+	pthread_mutex_lock(worker->lock);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		worker->failed = 1;
+	worker->completed++;
+	pthread_cond_broadcast(worker->cond);
+	pthread_mutex_unlock(worker->lock);
+}
+
+/* Mock devices the tests which are not about the mock backend run against,
+ * from the LIBUSB_MOCK_DEVICES environment variable, or NULL for the platform
+ * backend */
+static const char *default_mock_devices;
+
+/* Opens the first mock device, which completes transfers according to spec */
+static libusb_device_handle *open_mock_device(libusb_context **ctx, const char *spec,
+	libusb_testlib_result *result)
+{
+	libusb_device **device_list;
+	libusb_device_handle *handle = NULL;
+	int r;
+
+	*result = TEST_STATUS_FAILURE;
+	r = libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, spec);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED)
+		*result = TEST_STATUS_SKIP;
+	if (r != LIBUSB_SUCCESS)
+		return NULL;
+
+	r = libusb_init(ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, default_mock_devices);
+		return NULL;
+	}
+
+	if (libusb_get_device_list(*ctx, &device_list) < 1 ||
+	    libusb_open(device_list[0], &handle) != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to open the mock device");
+		handle = NULL;
+	} else {
+		*result = TEST_STATUS_SUCCESS;
+	}
+	libusb_free_device_list(device_list, 1);
+	if (!handle) {
+		libusb_exit(*ctx);
+		libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, default_mock_devices);
+	}
+
+	return handle;
+}
+
+static void close_mock_device(libusb_context *ctx, libusb_device_handle *handle)
+{
+	libusb_close(handle);
+	libusb_exit(ctx);
+	libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, default_mock_devices);
+}
+
+/** Tests that each completion of a backend thread wakes the event handler
+ * exactly once, over 100 sequential transfers. */
+static libusb_testlib_result test_completion_wakeups(void)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_testlib_result result;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	struct completion_worker worker = { 0 };
+	struct libusb_transfer *transfer;
+	int calls = 0;
+
+	handle = open_mock_device(&ctx, "ep=0x81:bulk", &result);
+	if (!handle)
+		return result;
+
+	worker.lock = &lock;
+	worker.cond = &cond;
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, worker.buf[0],
+		sizeof(worker.buf[0]), count_completion_cb, &worker, 0);
+
+	for (int i = 0; i < 100 && result == TEST_STATUS_SUCCESS; ++i) {
+		if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d", i);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		while (worker.completed == i) {
+			if (libusb_handle_events(ctx) != LIBUSB_SUCCESS) {
+				result = TEST_STATUS_FAILURE;
+				break;
+			}
+			calls++;
+		}
+	}
+
+	if (result == TEST_STATUS_SUCCESS && (calls != 100 || worker.failed)) {
+		libusb_testlib_logf("%d event handler calls for 100 completions", calls);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	libusb_free_transfer(transfer);
+	close_mock_device(ctx, handle);
+	return result;
+}
+
+static void *completion_worker_main(void *arg)
+{
+	struct completion_worker *worker = arg;
+	struct libusb_transfer *transfers[COMPLETION_DEPTH];
+	int i, round, failed = 0;
+
+	for (i = 0; i < COMPLETION_DEPTH; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], worker->handle, 0x81,
+			worker->buf[i], sizeof(worker->buf[i]), count_completion_cb,
+			worker, 0);
+	}
+
+	for (round = 1; round <= COMPLETION_ROUNDS && !failed; round++) {
+		for (i = 0; i < COMPLETION_DEPTH; i++) {
+			if (libusb_submit_transfer(transfers[i]) != LIBUSB_SUCCESS) {
+				pthread_mutex_lock(worker->lock);
+				worker->failed = 1;
+				pthread_mutex_unlock(worker->lock);
+				break;
+			}
+		}
+
+		pthread_mutex_lock(worker->lock);
+		while (!worker->failed && worker->completed < round * COMPLETION_DEPTH)
+			pthread_cond_wait(worker->cond, worker->lock);
+		failed = worker->failed;
+		pthread_mutex_unlock(worker->lock);
+	}
+
+	for (i = 0; i < COMPLETION_DEPTH; i++)
+		libusb_free_transfer(transfers[i]);
+
+	return NULL;
+}
+
+/** Tests that transfers completed from several threads at once are all
+ * reported to the event handler, and that the event is left cleared. */
+static libusb_testlib_result test_concurrent_completions(void)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_testlib_result result;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	struct completion_worker workers[COMPLETION_THREADS];
+	struct timeval tv = { 0, 100000 };
+	time_t start;
+	int i, total, failed, completed;
+
+	/* the mock device completes the transfers from the submitting threads */
+	handle = open_mock_device(&ctx, "ep=0x81:bulk,inline=1", &result);
+	if (!handle)
+		return result;
+
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < COMPLETION_THREADS; i++) {
+		workers[i].handle = handle;
+		workers[i].lock = &lock;
+		workers[i].cond = &cond;
+		pthread_create(&workers[i].thread, NULL, completion_worker_main, &workers[i]);
+	}
+
+	start = time(NULL);
+	do {
+		libusb_handle_events_timeout(ctx, &tv);
+
+		pthread_mutex_lock(&lock);
+		for (i = 0, total = 0, failed = 0; i < COMPLETION_THREADS; i++) {
+			total += workers[i].completed;
+			failed |= workers[i].failed;
+		}
+		pthread_mutex_unlock(&lock);
+	} while (!failed && total < COMPLETION_THREADS * COMPLETION_DEPTH * COMPLETION_ROUNDS &&
+		 time(NULL) - start < 30);
+
+	if (failed || total != COMPLETION_THREADS * COMPLETION_DEPTH * COMPLETION_ROUNDS) {
+		libusb_testlib_logf("%d transfers completed, failed %d", total, failed);
+		result = TEST_STATUS_FAILURE;
+		/* let the workers finish */
+		pthread_mutex_lock(&lock);
+		for (i = 0; i < COMPLETION_THREADS; i++)
+			workers[i].failed = 1;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+
+	for (i = 0; i < COMPLETION_THREADS; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	/* nothing may be left to do, nor may the event stay signalled */
+	tv.tv_usec = 0;
+	completed = 0;
+	if (result == TEST_STATUS_SUCCESS &&
+	    (libusb_handle_events_timeout_completed(ctx, &tv, &completed) != LIBUSB_SUCCESS ||
+	     completed)) {
+		libusb_testlib_logf("Event handling after the completions failed");
+		result = TEST_STATUS_FAILURE;
+	}
+
+	close_mock_device(ctx, handle);
+	return result;
+}
+
+/** Tests that the endpoint sizes kept with a device follow changes of the
+ * active configuration. */
+static libusb_testlib_result test_endpoint_sizes(void)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_device *dev;
+	libusb_testlib_result result;
+	int r;
+
+	handle = open_mock_device(&ctx, "ep=0x81:bulk:64,ep=0x02:int:8", &result);
+	if (!handle)
+		return result;
+	dev = libusb_get_device(handle);
+
+	for (int i = 0; i < 2 && result == TEST_STATUS_SUCCESS; ++i) {
+		if (libusb_get_max_packet_size(dev, 0x81) != 64 ||
+		    libusb_get_max_packet_size(dev, 0x02) != 8 ||
+		    libusb_get_max_packet_size(dev, 0x83) != LIBUSB_ERROR_NOT_FOUND) {
+			libusb_testlib_logf("Wrong endpoint sizes in round %d", i);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	/* without an active configuration there are no endpoints to look up */
+	r = libusb_set_configuration(handle, 0);
+	if (result == TEST_STATUS_SUCCESS &&
+	    (r != LIBUSB_SUCCESS || libusb_get_max_packet_size(dev, 0x81) >= 0)) {
+		libusb_testlib_logf("Endpoint sizes outlived the configuration: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_set_configuration(handle, 1);
+	if (result == TEST_STATUS_SUCCESS &&
+	    (r != LIBUSB_SUCCESS || libusb_get_max_packet_size(dev, 0x81) != 64)) {
+		libusb_testlib_logf("Endpoint sizes not found after reconfiguring: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	close_mock_device(ctx, handle);
+	return result;
+}
+#endif
+
+/** Tests that event handler wakeups and timeouts are counted in the
+ * context statistics. */
+static libusb_testlib_result test_context_stats(void)
+{
+	libusb_context *ctx;
+	struct libusb_context_stats stats;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct timeval tv = { 0, 0 };
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_get_context_stats(ctx, &stats, sizeof(stats));
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	for (int i = 0; i < 100; ++i) {
+		libusb_interrupt_event_handler(ctx);
+		libusb_handle_events_timeout(ctx, &tv);
+		libusb_handle_events_timeout(ctx, &tv);
+	}
+
+	r = libusb_get_context_stats(ctx, &stats, sizeof(stats));
+	if (r != LIBUSB_SUCCESS || stats.event_wakeups != 100 ||
+	    stats.event_timeouts != 100 || stats.completions_per_wakeup[0] != 100 ||
+	    stats.transfers_submitted || stats.transfers_in_flight) {
+		libusb_testlib_logf("Unexpected statistics: %d, %lu wakeups, %lu timeouts",
+			r, (unsigned long)stats.event_wakeups,
+			(unsigned long)stats.event_timeouts);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	/* a caller built against a shorter structure must not see it overrun */
+	memset(&stats, 0xff, sizeof(stats));
+	r = libusb_get_context_stats(ctx, &stats,
+		offsetof(struct libusb_context_stats, event_timeouts));
+	if (r != LIBUSB_SUCCESS || stats.event_wakeups != 100 ||
+	    stats.event_timeouts != UINT64_MAX) {
+		libusb_testlib_logf("Short statistics were not honoured: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Tests that walking a configuration view finds the same interfaces and
+ * endpoints as libusb_get_config_descriptor(), for every attached device. */
+static libusb_testlib_result test_config_view(void)
+{
+	libusb_context *ctx;
+	libusb_device **device_list = NULL;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	ssize_t list_size;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	list_size = libusb_get_device_list(ctx, &device_list);
+	if (list_size < 0) {
+		libusb_testlib_logf("Failed to get device list: %ld", (long)-list_size);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (ssize_t i = 0; i < list_size && result == TEST_STATUS_SUCCESS; ++i) {
+		struct libusb_config_descriptor *config;
+		struct libusb_config_view view;
+		struct libusb_interface_descriptor intf;
+		struct libusb_endpoint_descriptor ep;
+		int offset = 0;
+
+		if (libusb_get_config_descriptor(device_list[i], 0, &config) != 0)
+			continue;
+
+		r = libusb_get_config_view(device_list[i], 0, &view);
+		if (r != LIBUSB_SUCCESS ||
+		    view.bConfigurationValue != config->bConfigurationValue) {
+			libusb_testlib_logf("Failed to get config view: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+
+		for (int j = 0; j < config->bNumInterfaces && result == TEST_STATUS_SUCCESS; ++j) {
+			for (int k = 0; k < config->interface[j].num_altsetting &&
+					result == TEST_STATUS_SUCCESS; ++k) {
+				const struct libusb_interface_descriptor *altsetting =
+					&config->interface[j].altsetting[k];
+
+				r = libusb_config_view_next_interface(&view, &offset, &intf);
+				if (r != LIBUSB_SUCCESS ||
+				    intf.bInterfaceNumber != altsetting->bInterfaceNumber ||
+				    intf.bAlternateSetting != altsetting->bAlternateSetting) {
+					libusb_testlib_logf("Interface %d.%d mismatch: %d", j, k, r);
+					result = TEST_STATUS_FAILURE;
+					break;
+				}
+
+				for (int l = 0; l < altsetting->bNumEndpoints; ++l) {
+					r = libusb_config_view_next_endpoint(&view, &offset, &ep);
+					if (r != LIBUSB_SUCCESS ||
+					    ep.bEndpointAddress != altsetting->endpoint[l].bEndpointAddress ||
+					    ep.wMaxPacketSize != altsetting->endpoint[l].wMaxPacketSize ||
+					    ep.extra_length != altsetting->endpoint[l].extra_length) {
+						libusb_testlib_logf("Endpoint %d of %d.%d mismatch: %d",
+							l, j, k, r);
+						result = TEST_STATUS_FAILURE;
+						break;
+					}
+				}
+			}
+		}
+
+		libusb_free_config_descriptor(config);
+	}
+
+	libusb_free_device_list(device_list, 1);
+	libusb_exit(ctx);
+	return result;
+}
+
+static int LIBUSB_CALL count_hotplug_cb(libusb_context *ctx,
+	libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	(void)ctx;
+	(void)dev;
+	(void)event;
+	++*(int *)user_data;
+	return 0;
+}
+
+/** Tests that many hotplug callbacks with vendor filters can be registered
+ * and deregistered, and that enumeration only reports matching devices. */
+static libusb_testlib_result test_hotplug_callbacks(void)
+{
+#define CB_COUNT 100
+	libusb_hotplug_callback_handle handles[CB_COUNT] = { 0 };
+	libusb_context *ctx;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct timeval tv = { 0, 0 };
+	int matched = 0;
+	int r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return TEST_STATUS_SKIP;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (libusb_set_option(ctx, LIBUSB_OPTION_HOTPLUG_COALESCE_WINDOW, 50) != LIBUSB_SUCCESS ||
+	    libusb_set_option(ctx, LIBUSB_OPTION_HOTPLUG_COALESCE_WINDOW, -1) != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("Coalesce window option not handled");
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* Vendor IDs which no real device uses, spread over all buckets */
+	for (int i = 0; i < CB_COUNT; ++i) {
+		r = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, 0xff00 + i, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, count_hotplug_cb, &matched, &handles[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to register callback %d: %d", i, r);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		if (libusb_hotplug_get_user_data(ctx, handles[i]) != &matched) {
+			libusb_testlib_logf("Wrong user data for callback %d", i);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+	}
+
+	if (matched) {
+		libusb_testlib_logf("Unexpected match for %d devices", matched);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	for (int i = 0; i < CB_COUNT; ++i)
+		libusb_hotplug_deregister_callback(ctx, handles[i]);
+	libusb_handle_events_timeout(ctx, &tv);
+
+	for (int i = 0; i < CB_COUNT && result == TEST_STATUS_SUCCESS; ++i) {
+		if (libusb_hotplug_get_user_data(ctx, handles[i])) {
+			libusb_testlib_logf("Callback %d still registered", i);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	libusb_exit(ctx);
+	return result;
+#undef CB_COUNT
+}
+
 /* Fill in the list of tests. */
 static const libusb_testlib_test tests[] = {
 	{ "init_and_exit", &test_init_and_exit },
 	{ "get_device_list", &test_get_device_list },
 	{ "many_device_lists", &test_many_device_lists },
 	{ "default_context_change", &test_default_context_change },
+	{ "interrupt_event_handler", &test_interrupt_event_handler },
+#ifdef ENABLE_MOCK_BACKEND
+	{ "completion_wakeups", &test_completion_wakeups },
+	{ "concurrent_completions", &test_concurrent_completions },
+	{ "endpoint_sizes", &test_endpoint_sizes },
+#endif
+	{ "context_stats", &test_context_stats },
+	{ "config_view", &test_config_view },
+	{ "hotplug_callbacks", &test_hotplug_callbacks },
 	LIBUSB_NULL_TEST
 };
 
 int main(int argc, char *argv[])
 {
+#ifdef ENABLE_MOCK_BACKEND
+	/* allows running all tests on machines without USB access */
+	default_mock_devices = getenv("LIBUSB_MOCK_DEVICES");
+	if (default_mock_devices &&
+	    libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, default_mock_devices) != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Invalid LIBUSB_MOCK_DEVICES\n");
+		return 1;
+	}
+#endif
+
 	return libusb_testlib_run_tests(argc, argv, tests);
 }
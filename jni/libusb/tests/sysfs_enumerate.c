@@ -0,0 +1,354 @@
+/*
+ * libusb Linux sysfs enumeration benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Enumerates devices from a fake sysfs tree in a temporary directory, so
+ * that the cost of enumeration can be measured and checked without any
+ * hardware. The tree is selected with linux_set_sysfs_root(), which is not
+ * exported, so this program is linked against the static library. */
+#include "libusbi.h"
+#include "os/linux_usbfs.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libusb_testlib.h"
+
+/* Devices below the root hub of each fake bus: a hub on port 1 and up to
+ * 99 devices behind it, which keeps device addresses below 128 */
+#define DEVICES_PER_BUS		100
+
+#define NUM_CONTEXTS		4
+
+static char sysfs_root[64];
+static char devices_path[128];
+
+static const uint8_t fake_descriptors[] = {
+	/* device */
+	0x12, LIBUSB_DT_DEVICE, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x34, 0x12, 0x78, 0x56, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+	/* configuration, one interface with a bulk in and out endpoint */
+	0x09, LIBUSB_DT_CONFIG, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x09, LIBUSB_DT_INTERFACE, 0x00, 0x00, 0x02, 0xff, 0x00, 0x00, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x02, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0x00,
+};
+
+static const char * const fake_attrs[] = { "devnum", "speed", "descriptors" };
+
+static int write_attr(const char *dir, const char *attr, const void *data,
+	size_t len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ok;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", devices_path, dir, attr);
+	f = fopen(path, "wb");
+	if (!f)
+		return -1;
+	ok = fwrite(data, 1, len, f) == len;
+	return (fclose(f) == 0 && ok) ? 0 : -1;
+}
+
+static int add_fake_device(const char *name, int devnum)
+{
+	char path[PATH_MAX], value[16];
+
+	snprintf(path, sizeof(path), "%s/%s", devices_path, name);
+	if (mkdir(path, 0755) < 0)
+		return -1;
+
+	snprintf(value, sizeof(value), "%d\n", devnum);
+	if (write_attr(name, "devnum", value, strlen(value)) < 0 ||
+	    write_attr(name, "speed", "480\n", 4) < 0 ||
+	    write_attr(name, "descriptors", fake_descriptors, sizeof(fake_descriptors)) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* The name and address of device i of a bus, with 0 being the root hub */
+static void fake_device_name(int bus, int i, char *name, size_t size, int *devnum)
+{
+	if (i == 0)
+		snprintf(name, size, "usb%d", bus);
+	else if (i == 1)
+		snprintf(name, size, "%d-1", bus);
+	else
+		snprintf(name, size, "%d-1.%d", bus, i - 1);
+	*devnum = i + 1;
+}
+
+/* Adds devices first to count - 1 of each bus, root hubs included */
+static int add_fake_devices(int num_buses, int first, int count)
+{
+	char name[32];
+	int bus, i, devnum;
+
+	for (bus = 1; bus <= num_buses; bus++) {
+		for (i = first; i < count; i++) {
+			fake_device_name(bus, i, name, sizeof(name), &devnum);
+			if (add_fake_device(name, devnum) < 0) {
+				libusb_testlib_logf("Failed to create fake device %s", name);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void remove_fake_devices(void)
+{
+	DIR *dir = opendir(devices_path);
+	struct dirent *entry;
+	char path[PATH_MAX];
+	size_t i;
+
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		for (i = 0; i < ARRAYSIZE(fake_attrs); i++) {
+			snprintf(path, sizeof(path), "%s/%s/%s", devices_path,
+				 entry->d_name, fake_attrs[i]);
+			unlink(path);
+		}
+		snprintf(path, sizeof(path), "%s/%s", devices_path, entry->d_name);
+		rmdir(path);
+	}
+
+	closedir(dir);
+}
+
+static int create_fake_sysfs(void)
+{
+	static const char * const dirs[] = { "/bus", "/bus/usb", SYSFS_DEVICE_DIR };
+	char path[PATH_MAX];
+	size_t i;
+
+	strcpy(sysfs_root, "/tmp/libusb-sysfs-XXXXXX");
+	if (!mkdtemp(sysfs_root))
+		return -1;
+
+	for (i = 0; i < ARRAYSIZE(dirs); i++) {
+		snprintf(path, sizeof(path), "%s%s", sysfs_root, dirs[i]);
+		if (mkdir(path, 0755) < 0)
+			return -1;
+	}
+
+	snprintf(devices_path, sizeof(devices_path), "%s" SYSFS_DEVICE_DIR, sysfs_root);
+	linux_set_sysfs_root(sysfs_root);
+	return 0;
+}
+
+static void remove_fake_sysfs(void)
+{
+	char path[PATH_MAX];
+
+	remove_fake_devices();
+	rmdir(devices_path);
+	snprintf(path, sizeof(path), "%s/bus/usb", sysfs_root);
+	rmdir(path);
+	snprintf(path, sizeof(path), "%s/bus", sysfs_root);
+	rmdir(path);
+	rmdir(sysfs_root);
+}
+
+static double elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	usbi_get_monotonic_time(&now);
+	return (double)(now.tv_sec - start->tv_sec) * 1e6 +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int check_device_count(libusb_context *ctx, ssize_t expected)
+{
+	libusb_device **devs;
+	ssize_t count;
+
+	count = libusb_get_device_list(ctx, &devs);
+	if (count < 0) {
+		libusb_testlib_logf("Failed to get the device list: %zd", count);
+		return -1;
+	}
+	libusb_free_device_list(devs, 1);
+
+	if (count != expected) {
+		libusb_testlib_logf("Found %zd devices instead of %zd", count, expected);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Reports how long initializing a context takes, which enumerates every
+ * device of the fake tree, for several tree sizes. */
+static libusb_testlib_result test_enumerate(void)
+{
+	static const int bus_counts[] = { 1, 4, 16 };
+	libusb_context *ctx;
+	struct timespec start;
+	size_t i;
+	int n, r, num_devices;
+
+	for (i = 0; i < ARRAYSIZE(bus_counts); i++) {
+		const int rounds = 20;
+		double us;
+
+		num_devices = bus_counts[i] * DEVICES_PER_BUS;
+		if (add_fake_devices(bus_counts[i], 0, DEVICES_PER_BUS) < 0)
+			return TEST_STATUS_ERROR;
+
+		usbi_get_monotonic_time(&start);
+		for (n = 0; n < rounds; n++) {
+			r = libusb_init(&ctx);
+			if (r != LIBUSB_SUCCESS) {
+				libusb_testlib_logf("Failed to init libusb: %d", r);
+				return TEST_STATUS_FAILURE;
+			}
+			if (n == 0 && check_device_count(ctx, num_devices) < 0) {
+				libusb_exit(ctx);
+				return TEST_STATUS_FAILURE;
+			}
+			libusb_exit(ctx);
+		}
+		us = elapsed_us(&start) / rounds;
+
+		libusb_testlib_logf("%5d devices: %9.1f us per enumeration, %6.2f us per device",
+			num_devices, us, us / num_devices);
+		remove_fake_devices();
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Hands every non root hub device of the fake tree to all contexts, as
+ * the hotplug monitor does when devices arrive */
+static void hotplug_enumerate_all(int num_buses)
+{
+	char name[32];
+	int bus, i, devnum;
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	for (bus = 1; bus <= num_buses; bus++) {
+		for (i = 1; i < DEVICES_PER_BUS; i++) {
+			fake_device_name(bus, i, name, sizeof(name), &devnum);
+			linux_hotplug_enumerate((uint8_t)bus, (uint8_t)devnum, name);
+		}
+	}
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+}
+
+/** Reports how long hotplug arrivals take with several contexts, first for
+ * new devices, whose attributes are read once and shared by the contexts,
+ * then for devices the contexts already know, which must not be read at
+ * all. */
+static libusb_testlib_result test_hotplug(void)
+{
+	const int num_buses = 4;
+	const int num_devices = num_buses * (DEVICES_PER_BUS - 1);
+	libusb_context *ctx[NUM_CONTEXTS];
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct timespec start;
+	double new_us, known_us;
+	int i, r;
+
+	/* the contexts start out with only the root hubs */
+	if (add_fake_devices(num_buses, 0, 1) < 0)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < NUM_CONTEXTS; i++) {
+		r = libusb_init(&ctx[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to init libusb: %d", r);
+			while (i--)
+				libusb_exit(ctx[i]);
+			remove_fake_devices();
+			return TEST_STATUS_FAILURE;
+		}
+	}
+
+	if (add_fake_devices(num_buses, 1, DEVICES_PER_BUS) < 0) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	usbi_get_monotonic_time(&start);
+	hotplug_enumerate_all(num_buses);
+	new_us = elapsed_us(&start);
+
+	for (i = 0; i < NUM_CONTEXTS; i++) {
+		if (check_device_count(ctx[i], num_buses + num_devices) < 0) {
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+
+	/* the devices are known now, so their attributes must not be needed
+	 * anymore, not even to find out they have not changed */
+	remove_fake_devices();
+
+	usbi_get_monotonic_time(&start);
+	hotplug_enumerate_all(num_buses);
+	known_us = elapsed_us(&start);
+
+	for (i = 0; i < NUM_CONTEXTS; i++) {
+		if (check_device_count(ctx[i], num_buses + num_devices) < 0) {
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+
+	libusb_testlib_logf("%d contexts, %d devices: %6.2f us per new device, %6.2f us per known device",
+		NUM_CONTEXTS, num_devices, new_us / num_devices, known_us / num_devices);
+
+out:
+	for (i = 0; i < NUM_CONTEXTS; i++)
+		libusb_exit(ctx[i]);
+	remove_fake_devices();
+	return result;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "enumerate", &test_enumerate },
+	{ "hotplug", &test_hotplug },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	int r;
+
+	if (create_fake_sysfs() < 0) {
+		fprintf(stderr, "Failed to create a fake sysfs tree\n");
+		return 1;
+	}
+
+	r = libusb_testlib_run_tests(argc, argv, tests);
+	remove_fake_sysfs();
+	return r;
+}
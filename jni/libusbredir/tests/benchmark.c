@@ -0,0 +1,920 @@
+/*
+ * usbredir end-to-end pipeline benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* End-to-end benchmark of the usbredir pipeline: a guest side usbredirparser
+   talks over a socketpair to a usbredirhost, which redirects a device
+   simulated by the libusb mock backend. Everything runs in one thread from a
+   single poll() loop, so the numbers include the parsing, the socket
+   round trips and the libusb event handling, but no device or bus time
+   unless the mock device spec asks for it. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "usbredirhost.h"
+#include "usbredirparser.h"
+
+#define SKIP_EXIT_CODE  77
+#define MAX_DEPTH       64
+#define BENCH_VERSION   "usbredir-benchmark"
+
+#define EP_CONTROL_IN   0x80
+#define EP_BULK_IN      0x81
+#define EP_BULK_OUT     0x02
+#define EP_INTERRUPT_IN 0x83
+#define EP_ISO_IN       0x84
+#define EP_ISO_OUT      0x05
+#define EP_INTERRUPT_OUT 0x06
+
+/* iso out packets, and how many of them the guest keeps queued */
+#define ISO_PACKET_SIZE 1024
+#define ISO_OUT_QUEUED  32
+
+/* Bulk transfers kept in flight by workloads with a background endpoint,
+   their ids start at BACKGROUND_ID to tell them apart */
+#define BACKGROUND_DEPTH 16
+#define BACKGROUND_ID   (1ULL << 32)
+#define BACKGROUND_SNDBUF 32768
+
+static const char default_devices[] =
+    "ep=0x81:bulk,ep=0x02:bulk,ep=0x83:int,ep=0x84:iso,ep=0x05:iso,"
+    "ep=0x06:int";
+
+/* Count the allocations of the whole process by interposing the glibc
+   allocator, this includes both the guest and the host side */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 alloc_count;
+
+void *malloc(size_t size)
+{
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+static guint64 alloc_count;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+enum workload_kind {
+    WORKLOAD_REQUEST,   /* one reply per request, up to depth in flight */
+    WORKLOAD_STREAM,    /* packets get streamed once started, by the host
+                           for in and by the guest for out endpoints */
+};
+
+struct workload {
+    const char *name;
+    enum workload_kind kind;
+    uint8_t type;
+    uint8_t endpoint;
+    uint8_t background; /* bulk endpoint kept saturated meanwhile, or 0 */
+};
+
+static const struct workload workloads[] = {
+    { "control",      WORKLOAD_REQUEST, usb_redir_type_control,   EP_CONTROL_IN },
+    { "bulk-in",      WORKLOAD_REQUEST, usb_redir_type_bulk,      EP_BULK_IN },
+    { "bulk-out",     WORKLOAD_REQUEST, usb_redir_type_bulk,      EP_BULK_OUT },
+    { "interrupt-in", WORKLOAD_STREAM,  usb_redir_type_interrupt, EP_INTERRUPT_IN },
+    { "iso-in",       WORKLOAD_STREAM,  usb_redir_type_iso,       EP_ISO_IN },
+    { "iso-out",      WORKLOAD_STREAM,  usb_redir_type_iso,       EP_ISO_OUT },
+    /* interrupt latency while the host's output queue is full of bulk data */
+    { "int-out+bulk", WORKLOAD_REQUEST, usb_redir_type_interrupt, EP_INTERRUPT_OUT,
+      EP_BULK_IN },
+};
+
+struct bench {
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    struct usbredirhost *host;
+    struct usbredirparser *guest;
+    int host_fd;
+    int guest_fd;
+    int connected;
+    int failed;
+
+    /* options */
+    double duration;
+    int depth;
+    int bulk_size;
+    int control_size;
+
+    /* current workload */
+    const struct workload *workload;
+    int running;
+    int stopping;
+    uint64_t next_id;
+    int in_flight;
+    uint64_t sent_at[MAX_DEPTH];
+    uint64_t last_packet;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t errors;
+    int background_in_flight;
+    uint64_t background_id;
+    uint64_t background_bytes;
+    GArray *latencies;
+    FILE *trace;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        g_printerr("%s\n", msg);
+    }
+}
+
+static int bench_read(int fd, uint8_t *data, int count)
+{
+    int r = read(fd, data, count);
+    if (r < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    return r == 0 ? -1 : r;
+}
+
+static int bench_write(int fd, uint8_t *data, int count)
+{
+    int r = write(fd, data, count);
+    if (r < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    return r;
+}
+
+static int host_read(void *priv, uint8_t *data, int count)
+{
+    struct bench *b = priv;
+    return bench_read(b->host_fd, data, count);
+}
+
+static int host_write(void *priv, uint8_t *data, int count)
+{
+    struct bench *b = priv;
+    return bench_write(b->host_fd, data, count);
+}
+
+static int guest_read(void *priv, uint8_t *data, int count)
+{
+    struct bench *b = priv;
+    return bench_read(b->guest_fd, data, count);
+}
+
+static int guest_write(void *priv, uint8_t *data, int count)
+{
+    struct bench *b = priv;
+    return bench_write(b->guest_fd, data, count);
+}
+
+static int guest_write_trace(void *priv, const uint8_t *data, int count)
+{
+    struct bench *b = priv;
+    return fwrite(data, 1, count, b->trace) == (size_t)count ? 0 : -1;
+}
+
+/* Guest side: requests */
+
+static void send_request(struct bench *b)
+{
+    const struct workload *w = b->workload;
+    uint64_t id = b->next_id++;
+
+    b->sent_at[id % MAX_DEPTH] = now_ns();
+    b->in_flight++;
+
+    switch (w->type) {
+    case usb_redir_type_control: {
+        struct usb_redir_control_packet_header header = {
+            .endpoint = w->endpoint,
+            .request = 0x01,
+            .requesttype = 0xc0, /* vendor, device, IN */
+            .length = b->control_size,
+        };
+        usbredirparser_send_control_packet(b->guest, id, &header, NULL, 0);
+        break;
+    }
+    case usb_redir_type_bulk: {
+        static uint8_t out_data[1 << 20];
+        struct usb_redir_bulk_packet_header header = {
+            .endpoint = w->endpoint,
+            .length = b->bulk_size & 0xffff,
+            .length_high = b->bulk_size >> 16,
+        };
+        if (w->endpoint & 0x80) {
+            usbredirparser_send_bulk_packet(b->guest, id, &header, NULL, 0);
+        } else {
+            usbredirparser_send_bulk_packet(b->guest, id, &header,
+                                            out_data, b->bulk_size);
+        }
+        break;
+    }
+    case usb_redir_type_interrupt: {
+        static uint8_t out_data[8];
+        struct usb_redir_interrupt_packet_header header = {
+            .endpoint = w->endpoint,
+            .length = sizeof(out_data),
+        };
+        usbredirparser_send_interrupt_packet(b->guest, id, &header,
+                                             out_data, sizeof(out_data));
+        break;
+    }
+    }
+}
+
+static void fill_requests(struct bench *b)
+{
+    while (b->running && b->in_flight < b->depth) {
+        send_request(b);
+    }
+}
+
+static void fill_background(struct bench *b)
+{
+    struct usb_redir_bulk_packet_header header = {
+        .endpoint = b->workload->background,
+        .length = b->bulk_size & 0xffff,
+        .length_high = b->bulk_size >> 16,
+    };
+
+    while (b->running && b->background_in_flight < BACKGROUND_DEPTH) {
+        usbredirparser_send_bulk_packet(b->guest, b->background_id++,
+                                        &header, NULL, 0);
+        b->background_in_flight++;
+    }
+}
+
+static void background_done(struct bench *b, uint8_t status, int len)
+{
+    b->background_in_flight--;
+    if (status != usb_redir_success) {
+        b->errors++;
+    } else if (b->running) {
+        b->background_bytes += len;
+    }
+    fill_background(b);
+}
+
+static void request_done(struct bench *b, uint64_t id, uint8_t status,
+                         int len)
+{
+    uint64_t now = now_ns();
+
+    if (b->in_flight == 0) {
+        return;
+    }
+    b->in_flight--;
+    if (status != usb_redir_success) {
+        b->errors++;
+    } else if (b->running) {
+        uint64_t latency = now - b->sent_at[id % MAX_DEPTH];
+        g_array_append_val(b->latencies, latency);
+        b->packets++;
+        b->bytes += len;
+    }
+    fill_requests(b);
+}
+
+/* For streams the latency is the interval between packets */
+static void stream_packet(struct bench *b, uint8_t status, int len)
+{
+    uint64_t now = now_ns();
+
+    if (!b->running) {
+        return;
+    }
+    if (status != usb_redir_success) {
+        b->errors++;
+        return;
+    }
+    if (b->last_packet) {
+        uint64_t interval = now - b->last_packet;
+        g_array_append_val(b->latencies, interval);
+    }
+    b->last_packet = now;
+    b->packets++;
+    b->bytes += len;
+}
+
+/* Keep the iso out stream fed, there are no replies to count for it */
+static void fill_iso_out(struct bench *b)
+{
+    static uint8_t out_data[ISO_PACKET_SIZE];
+    struct usb_redir_iso_packet_header header = {
+        .endpoint = b->workload->endpoint,
+        .length = ISO_PACKET_SIZE,
+    };
+
+    while (usbredirparser_get_bufferered_output_size(b->guest) <
+               ISO_OUT_QUEUED * ISO_PACKET_SIZE) {
+        usbredirparser_send_iso_packet(b->guest, b->next_id++, &header,
+                                       out_data, ISO_PACKET_SIZE);
+        stream_packet(b, usb_redir_success, ISO_PACKET_SIZE);
+    }
+}
+
+/* Guest side: parser callbacks */
+
+static void guest_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct bench *b = priv;
+    b->connected = 1;
+}
+
+static void guest_device_disconnect(void *priv)
+{
+    struct bench *b = priv;
+    g_printerr("device disconnected\n");
+    b->failed = 1;
+}
+
+/* Neither the descriptors nor the status replies are of interest here */
+static void guest_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+}
+
+static void guest_ep_info(void *priv,
+    struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void guest_configuration_status(void *priv, uint64_t id,
+    struct usb_redir_configuration_status_header *configuration_status)
+{
+}
+
+static void guest_alt_setting_status(void *priv, uint64_t id,
+    struct usb_redir_alt_setting_status_header *alt_setting_status)
+{
+}
+
+static void guest_bulk_streams_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_streams_status_header *bulk_streams_status)
+{
+}
+
+static void guest_bulk_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_receiving_status_header *bulk_receiving_status)
+{
+}
+
+static void guest_filter_reject(void *priv)
+{
+}
+
+static void guest_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count)
+{
+    free(rules);
+}
+
+static void guest_buffered_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *b = priv;
+    usbredirparser_free_packet_data(b->guest, data);
+}
+
+static void guest_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *b = priv;
+    request_done(b, id, control_header->status, data_len);
+    usbredirparser_free_packet_data(b->guest, data);
+}
+
+static void guest_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *b = priv;
+    int len = data_len;
+
+    if (!(bulk_header->endpoint & 0x80)) {
+        len = (bulk_header->length_high << 16) | bulk_header->length;
+    }
+    if (id >= BACKGROUND_ID) {
+        background_done(b, bulk_header->status, len);
+    } else {
+        request_done(b, id, bulk_header->status, len);
+    }
+    usbredirparser_free_packet_data(b->guest, data);
+}
+
+static void guest_iso_packet(void *priv, uint64_t id,
+    struct usb_redir_iso_packet_header *iso_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *b = priv;
+    stream_packet(b, iso_header->status, data_len);
+    usbredirparser_free_packet_data(b->guest, data);
+}
+
+static void guest_interrupt_packet(void *priv, uint64_t id,
+    struct usb_redir_interrupt_packet_header *interrupt_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *b = priv;
+
+    if (interrupt_header->endpoint & 0x80) {
+        stream_packet(b, interrupt_header->status, data_len);
+    } else {
+        request_done(b, id, interrupt_header->status,
+                     interrupt_header->length);
+    }
+    usbredirparser_free_packet_data(b->guest, data);
+}
+
+static void guest_stream_status(struct bench *b, uint8_t status)
+{
+    if (status != usb_redir_success && status != usb_redir_stall) {
+        b->errors++;
+    }
+    b->stopping = 0;
+}
+
+static void guest_iso_stream_status(void *priv, uint64_t id,
+    struct usb_redir_iso_stream_status_header *iso_stream_status)
+{
+    guest_stream_status(priv, iso_stream_status->status);
+}
+
+static void guest_interrupt_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_interrupt_receiving_status_header *status)
+{
+    guest_stream_status(priv, status->status);
+}
+
+/* Main loop */
+
+static int bench_iterate(struct bench *b, int timeout_ms)
+{
+    const struct libusb_pollfd **usb_fds;
+    struct pollfd fds[32];
+    int i, n = 0, usb_n;
+    struct timeval tv = { 0, 0 };
+
+    if (b->running && b->workload->kind == WORKLOAD_STREAM &&
+        !(b->workload->endpoint & 0x80)) {
+        fill_iso_out(b);
+    }
+
+    fds[n].fd = b->host_fd;
+    fds[n].events = POLLIN;
+    if (usbredirhost_has_data_to_write(b->host)) {
+        fds[n].events |= POLLOUT;
+    }
+    n++;
+    fds[n].fd = b->guest_fd;
+    fds[n].events = POLLIN;
+    if (usbredirparser_has_data_to_write(b->guest)) {
+        fds[n].events |= POLLOUT;
+    }
+    n++;
+
+    usb_fds = libusb_get_pollfds(b->ctx);
+    for (i = 0; usb_fds && usb_fds[i] && n < (int)G_N_ELEMENTS(fds); i++) {
+        fds[n].fd = usb_fds[i]->fd;
+        fds[n].events = usb_fds[i]->events;
+        n++;
+    }
+    usb_n = n - 2;
+    libusb_free_pollfds(usb_fds);
+
+    if (poll(fds, n, timeout_ms) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (usbredirhost_read_guest_data(b->host)) {
+            return -1;
+        }
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (usbredirparser_do_read(b->guest)) {
+            return -1;
+        }
+    }
+    for (i = 0; i < usb_n; i++) {
+        if (fds[2 + i].revents) {
+            libusb_handle_events_timeout(b->ctx, &tv);
+            break;
+        }
+    }
+    if (usbredirhost_has_data_to_write(b->host) &&
+        usbredirhost_write_guest_data(b->host)) {
+        return -1;
+    }
+    if (usbredirparser_has_data_to_write(b->guest) &&
+        usbredirparser_do_write(b->guest)) {
+        return -1;
+    }
+    if (b->trace && usbredirparser_trace_flush(b->guest)) {
+        return -1;
+    }
+
+    return b->failed ? -1 : 0;
+}
+
+static void start_stream(struct bench *b)
+{
+    const struct workload *w = b->workload;
+
+    if (w->type == usb_redir_type_iso) {
+        struct usb_redir_start_iso_stream_header start = {
+            .endpoint = w->endpoint,
+            .pkts_per_urb = 8,
+            .no_urbs = 4,
+        };
+        usbredirparser_send_start_iso_stream(b->guest, 0, &start);
+    } else {
+        struct usb_redir_start_interrupt_receiving_header start = {
+            .endpoint = w->endpoint,
+        };
+        usbredirparser_send_start_interrupt_receiving(b->guest, 0, &start);
+    }
+}
+
+static void stop_stream(struct bench *b)
+{
+    const struct workload *w = b->workload;
+
+    b->stopping = 1;
+    if (w->type == usb_redir_type_iso) {
+        struct usb_redir_stop_iso_stream_header stop = {
+            .endpoint = w->endpoint,
+        };
+        usbredirparser_send_stop_iso_stream(b->guest, 0, &stop);
+    } else {
+        struct usb_redir_stop_interrupt_receiving_header stop = {
+            .endpoint = w->endpoint,
+        };
+        usbredirparser_send_stop_interrupt_receiving(b->guest, 0, &stop);
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(GArray *values, int percent)
+{
+    guint idx;
+
+    if (values->len == 0) {
+        return 0;
+    }
+    idx = MIN(values->len * percent / 100, values->len - 1);
+    return g_array_index(values, uint64_t, idx) / 1000.0;
+}
+
+static int run_workload(struct bench *b, const struct workload *w)
+{
+    uint64_t start, end, allocs;
+    double elapsed;
+    socklen_t sndbuf_len;
+    int sndbuf;
+
+    b->workload = w;
+    b->next_id = 0;
+    b->in_flight = 0;
+    b->packets = 0;
+    b->bytes = 0;
+    b->errors = 0;
+    b->last_packet = 0;
+    b->background_id = BACKGROUND_ID;
+    b->background_bytes = 0;
+    g_array_set_size(b->latencies, 0);
+
+    /* Like a network link which is slower than the device, so that the
+       data queues up in the host instead of in the socket */
+    if (w->background) {
+        int small_sndbuf = BACKGROUND_SNDBUF;
+
+        sndbuf_len = sizeof(sndbuf);
+        getsockopt(b->host_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_len);
+        setsockopt(b->host_fd, SOL_SOCKET, SO_SNDBUF, &small_sndbuf,
+                   sizeof(small_sndbuf));
+    }
+
+    b->running = 1;
+    allocs = alloc_count;
+    start = now_ns();
+    end = start + (uint64_t)(b->duration * 1e9);
+    if (w->kind == WORKLOAD_REQUEST) {
+        fill_requests(b);
+    } else {
+        start_stream(b);
+    }
+    if (w->background) {
+        fill_background(b);
+    }
+
+    while (now_ns() < end) {
+        if (bench_iterate(b, 10)) {
+            return -1;
+        }
+    }
+    elapsed = (now_ns() - start) / 1e9;
+    allocs = alloc_count - allocs;
+    b->running = 0;
+
+    /* let everything in flight drain before the next workload */
+    if (w->kind == WORKLOAD_STREAM) {
+        stop_stream(b);
+    }
+    end = now_ns() + 1000000000;
+    while ((b->in_flight || b->background_in_flight || b->stopping) &&
+           now_ns() < end) {
+        if (bench_iterate(b, 10)) {
+            return -1;
+        }
+    }
+
+    if (w->background) {
+        setsockopt(b->host_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sndbuf_len);
+    }
+
+    qsort(b->latencies->data, b->latencies->len, sizeof(uint64_t), compare_u64);
+    printf("%-14s %12.1f %10.2f %10.1f %10.1f", w->name,
+           b->packets / elapsed, b->bytes / elapsed / (1024 * 1024),
+           percentile_us(b->latencies, 50), percentile_us(b->latencies, 99));
+    if (HAVE_ALLOC_COUNT && b->packets) {
+        printf(" %10.2f", (double)allocs / b->packets);
+    } else {
+        printf(" %10s", "-");
+    }
+    if (w->background) {
+        printf("  (bulk %.2f MiB/s)",
+               b->background_bytes / elapsed / (1024 * 1024));
+    }
+    if (b->errors) {
+        printf("  (%" PRIu64 " errors)", b->errors);
+    }
+    printf("\n");
+    return 0;
+}
+
+static int bench_setup(struct bench *b, const char *devices,
+                       const char *trace_filename)
+{
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+    libusb_device **list;
+    ssize_t count;
+    int r, fds[2];
+    uint64_t end;
+
+#ifdef LIBUSB_HAS_MOCK_BACKEND
+    r = libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, devices);
+#else
+    r = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+    if (r != LIBUSB_SUCCESS) {
+        g_printerr("libusb mock backend not available, skipping\n");
+        return SKIP_EXIT_CODE;
+    }
+    r = libusb_init(&b->ctx);
+    if (r < 0) {
+        g_printerr("libusb_init: %s\n", libusb_strerror(r));
+        return 1;
+    }
+    count = libusb_get_device_list(b->ctx, &list);
+    if (count < 1) {
+        g_printerr("no mock device\n");
+        return 1;
+    }
+    r = libusb_open(list[0], &b->handle);
+    libusb_free_device_list(list, 1);
+    if (r < 0) {
+        g_printerr("libusb_open: %s\n", libusb_strerror(r));
+        return 1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        perror("socketpair");
+        return 1;
+    }
+    b->host_fd = fds[0];
+    b->guest_fd = fds[1];
+    fcntl(b->host_fd, F_SETFL, O_NONBLOCK);
+    fcntl(b->guest_fd, F_SETFL, O_NONBLOCK);
+
+    b->host = usbredirhost_open_full(b->ctx, b->handle, bench_log,
+                                     host_read, host_write, NULL,
+                                     NULL, NULL, NULL, NULL,
+                                     b, BENCH_VERSION,
+                                     usbredirparser_warning, 0);
+    b->handle = NULL; /* owned by the host now, even on failure */
+    if (!b->host) {
+        return 1;
+    }
+
+    b->guest = usbredirparser_create();
+    if (!b->guest) {
+        return 1;
+    }
+    usbredirparser_set_verbose(b->guest, usbredirparser_warning);
+    b->guest->priv = b;
+    b->guest->log_func = bench_log;
+    b->guest->read_func = guest_read;
+    b->guest->write_func = guest_write;
+    b->guest->device_connect_func = guest_device_connect;
+    b->guest->device_disconnect_func = guest_device_disconnect;
+    b->guest->interface_info_func = guest_interface_info;
+    b->guest->ep_info_func = guest_ep_info;
+    b->guest->configuration_status_func = guest_configuration_status;
+    b->guest->alt_setting_status_func = guest_alt_setting_status;
+    b->guest->bulk_streams_status_func = guest_bulk_streams_status;
+    b->guest->bulk_receiving_status_func = guest_bulk_receiving_status;
+    b->guest->filter_reject_func = guest_filter_reject;
+    b->guest->filter_filter_func = guest_filter_filter;
+    b->guest->buffered_bulk_packet_func = guest_buffered_bulk_packet;
+    b->guest->control_packet_func = guest_control_packet;
+    b->guest->bulk_packet_func = guest_bulk_packet;
+    b->guest->iso_packet_func = guest_iso_packet;
+    b->guest->interrupt_packet_func = guest_interrupt_packet;
+    b->guest->iso_stream_status_func = guest_iso_stream_status;
+    b->guest->interrupt_receiving_status_func = guest_interrupt_receiving_status;
+
+    if (trace_filename) {
+        b->trace = fopen(trace_filename, "wb");
+        if (!b->trace) {
+            g_printerr("could not open %s\n", trace_filename);
+            return 1;
+        }
+        /* before init, to record our hello */
+        if (usbredirparser_start_trace(b->guest, guest_write_trace, b,
+                                       16 * 1024 * 1024, 0)) {
+            return 1;
+        }
+    }
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_init(b->guest, BENCH_VERSION, caps, USB_REDIR_CAPS_SIZE, 0);
+
+    end = now_ns() + 5000000000ULL;
+    while (!b->connected && now_ns() < end) {
+        if (bench_iterate(b, 10)) {
+            return 1;
+        }
+    }
+    if (!b->connected) {
+        g_printerr("device was not redirected\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void bench_teardown(struct bench *b)
+{
+    if (b->guest) {
+        usbredirparser_destroy(b->guest);
+    }
+    if (b->trace) {
+        fclose(b->trace);
+    }
+    if (b->host) {
+        usbredirhost_close(b->host);
+    }
+    if (b->handle) {
+        libusb_close(b->handle);
+    }
+    if (b->host_fd > 0) {
+        close(b->host_fd);
+    }
+    if (b->guest_fd > 0) {
+        close(b->guest_fd);
+    }
+    if (b->ctx) {
+        libusb_exit(b->ctx);
+    }
+    g_array_free(b->latencies, TRUE);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = {
+        .duration = 2.0,
+        .depth = 1,
+        .bulk_size = 16384,
+        .control_size = 64,
+    };
+    gchar *devices = NULL, *only = NULL, *trace = NULL;
+    GOptionEntry entries[] = {
+        { "duration", 't', 0, G_OPTION_ARG_DOUBLE, &b.duration,
+          "Seconds to run each workload (default 2)", "SECONDS" },
+        { "depth", 'd', 0, G_OPTION_ARG_INT, &b.depth,
+          "Requests in flight for control and bulk (default 1)", "N" },
+        { "bulk-size", 's', 0, G_OPTION_ARG_INT, &b.bulk_size,
+          "Bytes per bulk transfer (default 16384)", "BYTES" },
+        { "devices", 0, 0, G_OPTION_ARG_STRING, &devices,
+          "libusb mock backend device spec", "SPEC" },
+        { "workload", 'w', 0, G_OPTION_ARG_STRING, &only,
+          "Only run this workload", "NAME" },
+        { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace,
+          "Record a trace of the guest side for usbredir-replay", "FILE" },
+        { NULL }
+    };
+    GOptionContext *context;
+    GError *err = NULL;
+    unsigned int i;
+    int r;
+
+    context = g_option_context_new("- benchmark the usbredir pipeline");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err)) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (b.depth < 1 || b.depth > MAX_DEPTH || b.bulk_size < 1 ||
+        b.bulk_size > (1 << 20) || b.duration <= 0) {
+        g_printerr("invalid arguments\n");
+        return 1;
+    }
+
+    b.latencies = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 1 << 20);
+    r = bench_setup(&b, devices ? devices : default_devices, trace);
+    if (r == 0) {
+        printf("%-14s %12s %10s %10s %10s %10s\n", "workload", "packets/s",
+               "MiB/s", "p50 us", "p99 us", "allocs/pkt");
+        for (i = 0; i < G_N_ELEMENTS(workloads); i++) {
+            if (only && strcmp(only, workloads[i].name)) {
+                continue;
+            }
+            if (run_workload(&b, &workloads[i])) {
+                r = 1;
+                break;
+            }
+        }
+    }
+    bench_teardown(&b);
+    g_free(devices);
+    g_free(only);
+    g_free(trace);
+
+    return r;
+}
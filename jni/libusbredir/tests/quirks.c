@@ -0,0 +1,467 @@
+/*
+ * usbredirhost quirks file tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Tests the quirks file parser and the vid:pid hash of the quirks table.
+   Those are static, so usbredirhost.c gets included here; the hosts are
+   bare structs without a parser or libusb device, which is all the quirks
+   code needs. */
+
+#include <locale.h>
+#include <glib.h>
+
+#include "../usbredirhost/usbredirhost.c"
+
+#define VID 0x1234
+#define PID 0x5678
+
+static void
+log_cb(void *priv, int level, const char *msg)
+{
+    g_test_message("%s", msg);
+}
+
+static struct usbredirhost *
+create_host(void)
+{
+    struct usbredirhost *host = calloc(1, sizeof(*host));
+
+    g_assert_nonnull(host);
+    host->log_func = log_cb;
+    host->verbose = usbredirparser_debug;
+    g_assert_cmpint(usbredirhost_hash_quirks(host), ==, 0);
+    return host;
+}
+
+static void
+destroy_host(struct usbredirhost *host)
+{
+    free(host->quirk_table);
+    free(host->quirk_hash);
+    free(host);
+}
+
+static int
+parse(struct usbredirhost *host, const char *line,
+      struct usbredirhost_quirk *q)
+{
+    return usbredirhost_parse_quirk(host, line, "test", 1, q);
+}
+
+/* Write contents to a temporary quirks file and load it */
+static int
+load(struct usbredirhost *host, const char *contents)
+{
+    gchar *filename;
+    size_t len = strlen(contents);
+    int fd, status;
+
+    fd = g_file_open_tmp("usbredir-quirks-XXXXXX", &filename, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(write(fd, contents, len), ==, len);
+    close(fd);
+
+    status = usbredirhost_load_quirks(host, filename);
+    unlink(filename);
+    g_free(filename);
+    return status;
+}
+
+/* Apply the quirks for VID:PID with the given bcdDevice, from scratch */
+static void
+apply(struct usbredirhost *host, uint16_t bcd)
+{
+    host->quirks = 0;
+    host->iso_transfers = 0;
+    host->interrupt_transfers = 0;
+    memset(host->read_ahead, 0, sizeof(host->read_ahead));
+    host->desc.idVendor = VID;
+    host->desc.idProduct = PID;
+    host->desc.bcdDevice = bcd;
+    usbredirhost_apply_quirks(host);
+}
+
+static void
+test_parse_ids(void)
+{
+    static const char *bad[] = {
+        "1234",
+        "1234 no-reset",
+        "1234:",
+        ":5678",
+        "1234 5678",
+        "12345:5678",
+        "1234:5678x no-reset",
+        "-1:5678",
+        "+1234:5678",
+        "g234:5678",
+    };
+    struct usbredirhost *host = create_host();
+    struct usbredirhost_quirk q;
+    guint i;
+
+    g_assert_cmpint(parse(host, "1d6b:0002 no-reset", &q), ==, 1);
+    g_assert_cmpuint(q.vendor_id, ==, 0x1d6b);
+    g_assert_cmpuint(q.product_id, ==, 0x0002);
+    g_assert_cmpuint(q.bcd_min, ==, 0);
+    g_assert_cmpuint(q.bcd_max, ==, 0xffff);
+    g_assert_cmpint(q.flags, ==, QUIRK_DO_NOT_RESET);
+    g_assert_cmpint(q.next, ==, -1);
+
+    /* Upper case, no leading zeros, no quirks */
+    g_assert_cmpint(parse(host, "ABcd:Ef1\n", &q), ==, 1);
+    g_assert_cmpuint(q.vendor_id, ==, 0xabcd);
+    g_assert_cmpuint(q.product_id, ==, 0x0ef1);
+    g_assert_cmpint(q.flags, ==, 0);
+
+    g_assert_cmpint(parse(host, "ffff:0 no-descriptor-cache", &q), ==, 1);
+    g_assert_cmpuint(q.vendor_id, ==, 0xffff);
+    g_assert_cmpuint(q.product_id, ==, 0);
+    g_assert_cmpint(q.flags, ==, QUIRK_NO_DESC_CACHE);
+
+    for (i = 0; i < G_N_ELEMENTS(bad); i++)
+        g_assert_cmpint(parse(host, bad[i], &q), ==, -1);
+
+    destroy_host(host);
+}
+
+static void
+test_parse_bcd(void)
+{
+    static const char *bad[] = {
+        "1234:5678:",
+        "1234:5678:0100-",
+        "1234:5678:-0200",
+        "1234:5678:0200-0100",
+        "1234:5678:10000",
+        "1234:5678:0100:0200",
+        "1234:5678:0100-0200-0300",
+    };
+    struct usbredirhost *host = create_host();
+    struct usbredirhost_quirk q;
+    guint i;
+
+    g_assert_cmpint(parse(host, "1234:5678:0100 no-reset", &q), ==, 1);
+    g_assert_cmpuint(q.bcd_min, ==, 0x0100);
+    g_assert_cmpuint(q.bcd_max, ==, 0x0100);
+
+    g_assert_cmpint(parse(host, "1234:5678:0100-02Ff no-reset", &q), ==, 1);
+    g_assert_cmpuint(q.bcd_min, ==, 0x0100);
+    g_assert_cmpuint(q.bcd_max, ==, 0x02ff);
+
+    g_assert_cmpint(parse(host, "1234:5678:0200-0200", &q), ==, 1);
+    g_assert_cmpuint(q.bcd_min, ==, 0x0200);
+    g_assert_cmpuint(q.bcd_max, ==, 0x0200);
+
+    for (i = 0; i < G_N_ELEMENTS(bad); i++)
+        g_assert_cmpint(parse(host, bad[i], &q), ==, -1);
+
+    destroy_host(host);
+}
+
+static void
+test_parse_comments(void)
+{
+    static const char *empty[] = {
+        "",
+        "\n",
+        " \t\r\n",
+        "#",
+        "# 1234:5678 no-reset",
+        "  \t# 1234:5678 no-reset\n",
+    };
+    struct usbredirhost *host = create_host();
+    struct usbredirhost_quirk q;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(empty); i++)
+        g_assert_cmpint(parse(host, empty[i], &q), ==, 0);
+
+    g_assert_cmpint(parse(host, "1234:5678 no-reset # iso-transfers=4", &q),
+                    ==, 1);
+    g_assert_cmpint(q.flags, ==, QUIRK_DO_NOT_RESET);
+    g_assert_cmpint(q.iso_transfers, ==, 0);
+
+    g_assert_cmpint(parse(host, "1234:5678#no-reset", &q), ==, 1);
+    g_assert_cmpint(q.flags, ==, 0);
+
+    g_assert_cmpint(parse(host, "1234:5678:0100-0200# no-reset", &q), ==, 1);
+    g_assert_cmpuint(q.bcd_max, ==, 0x0200);
+    g_assert_cmpint(q.flags, ==, 0);
+
+    g_assert_cmpint(parse(host, "\t1234:5678 iso-transfers=4#x\r\n", &q),
+                    ==, 1);
+    g_assert_cmpint(q.iso_transfers, ==, 4);
+
+    destroy_host(host);
+}
+
+static void
+test_parse_values(void)
+{
+    static const char *bad[] = {
+        "1234:5678 reset",
+        "1234:5678 no-reset=1",
+        "1234:5678 no-resetx",
+        "1234:5678 iso-transfers",
+        "1234:5678 iso-transfers=",
+        "1234:5678 iso-transfers=0",
+        "1234:5678 iso-transfers=17",
+        "1234:5678 iso-transfers=4x",
+        "1234:5678 iso-transfers = 4",
+        "1234:5678 interrupt-transfers=-1",
+        "1234:5678 bulk-read-ahead=81:4",
+        "1234:5678 bulk-read-ahead=01:4:512",
+        "1234:5678 bulk-read-ahead=90:4:512",
+        "1234:5678 bulk-read-ahead=81:0:512",
+        "1234:5678 bulk-read-ahead=81:4:0",
+        "1234:5678 bulk-read-ahead=81:4:134217729",
+    };
+    struct usbredirhost *host = create_host();
+    struct usbredirhost_quirk q;
+    guint i;
+
+    g_assert_cmpint(parse(host, "1234:5678 no-reset no-descriptor-cache "
+                          "iso-transfers=16\tinterrupt-transfers=1 "
+                          "bulk-read-ahead=8F:4:16384", &q), ==, 1);
+    g_assert_cmpint(q.flags, ==, QUIRK_DO_NOT_RESET | QUIRK_NO_DESC_CACHE);
+    g_assert_cmpint(q.iso_transfers, ==, 16);
+    g_assert_cmpint(q.interrupt_transfers, ==, 1);
+    g_assert_cmpuint(q.read_ahead_ep, ==, 0x8f);
+    g_assert_cmpint(q.read_ahead_transfer_count, ==, 4);
+    g_assert_cmpint(q.read_ahead_bytes_per_transfer, ==, 16384);
+
+    for (i = 0; i < G_N_ELEMENTS(bad); i++)
+        g_assert_cmpint(parse(host, bad[i], &q), ==, -1);
+
+    destroy_host(host);
+}
+
+/* A file with an error gets rejected as a whole, leaving what was loaded
+   before as it was */
+static void
+test_load_bad_line(void)
+{
+    struct usbredirhost *host = create_host();
+    int count;
+
+    g_assert_cmpint(load(host, "# good\n"
+                               "1234:5678 iso-transfers=4\n"), ==,
+                    usb_redir_success);
+    count = host->quirk_count;
+    g_assert_cmpint(count, ==, 1);
+
+    g_assert_cmpint(load(host, "1234:5678 no-reset\n"
+                               "1111:2222 no-reset\n"
+                               "\n"
+                               "3333:4444 no-such-quirk\n"
+                               "5555:6666 no-reset\n"), ==,
+                    usb_redir_inval);
+    g_assert_cmpint(host->quirk_count, ==, count);
+    g_assert_cmpint(usbredirhost_find_quirk(host, 0x1111, 0x2222), ==, -1);
+    g_assert_cmpint(usbredirhost_find_quirk(host, 0x5555, 0x6666), ==, -1);
+    apply(host, 0);
+    g_assert_cmpint(host->quirks, ==, 0);
+    g_assert_cmpint(host->iso_transfers, ==, 4);
+
+    /* The bad entries must not show up after the next successful load */
+    g_assert_cmpint(load(host, "7777:8888 no-reset\n"), ==,
+                    usb_redir_success);
+    g_assert_cmpint(host->quirk_count, ==, count + 1);
+    g_assert_cmpint(usbredirhost_find_quirk(host, 0x1111, 0x2222), ==, -1);
+    g_assert_cmpint(usbredirhost_find_quirk(host, 0x7777, 0x8888), ==, count);
+    apply(host, 0);
+    g_assert_cmpint(host->quirks, ==, 0);
+
+    g_assert_cmpint(load(host, "1234:5678:0200-0100 no-reset\n"), ==,
+                    usb_redir_inval);
+    g_assert_cmpint(host->quirk_count, ==, count + 1);
+
+    g_assert_cmpint(usbredirhost_load_quirks(host,
+                                             "/nonexistent/usbredir-quirks"),
+                    ==, usb_redir_ioerror);
+    g_assert_cmpint(host->quirk_count, ==, count + 1);
+
+    destroy_host(host);
+}
+
+/* All matching entries get applied in order, later ones override earlier
+   ones, also across files */
+static void
+test_load_override(void)
+{
+    struct usbredirhost *host = create_host();
+    int i, prev;
+
+    host->endpoint[EP2I(0x81)].type = usb_redir_type_bulk;
+    host->endpoint[EP2I(0x81)].max_packetsize = 512;
+
+    g_assert_cmpint(load(host,
+        "1234:5678 iso-transfers=4 interrupt-transfers=2\n"
+        "1234:5678 bulk-read-ahead=81:2:4096\n"
+        "1234:5678:0100-01ff iso-transfers=8 bulk-read-ahead=81:3:8192\n"
+        "1234:5678:0200 no-reset\n"
+        "1234:5679 iso-transfers=16\n"), ==, usb_redir_success);
+
+    /* The entries for VID:PID are chained in file order */
+    prev = -1;
+    for (i = usbredirhost_find_quirk(host, VID, PID); i != -1;
+         i = host->quirk_table[i].next) {
+        g_assert_cmpint(i, >, prev);
+        g_assert_cmpuint(host->quirk_table[i].product_id, ==, PID);
+        prev = i;
+    }
+    g_assert_cmpint(prev, ==, 3);
+
+    apply(host, 0x0050);
+    g_assert_cmpint(host->quirks, ==, 0);
+    g_assert_cmpint(host->iso_transfers, ==, 4);
+    g_assert_cmpint(host->interrupt_transfers, ==, 2);
+    g_assert_cmpint(host->read_ahead[EP2I(0x81)].transfer_count, ==, 2);
+    g_assert_cmpint(host->read_ahead[EP2I(0x81)].bytes_per_transfer, ==, 4096);
+
+    apply(host, 0x0150);
+    g_assert_cmpint(host->quirks, ==, 0);
+    g_assert_cmpint(host->iso_transfers, ==, 8);
+    g_assert_cmpint(host->interrupt_transfers, ==, 2);
+    g_assert_cmpint(host->read_ahead[EP2I(0x81)].transfer_count, ==, 3);
+    g_assert_cmpint(host->read_ahead[EP2I(0x81)].bytes_per_transfer, ==, 8192);
+
+    apply(host, 0x0200);
+    g_assert_cmpint(host->quirks, ==, QUIRK_DO_NOT_RESET);
+    g_assert_cmpint(host->iso_transfers, ==, 4);
+
+    /* A later file overrides the settings, the flags set by earlier entries
+       stay set */
+    g_assert_cmpint(load(host, "1234:5678 iso-transfers=6 "
+                               "bulk-read-ahead=81:5:1024\n"), ==,
+                    usb_redir_success);
+
+    apply(host, 0x0150);
+    g_assert_cmpint(host->iso_transfers, ==, 6);
+    g_assert_cmpint(host->interrupt_transfers, ==, 2);
+    g_assert_cmpint(host->read_ahead[EP2I(0x81)].transfer_count, ==, 5);
+    g_assert_cmpint(host->read_ahead[EP2I(0x81)].bytes_per_transfer, ==, 1024);
+
+    apply(host, 0x0200);
+    g_assert_cmpint(host->quirks, ==, QUIRK_DO_NOT_RESET);
+    g_assert_cmpint(host->iso_transfers, ==, 6);
+
+    destroy_host(host);
+}
+
+/* Entries whose vid:pid hash to the same slot must all be found, and a
+   vid:pid without entries, hashing to that slot too, must not be */
+static void
+test_hash_collisions(void)
+{
+    struct usbredirhost *host = create_host();
+    uint16_t pids[6], missing_pid = 0;
+    char contents[512];
+    int i, idx, len = 0, home, slot_count = host->quirk_hash_size;
+    uint32_t pid;
+
+    /* With an empty hash the slot is where the probing starts */
+    home = usbredirhost_quirk_slot(host, VID, 0);
+    for (i = 0, pid = 1; i <= (int)G_N_ELEMENTS(pids); pid++) {
+        g_assert_cmpuint(pid, <=, 0xffff);
+        if (usbredirhost_quirk_slot(host, VID, pid) != home)
+            continue;
+        if (i < (int)G_N_ELEMENTS(pids))
+            pids[i] = pid;
+        else
+            missing_pid = pid;
+        i++;
+    }
+
+    for (i = 0; i < (int)G_N_ELEMENTS(pids); i++)
+        len += snprintf(contents + len, sizeof(contents) - len,
+                        "%04x:%04x iso-transfers=%d\n", VID, pids[i], i + 1);
+    /* A second entry for the first vid:pid, after the colliding ones */
+    len += snprintf(contents + len, sizeof(contents) - len,
+                    "%04x:%04x no-reset\n", VID, pids[0]);
+    g_assert_cmpint(load(host, contents), ==, usb_redir_success);
+    /* Otherwise the hash got resized and the entries may not collide */
+    g_assert_cmpint(host->quirk_hash_size, ==, slot_count);
+
+    for (i = 0; i < (int)G_N_ELEMENTS(pids); i++) {
+        idx = usbredirhost_find_quirk(host, VID, pids[i]);
+        g_assert_cmpint(idx, ==, i);
+        g_assert_cmpuint(host->quirk_table[idx].vendor_id, ==, VID);
+        g_assert_cmpuint(host->quirk_table[idx].product_id, ==, pids[i]);
+        g_assert_cmpint(host->quirk_table[idx].iso_transfers, ==, i + 1);
+    }
+    idx = host->quirk_table[0].next;
+    g_assert_cmpint(idx, ==, G_N_ELEMENTS(pids));
+    g_assert_cmpint(host->quirk_table[idx].flags, ==, QUIRK_DO_NOT_RESET);
+    g_assert_cmpint(host->quirk_table[idx].next, ==, -1);
+    for (i = 1; i < (int)G_N_ELEMENTS(pids); i++)
+        g_assert_cmpint(host->quirk_table[i].next, ==, -1);
+
+    g_assert_cmpint(usbredirhost_find_quirk(host, VID, missing_pid), ==, -1);
+
+    destroy_host(host);
+}
+
+/* The hash grows with the table and keeps finding every entry */
+static void
+test_hash_grow(void)
+{
+    const int count = 1000;
+    struct usbredirhost *host = create_host();
+    size_t size = count * sizeof("ffff:ffff interrupt-transfers=16\n") + 1;
+    char *contents = malloc(size);
+    int i, idx, len = 0;
+
+    g_assert_nonnull(contents);
+    for (i = 0; i < count; i++)
+        len += snprintf(contents + len, size - len,
+                        "%04x:%04x interrupt-transfers=%d\n",
+                        0x1000 + i / 8, i, i % 16 + 1);
+    g_assert_cmpint(load(host, contents), ==, usb_redir_success);
+    free(contents);
+
+    g_assert_cmpint(host->quirk_count, ==, count);
+    g_assert_cmpint(host->quirk_hash_size, >=, 2 * count);
+    g_assert_cmpint(host->quirk_hash_size & (host->quirk_hash_size - 1), ==, 0);
+    for (i = 0; i < count; i++) {
+        idx = usbredirhost_find_quirk(host, 0x1000 + i / 8, i);
+        g_assert_cmpint(idx, ==, i);
+        g_assert_cmpint(host->quirk_table[idx].interrupt_transfers, ==,
+                        i % 16 + 1);
+    }
+    g_assert_cmpint(usbredirhost_find_quirk(host, 0x1000, 8), ==, -1);
+
+    destroy_host(host);
+}
+
+int
+main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "");
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/quirks/parse/ids", test_parse_ids);
+    g_test_add_func("/quirks/parse/bcd", test_parse_bcd);
+    g_test_add_func("/quirks/parse/comments", test_parse_comments);
+    g_test_add_func("/quirks/parse/values", test_parse_values);
+    g_test_add_func("/quirks/load/bad-line", test_load_bad_line);
+    g_test_add_func("/quirks/load/override", test_load_override);
+    g_test_add_func("/quirks/hash/collisions", test_hash_collisions);
+    g_test_add_func("/quirks/hash/grow", test_hash_grow);
+
+    return g_test_run();
+}
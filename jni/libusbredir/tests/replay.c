@@ -0,0 +1,431 @@
+/*
+ * usbredir trace replayer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Replays the usb-guest side of a usbredir trace (see the tracing section of
+   usbredirparser.h) into a usbredirhost, which redirects either a device
+   simulated by the libusb mock backend or a real device. The packets are
+   sent with their original timing, or as fast as the host accepts them.
+   The replies of the host are only counted, so this is meant for
+   benchmarking and for reproducing problems, not for checking results. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "usbredirhost.h"
+#include "usbredirparser.h"
+
+#define SKIP_EXIT_CODE  77
+#define REPLAY_VERSION  "usbredir-replay"
+
+struct replay {
+    libusb_context *ctx;
+    struct usbredirhost *host;
+    int host_fd;
+    int guest_fd;
+    int failed;
+
+    FILE *trace;
+    struct usbredirparser_trace_header header;
+    int guest_direction;
+    gboolean max_speed;
+
+    /* packet being written to the host */
+    uint8_t *packet;
+    size_t packet_len;
+    size_t packet_pos;
+    uint64_t packet_time;
+
+    uint64_t packets;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t dropped;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void replay_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        g_printerr("%s\n", msg);
+    }
+}
+
+static int host_read(void *priv, uint8_t *data, int count)
+{
+    struct replay *rp = priv;
+    int r = read(rp->host_fd, data, count);
+    if (r < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    return r == 0 ? -1 : r;
+}
+
+static int host_write(void *priv, uint8_t *data, int count)
+{
+    struct replay *rp = priv;
+    int r = write(rp->host_fd, data, count);
+    if (r < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    return r;
+}
+
+/* Read the next usb-guest packet from the trace and turn it back into what
+   went over the wire. Returns 1 on success, 0 at the end of the trace and
+   -1 on error. */
+static int next_packet(struct replay *rp)
+{
+    struct usbredirparser_trace_record rec;
+    size_t header_len, len, captured, padding;
+    uint32_t length;
+    uint8_t *p;
+
+    for (;;) {
+        if (fread(&rec, sizeof(rec), 1, rp->trace) != 1) {
+            return feof(rp->trace) ? 0 : -1;
+        }
+        captured = rec.type_header_len;
+        if (rec.flags & usbredirparser_trace_payload) {
+            captured += rec.data_len;
+        }
+        padding = (8 - (sizeof(rec) + captured) % 8) % 8;
+        rp->dropped += rec.dropped;
+        if (rec.direction == rp->guest_direction) {
+            break;
+        }
+        if (fseek(rp->trace, captured + padding, SEEK_CUR)) {
+            return -1;
+        }
+    }
+
+    /* usb_redir_header, with a 32 bit id until both sides have
+       usb_redir_cap_64bits_ids */
+    header_len = (rec.flags & usbredirparser_trace_32bits_ids) ? 12 : 16;
+    len = header_len + rec.type_header_len + rec.data_len;
+    g_free(rp->packet);
+    /* data which was not captured is replayed as zeros */
+    rp->packet = g_malloc0(len);
+    rp->packet_len = len;
+    rp->packet_pos = 0;
+    rp->packet_time = rec.timestamp;
+
+    p = rp->packet;
+    length = rec.type_header_len + rec.data_len;
+    memcpy(p, &rec.type, sizeof(uint32_t));
+    memcpy(p + 4, &length, sizeof(uint32_t));
+    if (header_len == 12) {
+        uint32_t id = rec.id;
+        memcpy(p + 8, &id, sizeof(id));
+    } else {
+        memcpy(p + 8, &rec.id, sizeof(rec.id));
+    }
+    p += header_len;
+
+    if (captured && fread(p, captured, 1, rp->trace) != 1) {
+        return -1;
+    }
+    if (padding && fseek(rp->trace, padding, SEEK_CUR)) {
+        return -1;
+    }
+    return 1;
+}
+
+static int replay_iterate(struct replay *rp, uint64_t start, int *done)
+{
+    const struct libusb_pollfd **usb_fds;
+    struct pollfd fds[32];
+    int i, n = 0, usb_n, timeout_ms = 100;
+    struct timeval tv = { 0, 0 };
+    uint64_t due, now;
+
+    if (!rp->packet && !*done) {
+        int r = next_packet(rp);
+        if (r < 0) {
+            g_printerr("error reading trace\n");
+            return -1;
+        }
+        *done = (r == 0);
+    }
+
+    /* In original speed mode wait for the packet to be due */
+    now = now_ns();
+    due = start + (rp->packet ? rp->packet_time : 0);
+    if (rp->packet && !rp->max_speed && due > now) {
+        timeout_ms = (due - now) / 1000000;
+    }
+
+    fds[n].fd = rp->host_fd;
+    fds[n].events = POLLIN;
+    if (usbredirhost_has_data_to_write(rp->host)) {
+        fds[n].events |= POLLOUT;
+    }
+    n++;
+    fds[n].fd = rp->guest_fd;
+    fds[n].events = POLLIN;
+    if (rp->packet && (rp->max_speed || due <= now)) {
+        fds[n].events |= POLLOUT;
+    }
+    n++;
+
+    usb_fds = libusb_get_pollfds(rp->ctx);
+    for (i = 0; usb_fds && usb_fds[i] && n < (int)G_N_ELEMENTS(fds); i++) {
+        fds[n].fd = usb_fds[i]->fd;
+        fds[n].events = usb_fds[i]->events;
+        n++;
+    }
+    usb_n = n - 2;
+    libusb_free_pollfds(usb_fds);
+
+    if (poll(fds, n, timeout_ms) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (usbredirhost_read_guest_data(rp->host)) {
+            return -1;
+        }
+    }
+    for (i = 0; i < usb_n; i++) {
+        if (fds[2 + i].revents) {
+            libusb_handle_events_timeout(rp->ctx, &tv);
+            break;
+        }
+    }
+    if (usbredirhost_has_data_to_write(rp->host) &&
+        usbredirhost_write_guest_data(rp->host)) {
+        return -1;
+    }
+
+    /* The guest side: discard the replies, send the next packet */
+    if (fds[1].revents & POLLIN) {
+        uint8_t buf[65536];
+        ssize_t r = read(rp->guest_fd, buf, sizeof(buf));
+        if (r > 0) {
+            rp->bytes_received += r;
+        }
+    }
+    if (fds[1].revents & POLLOUT) {
+        ssize_t r = write(rp->guest_fd, rp->packet + rp->packet_pos,
+                          rp->packet_len - rp->packet_pos);
+        if (r < 0 && errno != EAGAIN) {
+            perror("write");
+            return -1;
+        }
+        if (r > 0) {
+            rp->packet_pos += r;
+            rp->bytes_sent += r;
+            if (rp->packet_pos == rp->packet_len) {
+                g_clear_pointer(&rp->packet, g_free);
+                rp->packets++;
+            }
+        }
+    }
+
+    return rp->failed ? -1 : 0;
+}
+
+static int open_trace(struct replay *rp, const char *filename)
+{
+    rp->trace = fopen(filename, "rb");
+    if (!rp->trace) {
+        g_printerr("could not open %s: %s\n", filename, g_strerror(errno));
+        return -1;
+    }
+    if (fread(&rp->header, sizeof(rp->header), 1, rp->trace) != 1 ||
+        memcmp(rp->header.magic, USBREDIRPARSER_TRACE_MAGIC,
+               sizeof(USBREDIRPARSER_TRACE_MAGIC)) ||
+        rp->header.version != USBREDIRPARSER_TRACE_VERSION) {
+        g_printerr("%s is not a usbredir trace\n", filename);
+        return -1;
+    }
+    /* The usb-guest's packets are the ones received by the usb-host, or the
+       ones sent by the usb-guest */
+    rp->guest_direction = (rp->header.flags & usbredirparser_fl_usb_host) ?
+        usbredirparser_trace_received : usbredirparser_trace_sent;
+    return 0;
+}
+
+static int open_device(struct replay *rp, const char *devices,
+                       const char *device)
+{
+    libusb_device_handle *handle = NULL;
+    unsigned int vid, pid;
+    int r;
+
+    if (!device) {
+#ifdef LIBUSB_HAS_MOCK_BACKEND
+        r = libusb_set_option(NULL, LIBUSB_OPTION_MOCK_BACKEND, devices);
+#else
+        r = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+        if (r != LIBUSB_SUCCESS) {
+            g_printerr("libusb mock backend not available, use --device\n");
+            return SKIP_EXIT_CODE;
+        }
+    }
+    r = libusb_init(&rp->ctx);
+    if (r < 0) {
+        g_printerr("libusb_init: %s\n", libusb_strerror(r));
+        return 1;
+    }
+
+    if (device) {
+        if (sscanf(device, "%x:%x", &vid, &pid) != 2) {
+            g_printerr("invalid device %s, expected vid:pid\n", device);
+            return 1;
+        }
+        handle = libusb_open_device_with_vid_pid(rp->ctx, vid, pid);
+    } else {
+        libusb_device **list;
+        ssize_t count = libusb_get_device_list(rp->ctx, &list);
+        if (count > 0) {
+            libusb_open(list[0], &handle);
+        }
+        if (count >= 0) {
+            libusb_free_device_list(list, 1);
+        }
+    }
+    if (!handle) {
+        g_printerr("could not open the device\n");
+        return 1;
+    }
+
+    rp->host = usbredirhost_open_full(rp->ctx, handle, replay_log,
+                                      host_read, host_write, NULL,
+                                      NULL, NULL, NULL, NULL,
+                                      rp, REPLAY_VERSION,
+                                      usbredirparser_warning, 0);
+    return rp->host ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct replay rp = { 0, };
+    gchar *devices = NULL, *device = NULL;
+    GOptionEntry entries[] = {
+        { "max-speed", 'm', 0, G_OPTION_ARG_NONE, &rp.max_speed,
+          "Send packets as fast as possible instead of with the original timing",
+          NULL },
+        { "devices", 0, 0, G_OPTION_ARG_STRING, &devices,
+          "libusb mock backend device spec", "SPEC" },
+        { "device", 'd', 0, G_OPTION_ARG_STRING, &device,
+          "Replay to a real device instead of the mock backend", "VID:PID" },
+        { NULL }
+    };
+    GOptionContext *context;
+    GError *err = NULL;
+    uint64_t start, end;
+    double elapsed;
+    int fds[2], done = 0, r;
+
+    context = g_option_context_new("TRACE - replay a usbredir trace");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err)) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (argc != 2) {
+        g_printerr("missing trace file argument\n");
+        return 1;
+    }
+
+    r = 1;
+    if (open_trace(&rp, argv[1])) {
+        goto out;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        perror("socketpair");
+        goto out;
+    }
+    rp.host_fd = fds[0];
+    rp.guest_fd = fds[1];
+    fcntl(rp.host_fd, F_SETFL, O_NONBLOCK);
+    fcntl(rp.guest_fd, F_SETFL, O_NONBLOCK);
+
+    r = open_device(&rp, devices ? devices : "", device);
+    if (r) {
+        goto out;
+    }
+
+    start = now_ns();
+    while (!done || rp.packet) {
+        if (replay_iterate(&rp, start, &done)) {
+            r = 1;
+            goto out;
+        }
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    /* give the host a moment to answer the last packets */
+    end = now_ns() + 200000000;
+    while (now_ns() < end) {
+        if (replay_iterate(&rp, start, &done)) {
+            break;
+        }
+    }
+
+    printf("replayed %" PRIu64 " packets in %.3f s, %.1f packets/s, "
+           "%.2f MiB/s sent, %.2f MiB received\n", rp.packets, elapsed,
+           rp.packets / elapsed, rp.bytes_sent / elapsed / (1024 * 1024),
+           rp.bytes_received / (1024.0 * 1024));
+    if (rp.dropped) {
+        printf("the trace lost %" PRIu64 " records\n", rp.dropped);
+    }
+
+out:
+    if (rp.host) {
+        usbredirhost_close(rp.host);
+    }
+    if (rp.host_fd > 0) {
+        close(rp.host_fd);
+    }
+    if (rp.guest_fd > 0) {
+        close(rp.guest_fd);
+    }
+    if (rp.ctx) {
+        libusb_exit(rp.ctx);
+    }
+    if (rp.trace) {
+        fclose(rp.trace);
+    }
+    g_free(rp.packet);
+    g_free(devices);
+    g_free(device);
+    return r;
+}
@@ -0,0 +1,356 @@
+/*
+ * usbredirparser output queue ordering tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Queues packets of the different priority classes on a usb-host side
+   parser and checks the order in which they appear on the wire, see
+   usbredirparser_next_write_prio and usbredirparser_may_write. The parsers
+   have no peer caps, so the packets use 32 bit ids. */
+
+#include <locale.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbredirparser.h"
+#include "usbredirproto-compat.h"
+
+#define BULK_EP      0x81 /* low priority class */
+#define BULK_EP2     0x82
+#define ISO_EP       0x84 /* medium priority class */
+#define INTERRUPT_EP 0x83 /* high priority class */
+
+/* Id of the barrier packets, which are not for an endpoint */
+#define BARRIER_ID   0
+
+struct wire {
+    GByteArray *data;
+    /* Bytes the write callback still accepts, -1 for no limit */
+    int accept;
+};
+
+struct packet {
+    uint32_t type;
+    uint32_t id;
+};
+
+static void
+log_cb(void *priv, int level, const char *msg)
+{
+    g_test_message("%s", msg);
+}
+
+static int
+write_cb(void *priv, uint8_t *data, int count)
+{
+    struct wire *wire = priv;
+
+    if (wire->accept != -1) {
+        if (count > wire->accept)
+            count = wire->accept;
+        wire->accept -= count;
+    }
+    g_byte_array_append(wire->data, data, count);
+    return count;
+}
+
+static struct usbredirparser *
+create_parser(struct wire *wire)
+{
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+    struct usbredirparser *parser = usbredirparser_create();
+
+    g_assert_nonnull(parser);
+    parser->priv = wire;
+    parser->log_func = log_cb;
+    parser->write_func = write_cb;
+    usbredirparser_init(parser, "write-order test", caps, USB_REDIR_CAPS_SIZE,
+                        usbredirparser_fl_usb_host | usbredirparser_fl_no_hello);
+    return parser;
+}
+
+static void
+wire_init(struct wire *wire)
+{
+    wire->data = g_byte_array_new();
+    wire->accept = -1;
+}
+
+static void
+send_bulk(struct usbredirparser *parser, uint8_t ep, uint32_t id)
+{
+    struct usb_redir_bulk_packet_header header = {
+        .endpoint = ep,
+        .status = usb_redir_success,
+        .length = sizeof(id),
+    };
+
+    usbredirparser_send_bulk_packet(parser, id, &header, (uint8_t *)&id,
+                                    sizeof(id));
+}
+
+static void
+send_iso(struct usbredirparser *parser, uint32_t id)
+{
+    struct usb_redir_iso_packet_header header = {
+        .endpoint = ISO_EP,
+        .status = usb_redir_success,
+        .length = sizeof(id),
+    };
+
+    usbredirparser_send_iso_packet(parser, id, &header, (uint8_t *)&id,
+                                   sizeof(id));
+}
+
+static void
+send_interrupt(struct usbredirparser *parser, uint32_t id)
+{
+    struct usb_redir_interrupt_packet_header header = {
+        .endpoint = INTERRUPT_EP,
+        .status = usb_redir_success,
+        .length = sizeof(id),
+    };
+
+    usbredirparser_send_interrupt_packet(parser, id, &header, (uint8_t *)&id,
+                                         sizeof(id));
+}
+
+static void
+send_barrier(struct usbredirparser *parser)
+{
+    usbredirparser_send_device_disconnect(parser);
+}
+
+/* Split what was written into packets, all of which must be complete */
+static GArray *
+wire_packets(const struct wire *wire)
+{
+    GArray *packets = g_array_new(FALSE, FALSE, sizeof(struct packet));
+    struct usb_redir_header_32bit_id header;
+    struct packet packet;
+    guint pos = 0;
+
+    while (pos < wire->data->len) {
+        g_assert_cmpuint(wire->data->len - pos, >=, sizeof(header));
+        memcpy(&header, wire->data->data + pos, sizeof(header));
+        pos += sizeof(header);
+        g_assert_cmpuint(wire->data->len - pos, >=, header.length);
+        pos += header.length;
+
+        packet.type = header.type;
+        packet.id = header.id;
+        g_array_append_val(packets, packet);
+    }
+    return packets;
+}
+
+/* Check the ids of the packets on the wire, BARRIER_ID must be a barrier */
+static void
+assert_wire_ids(const struct wire *wire, const uint32_t *ids, guint count)
+{
+    GArray *packets = wire_packets(wire);
+    guint i;
+
+    g_assert_cmpuint(packets->len, ==, count);
+    for (i = 0; i < count; i++) {
+        const struct packet *packet =
+            &g_array_index(packets, struct packet, i);
+
+        g_assert_cmpuint(packet->id, ==, ids[i]);
+        if (ids[i] == BARRIER_ID)
+            g_assert_cmpuint(packet->type, ==, usb_redir_device_disconnect);
+        else
+            g_assert_cmpuint(packet->type, !=, usb_redir_device_disconnect);
+    }
+    g_array_unref(packets);
+}
+
+static void
+test_priority_classes(void)
+{
+    static const uint32_t want[] = { 3, 2, 1 };
+    struct wire wire;
+    struct usbredirparser *parser;
+
+    wire_init(&wire);
+    parser = create_parser(&wire);
+
+    send_bulk(parser, BULK_EP, 1);
+    send_iso(parser, 2);
+    send_interrupt(parser, 3);
+    g_assert_cmpint(usbredirparser_do_write(parser), ==, 0);
+    assert_wire_ids(&wire, want, G_N_ELEMENTS(want));
+
+    usbredirparser_destroy(parser);
+    g_byte_array_unref(wire.data);
+}
+
+/* Endpoint packets may pass each other, but never a barrier */
+static void
+test_barrier(void)
+{
+    static const uint32_t want[] = { 2, 1, BARRIER_ID, 5, 3, 4 };
+    struct wire wire;
+    struct usbredirparser *parser;
+
+    wire_init(&wire);
+    parser = create_parser(&wire);
+
+    send_bulk(parser, BULK_EP, 1);
+    send_interrupt(parser, 2);
+    send_barrier(parser);
+    send_iso(parser, 3);
+    send_bulk(parser, BULK_EP, 4);
+    send_interrupt(parser, 5);
+    g_assert_cmpint(usbredirparser_do_write(parser), ==, 0);
+    assert_wire_ids(&wire, want, G_N_ELEMENTS(want));
+
+    usbredirparser_destroy(parser);
+    g_byte_array_unref(wire.data);
+}
+
+/* A low priority packet gets passed over by 8 high priority ones at most */
+static void
+test_starvation(void)
+{
+    uint32_t want[21];
+    struct wire wire;
+    struct usbredirparser *parser;
+    uint32_t i;
+
+    wire_init(&wire);
+    parser = create_parser(&wire);
+
+    send_bulk(parser, BULK_EP, 100);
+    for (i = 1; i <= 20; i++)
+        send_interrupt(parser, i);
+    g_assert_cmpint(usbredirparser_do_write(parser), ==, 0);
+
+    for (i = 0; i < 8; i++)
+        want[i] = i + 1;
+    want[8] = 100;
+    for (i = 9; i < 21; i++)
+        want[i] = i;
+    assert_wire_ids(&wire, want, G_N_ELEMENTS(want));
+
+    usbredirparser_destroy(parser);
+    g_byte_array_unref(wire.data);
+}
+
+/* The packets of an endpoint keep their order, whatever the classes and the
+   anti-starvation do to packets of other endpoints */
+static void
+test_endpoint_fifo(void)
+{
+    struct wire wire;
+    struct usbredirparser *parser;
+    GArray *packets;
+    uint32_t i, last_bulk = 0, last_bulk2 = 0, last_interrupt = 0;
+    guint j;
+
+    wire_init(&wire);
+    parser = create_parser(&wire);
+    g_assert_cmpint(usbredirparser_set_ep_priority(parser, BULK_EP2,
+                                                   usbredirparser_prio_high),
+                    ==, usb_redir_success);
+
+    /* ids encode the endpoint in the hundreds */
+    for (i = 1; i <= 30; i++) {
+        send_bulk(parser, BULK_EP, 100 + i);
+        if (i % 3 == 0)
+            send_bulk(parser, BULK_EP2, 200 + i);
+        send_interrupt(parser, 300 + 2 * i - 1);
+        send_interrupt(parser, 300 + 2 * i);
+    }
+    g_assert_cmpint(usbredirparser_do_write(parser), ==, 0);
+
+    packets = wire_packets(&wire);
+    g_assert_cmpuint(packets->len, ==, 30 + 10 + 60);
+    for (j = 0; j < packets->len; j++) {
+        uint32_t id = g_array_index(packets, struct packet, j).id;
+        uint32_t *last;
+
+        switch (id / 100) {
+        case 1: last = &last_bulk; break;
+        case 2: last = &last_bulk2; break;
+        default: last = &last_interrupt; break;
+        }
+        g_assert_cmpuint(id, >, *last);
+        *last = id;
+    }
+    g_array_unref(packets);
+
+    usbredirparser_destroy(parser);
+    g_byte_array_unref(wire.data);
+}
+
+/* The rest of a partially written buffer must come first after migration,
+   followed by the other buffers in the order they were queued in */
+static void
+test_serialize_partial_write(void)
+{
+    static const uint32_t want[] = { 3, 1, 2, 4 };
+    struct wire wire, wire2;
+    struct usbredirparser *parser, *parser2;
+    uint8_t *state;
+    int state_len;
+
+    wire_init(&wire);
+    parser = create_parser(&wire);
+
+    send_bulk(parser, BULK_EP, 1);
+    send_iso(parser, 2);
+    send_interrupt(parser, 3);
+    send_bulk(parser, BULK_EP2, 4);
+
+    /* Stop halfway through the interrupt packet, which goes first */
+    wire.accept = 5;
+    g_assert_cmpint(usbredirparser_do_write(parser), ==, 0);
+    g_assert_cmpuint(wire.data->len, ==, 5);
+
+    g_assert_cmpint(usbredirparser_serialize(parser, &state, &state_len), ==, 0);
+    usbredirparser_destroy(parser);
+
+    wire_init(&wire2);
+    parser2 = create_parser(&wire2);
+    g_assert_cmpint(usbredirparser_unserialize(parser2, state, state_len), ==, 0);
+    free(state);
+    g_assert_cmpint(usbredirparser_has_data_to_write(parser2), ==, 4);
+    g_assert_cmpint(usbredirparser_do_write(parser2), ==, 0);
+
+    g_byte_array_append(wire.data, wire2.data->data, wire2.data->len);
+    assert_wire_ids(&wire, want, G_N_ELEMENTS(want));
+
+    usbredirparser_destroy(parser2);
+    g_byte_array_unref(wire.data);
+    g_byte_array_unref(wire2.data);
+}
+
+int
+main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "");
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/write-order/priority-classes", test_priority_classes);
+    g_test_add_func("/write-order/barrier", test_barrier);
+    g_test_add_func("/write-order/starvation", test_starvation);
+    g_test_add_func("/write-order/endpoint-fifo", test_endpoint_fifo);
+    g_test_add_func("/write-order/serialize-partial-write",
+                    test_serialize_partial_write);
+
+    return g_test_run();
+}
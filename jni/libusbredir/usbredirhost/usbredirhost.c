@@ -25,10 +25,17 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #include "usbredirhost.h"
+#include "usbredirprobes.h"
 
 #define MAX_ENDPOINTS        32
 #define MAX_INTERFACES       32 /* Max 32 endpoints and thus interfaces */
@@ -39,12 +46,24 @@
 
 #define MAX_TRANSFER_COUNT        16
 #define MAX_PACKETS_PER_TRANSFER  32
+/* Same limit as the parser puts on the length of a bulk packet */
+#define MAX_BULK_TRANSFER_SIZE    (128u * 1024u * 1024u)
 #define INTERRUPT_TRANSFER_COUNT   5
 /* Special packet_idx value indicating a submitted transfer */
 #define SUBMITTED_IDX             -1
+/* Iso out jitter buffer: transfers to wait between two clock drift
+   corrections, and the weight of the new sample in the depth average */
+#define ISO_OUT_ADJUST_INTERVAL    8
+#define ISO_OUT_AVG_WEIGHT        16
 
 /* quirk flags */
 #define QUIRK_DO_NOT_RESET    0x01
+#define QUIRK_NO_DESC_CACHE   0x02
+/* Why the cached descriptors may no longer match the device */
+#define DESC_CACHE_STALE_CONFIG       0x01 /* guest changed config / alt */
+#define DESC_CACHE_STALE_DESCRIPTORS  0x02 /* guest sent SET_DESCRIPTOR */
+/* Max length of a line of a quirks file */
+#define QUIRKS_LINE_SIZE      1024
 
 /* Macros to go from an endpoint address to an index for our ep array */
 #define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
@@ -77,7 +96,9 @@ struct usbredirtransfer {
     struct libusb_transfer *transfer; /* Back pointer to the libusb transfer */
     uint64_t id;
     uint8_t cancelled;
+    uint8_t dev_mem;                  /* buffer is from libusb_dev_mem_alloc */
     int packet_idx;
+    uint64_t submit_time;             /* usbredirhost_clock_us() on submit */
     union {
         struct usb_redir_control_packet_header control_packet;
         struct usb_redir_bulk_packet_header bulk_packet;
@@ -88,6 +109,13 @@ struct usbredirtransfer {
     struct usbredirtransfer *prev;
 };
 
+/* A bulk-in request from the usb-guest, waiting for read-ahead data */
+struct usbredirhost_bulk_request {
+    uint64_t id;
+    struct usb_redir_bulk_packet_header bulk_packet;
+    struct usbredirhost_bulk_request *next;
+};
+
 struct usbredirhost_ep {
     uint8_t type;
     uint8_t interval;
@@ -101,6 +129,35 @@ struct usbredirhost_ep {
     int max_packetsize;
     unsigned int max_streams;
     struct usbredirtransfer *transfer[MAX_TRANSFER_COUNT];
+    struct usbredirhost_bulk_request *read_ahead_requests;
+    /* iso out jitter buffer, depths are in packets */
+    struct {
+        int depth;       /* packets queued or submitted */
+        int target;      /* depth to (re)start the stream at */
+        int depth_avg;   /* average depth on submit, times ISO_OUT_AVG_WEIGHT */
+        int adjust_wait; /* transfers until the next drift correction */
+        int duplicate;   /* queue the next packet twice */
+        uint64_t underruns;
+        uint64_t overruns;
+        uint64_t dropped;
+        uint64_t duplicated;
+    } iso_out;
+    struct usbredirhost_ep_stats stats;
+};
+
+/* An entry of the quirks table, see usbredirhost_load_quirks */
+struct usbredirhost_quirk {
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t bcd_min;
+    uint16_t bcd_max;
+    int flags;
+    int iso_transfers;
+    int interrupt_transfers;
+    uint8_t read_ahead_ep;
+    int read_ahead_transfer_count;
+    int read_ahead_bytes_per_transfer;
+    int next; /* next entry for the same vid:pid, or -1 */
 };
 
 struct usbredirhost {
@@ -110,6 +167,7 @@ struct usbredirhost {
     void *disconnect_lock;
 
     usbredirparser_log log_func;
+    usbredirparser_log_va log_va_func;
     usbredirparser_read read_func;
     usbredirparser_write write_func;
     usbredirhost_flush_writes flush_writes_func;
@@ -117,21 +175,44 @@ struct usbredirhost {
     void *func_priv;
     int verbose;
     int flags;
+    char *version;
+    int8_t ep_priority[MAX_ENDPOINTS]; /* re-applied to a new parser */
     libusb_context *ctx;
     libusb_device *dev;
     libusb_device_handle *handle;
     struct libusb_device_descriptor desc;
     struct libusb_config_descriptor *config;
     int quirks;
+    int desc_cache_stale; /* DESC_CACHE_STALE_* flags, host lock */
+    /* Per device settings from the quirks table, 0 if not set */
+    int iso_transfers;
+    int interrupt_transfers;
     int restore_config;
     int claimed;
+    /* How long the phases of the last usbredirhost_set_device took */
+    struct {
+        uint32_t descriptors;
+        uint32_t claim;
+        uint32_t reset;
+        uint32_t connect;
+    } attach_us;
     int reset;
     int disconnected;
     int read_status;
     int cancels_pending;
     int wait_disconnect;
     int connect_pending;
+    int no_dev_mem;
+    int iso_out_latency;
+    struct usbredirhost_quirk *quirk_table;
+    int quirk_count;
+    int *quirk_hash; /* quirk_table index of the first entry per vid:pid */
+    int quirk_hash_size;
     struct usbredirhost_ep endpoint[MAX_ENDPOINTS];
+    struct {
+        uint8_t transfer_count;
+        int bytes_per_transfer;
+    } read_ahead[MAX_ENDPOINTS];
     uint8_t alt_setting[MAX_INTERFACES];
     struct usbredirtransfer transfers_head;
     struct usbredirfilter_rule *filter_rules;
@@ -141,17 +222,23 @@ struct usbredirhost {
         uint64_t lower;
         bool dropping;
     } iso_threshold;
+    /* iso out packet slot the parser is reading usb-guest data into */
+    struct {
+        struct usbredirtransfer *transfer;
+        uint8_t *buffer;
+        /* the stream was cancelled while reading, free the transfer (and
+           close the handle its buffer belongs to) once the read is done */
+        int orphaned;
+        libusb_device_handle *handle;
+    } iso_out_dest;
 };
 
-struct usbredirhost_dev_ids {
-    int vendor_id;
-    int product_id;
-};
-
-static const struct usbredirhost_dev_ids usbredirhost_reset_blacklist[] = {
-    { 0x1210, 0x001c },
-    { 0x2798, 0x0001 },
-    { -1, -1 } /* Terminating Entry */
+/* Quirks for devices which do not survive a reset, in quirks file format,
+   see usbredirhost_load_quirks */
+static const char *usbredirhost_builtin_quirks[] = {
+    "1210:001c no-reset",
+    "2798:0001 no-reset",
+    NULL /* Terminating Entry */
 };
 
 static void
@@ -170,8 +257,13 @@ va_log(struct usbredirhost *host, int level, const char *fmt, ...)
         return;
     }
 
-    n = sprintf(buf, "usbredirhost: ");
     va_start(ap, fmt);
+    if (host->log_va_func) {
+        host->log_va_func(host->func_priv, level, "usbredirhost", fmt, ap);
+        va_end(ap);
+        return;
+    }
+    n = sprintf(buf, "usbredirhost: ");
     vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
     va_end(ap);
 
@@ -181,10 +273,17 @@ va_log(struct usbredirhost *host, int level, const char *fmt, ...)
 #ifdef ERROR /* defined on WIN32 */
 #undef ERROR
 #endif
-#define ERROR(...)   va_log(host, usbredirparser_error, __VA_ARGS__)
-#define WARNING(...) va_log(host, usbredirparser_warning, __VA_ARGS__)
-#define INFO(...)    va_log(host, usbredirparser_info, __VA_ARGS__)
-#define DEBUG(...)   va_log(host, usbredirparser_debug, __VA_ARGS__)
+/* Check the level before evaluating the arguments, see usbredirparser.c */
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= host->verbose) \
+            va_log(host, (level), __VA_ARGS__); \
+    } while (0)
+
+#define ERROR(...)   LOG(usbredirparser_error, __VA_ARGS__)
+#define WARNING(...) LOG(usbredirparser_warning, __VA_ARGS__)
+#define INFO(...)    LOG(usbredirparser_info, __VA_ARGS__)
+#define DEBUG(...)   LOG(usbredirparser_debug, __VA_ARGS__)
 
 static void usbredirhost_hello(void *priv, struct usb_redir_hello_header *h);
 static void usbredirhost_reset(void *priv);
@@ -228,6 +327,8 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
 static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
     struct usb_redir_interrupt_packet_header *interrupt_packet,
     uint8_t *data, int data_len);
+static uint8_t *usbredirhost_get_data_buffer(void *priv, int type,
+    uint64_t id, void *type_header, int data_len);
 
 static void LIBUSB_CALL usbredirhost_iso_packet_complete(
     struct libusb_transfer *libusb_transfer);
@@ -237,6 +338,90 @@ static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host,
                                             int notify_guest);
 static void usbredirhost_wait_for_cancel_completion(struct usbredirhost *host);
 static void usbredirhost_clear_device(struct usbredirhost *host);
+static void usbredirhost_free_transfer(struct usbredirtransfer *transfer);
+
+/* Monotonic time in microseconds, for the transfer latency statistics */
+static uint64_t usbredirhost_clock_us(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 /
+           freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Count a transfer or iso packet status in the endpoint statistics */
+static void usbredirhost_count_status(struct usbredirhost_ep_stats *stats,
+    int status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        stats->cancels++;
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        stats->stalls++;
+        break;
+    default:
+        stats->errors++;
+    }
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_transfer_submitted(struct usbredirhost *host,
+    struct usbredirtransfer *transfer, uint8_t ep)
+{
+    transfer->submit_time = usbredirhost_clock_us();
+    host->endpoint[EP2I(ep)].stats.queue_depth++;
+    USBREDIR_PROBE(usbredirhost, transfer_submitted, ep, transfer->id);
+}
+
+/* Called at the start of all completion callbacks, this also counts the
+   completions of failed submissions and of cancelled transfers.
+   Note caller must hold the host lock */
+static void usbredirhost_transfer_done(struct usbredirhost *host,
+    struct usbredirtransfer *transfer, uint8_t ep)
+{
+    struct usbredirhost_ep_stats *stats = &host->endpoint[EP2I(ep)].stats;
+    uint64_t latency;
+
+    /* The stats get reset when the device is cleared */
+    if (stats->queue_depth == 0)
+        return;
+    stats->queue_depth--;
+
+    /* A cancelled transfer may still have completed before the cancel */
+    if (transfer->cancelled) {
+        stats->cancels++;
+        return;
+    }
+    usbredirhost_count_status(stats, transfer->transfer->status);
+
+    latency = usbredirhost_clock_us() - transfer->submit_time;
+    USBREDIR_PROBE(usbredirhost, transfer_done, ep,
+                   transfer->transfer->status, latency);
+    stats->transfers++;
+    stats->latency_total_us += latency;
+    if (latency > stats->latency_max_us)
+        stats->latency_max_us = latency;
+}
+
+static void usbredirhost_count_data(struct usbredirhost *host, uint8_t ep,
+    int packets, int bytes)
+{
+    host->endpoint[EP2I(ep)].stats.packets += packets;
+    host->endpoint[EP2I(ep)].stats.bytes += bytes;
+}
 
 static void usbredirhost_log(void *priv, int level, const char *msg)
 {
@@ -245,6 +430,14 @@ static void usbredirhost_log(void *priv, int level, const char *msg)
     host->log_func(host->func_priv, level, msg);
 }
 
+static void usbredirhost_log_va(void *priv, int level, const char *domain,
+    const char *fmt, va_list args)
+{
+    struct usbredirhost *host = priv;
+
+    host->log_va_func(host->func_priv, level, domain, fmt, args);
+}
+
 static int usbredirhost_read(void *priv, uint8_t *data, int count)
 {
     struct usbredirhost *host = priv;
@@ -489,6 +682,7 @@ static void usbredirhost_parse_config(struct usbredirhost *host)
 /* Called from open/close and parser read callbacks */
 static int usbredirhost_claim(struct usbredirhost *host, int initial_claim)
 {
+    uint64_t start = usbredirhost_clock_us();
     int i, n, r;
 
     if (host->config) {
@@ -538,6 +732,11 @@ static int usbredirhost_claim(struct usbredirhost *host, int initial_claim)
     /* All interfaces begin at alt setting 0 when (re)claimed */
     memset(host->alt_setting, 0, MAX_INTERFACES);
 
+    if (initial_claim) {
+        host->attach_us.descriptors = usbredirhost_clock_us() - start;
+        start = usbredirhost_clock_us();
+    }
+
     host->claimed = 1;
 #if LIBUSBX_API_VERSION >= 0x01000102
     libusb_set_auto_detach_kernel_driver(host->handle, 1);
@@ -566,6 +765,9 @@ static int usbredirhost_claim(struct usbredirhost *host, int initial_claim)
             return libusb_status_or_error_to_redir_status(host, r);
         }
     }
+    if (initial_claim) {
+        host->attach_us.claim = usbredirhost_clock_us() - start;
+    }
 
     usbredirhost_parse_config(host);
     return usb_redir_success;
@@ -658,6 +860,324 @@ struct usbredirhost *usbredirhost_open(
                                   func_priv, version, verbose, flags);
 }
 
+/* Parse a number in the range min - max at *str and advance *str past it,
+   returns -1 on errors */
+static long usbredirhost_parse_quirk_num(const char **str, int base,
+    long min, long max)
+{
+    char *end;
+    long val;
+
+    /* strtol would also accept leading white space and signs */
+    if (!isxdigit((unsigned char)**str))
+        return -1;
+
+    errno = 0;
+    val = strtol(*str, &end, base);
+    if (errno || end == *str || val < min || val > max)
+        return -1;
+
+    *str = end;
+    return val;
+}
+
+static bool usbredirhost_quirk_name_is(const char *name, size_t len,
+    const char *quirk)
+{
+    return len == strlen(quirk) && !strncmp(name, quirk, len);
+}
+
+/* Parse a line of a quirks file into q, returns 1 for an entry, 0 for an
+   empty or comment line and -1 on errors, which get logged */
+static int usbredirhost_parse_quirk(struct usbredirhost *host,
+    const char *line, const char *source, int line_no,
+    struct usbredirhost_quirk *q)
+{
+    const char *separators = " \t\r\n";
+    const char *pos = line, *name = NULL;
+    bool has_value;
+    size_t len = 0;
+    long v;
+
+    memset(q, 0, sizeof(*q));
+    q->bcd_max = 0xffff;
+    q->next = -1;
+
+    pos += strspn(pos, separators);
+    if (*pos == '\0' || *pos == '#')
+        return 0;
+
+    /* <vendor>:<product>[:<bcdDevice>[-<bcdDevice>]] */
+    if ((v = usbredirhost_parse_quirk_num(&pos, 16, 0, 0xffff)) < 0 ||
+            *pos++ != ':')
+        goto bad_ids;
+    q->vendor_id = v;
+    if ((v = usbredirhost_parse_quirk_num(&pos, 16, 0, 0xffff)) < 0)
+        goto bad_ids;
+    q->product_id = v;
+    if (*pos == ':') {
+        pos++;
+        if ((v = usbredirhost_parse_quirk_num(&pos, 16, 0, 0xffff)) < 0)
+            goto bad_ids;
+        q->bcd_min = q->bcd_max = v;
+        if (*pos == '-') {
+            pos++;
+            if ((v = usbredirhost_parse_quirk_num(&pos, 16, q->bcd_min,
+                                                  0xffff)) < 0)
+                goto bad_ids;
+            q->bcd_max = v;
+        }
+    }
+    if (*pos && !strchr(separators, *pos) && *pos != '#')
+        goto bad_ids;
+
+    for (;;) {
+        pos += strspn(pos, separators);
+        if (*pos == '\0' || *pos == '#')
+            break;
+
+        name = pos;
+        len = strcspn(pos, "= \t\r\n#");
+        pos += len;
+        has_value = (*pos == '=');
+        if (has_value)
+            pos++;
+
+        if (usbredirhost_quirk_name_is(name, len, "no-reset")) {
+            if (has_value)
+                goto bad_value;
+            q->flags |= QUIRK_DO_NOT_RESET;
+        } else if (usbredirhost_quirk_name_is(name, len,
+                                              "no-descriptor-cache")) {
+            if (has_value)
+                goto bad_value;
+            q->flags |= QUIRK_NO_DESC_CACHE;
+        } else if (usbredirhost_quirk_name_is(name, len, "iso-transfers")) {
+            if (!has_value || (v = usbredirhost_parse_quirk_num(&pos, 10, 1,
+                                            MAX_TRANSFER_COUNT)) < 0)
+                goto bad_value;
+            q->iso_transfers = v;
+        } else if (usbredirhost_quirk_name_is(name, len,
+                                              "interrupt-transfers")) {
+            if (!has_value || (v = usbredirhost_parse_quirk_num(&pos, 10, 1,
+                                            MAX_TRANSFER_COUNT)) < 0)
+                goto bad_value;
+            q->interrupt_transfers = v;
+        } else if (usbredirhost_quirk_name_is(name, len, "bulk-read-ahead")) {
+            /* <ep>:<transfer_count>:<bytes_per_transfer> */
+            if (!has_value ||
+                    (v = usbredirhost_parse_quirk_num(&pos, 16, 0x81,
+                                                      0x8f)) < 0)
+                goto bad_value;
+            q->read_ahead_ep = v;
+            if (*pos++ != ':' ||
+                    (v = usbredirhost_parse_quirk_num(&pos, 10, 1,
+                                            MAX_TRANSFER_COUNT)) < 0)
+                goto bad_value;
+            q->read_ahead_transfer_count = v;
+            if (*pos++ != ':' ||
+                    (v = usbredirhost_parse_quirk_num(&pos, 10, 1,
+                                            MAX_BULK_TRANSFER_SIZE)) < 0)
+                goto bad_value;
+            q->read_ahead_bytes_per_transfer = v;
+        } else {
+            ERROR("%s:%d: unknown quirk '%.*s'", source, line_no, (int)len,
+                  name);
+            return -1;
+        }
+        if (*pos && !strchr(separators, *pos) && *pos != '#')
+            goto bad_value;
+    }
+    return 1;
+
+bad_ids:
+    ERROR("%s:%d: invalid device, expected "
+          "<vendor>:<product>[:<bcdDevice>[-<bcdDevice>]]", source, line_no);
+    return -1;
+bad_value:
+    ERROR("%s:%d: invalid value for quirk '%.*s'", source, line_no, (int)len,
+          name);
+    return -1;
+}
+
+/* Slot of the quirks hash for vid:pid, this is either empty or holds the
+   first quirks table entry for vid:pid */
+static int usbredirhost_quirk_slot(struct usbredirhost *host, uint16_t vid,
+    uint16_t pid)
+{
+    uint32_t h, mask = host->quirk_hash_size - 1;
+    int idx;
+
+    h = ((uint32_t)vid << 16 | pid) * 2654435761u;
+    for (h = (h ^ (h >> 16)) & mask; ; h = (h + 1) & mask) {
+        idx = host->quirk_hash[h];
+        if (idx == -1 || (host->quirk_table[idx].vendor_id == vid &&
+                          host->quirk_table[idx].product_id == pid))
+            return h;
+    }
+}
+
+/* Index of the first quirks table entry for vid:pid, or -1 */
+static int usbredirhost_find_quirk(struct usbredirhost *host, uint16_t vid,
+    uint16_t pid)
+{
+    if (!host->quirk_hash)
+        return -1;
+    return host->quirk_hash[usbredirhost_quirk_slot(host, vid, pid)];
+}
+
+/* (Re)build the vid:pid hash of the quirks table, entries for the same
+   vid:pid get chained in table order. Returns -1 when out of memory, leaving
+   the old hash in place */
+static int usbredirhost_hash_quirks(struct usbredirhost *host)
+{
+    struct usbredirhost_quirk *q;
+    int i, j, slot, *hash, size = 16;
+
+    while (size < 2 * host->quirk_count)
+        size *= 2;
+
+    hash = malloc(size * sizeof(*hash));
+    if (!hash) {
+        ERROR("out of memory allocating quirks hash");
+        return -1;
+    }
+    for (i = 0; i < size; i++)
+        hash[i] = -1;
+    free(host->quirk_hash);
+    host->quirk_hash = hash;
+    host->quirk_hash_size = size;
+
+    for (i = 0; i < host->quirk_count; i++) {
+        q = &host->quirk_table[i];
+        q->next = -1;
+        slot = usbredirhost_quirk_slot(host, q->vendor_id, q->product_id);
+        j = hash[slot];
+        if (j == -1) {
+            hash[slot] = i;
+            continue;
+        }
+        while (host->quirk_table[j].next != -1)
+            j = host->quirk_table[j].next;
+        host->quirk_table[j].next = i;
+    }
+    return 0;
+}
+
+static int usbredirhost_add_quirk(struct usbredirhost *host,
+    const struct usbredirhost_quirk *q)
+{
+    struct usbredirhost_quirk *table;
+
+    table = realloc(host->quirk_table,
+                    (host->quirk_count + 1) * sizeof(*table));
+    if (!table) {
+        ERROR("out of memory allocating quirks table");
+        return -1;
+    }
+    table[host->quirk_count++] = *q;
+    host->quirk_table = table;
+    return 0;
+}
+
+static int usbredirhost_add_builtin_quirks(struct usbredirhost *host)
+{
+    struct usbredirhost_quirk q;
+    int i;
+
+    for (i = 0; usbredirhost_builtin_quirks[i]; i++) {
+        if (usbredirhost_parse_quirk(host, usbredirhost_builtin_quirks[i],
+                                     "built-in", i + 1, &q) == 1 &&
+                usbredirhost_add_quirk(host, &q))
+            return -1;
+    }
+    return usbredirhost_hash_quirks(host);
+}
+
+/* Apply the quirks table entries matching the current device, entries
+   later in the table override the settings of earlier ones */
+/* Check that read-ahead with transfers of bytes_per_transfer bytes can be
+   used on endpoint ep, as it is in the current configuration and alt
+   setting. Interrupt endpoints are excluded, as their data must always be
+   passed on to the usb-guest as is */
+static int usbredirhost_read_ahead_fits(struct usbredirhost *host, uint8_t ep,
+    int bytes_per_transfer)
+{
+    int maxp = host->endpoint[EP2I(ep)].max_packetsize;
+
+    return (ep & LIBUSB_ENDPOINT_IN) &&
+           host->endpoint[EP2I(ep)].type == usb_redir_type_bulk &&
+           maxp > 0 && bytes_per_transfer > 0 &&
+           (unsigned int)bytes_per_transfer <= MAX_BULK_TRANSFER_SIZE &&
+           bytes_per_transfer % maxp == 0;
+}
+
+static void usbredirhost_apply_quirks(struct usbredirhost *host)
+{
+    const struct usbredirhost_quirk *q;
+    uint16_t bcd = host->desc.bcdDevice;
+    int i;
+
+    i = usbredirhost_find_quirk(host, host->desc.idVendor,
+                                host->desc.idProduct);
+    for (; i != -1; i = q->next) {
+        q = &host->quirk_table[i];
+        if (bcd < q->bcd_min || bcd > q->bcd_max)
+            continue;
+
+        host->quirks |= q->flags;
+        if (q->iso_transfers)
+            host->iso_transfers = q->iso_transfers;
+        if (q->interrupt_transfers)
+            host->interrupt_transfers = q->interrupt_transfers;
+        if (q->read_ahead_ep && !usbredirhost_read_ahead_fits(host,
+                        q->read_ahead_ep, q->read_ahead_bytes_per_transfer)) {
+            WARNING("quirks entry %d: ignoring bulk-read-ahead for ep %02X, "
+                    "not a bulk endpoint or bad transfer size", i,
+                    q->read_ahead_ep);
+        } else if (q->read_ahead_ep) {
+            host->read_ahead[EP2I(q->read_ahead_ep)].transfer_count =
+                q->read_ahead_transfer_count;
+            host->read_ahead[EP2I(q->read_ahead_ep)].bytes_per_transfer =
+                q->read_ahead_bytes_per_transfer;
+        }
+        DEBUG("applied quirks entry %d to %04x:%04x", i,
+              host->desc.idVendor, host->desc.idProduct);
+    }
+}
+
+/* Queue the hello for a new usb-guest on host->parser */
+static void usbredirhost_init_parser(struct usbredirhost *host)
+{
+    int i, parser_flags = usbredirparser_fl_usb_host;
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        if (host->ep_priority[i] != usbredirparser_prio_default)
+            usbredirparser_set_ep_priority(host->parser, I2EP(i),
+                                           host->ep_priority[i]);
+    }
+
+    if (host->flags & usbredirhost_fl_write_cb_owns_buffer) {
+        parser_flags |= usbredirparser_fl_write_cb_owns_buffer;
+    }
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
+#if LIBUSBX_API_VERSION >= 0x01000103
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_streams);
+#endif
+
+    usbredirparser_set_verbose(host->parser, host->verbose);
+    usbredirparser_init(host->parser, host->version, caps,
+                        USB_REDIR_CAPS_SIZE, parser_flags);
+}
+
 USBREDIR_VISIBLE
 struct usbredirhost *usbredirhost_open_full(
     libusb_context *usb_ctx,
@@ -673,8 +1193,6 @@ struct usbredirhost *usbredirhost_open_full(
     void *func_priv, const char *version, int verbose, int flags)
 {
     struct usbredirhost *host;
-    int parser_flags = usbredirparser_fl_usb_host;
-    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
 
     host = calloc(1, sizeof(*host));
     if (!host) {
@@ -693,6 +1211,8 @@ struct usbredirhost *usbredirhost_open_full(
     host->verbose = verbose;
     host->disconnected = 1; /* No device is connected initially */
     host->flags = flags;
+    memset(host->ep_priority, usbredirparser_prio_default,
+           sizeof(host->ep_priority));
     host->parser = usbredirparser_create();
     if (!host->parser) {
         log_func(func_priv, usbredirparser_error,
@@ -732,6 +1252,7 @@ struct usbredirhost *usbredirhost_open_full(
     host->parser->bulk_packet_func = usbredirhost_bulk_packet;
     host->parser->iso_packet_func = usbredirhost_iso_packet;
     host->parser->interrupt_packet_func = usbredirhost_interrupt_packet;
+    host->parser->get_data_buffer_func = usbredirhost_get_data_buffer;
     host->parser->alloc_lock_func = alloc_lock_func;
     host->parser->lock_func = lock_func;
     host->parser->unlock_func = unlock_func;
@@ -742,23 +1263,22 @@ struct usbredirhost *usbredirhost_open_full(
         host->disconnect_lock = host->parser->alloc_lock_func();
     }
 
-    if (flags & usbredirhost_fl_write_cb_owns_buffer) {
-        parser_flags |= usbredirparser_fl_write_cb_owns_buffer;
+    host->version = strdup(version);
+    if (!host->version) {
+        log_func(func_priv, usbredirparser_error,
+            "usbredirhost error: Out of memory allocating usbredirhost");
+        libusb_close(usb_dev_handle);
+        usbredirhost_close(host);
+        return NULL;
     }
 
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
-#if LIBUSBX_API_VERSION >= 0x01000103
-    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_streams);
-#endif
+    if (usbredirhost_add_builtin_quirks(host)) {
+        libusb_close(usb_dev_handle);
+        usbredirhost_close(host);
+        return NULL;
+    }
 
-    usbredirparser_init(host->parser, version, caps, USB_REDIR_CAPS_SIZE,
-                        parser_flags);
+    usbredirhost_init_parser(host);
 
 #if LIBUSB_API_VERSION >= 0x01000106
     int ret = libusb_set_option(host->ctx, LIBUSB_OPTION_LOG_LEVEL,
@@ -796,10 +1316,104 @@ void usbredirhost_close(struct usbredirhost *host)
     if (host->parser) {
         usbredirparser_destroy(host->parser);
     }
+    if (host->iso_out_dest.orphaned) {
+        usbredirhost_free_transfer(host->iso_out_dest.transfer);
+    }
+    if (host->iso_out_dest.handle) {
+        libusb_close(host->iso_out_dest.handle);
+    }
     free(host->filter_rules);
+    free(host->version);
+    free(host->quirk_table);
+    free(host->quirk_hash);
     free(host);
 }
 
+/* Called with the host lock held when a new usb-guest takes over. A
+   configuration or alt setting change by the previous usb-guest only keeps
+   the descriptor cache disabled if the device did end up in another
+   configuration than the one we have read, changed descriptors stay
+   changed until the device is disconnected. */
+static void usbredirhost_recheck_desc_cache(struct usbredirhost *host)
+{
+    struct libusb_config_descriptor *config = NULL;
+    int r, same;
+
+    if (host->desc_cache_stale != DESC_CACHE_STALE_CONFIG || !host->dev) {
+        return;
+    }
+
+    r = libusb_get_active_config_descriptor(host->dev, &config);
+    if (r == 0) {
+        same = host->config && config->bConfigurationValue ==
+                               host->config->bConfigurationValue;
+        libusb_free_config_descriptor(config);
+    } else {
+        same = r == LIBUSB_ERROR_NOT_FOUND && !host->config;
+    }
+
+    if (same) {
+        DEBUG("configuration unchanged, re-enabling descriptor cache");
+        host->desc_cache_stale = 0;
+    }
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_reconnect_guest(struct usbredirhost *host)
+{
+    struct usbredirparser *parser;
+
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return usb_redir_inval;
+    }
+
+    parser = usbredirparser_create();
+    if (!parser) {
+        ERROR("out of memory allocating usbredirparser");
+        return usb_redir_ioerror;
+    }
+    /* Same callbacks, fresh protocol state */
+    *parser = *host->parser;
+
+    /* Stop whatever the previous usb-guest had going on, but leave the
+       device claimed and configured */
+    if (usbredirhost_cancel_pending_urbs(host, 0))
+        usbredirhost_wait_for_cancel_completion(host);
+
+    LOCK(host);
+    usbredirparser_destroy(host->parser);
+    host->parser = parser;
+
+    /* The old parser will never finish reading into an orphaned buffer */
+    if (host->iso_out_dest.orphaned) {
+        usbredirhost_free_transfer(host->iso_out_dest.transfer);
+    }
+    if (host->iso_out_dest.handle) {
+        libusb_close(host->iso_out_dest.handle);
+    }
+    memset(&host->iso_out_dest, 0, sizeof(host->iso_out_dest));
+
+    free(host->filter_rules);
+    host->filter_rules = NULL;
+    host->filter_rules_count = 0;
+    host->read_status = 0;
+    host->wait_disconnect = 0;
+    host->connect_pending = 0;
+    host->disconnected = 1;
+    usbredirhost_recheck_desc_cache(host);
+    UNLOCK(host);
+
+    usbredirhost_init_parser(host);
+    if (host->dev) {
+        /* Sent once the new usb-guest's hello arrives */
+        usbredirhost_send_device_connect(host);
+    }
+    FLUSH(host);
+
+    return usb_redir_success;
+}
+
 static int usbredirhost_reset_device(struct usbredirhost *host)
 {
     int r;
@@ -823,13 +1437,16 @@ USBREDIR_VISIBLE
 int usbredirhost_set_device(struct usbredirhost *host,
                              libusb_device_handle *usb_dev_handle)
 {
-    int i, r, status;
+    uint64_t start;
+    int r, status;
 
     usbredirhost_clear_device(host);
 
     if (!usb_dev_handle)
         return usb_redir_success;
 
+    memset(&host->attach_us, 0, sizeof(host->attach_us));
+
     host->dev = libusb_get_device(usb_dev_handle);
     host->handle = usb_dev_handle;
 
@@ -839,29 +1456,35 @@ int usbredirhost_set_device(struct usbredirhost *host,
         return status;
     }
 
-    for (i = 0; usbredirhost_reset_blacklist[i].vendor_id != -1; i++) {
-        if (host->desc.idVendor == usbredirhost_reset_blacklist[i].vendor_id &&
-            host->desc.idProduct ==
-                                usbredirhost_reset_blacklist[i].product_id) {
-            host->quirks |= QUIRK_DO_NOT_RESET;
-            break;
-        }
-    }
+    usbredirhost_apply_quirks(host);
 
     /* The first thing almost any usb-guest does is a (slow) device-reset
        so lets do that before hand */
+    start = usbredirhost_clock_us();
     r = usbredirhost_reset_device(host);
     if (r != 0) {
         return libusb_status_or_error_to_redir_status(host, r);
     }
+    host->attach_us.reset = usbredirhost_clock_us() - start;
 
+    start = usbredirhost_clock_us();
     usbredirhost_send_device_connect(host);
+    host->attach_us.connect = usbredirhost_clock_us() - start;
+
+    INFO("attached %04x:%04x with %d interfaces: descriptors %u us, "
+         "claim %u us, reset %u us, connect %u us",
+         host->desc.idVendor, host->desc.idProduct,
+         host->config ? host->config->bNumInterfaces : 0,
+         host->attach_us.descriptors, host->attach_us.claim,
+         host->attach_us.reset, host->attach_us.connect);
 
     return usb_redir_success;
 }
 
 static void usbredirhost_clear_device(struct usbredirhost *host)
 {
+    int i;
+
     if (!host->dev)
         return;
 
@@ -875,12 +1498,24 @@ static void usbredirhost_clear_device(struct usbredirhost *host)
         host->config = NULL;
     }
     if (host->handle) {
-        libusb_close(host->handle);
+        /* The parser may still be reading into an orphaned stream buffer */
+        if (host->iso_out_dest.orphaned)
+            host->iso_out_dest.handle = host->handle;
+        else
+            libusb_close(host->handle);
         host->handle = NULL;
     }
 
     host->connect_pending = 0;
+    host->no_dev_mem = 0;
     host->quirks = 0;
+    host->desc_cache_stale = 0;
+    host->iso_transfers = 0;
+    host->interrupt_transfers = 0;
+    memset(host->read_ahead, 0, sizeof(host->read_ahead));
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        memset(&host->endpoint[i].stats, 0, sizeof(host->endpoint[i].stats));
+    }
     host->dev = NULL;
 
     usbredirhost_handle_disconnect(host);
@@ -911,6 +1546,27 @@ void usbredirhost_free_write_buffer(struct usbredirhost *host, uint8_t *data)
     usbredirparser_free_write_buffer(host->parser, data);
 }
 
+USBREDIR_VISIBLE
+int usbredirhost_start_trace(struct usbredirhost *host,
+    usbredirparser_trace_write trace_write_func, void *trace_priv,
+    size_t buffer_size, int flags)
+{
+    return usbredirparser_start_trace(host->parser, trace_write_func,
+                                      trace_priv, buffer_size, flags);
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_trace_flush(struct usbredirhost *host)
+{
+    return usbredirparser_trace_flush(host->parser);
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_stop_trace(struct usbredirhost *host)
+{
+    usbredirparser_stop_trace(host->parser);
+}
+
 /**************************************************************************/
 
 static struct usbredirtransfer *usbredirhost_alloc_transfer(
@@ -939,6 +1595,13 @@ static void usbredirhost_free_transfer(struct usbredirtransfer *transfer)
     if (!transfer)
         return;
 
+#if LIBUSB_API_VERSION >= 0x01000105
+    if (transfer->dev_mem) {
+        libusb_dev_mem_free(transfer->transfer->dev_handle,
+                            transfer->transfer->buffer,
+                            transfer->transfer->length);
+    } else
+#endif
     /* In certain cases this should really be a usbredirparser_free_packet_data
        but since we use the same malloc impl. as usbredirparser this is ok. */
     free(transfer->transfer->buffer);
@@ -946,8 +1609,32 @@ static void usbredirhost_free_transfer(struct usbredirtransfer *transfer)
     free(transfer);
 }
 
+/* Stream buffers are long lived and get resubmitted over and over, so we try
+   to get them from device memory, which saves the kernel copying the data
+   around on every completion. Not all platforms / kernels support this, so
+   we fall back to malloc, and stop trying after the first failure. */
+static unsigned char *usbredirhost_alloc_stream_buffer(
+    struct usbredirhost *host, struct usbredirtransfer *transfer, int size)
+{
+#if LIBUSB_API_VERSION >= 0x01000105
+    unsigned char *buffer;
+
+    if (!host->no_dev_mem) {
+        buffer = libusb_dev_mem_alloc(host->handle, size);
+        if (buffer) {
+            transfer->dev_mem = 1;
+            return buffer;
+        }
+        DEBUG("device memory not available, using malloc for stream buffers");
+        host->no_dev_mem = 1;
+    }
+#endif
+    transfer->dev_mem = 0;
+    return malloc(size);
+}
+
 static void usbredirhost_add_transfer(struct usbredirhost *host,
-    struct usbredirtransfer *new_transfer)
+    struct usbredirtransfer *new_transfer, uint8_t ep)
 {
     struct usbredirtransfer *transfer = &host->transfers_head;
 
@@ -958,6 +1645,9 @@ static void usbredirhost_add_transfer(struct usbredirhost *host,
 
     new_transfer->prev = transfer;
     transfer->next = new_transfer;
+    /* Our caller submits the transfer next, a failed submission still ends
+       in the completion callback */
+    usbredirhost_transfer_submitted(host, new_transfer, ep);
     UNLOCK(host);
 }
 
@@ -974,6 +1664,45 @@ static void usbredirhost_remove_and_free_transfer(
 
 /**************************************************************************/
 
+/* Bulk-in read-ahead keeps a buffered bulk stream running on the endpoint
+   and answers the usb-guest's bulk-in packets from the received data. This is
+   only used for usb-guests which cannot do buffered bulk receiving themselves,
+   as for those the usb-guest controls the stream. */
+static int usbredirhost_is_read_ahead(struct usbredirhost *host, uint8_t ep)
+{
+    return (ep & LIBUSB_ENDPOINT_IN) &&
+           host->endpoint[EP2I(ep)].type == usb_redir_type_bulk &&
+           host->read_ahead[EP2I(ep)].transfer_count &&
+           !usbredirparser_peer_has_cap(host->parser,
+                                        usb_redir_cap_bulk_receiving);
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_send_read_ahead_data(struct usbredirhost *host,
+    struct usbredirhost_bulk_request *request, uint8_t status,
+    uint8_t *data, int len)
+{
+    request->bulk_packet.status = status;
+    request->bulk_packet.length = len;
+    request->bulk_packet.length_high = len >> 16;
+    usbredirhost_count_data(host, request->bulk_packet.endpoint, 1, len);
+    usbredirparser_send_bulk_packet(host->parser, request->id,
+                                    &request->bulk_packet, data, len);
+    free(request);
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_flush_read_ahead_requests(struct usbredirhost *host,
+    uint8_t ep, uint8_t status)
+{
+    struct usbredirhost_bulk_request *request;
+
+    while ((request = host->endpoint[EP2I(ep)].read_ahead_requests)) {
+        host->endpoint[EP2I(ep)].read_ahead_requests = request->next;
+        usbredirhost_send_read_ahead_data(host, request, status, NULL, 0);
+    }
+}
+
 /* Called from both parser read and packet complete callbacks */
 static void usbredirhost_cancel_stream_unlocked(struct usbredirhost *host,
     uint8_t ep)
@@ -981,12 +1710,19 @@ static void usbredirhost_cancel_stream_unlocked(struct usbredirhost *host,
     int i;
     struct usbredirtransfer *transfer;
 
+    if (usbredirhost_is_read_ahead(host, ep)) {
+        usbredirhost_flush_read_ahead_requests(host, ep, usb_redir_cancelled);
+    }
+
     for (i = 0; i < host->endpoint[EP2I(ep)].transfer_count; i++) {
         transfer = host->endpoint[EP2I(ep)].transfer[i];
         if (transfer->packet_idx == SUBMITTED_IDX) {
             libusb_cancel_transfer(transfer->transfer);
             transfer->cancelled = 1;
             host->cancels_pending++;
+        } else if (transfer == host->iso_out_dest.transfer) {
+            /* Freed by usbredirhost_iso_packet once the parser is done */
+            host->iso_out_dest.orphaned = 1;
         } else {
             usbredirhost_free_transfer(transfer);
         }
@@ -1024,6 +1760,9 @@ static void usbredirhost_send_stream_status(struct usbredirhost *host,
             .endpoint = ep,
             .status   = status,
         };
+        /* The usb-guest does not know about read-ahead streams */
+        if (usbredirhost_is_read_ahead(host, ep))
+            break;
         usbredirparser_send_bulk_receiving_status(host->parser, id,
                                                   &bulk_status);
         break;
@@ -1071,8 +1810,8 @@ static int usbredirhost_can_write_iso_package(struct usbredirhost *host)
     return !host->iso_threshold.dropping;
 }
 
-static void usbredirhost_send_stream_data(struct usbredirhost *host,
-    uint64_t id, uint8_t ep, uint8_t status, uint8_t *data, int len)
+static int usbredirhost_stream_too_slow(struct usbredirhost *host,
+    uint8_t ep)
 {
     /* USB-2 is max 8000 packets / sec, if we've queued up more then 0.1 sec,
        assume our connection is not keeping up and start dropping packets. */
@@ -1082,8 +1821,18 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
                     "dropping packets", ep);
             host->endpoint[EP2I(ep)].warn_on_drop = 0;
         }
+        return true;
+    }
+    return false;
+}
+
+static void usbredirhost_send_stream_data(struct usbredirhost *host,
+    uint64_t id, uint8_t ep, uint8_t status, uint8_t *data, int len)
+{
+    if (usbredirhost_stream_too_slow(host, ep)) {
         DEBUG("buffered complete ep %02X dropping packet status %d len %d",
               ep, status, len);
+        host->endpoint[EP2I(ep)].stats.dropped++;
         return;
     }
 
@@ -1097,9 +1846,13 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
             .length   = len,
         };
 
-        if (usbredirhost_can_write_iso_package(host))
-            usbredirparser_send_iso_packet(host->parser, id, &iso_packet,
-                                           data, len);
+        if (!usbredirhost_can_write_iso_package(host)) {
+            host->endpoint[EP2I(ep)].stats.dropped++;
+            break;
+        }
+        usbredirhost_count_data(host, ep, 1, len);
+        usbredirparser_send_iso_packet(host->parser, id, &iso_packet,
+                                       data, len);
         break;
     }
     case usb_redir_type_bulk: {
@@ -1108,6 +1861,7 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
             .status   = status,
             .length   = len,
         };
+        usbredirhost_count_data(host, ep, 1, len);
         usbredirparser_send_buffered_bulk_packet(host->parser, id,
                                                  &bulk_packet, data, len);
         break;
@@ -1118,6 +1872,7 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
             .status   = status,
             .length   = len,
         };
+        usbredirhost_count_data(host, ep, 1, len);
         usbredirparser_send_interrupt_packet(host->parser, id,
                                              &interrupt_packet, data, len);
         break;
@@ -1125,6 +1880,34 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
     }
 }
 
+/* Send the packets of (part of) a completed iso in transfer to the usb-guest
+   in one go, so that they share a single parser write buffer */
+static void usbredirhost_send_iso_in_packets(struct usbredirhost *host,
+    uint64_t id, uint8_t ep, struct usb_redir_iso_packet_header *iso_packets,
+    uint8_t **data, int count)
+{
+    int i, len = 0;
+
+    if (count == 0)
+        return;
+
+    if (usbredirhost_stream_too_slow(host, ep) ||
+            !usbredirhost_can_write_iso_package(host)) {
+        DEBUG("iso-in complete ep %02X dropping %d packets", ep, count);
+        host->endpoint[EP2I(ep)].stats.dropped += count;
+        return;
+    }
+
+    DEBUG("iso-in complete ep %02X packets %d id %"PRIu64, ep, count, id);
+
+    for (i = 0; i < count; i++) {
+        len += iso_packets[i].length;
+    }
+    usbredirhost_count_data(host, ep, count, len);
+    usbredirparser_send_iso_packets(host->parser, id, iso_packets, data,
+                                    count);
+}
+
 /* Called from both parser read and packet complete callbacks */
 static int usbredirhost_submit_stream_transfer_unlocked(
     struct usbredirhost *host, struct usbredirtransfer *transfer)
@@ -1149,6 +1932,8 @@ static int usbredirhost_submit_stream_transfer_unlocked(
     }
 
     transfer->packet_idx = SUBMITTED_IDX;
+    usbredirhost_transfer_submitted(host, transfer,
+                                    transfer->transfer->endpoint);
     return usb_redir_success;
 }
 
@@ -1156,28 +1941,140 @@ static int usbredirhost_submit_stream_transfer_unlocked(
 static int usbredirhost_start_stream_unlocked(struct usbredirhost *host,
     uint8_t ep)
 {
-    unsigned int i, count = host->endpoint[EP2I(ep)].transfer_count;
+    struct usbredirhost_ep *endpoint = &host->endpoint[EP2I(ep)];
+    unsigned int i = 0, first = 0, count = endpoint->transfer_count;
     int status;
 
-    /* For out endpoints 1/2 the transfers are a buffer for usb-guest data */
+    /* For out endpoints submit the transfers filled with usb-guest data so
+       far, ending at out_idx, the others are a buffer for usb-guest data */
     if (!(ep & LIBUSB_ENDPOINT_IN)) {
-        count /= 2;
+        count = endpoint->iso_out.depth / endpoint->pkts_per_transfer;
+        first = (endpoint->out_idx + endpoint->transfer_count - count) %
+                endpoint->transfer_count;
+        endpoint->iso_out.depth_avg = ISO_OUT_AVG_WEIGHT *
+            (endpoint->iso_out.target + endpoint->pkts_per_transfer / 2);
+        endpoint->iso_out.adjust_wait = ISO_OUT_ADJUST_INTERVAL;
     }
-    for (i = 0; i < count; i++) {
-        if (ep & LIBUSB_ENDPOINT_IN) {
+    if (ep & LIBUSB_ENDPOINT_IN) {
+        for (i = 0; i < count; i++) {
             host->endpoint[EP2I(ep)].transfer[i]->id =
                 i * host->endpoint[EP2I(ep)].pkts_per_transfer;
         }
+    }
+#ifdef LIBUSB_HAS_SUBMIT_TRANSFERS
+    /* Submit the whole stream in one go, so that libusb only needs to take
+       its locks and re-arm its timeout once. If this stops short, fall
+       through to submitting the rest one by one, which reports the error. */
+    {
+        struct libusb_transfer *transfers[MAX_TRANSFER_COUNT];
+        int r;
+
+        host->reset = 0;
+        for (i = 0; i < count; i++) {
+            transfers[i] = endpoint->transfer[
+                               (first + i) % endpoint->transfer_count]->transfer;
+        }
+        r = libusb_submit_transfers(transfers, count);
+        for (i = 0; r > 0 && i < (unsigned int)r; i++) {
+            struct usbredirtransfer *transfer =
+                endpoint->transfer[(first + i) % endpoint->transfer_count];
+
+            transfer->packet_idx = SUBMITTED_IDX;
+            usbredirhost_transfer_submitted(host, transfer, ep);
+        }
+    }
+#else
+    i = 0;
+#endif
+    for (; i < count; i++) {
         status = usbredirhost_submit_stream_transfer_unlocked(host,
-                               host->endpoint[EP2I(ep)].transfer[i]);
+                     endpoint->transfer[(first + i) % endpoint->transfer_count]);
         if (status != usb_redir_success) {
             return status;
         }
     }
-    host->endpoint[EP2I(ep)].stream_started = 1;
+    endpoint->stream_started = 1;
     return usb_redir_success;
 }
 
+/* Size the jitter buffer of a newly allocated iso out stream and reset its
+   stats. Note caller must hold the host lock */
+static void usbredirhost_reset_iso_out(struct usbredirhost *host, uint8_t ep)
+{
+    struct usbredirhost_ep *endpoint = &host->endpoint[EP2I(ep)];
+    int transfers = endpoint->transfer_count / 2, interval_us;
+
+    if (host->iso_out_latency) {
+        /* Iso packets go out every 2^(bInterval - 1) (micro)frames */
+        interval_us = (libusb_get_device_speed(host->dev) >= LIBUSB_SPEED_HIGH)
+                      ? 125 : 1000;
+        interval_us <<= CLAMP(endpoint->interval, 1, 16) - 1;
+        transfers = (host->iso_out_latency / interval_us +
+                     endpoint->pkts_per_transfer / 2) /
+                    endpoint->pkts_per_transfer;
+    }
+    /* Keep at least one transfer free for filling with usb-guest data */
+    transfers = CLAMP(transfers, 1, endpoint->transfer_count > 1 ?
+                                    endpoint->transfer_count - 1 : 1);
+
+    memset(&endpoint->iso_out, 0, sizeof(endpoint->iso_out));
+    endpoint->iso_out.target = transfers * endpoint->pkts_per_transfer;
+}
+
+/* Called when the usb-guest has filled transfer of iso out endpoint ep.
+   Note caller must hold the host lock */
+static void usbredirhost_iso_out_transfer_filled(struct usbredirhost *host,
+    uint8_t ep, struct usbredirtransfer *transfer)
+{
+    struct usbredirhost_ep *endpoint = &host->endpoint[EP2I(ep)];
+    int nominal, error;
+
+    if (!endpoint->stream_started) {
+        /* (Re)start the stream once the buffer is filled up to its target */
+        if (endpoint->iso_out.depth >= endpoint->iso_out.target) {
+            DEBUG("iso-out starting stream on ep %02X", ep);
+            usbredirhost_start_stream_unlocked(host, ep);
+        }
+        return;
+    }
+
+    if (usbredirhost_submit_stream_transfer_unlocked(host, transfer) !=
+            usb_redir_success) {
+        return;
+    }
+
+    /* The usb-guest's and the device's clocks drift apart, slowly filling or
+       draining the buffer. Compensate by dropping or duplicating a single
+       packet when the average depth is more than a transfer off, and give
+       each correction some time to take effect. */
+    endpoint->iso_out.depth_avg += endpoint->iso_out.depth -
+        endpoint->iso_out.depth_avg / ISO_OUT_AVG_WEIGHT;
+    if (endpoint->iso_out.adjust_wait) {
+        endpoint->iso_out.adjust_wait--;
+        return;
+    }
+
+    /* Right after submitting the depth ranges from target to one transfer
+       more, depending on the phase of the usb-guest and the device */
+    nominal = endpoint->iso_out.target + endpoint->pkts_per_transfer / 2;
+    error = endpoint->iso_out.depth_avg / ISO_OUT_AVG_WEIGHT - nominal;
+    if (error > endpoint->pkts_per_transfer) {
+        DEBUG("iso-out buffer on ep %02X above target, dropping a packet", ep);
+        endpoint->drop_packets = 1;
+        endpoint->iso_out.dropped++;
+        endpoint->iso_out.depth_avg -= ISO_OUT_AVG_WEIGHT;
+    } else if (error < -endpoint->pkts_per_transfer) {
+        DEBUG("iso-out buffer on ep %02X below target, repeating a packet",
+              ep);
+        endpoint->iso_out.duplicate = 1;
+        endpoint->iso_out.duplicated++;
+        endpoint->iso_out.depth_avg += ISO_OUT_AVG_WEIGHT;
+    } else {
+        return;
+    }
+    endpoint->iso_out.adjust_wait = ISO_OUT_ADJUST_INTERVAL;
+}
+
 static void usbredirhost_stop_stream(struct usbredirhost *host,
     uint64_t id, uint8_t ep)
 {
@@ -1245,7 +2142,8 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
         }
 
         buf_size = pkt_size * pkts_per_transfer;
-        buffer = malloc(buf_size);
+        buffer = usbredirhost_alloc_stream_buffer(host,
+                     host->endpoint[EP2I(ep)].transfer[i], buf_size);
         if (!buffer) {
             goto alloc_error;
         }
@@ -1282,9 +2180,12 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
     host->endpoint[EP2I(ep)].pkts_per_transfer = pkts_per_transfer;
     host->endpoint[EP2I(ep)].transfer_count = transfer_count;
 
-    /* For input endpoints submit the transfers now */
+    /* For input endpoints submit the transfers now, output endpoints wait
+       for the usb-guest to fill their jitter buffer */
     if (ep & LIBUSB_ENDPOINT_IN) {
         status = usbredirhost_start_stream_unlocked(host, ep);
+    } else {
+        usbredirhost_reset_iso_out(host, ep);
     }
 
     if (send_success && status == usb_redir_success) {
@@ -1418,47 +2319,302 @@ static int usbredirhost_bInterfaceNumber_to_index(
         }
     }
 
-    ERROR("invalid bNumInterface: %d\n", (int)bInterfaceNumber);
-    return -1;
+    ERROR("invalid bNumInterface: %d\n", (int)bInterfaceNumber);
+    return -1;
+}
+
+static void usbredirhost_log_data(struct usbredirhost *host, const char *desc,
+    const uint8_t *data, int len)
+{
+    if (usbredirparser_debug_data <= host->verbose) {
+        int i, j, n;
+
+        for (i = 0; i < len; i += j) {
+            char buf[128];
+
+            n = sprintf(buf, "%s", desc);
+            for (j = 0; j < 8 && i + j < len; j++){
+                 n += sprintf(buf + n, " %02X", data[i + j]);
+            }
+            va_log(host, usbredirparser_debug_data, "%s", buf);
+        }
+    }
+}
+
+/**************************************************************************/
+
+USBREDIR_VISIBLE
+void usbredirhost_set_log_va_cb(struct usbredirhost *host,
+    usbredirparser_log_va log_va_func)
+{
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return;
+    }
+
+    LOCK(host);
+    host->log_va_func = log_va_func;
+    host->parser->log_va_func = log_va_func ? usbredirhost_log_va : NULL;
+    UNLOCK(host);
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_set_ep_priority(struct usbredirhost *host, uint8_t ep,
+    int priority)
+{
+    int ret;
+
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return usb_redir_inval;
+    }
+
+    LOCK(host);
+    ret = usbredirparser_set_ep_priority(host->parser, ep, priority);
+    if (ret == 0)
+        host->ep_priority[EP2I(ep)] = priority;
+    UNLOCK(host);
+
+    return ret ? usb_redir_inval : usb_redir_success;
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_set_buffered_output_size_cb(struct usbredirhost *host,
+    usbredirhost_buffered_output_size buffered_output_size_func)
+{
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return;
+    }
+
+    if (!(host->flags & usbredirhost_fl_write_cb_owns_buffer)) {
+        host->log_func(host->func_priv, usbredirparser_warning,
+                       "can't set callback as usbredirhost owns the output "
+                       "buffer (flag: usbredirhost_fl_write_cb_owns_buffer)");
+        return;
+    }
+
+    host->buffered_output_size_func = buffered_output_size_func;
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_set_bulk_read_ahead(struct usbredirhost *host, uint8_t ep,
+    int transfer_count, int bytes_per_transfer)
+{
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return usb_redir_inval;
+    }
+
+    if (!(ep & LIBUSB_ENDPOINT_IN) || transfer_count < 0 ||
+            transfer_count > MAX_TRANSFER_COUNT) {
+        ERROR("error invalid bulk read-ahead parameters for ep %02X", ep);
+        return usb_redir_inval;
+    }
+
+    LOCK(host);
+    if (transfer_count &&
+            !usbredirhost_read_ahead_fits(host, ep, bytes_per_transfer)) {
+        ERROR("error invalid bulk read-ahead parameters for ep %02X", ep);
+        UNLOCK(host);
+        return usb_redir_inval;
+    }
+    /* Changing the parameters takes effect on the next bulk-in packet */
+    if (usbredirhost_is_read_ahead(host, ep)) {
+        usbredirhost_cancel_stream_unlocked(host, ep);
+    }
+    host->read_ahead[EP2I(ep)].transfer_count = transfer_count;
+    host->read_ahead[EP2I(ep)].bytes_per_transfer = bytes_per_transfer;
+    UNLOCK(host);
+    FLUSH(host);
+
+    return usb_redir_success;
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_set_descriptor_cache(struct usbredirhost *host, int enable)
+{
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return;
+    }
+
+    LOCK(host);
+    if (enable)
+        host->quirks &= ~QUIRK_NO_DESC_CACHE;
+    else
+        host->quirks |= QUIRK_NO_DESC_CACHE;
+    UNLOCK(host);
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_set_iso_out_latency(struct usbredirhost *host,
+    int latency_us)
+{
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return;
+    }
+
+    LOCK(host);
+    host->iso_out_latency = (latency_us > 0) ? latency_us : 0;
+    UNLOCK(host);
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_load_quirks(struct usbredirhost *host, const char *filename)
+{
+    struct usbredirhost_quirk q;
+    char line[QUIRKS_LINE_SIZE];
+    int r, line_no = 0, status = usb_redir_success;
+    int orig_count;
+    FILE *f;
+
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return usb_redir_inval;
+    }
+
+    f = fopen(filename, "r");
+    if (!f) {
+        ERROR("error opening quirks file %s: %s", filename, strerror(errno));
+        return usb_redir_ioerror;
+    }
+
+    orig_count = host->quirk_count;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        if (!strchr(line, '\n') && !feof(f)) {
+            ERROR("%s:%d: line too long", filename, line_no);
+            status = usb_redir_inval;
+            break;
+        }
+        r = usbredirhost_parse_quirk(host, line, filename, line_no, &q);
+        if (r < 0) {
+            status = usb_redir_inval;
+            break;
+        }
+        if (r == 1 && usbredirhost_add_quirk(host, &q)) {
+            status = usb_redir_ioerror;
+            break;
+        }
+    }
+    if (status == usb_redir_success && ferror(f)) {
+        ERROR("error reading quirks file %s", filename);
+        status = usb_redir_ioerror;
+    }
+    fclose(f);
+
+    if (status == usb_redir_success && usbredirhost_hash_quirks(host)) {
+        status = usb_redir_ioerror;
+    }
+    if (status != usb_redir_success) {
+        /* All or nothing, the hash only refers to the entries we had */
+        host->quirk_count = orig_count;
+        return status;
+    }
+
+    INFO("loaded %d quirks from %s", host->quirk_count - orig_count,
+         filename);
+    return usb_redir_success;
 }
 
-static void usbredirhost_log_data(struct usbredirhost *host, const char *desc,
-    const uint8_t *data, int len)
+USBREDIR_VISIBLE
+int usbredirhost_get_iso_out_stats(struct usbredirhost *host, uint8_t ep,
+    struct usbredirhost_iso_out_stats *stats)
 {
-    if (usbredirparser_debug_data <= host->verbose) {
-        int i, j, n;
+    struct usbredirhost_ep *endpoint;
 
-        for (i = 0; i < len; i += j) {
-            char buf[128];
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
+        return usb_redir_inval;
+    }
 
-            n = sprintf(buf, "%s", desc);
-            for (j = 0; j < 8 && i + j < len; j++){
-                 n += sprintf(buf + n, " %02X", data[i + j]);
-            }
-            va_log(host, usbredirparser_debug_data, "%s", buf);
-        }
+    if ((ep & LIBUSB_ENDPOINT_IN) || !stats) {
+        return usb_redir_inval;
     }
-}
 
-/**************************************************************************/
+    LOCK(host);
+    endpoint = &host->endpoint[EP2I(ep)];
+    if (endpoint->type != usb_redir_type_iso ||
+            endpoint->transfer_count == 0) {
+        UNLOCK(host);
+        return usb_redir_inval;
+    }
+    stats->depth = endpoint->iso_out.depth;
+    stats->target_depth = endpoint->iso_out.target;
+    stats->underruns = endpoint->iso_out.underruns;
+    stats->overruns = endpoint->iso_out.overruns;
+    stats->dropped = endpoint->iso_out.dropped;
+    stats->duplicated = endpoint->iso_out.duplicated;
+    UNLOCK(host);
+
+    return usb_redir_success;
+}
 
 USBREDIR_VISIBLE
-void usbredirhost_set_buffered_output_size_cb(struct usbredirhost *host,
-    usbredirhost_buffered_output_size buffered_output_size_func)
+int usbredirhost_get_ep_stats(struct usbredirhost *host, uint8_t ep,
+    struct usbredirhost_ep_stats *stats)
 {
     if (!host) {
         fprintf(stderr, "%s: invalid usbredirhost", __func__);
-        return;
+        return usb_redir_inval;
     }
 
-    if (!(host->flags & usbredirhost_fl_write_cb_owns_buffer)) {
-        host->log_func(host->func_priv, usbredirparser_warning,
-                       "can't set callback as usbredirhost owns the output "
-                       "buffer (flag: usbredirhost_fl_write_cb_owns_buffer)");
+    if ((ep & 0x70) || !stats) {
+        return usb_redir_inval;
+    }
+
+    LOCK(host);
+    if (!host->dev ||
+            host->endpoint[EP2I(ep)].type == usb_redir_type_invalid) {
+        UNLOCK(host);
+        return usb_redir_inval;
+    }
+    *stats = host->endpoint[EP2I(ep)].stats;
+    UNLOCK(host);
+
+    return usb_redir_success;
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_get_stats(struct usbredirhost *host,
+    struct usbredirhost_stats *stats)
+{
+    struct usbredirhost_ep_stats *ep_stats;
+    int i;
+
+    if (!host) {
+        fprintf(stderr, "%s: invalid usbredirhost", __func__);
         return;
     }
 
-    host->buffered_output_size_func = buffered_output_size_func;
+    memset(stats, 0, sizeof(*stats));
+    LOCK(host);
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        ep_stats = &host->endpoint[i].stats;
+        if (I2EP(i) & LIBUSB_ENDPOINT_IN) {
+            stats->packets_in += ep_stats->packets;
+            stats->bytes_in += ep_stats->bytes;
+        } else {
+            stats->packets_out += ep_stats->packets;
+            stats->bytes_out += ep_stats->bytes;
+        }
+        stats->dropped += ep_stats->dropped;
+        stats->stalls += ep_stats->stalls;
+        stats->cancels += ep_stats->cancels;
+        stats->errors += ep_stats->errors;
+        stats->queue_depth += ep_stats->queue_depth;
+    }
+    stats->attach_descriptors_us = host->attach_us.descriptors;
+    stats->attach_claim_us = host->attach_us.claim;
+    stats->attach_reset_us = host->attach_us.reset;
+    stats->attach_connect_us = host->attach_us.connect;
+    UNLOCK(host);
+    stats->write_queue_packets =
+        usbredirparser_has_data_to_write(host->parser);
+    stats->write_queue_bytes =
+        usbredirparser_get_bufferered_output_size(host->parser);
 }
 
 /* Return value:
@@ -1498,9 +2654,13 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
     struct usbredirtransfer *transfer = libusb_transfer->user_data;
     uint8_t ep = libusb_transfer->endpoint;
     struct usbredirhost *host = transfer->host;
-    int i, r, len, status;
+    struct usb_redir_iso_packet_header iso_packets[MAX_PACKETS_PER_TRANSFER];
+    uint8_t *iso_data[MAX_PACKETS_PER_TRANSFER];
+    int i, r, len, status, iso_count = 0;
+    uint64_t iso_id;
 
     LOCK(host);
+    usbredirhost_transfer_done(host, transfer, ep);
     if (transfer->cancelled) {
         host->cancels_pending--;
         usbredirhost_free_transfer(transfer);
@@ -1509,6 +2669,10 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
 
     /* Mark transfer completed (iow not submitted) */
     transfer->packet_idx = 0;
+    if (!(ep & LIBUSB_ENDPOINT_IN)) {
+        host->endpoint[EP2I(ep)].iso_out.depth -=
+            libusb_transfer->num_iso_packets;
+    }
 
     /* Check overal transfer status */
     r = libusb_transfer->status;
@@ -1536,11 +2700,22 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
         goto unlock;
     }
 
-    /* Check per packet status and send ok input packets to usb-guest */
+    /* Check per packet status and send ok input packets to usb-guest,
+       input packets are collected and send together per urb */
+    iso_id = transfer->id;
     for (i = 0; i < libusb_transfer->num_iso_packets; i++) {
         r   = libusb_transfer->iso_packet_desc[i].status;
         len = libusb_transfer->iso_packet_desc[i].actual_length;
         status = libusb_status_or_error_to_redir_status(host, r);
+        if (r != LIBUSB_TRANSFER_COMPLETED) {
+            usbredirhost_count_status(&host->endpoint[EP2I(ep)].stats, r);
+            /* Handling the status may free the transfer, so send the
+               packets collected sofar first */
+            usbredirhost_send_iso_in_packets(host, iso_id, ep, iso_packets,
+                                             iso_data, iso_count);
+            iso_id = transfer->id;
+            iso_count = 0;
+        }
         switch (usbredirhost_handle_iso_status(host, transfer->id, ep, r)) {
         case 0:
             break;
@@ -1557,14 +2732,21 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
             goto unlock;
         }
         if (ep & LIBUSB_ENDPOINT_IN) {
-            usbredirhost_send_stream_data(host, transfer->id, ep, status,
-                   libusb_get_iso_packet_buffer(libusb_transfer, i), len);
+            iso_packets[iso_count].endpoint = ep;
+            iso_packets[iso_count].status   = status;
+            iso_packets[iso_count].length   = len;
+            iso_data[iso_count] =
+                libusb_get_iso_packet_buffer(libusb_transfer, i);
+            iso_count++;
             transfer->id++;
         } else {
             DEBUG("iso-in complete ep %02X pkt %d len %d id %"PRIu64,
                   ep, i, len, transfer->id);
+            usbredirhost_count_data(host, ep, 1, len);
         }
     }
+    usbredirhost_send_iso_in_packets(host, iso_id, ep, iso_packets, iso_data,
+                                     iso_count);
 
     /* And for input transfers resubmit the transfer (output transfers
        get resubmitted when they have all their packets filled with data) */
@@ -1581,10 +2763,10 @@ resubmit:
         }
         if (i == host->endpoint[EP2I(ep)].transfer_count) {
             DEBUG("underflow of iso out queue on ep: %02X", ep);
-            /* Re-fill buffers before submitting urbs again */
-            for (i = 0; i < host->endpoint[EP2I(ep)].transfer_count; i++)
-                host->endpoint[EP2I(ep)].transfer[i]->packet_idx = 0;
-            host->endpoint[EP2I(ep)].out_idx = 0;
+            /* Re-fill the buffer up to its target before submitting urbs
+               again, keeping the packets queued so far */
+            host->endpoint[EP2I(ep)].iso_out.underruns++;
+            host->endpoint[EP2I(ep)].iso_out.duplicate = 0;
             host->endpoint[EP2I(ep)].stream_started = 0;
             host->endpoint[EP2I(ep)].drop_packets = 0;
         }
@@ -1596,6 +2778,73 @@ unlock:
 
 /**************************************************************************/
 
+/* Answer queued usb-guest bulk-in packets from completed read-ahead transfers.
+   The transfers are consumed and resubmitted in the order they were
+   submitted in, so that the data reaches the usb-guest in order.
+   Note caller must hold the host lock */
+static void usbredirhost_read_ahead_unlocked(struct usbredirhost *host,
+    uint8_t ep)
+{
+    struct usbredirhost_ep *endpoint = &host->endpoint[EP2I(ep)];
+    struct usbredirhost_bulk_request *request;
+    struct usbredirtransfer *transfer;
+    int avail, len;
+
+    while (endpoint->transfer_count) {
+        transfer = endpoint->transfer[endpoint->out_idx];
+        if (transfer->packet_idx == SUBMITTED_IDX)
+            break;
+
+        /* packet_idx is the amount of data already sent to the usb-guest */
+        avail = transfer->transfer->actual_length - transfer->packet_idx;
+        if (avail > 0) {
+            request = endpoint->read_ahead_requests;
+            if (!request)
+                break;
+            endpoint->read_ahead_requests = request->next;
+
+            len = (request->bulk_packet.length_high << 16) |
+                  request->bulk_packet.length;
+            if (len > avail)
+                len = avail;
+            usbredirhost_log_data(host, "bulk data in:",
+                transfer->transfer->buffer + transfer->packet_idx, len);
+            usbredirhost_send_read_ahead_data(host, request,
+                usb_redir_success,
+                transfer->transfer->buffer + transfer->packet_idx, len);
+            transfer->packet_idx += len;
+            if (len < avail)
+                continue;
+        }
+
+        endpoint->out_idx = (endpoint->out_idx + 1) % endpoint->transfer_count;
+        if (usbredirhost_submit_stream_transfer_unlocked(host, transfer) !=
+                usb_redir_success)
+            break;
+    }
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_read_ahead_complete_unlocked(
+    struct usbredirhost *host, struct usbredirtransfer *transfer)
+{
+    uint8_t ep = transfer->transfer->endpoint;
+    int status;
+
+    if (transfer->transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        /* Report the error to the usb-guest and stop reading ahead, the
+           stream gets restarted by the next bulk-in packet */
+        status = libusb_status_or_error_to_redir_status(host,
+                                                  transfer->transfer->status);
+        DEBUG("read-ahead ep %02X status %d, stopping", ep, status);
+        usbredirhost_flush_read_ahead_requests(host, ep, status);
+        usbredirhost_cancel_stream_unlocked(host, ep);
+        return;
+    }
+
+    usbredirhost_read_ahead_unlocked(host, ep);
+}
+
 static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
     struct libusb_transfer *libusb_transfer)
 {
@@ -1605,6 +2854,7 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
     int r, len = libusb_transfer->actual_length;
 
     LOCK(host);
+    usbredirhost_transfer_done(host, transfer, ep);
 
     if (transfer->cancelled) {
         host->cancels_pending--;
@@ -1615,6 +2865,11 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
     /* Mark transfer completed (iow not submitted) */
     transfer->packet_idx = 0;
 
+    if (usbredirhost_is_read_ahead(host, ep)) {
+        usbredirhost_read_ahead_complete_unlocked(host, transfer);
+        goto unlock;
+    }
+
     r = libusb_transfer->status;
     switch (r) {
     case LIBUSB_TRANSFER_COMPLETED:
@@ -1840,11 +3095,17 @@ static void usbredirhost_start_iso_stream(void *priv, uint64_t id,
 {
     struct usbredirhost *host = priv;
     uint8_t ep = start_iso_stream->endpoint;
+    int transfer_count = start_iso_stream->no_urbs;
+
+    /* The quirks table may ask for more buffering than the usb-guest */
+    if (transfer_count && transfer_count < host->iso_transfers) {
+        transfer_count = host->iso_transfers;
+    }
 
     usbredirhost_alloc_stream(host, id, ep, usb_redir_type_iso,
                               start_iso_stream->pkts_per_urb,
                               host->endpoint[EP2I(ep)].max_packetsize,
-                              start_iso_stream->no_urbs, 1);
+                              transfer_count, 1);
     FLUSH(host);
 }
 
@@ -1862,7 +3123,9 @@ static void usbredirhost_start_interrupt_receiving(void *priv, uint64_t id,
 
     usbredirhost_alloc_stream(host, id, ep, usb_redir_type_interrupt, 1,
                               host->endpoint[EP2I(ep)].max_packetsize,
-                              INTERRUPT_TRANSFER_COUNT, 1);
+                              host->interrupt_transfers ?
+                                  host->interrupt_transfers :
+                                  INTERRUPT_TRANSFER_COUNT, 1);
     FLUSH(host);
 }
 
@@ -1999,6 +3262,30 @@ static void usbredirhost_stop_bulk_receiving(void *priv, uint64_t id,
 
 /**************************************************************************/
 
+/* Note caller must hold the host lock */
+static int usbredirhost_cancel_read_ahead_request(struct usbredirhost *host,
+    uint64_t id)
+{
+    struct usbredirhost_bulk_request *request, **prev;
+    int i;
+
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        prev = &host->endpoint[i].read_ahead_requests;
+        for (request = *prev; request; request = *prev) {
+            if (request->id == id) {
+                *prev = request->next;
+                DEBUG("cancelled bulk packet ep %02x id %"PRIu64,
+                      request->bulk_packet.endpoint, id);
+                usbredirhost_send_read_ahead_data(host, request,
+                                                  usb_redir_cancelled, NULL, 0);
+                return 1;
+            }
+            prev = &request->next;
+        }
+    }
+    return 0;
+}
+
 static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
 {
     struct usbredirhost *host = priv;
@@ -2073,7 +3360,7 @@ static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
                   interrupt_packet.endpoint, id);
             break;
         }
-    } else
+    } else if (!usbredirhost_cancel_read_ahead_request(host, id))
         DEBUG("cancel packet id %"PRIu64" not found", id);
     UNLOCK(host);
     FLUSH(host);
@@ -2087,6 +3374,8 @@ static void LIBUSB_CALL usbredirhost_control_packet_complete(
     struct usbredirhost *host = transfer->host;
 
     LOCK(host);
+    usbredirhost_transfer_done(host, transfer,
+                               transfer->control_packet.endpoint);
 
     control_packet = transfer->control_packet;
     control_packet.status = libusb_status_or_error_to_redir_status(host,
@@ -2098,6 +3387,8 @@ static void LIBUSB_CALL usbredirhost_control_packet_complete(
           control_packet.length, transfer->id);
 
     if (!transfer->cancelled) {
+        usbredirhost_count_data(host, control_packet.endpoint, 1,
+                                libusb_transfer->actual_length);
         if (control_packet.endpoint & LIBUSB_ENDPOINT_IN) {
             usbredirhost_log_data(host, "ctrl data in:",
                          libusb_transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
@@ -2128,6 +3419,125 @@ static void usbredirhost_send_control_status(struct usbredirhost *host,
                                        NULL, 0);
 }
 
+/* Answer standard requests which only return (parts of) the descriptors we
+   already have read, without a round-trip to the device. Guests send lots of
+   these while enumerating, so over high-latency links this noticeably cuts
+   the time it takes for a device to show up in the guest.
+   Returns 1 if the request was answered, 0 if it must be sent to the device */
+static int usbredirhost_control_from_cache(struct usbredirhost *host,
+    uint64_t id, struct usb_redir_control_packet_header *control_packet)
+{
+    const struct libusb_device_descriptor *desc = &host->desc;
+    uint8_t buf[LIBUSB_DT_DEVICE_SIZE];
+    const uint8_t *data = buf;
+    int len, disabled;
+#ifdef LIBUSB_HAS_CONFIG_VIEW
+    struct libusb_config_view view;
+#endif
+
+    LOCK(host);
+    disabled = (host->flags & usbredirhost_fl_no_descriptor_cache) ||
+               (host->quirks & QUIRK_NO_DESC_CACHE) || host->desc_cache_stale;
+    UNLOCK(host);
+    if (disabled) {
+        return 0;
+    }
+
+    if ((control_packet->requesttype & LIBUSB_ENDPOINT_IN) == 0 ||
+            (control_packet->requesttype & (0x03 << 5)) !=
+                LIBUSB_REQUEST_TYPE_STANDARD) {
+        return 0;
+    }
+
+    switch (control_packet->requesttype & 0x1f) {
+    case LIBUSB_RECIPIENT_DEVICE:
+        break;
+    case LIBUSB_RECIPIENT_INTERFACE:
+        /* The interface status is reserved and always reads as zero */
+        if (control_packet->request != LIBUSB_REQUEST_GET_STATUS ||
+                control_packet->value != 0 || !host->config) {
+            return 0;
+        }
+        buf[0] = buf[1] = 0;
+        len = 2;
+        goto send;
+    default:
+        return 0;
+    }
+
+    switch (control_packet->request) {
+    case LIBUSB_REQUEST_GET_CONFIGURATION:
+        if (control_packet->value != 0 || control_packet->index != 0) {
+            return 0;
+        }
+        buf[0] = host->config ? host->config->bConfigurationValue : 0;
+        len = 1;
+        break;
+    case LIBUSB_REQUEST_GET_DESCRIPTOR:
+        /* Only string descriptors use the language id in wIndex */
+        if (control_packet->index != 0) {
+            return 0;
+        }
+        switch (control_packet->value >> 8) {
+        case LIBUSB_DT_DEVICE:
+            if ((control_packet->value & 0xff) != 0) {
+                return 0;
+            }
+            buf[0] = LIBUSB_DT_DEVICE_SIZE;
+            buf[1] = LIBUSB_DT_DEVICE;
+            buf[2] = desc->bcdUSB & 0xff;
+            buf[3] = desc->bcdUSB >> 8;
+            buf[4] = desc->bDeviceClass;
+            buf[5] = desc->bDeviceSubClass;
+            buf[6] = desc->bDeviceProtocol;
+            buf[7] = desc->bMaxPacketSize0;
+            buf[8] = desc->idVendor & 0xff;
+            buf[9] = desc->idVendor >> 8;
+            buf[10] = desc->idProduct & 0xff;
+            buf[11] = desc->idProduct >> 8;
+            buf[12] = desc->bcdDevice & 0xff;
+            buf[13] = desc->bcdDevice >> 8;
+            buf[14] = desc->iManufacturer;
+            buf[15] = desc->iProduct;
+            buf[16] = desc->iSerialNumber;
+            buf[17] = desc->bNumConfigurations;
+            len = LIBUSB_DT_DEVICE_SIZE;
+            break;
+#ifdef LIBUSB_HAS_CONFIG_VIEW
+        case LIBUSB_DT_CONFIG:
+            if ((control_packet->value & 0xff) >= desc->bNumConfigurations ||
+                    libusb_get_config_view(host->dev,
+                                           control_packet->value & 0xff,
+                                           &view) != 0) {
+                return 0;
+            }
+            data = view.data;
+            len = view.length;
+            break;
+#endif
+        default:
+            return 0;
+        }
+        break;
+    default:
+        return 0;
+    }
+
+send:
+    if (len > control_packet->length)
+        len = control_packet->length;
+
+    DEBUG("control ep %02X request %02X value %04X answered from cache",
+          control_packet->endpoint, control_packet->request,
+          control_packet->value);
+    control_packet->status = usb_redir_success;
+    control_packet->length = len;
+    usbredirhost_log_data(host, "ctrl data in:", data, len);
+    usbredirparser_send_control_packet(host->parser, id, control_packet,
+                                       (uint8_t *)data, len);
+    return 1;
+}
+
 static void usbredirhost_control_packet(void *priv, uint64_t id,
     struct usb_redir_control_packet_header *control_packet,
     uint8_t *data, int data_len)
@@ -2175,6 +3585,33 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
         return;
     }
 
+    if (usbredirhost_control_from_cache(host, id, control_packet)) {
+        usbredirparser_free_packet_data(host->parser, data);
+        FLUSH(host);
+        return;
+    }
+
+    /* Requests which change the configuration, alt setting or descriptors
+       behind our back make the cached descriptors unreliable, stop using
+       them for this device (or this usb-guest, see
+       usbredirhost_recheck_desc_cache) */
+    if ((control_packet->requesttype & ~LIBUSB_ENDPOINT_IN) <=
+            LIBUSB_RECIPIENT_INTERFACE) {
+        switch (control_packet->request) {
+        case LIBUSB_REQUEST_SET_CONFIGURATION:
+        case LIBUSB_REQUEST_SET_INTERFACE:
+            LOCK(host);
+            host->desc_cache_stale |= DESC_CACHE_STALE_CONFIG;
+            UNLOCK(host);
+            break;
+        case LIBUSB_REQUEST_SET_DESCRIPTOR:
+            LOCK(host);
+            host->desc_cache_stale |= DESC_CACHE_STALE_DESCRIPTORS;
+            UNLOCK(host);
+            break;
+        }
+    }
+
     buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
     if (!buffer) {
         ERROR("out of memory allocating transfer buffer, dropping packet");
@@ -2208,7 +3645,7 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
     transfer->id = id;
     transfer->control_packet = *control_packet;
 
-    usbredirhost_add_transfer(host, transfer);
+    usbredirhost_add_transfer(host, transfer, control_packet->endpoint);
 
     r = libusb_submit_transfer(transfer->transfer);
     if (r < 0) {
@@ -2228,6 +3665,8 @@ static void LIBUSB_CALL usbredirhost_bulk_packet_complete(
     struct usbredirhost *host = transfer->host;
 
     LOCK(host);
+    usbredirhost_transfer_done(host, transfer,
+                               transfer->bulk_packet.endpoint);
 
     bulk_packet = transfer->bulk_packet;
     bulk_packet.status = libusb_status_or_error_to_redir_status(host,
@@ -2240,6 +3679,8 @@ static void LIBUSB_CALL usbredirhost_bulk_packet_complete(
           libusb_transfer->actual_length, transfer->id);
 
     if (!transfer->cancelled) {
+        usbredirhost_count_data(host, bulk_packet.endpoint, 1,
+                                libusb_transfer->actual_length);
         if (bulk_packet.endpoint & LIBUSB_ENDPOINT_IN) {
             usbredirhost_log_data(host, "bulk data in:",
                                   libusb_transfer->buffer,
@@ -2269,6 +3710,45 @@ static void usbredirhost_send_bulk_status(struct usbredirhost *host,
     usbredirparser_send_bulk_packet(host->parser, id, bulk_packet, NULL, 0);
 }
 
+static void usbredirhost_read_ahead_packet(struct usbredirhost *host,
+    uint64_t id, struct usb_redir_bulk_packet_header *bulk_packet)
+{
+    uint8_t ep = bulk_packet->endpoint;
+    struct usbredirhost_bulk_request *request, **tail;
+
+    LOCK(host);
+
+    if (host->endpoint[EP2I(ep)].transfer_count == 0) {
+        usbredirhost_alloc_stream_unlocked(host, id, ep, usb_redir_type_bulk, 1,
+                host->read_ahead[EP2I(ep)].bytes_per_transfer,
+                host->read_ahead[EP2I(ep)].transfer_count, 0);
+        if (host->endpoint[EP2I(ep)].transfer_count == 0) {
+            ERROR("error starting read-ahead on ep %02X", ep);
+            usbredirhost_send_bulk_status(host, id, bulk_packet,
+                                          usb_redir_stall);
+            goto unlock;
+        }
+    }
+
+    request = malloc(sizeof(*request));
+    if (!request) {
+        ERROR("out of memory allocating bulk request, dropping packet");
+        goto unlock;
+    }
+    request->id = id;
+    request->bulk_packet = *bulk_packet;
+    request->next = NULL;
+
+    tail = &host->endpoint[EP2I(ep)].read_ahead_requests;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = request;
+
+    usbredirhost_read_ahead_unlocked(host, ep);
+unlock:
+    UNLOCK(host);
+}
+
 static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     struct usb_redir_bulk_packet_header *bulk_packet,
     uint8_t *data, int data_len)
@@ -2297,6 +3777,12 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
         return;
     }
 
+    if (bulk_packet->stream_id == 0 && usbredirhost_is_read_ahead(host, ep)) {
+        usbredirhost_read_ahead_packet(host, id, bulk_packet);
+        FLUSH(host);
+        return;
+    }
+
     if (ep & LIBUSB_ENDPOINT_IN) {
         data = malloc(len);
         if (!data) {
@@ -2336,7 +3822,7 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     transfer->id = id;
     transfer->bulk_packet = *bulk_packet;
 
-    usbredirhost_add_transfer(host, transfer);
+    usbredirhost_add_transfer(host, transfer, ep);
 
     r = libusb_submit_transfer(transfer->transfer);
     if (r < 0) {
@@ -2351,17 +3837,70 @@ error:
     }
 }
 
+/* Let the parser read iso out data straight into the next free packet slot
+   of the stream, rather than into a buffer we then copy from */
+static uint8_t *usbredirhost_get_data_buffer(void *priv, int type,
+    uint64_t id, void *type_header, int data_len)
+{
+    struct usbredirhost *host = priv;
+    struct usb_redir_iso_packet_header *iso_packet = type_header;
+    uint8_t ep;
+    struct usbredirtransfer *transfer;
+    uint8_t *buffer = NULL;
+
+    if (type != usb_redir_iso_packet)
+        return NULL;
+
+    ep = iso_packet->endpoint;
+
+    LOCK(host);
+    /* Anything usbredirhost_iso_packet would not queue gets a parser buffer */
+    if (host->disconnected ||
+            host->endpoint[EP2I(ep)].type != usb_redir_type_iso ||
+            host->endpoint[EP2I(ep)].transfer_count == 0 ||
+            host->endpoint[EP2I(ep)].drop_packets ||
+            data_len > host->endpoint[EP2I(ep)].max_packetsize) {
+        goto unlock;
+    }
+
+    transfer = host->endpoint[EP2I(ep)].transfer[
+                   host->endpoint[EP2I(ep)].out_idx];
+    if (transfer->packet_idx == SUBMITTED_IDX) {
+        goto unlock;
+    }
+
+    buffer = libusb_get_iso_packet_buffer(transfer->transfer,
+                                          transfer->packet_idx);
+    host->iso_out_dest.transfer = transfer;
+    host->iso_out_dest.buffer = buffer;
+unlock:
+    UNLOCK(host);
+    return buffer;
+}
+
 static void usbredirhost_iso_packet(void *priv, uint64_t id,
     struct usb_redir_iso_packet_header *iso_packet,
     uint8_t *data, int data_len)
 {
     struct usbredirhost *host = priv;
     uint8_t ep = iso_packet->endpoint;
-    struct usbredirtransfer *transfer;
-    int i, j, status = usb_redir_success;
+    struct usbredirtransfer *transfer, *orphan = NULL;
+    libusb_device_handle *orphan_handle = NULL;
+    int i, j, copies, status = usb_redir_success;
+    int in_place;
 
     LOCK(host);
 
+    /* Was the data read into a packet slot by usbredirhost_get_data_buffer? */
+    in_place = data && data == host->iso_out_dest.buffer;
+    if (in_place) {
+        if (host->iso_out_dest.orphaned) {
+            orphan = host->iso_out_dest.transfer;
+            orphan_handle = host->iso_out_dest.handle;
+        }
+        memset(&host->iso_out_dest, 0, sizeof(host->iso_out_dest));
+    }
+
     if (host->disconnected) {
         status = usb_redir_ioerror;
         goto leave;
@@ -2387,60 +3926,62 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
 
     if (host->endpoint[EP2I(ep)].drop_packets) {
         host->endpoint[EP2I(ep)].drop_packets--;
+        host->endpoint[EP2I(ep)].stats.dropped++;
         goto leave;
     }
 
-    i = host->endpoint[EP2I(ep)].out_idx;
-    transfer = host->endpoint[EP2I(ep)].transfer[i];
-    j = transfer->packet_idx;
-    if (j == SUBMITTED_IDX) {
-        DEBUG("overflow of iso out queue on ep: %02X, dropping packet", ep);
-        /* Since we're interupting the stream anyways, drop enough packets to
-           get back to our target buffer size */
-        host->endpoint[EP2I(ep)].drop_packets =
-                     (host->endpoint[EP2I(ep)].pkts_per_transfer *
-                      host->endpoint[EP2I(ep)].transfer_count) / 2;
-        goto leave;
-    }
-
-    /* Store the id of the first packet in the urb */
-    if (j == 0) {
-        transfer->id = id;
-    }
-    memcpy(libusb_get_iso_packet_buffer(transfer->transfer, j),
-           data, data_len);
-    transfer->transfer->iso_packet_desc[j].length = data_len;
-    DEBUG("iso-in queue ep %02X urb %d pkt %d len %d id %"PRIu64,
-           ep, i, j, data_len, transfer->id);
-
-    j++;
-    transfer->packet_idx = j;
-    if (j == host->endpoint[EP2I(ep)].pkts_per_transfer) {
-        i = (i + 1) % host->endpoint[EP2I(ep)].transfer_count;
-        host->endpoint[EP2I(ep)].out_idx = i;
-        j = 0;
+    copies = 1;
+    if (host->endpoint[EP2I(ep)].iso_out.duplicate) {
+        host->endpoint[EP2I(ep)].iso_out.duplicate = 0;
+        copies = 2;
     }
+    /* Submitting a filled transfer may fail and stop the stream */
+    while (copies-- && host->endpoint[EP2I(ep)].transfer_count) {
+        i = host->endpoint[EP2I(ep)].out_idx;
+        transfer = host->endpoint[EP2I(ep)].transfer[i];
+        j = transfer->packet_idx;
+        if (j == SUBMITTED_IDX) {
+            DEBUG("overflow of iso out queue on ep: %02X, dropping packet",
+                  ep);
+            host->endpoint[EP2I(ep)].iso_out.overruns++;
+            host->endpoint[EP2I(ep)].stats.dropped++;
+            break;
+        }
 
-    if (host->endpoint[EP2I(ep)].stream_started) {
-        if (transfer->packet_idx ==
-                host->endpoint[EP2I(ep)].pkts_per_transfer) {
-            usbredirhost_submit_stream_transfer_unlocked(host, transfer);
+        /* Store the id of the first packet in the urb */
+        if (j == 0) {
+            transfer->id = id;
         }
-    } else {
-        /* We've not started the stream (submitted some transfers) yet,
-           do so once we have half our buffers filled */
-        int available = i * host->endpoint[EP2I(ep)].pkts_per_transfer + j;
-        int needed = (host->endpoint[EP2I(ep)].pkts_per_transfer *
-                      host->endpoint[EP2I(ep)].transfer_count) / 2;
-        if (available == needed) {
-            DEBUG("iso-in starting stream on ep %02X", ep);
-            usbredirhost_start_stream_unlocked(host, ep);
+        /* The slot may have changed if the stream got restarted meanwhile */
+        if (data != libusb_get_iso_packet_buffer(transfer->transfer, j)) {
+            memcpy(libusb_get_iso_packet_buffer(transfer->transfer, j),
+                   data, data_len);
+        }
+        transfer->transfer->iso_packet_desc[j].length = data_len;
+        DEBUG("iso-out queue ep %02X urb %d pkt %d len %d id %"PRIu64,
+               ep, i, j, data_len, transfer->id);
+
+        host->endpoint[EP2I(ep)].iso_out.depth++;
+        transfer->packet_idx = ++j;
+        if (j == host->endpoint[EP2I(ep)].pkts_per_transfer) {
+            host->endpoint[EP2I(ep)].out_idx =
+                (i + 1) % host->endpoint[EP2I(ep)].transfer_count;
+            usbredirhost_iso_out_transfer_filled(host, ep, transfer);
         }
     }
 
 leave:
     UNLOCK(host);
-    usbredirparser_free_packet_data(host->parser, data);
+    if (!in_place) {
+        usbredirparser_free_packet_data(host->parser, data);
+    }
+    /* Done outside the lock, as libusb_close may wait for event handling */
+    if (orphan) {
+        usbredirhost_free_transfer(orphan);
+    }
+    if (orphan_handle) {
+        libusb_close(orphan_handle);
+    }
     if (status != usb_redir_success) {
         usbredirhost_send_stream_status(host, id, ep, status);
     }
@@ -2455,6 +3996,8 @@ static void LIBUSB_CALL usbredirhost_interrupt_out_packet_complete(
     struct usbredirhost *host = transfer->host;
 
     LOCK(host);
+    usbredirhost_transfer_done(host, transfer,
+                               transfer->interrupt_packet.endpoint);
 
     interrupt_packet = transfer->interrupt_packet;
     interrupt_packet.status = libusb_status_or_error_to_redir_status(host,
@@ -2466,6 +4009,8 @@ static void LIBUSB_CALL usbredirhost_interrupt_out_packet_complete(
           interrupt_packet.length, transfer->id);
 
     if (!transfer->cancelled) {
+        usbredirhost_count_data(host, interrupt_packet.endpoint, 1,
+                                libusb_transfer->actual_length);
         usbredirparser_send_interrupt_packet(host->parser, transfer->id,
                                              &interrupt_packet, NULL, 0);
     }
@@ -2541,7 +4086,7 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
     transfer->id = id;
     transfer->interrupt_packet = *interrupt_packet;
 
-    usbredirhost_add_transfer(host, transfer);
+    usbredirhost_add_transfer(host, transfer, ep);
 
     r = libusb_submit_transfer(transfer->transfer);
     if (r < 0) {
@@ -2563,13 +4108,71 @@ void usbredirhost_get_guest_filter(struct usbredirhost *host,
     *rules_count_ret = host->filter_rules_count;
 }
 
+/* Fill in the class triplets of the first alt setting of every interface of
+ * the active configuration. Returns the number of interfaces, 0 if the device
+ * is unconfigured, or a negative libusb error code. */
+static int usbredirhost_get_interface_classes(libusb_device *dev,
+    uint8_t *interface_class, uint8_t *interface_subclass,
+    uint8_t *interface_protocol)
+{
+#ifdef LIBUSB_HAS_CONFIG_VIEW
+    /* Walk the cached raw descriptors, rather than parsing the whole
+       configuration into newly allocated structures */
+    struct libusb_config_view view;
+    struct libusb_interface_descriptor intf_desc;
+    int r, offset = 0, num_interfaces = 0;
+
+    r = libusb_get_active_config_view(dev, &view);
+    if (r < 0) {
+        return r == LIBUSB_ERROR_NOT_FOUND ? 0 : r;
+    }
+
+    while (num_interfaces < MAX_INTERFACES &&
+           (r = libusb_config_view_next_interface(&view, &offset,
+                                                  &intf_desc)) == 0) {
+        if (intf_desc.bAlternateSetting != 0)
+            continue;
+        interface_class[num_interfaces] = intf_desc.bInterfaceClass;
+        interface_subclass[num_interfaces] = intf_desc.bInterfaceSubClass;
+        interface_protocol[num_interfaces] = intf_desc.bInterfaceProtocol;
+        num_interfaces++;
+    }
+    if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND) {
+        return r;
+    }
+
+    return num_interfaces;
+#else
+    struct libusb_config_descriptor *config = NULL;
+    int i, r, num_interfaces;
+
+    r = libusb_get_active_config_descriptor(dev, &config);
+    if (r < 0) {
+        return r == LIBUSB_ERROR_NOT_FOUND ? 0 : r;
+    }
+
+    num_interfaces = config->bNumInterfaces;
+    if (num_interfaces > MAX_INTERFACES)
+        num_interfaces = MAX_INTERFACES;
+    for (i = 0; i < num_interfaces; i++) {
+        const struct libusb_interface_descriptor *intf_desc =
+            config->interface[i].altsetting;
+        interface_class[i] = intf_desc->bInterfaceClass;
+        interface_subclass[i] = intf_desc->bInterfaceSubClass;
+        interface_protocol[i] = intf_desc->bInterfaceProtocol;
+    }
+    libusb_free_config_descriptor(config);
+
+    return num_interfaces;
+#endif
+}
+
 USBREDIR_VISIBLE
 int usbredirhost_check_device_filter(const struct usbredirfilter_rule *rules,
     int rules_count, libusb_device *dev, int flags)
 {
-    int i, r, num_interfaces;
+    int r, num_interfaces;
     struct libusb_device_descriptor dev_desc;
-    struct libusb_config_descriptor *config = NULL;
     uint8_t interface_class[MAX_INTERFACES];
     uint8_t interface_subclass[MAX_INTERFACES];
     uint8_t interface_protocol[MAX_INTERFACES];
@@ -2581,13 +4184,15 @@ int usbredirhost_check_device_filter(const struct usbredirfilter_rule *rules,
         return -EIO;
     }
 
-    r = libusb_get_active_config_descriptor(dev, &config);
-    if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND) {
-        if (r == LIBUSB_ERROR_NO_MEM)
+    num_interfaces = usbredirhost_get_interface_classes(dev, interface_class,
+                                                        interface_subclass,
+                                                        interface_protocol);
+    if (num_interfaces < 0) {
+        if (num_interfaces == LIBUSB_ERROR_NO_MEM)
             return -ENOMEM;
         return -EIO;
     }
-    if (config == NULL) {
+    if (num_interfaces == 0) {
         return usbredirfilter_check(rules, rules_count, dev_desc.bDeviceClass,
                     dev_desc.bDeviceSubClass, dev_desc.bDeviceProtocol,
                     NULL, NULL, NULL, 0,
@@ -2595,16 +4200,6 @@ int usbredirhost_check_device_filter(const struct usbredirfilter_rule *rules,
                     dev_desc.bcdDevice, flags);
     }
 
-    num_interfaces = config->bNumInterfaces;
-    for (i = 0; i < num_interfaces; i++) {
-        const struct libusb_interface_descriptor *intf_desc =
-            config->interface[i].altsetting;
-        interface_class[i] = intf_desc->bInterfaceClass;
-        interface_subclass[i] = intf_desc->bInterfaceSubClass;
-        interface_protocol[i] = intf_desc->bInterfaceProtocol;
-    }
-    libusb_free_config_descriptor(config);
-
     return usbredirfilter_check(rules, rules_count, dev_desc.bDeviceClass,
                 dev_desc.bDeviceSubClass, dev_desc.bDeviceProtocol,
                 interface_class, interface_subclass, interface_protocol,
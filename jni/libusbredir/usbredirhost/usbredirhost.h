@@ -62,6 +62,10 @@ typedef uint64_t (*usbredirhost_buffered_output_size)(void *priv);
 
 enum {
     usbredirhost_fl_write_cb_owns_buffer = 0x01, /* See usbredirparser.h */
+    /* Always forward standard descriptor requests to the device, rather
+       than answering them from the already read descriptors, see
+       usbredirhost_set_descriptor_cache() */
+    usbredirhost_fl_no_descriptor_cache = 0x02,
 };
 
 struct usbredirhost *usbredirhost_open(
@@ -92,6 +96,27 @@ struct usbredirhost *usbredirhost_open_full(
 */
 void usbredirhost_close(struct usbredirhost *host);
 
+/* Start over with a new usb-guest, e.g. after the connection to the previous
+   one got lost, without giving up the device. This cancels all transfers and
+   streams of the previous usb-guest, drops all packets still queued for it,
+   and queues a new hello, after which the new usb-guest gets the device
+   connect and interface / ep info as usual.
+
+   Unlike closing the usbredirhost and opening a new one, this keeps the
+   device open and its interfaces claimed in their current configuration and
+   alt settings. So the kernel drivers do not get re-attached in between, and
+   the device is not claimed and reset again, which makes reconnecting much
+   faster. The new usb-guest still has to enumerate the device, like any
+   newly attached device.
+
+   Call this from the thread which calls usbredirhost_read_guest_data, after
+   the read / write callbacks have been switched over to the new
+   connection. A packet trace is stopped by this.
+
+   This function returns a usbredirproto.h status code (i.e. usb_redir_success)
+*/
+int usbredirhost_reconnect_guest(struct usbredirhost *host);
+
 /* Call this function with a valid libusb_device_handle to send the initial
    device info (interface_info, ep_info and device_connect packets) and make
    the device available to the usbredir-guest connected to the usbredir-host.
@@ -127,6 +152,178 @@ int usbredirhost_set_device(struct usbredirhost *host,
 void usbredirhost_set_buffered_output_size_cb(struct usbredirhost *host,
     usbredirhost_buffered_output_size buffered_output_size_func);
 
+/* Set a structured log callback, when set it gets called instead of the
+   log_func passed to usbredirhost_open for messages of both usbredirhost and
+   its usbredirparser, with the message still unformatted, see
+   usbredirparser_log_va. Messages above the verbose level passed to
+   usbredirhost_open are never generated. Pass NULL to go back to log_func.
+*/
+void usbredirhost_set_log_va_cb(struct usbredirhost *host,
+    usbredirparser_log_va log_va_func);
+
+/* Set the priority class in which the packets of endpoint ep get queued for
+   the usb-guest, see usbredirparser_set_ep_priority. E.g. raise a bulk
+   endpoint which carries latency sensitive data. This stays in effect across
+   usbredirhost_reconnect_guest.
+
+   This function returns a usbredirproto.h status code (i.e. usb_redir_success)
+*/
+int usbredirhost_set_ep_priority(struct usbredirhost *host, uint8_t ep,
+    int priority);
+
+/* Enable speculative read-ahead on bulk-in endpoint ep of the current
+   device. usbredirhost then keeps transfer_count bulk-in transfers of
+   bytes_per_transfer bytes posted, and answers bulk-in packets from the
+   usb-guest from the already received data, instead of only submitting a
+   transfer once the usb-guest asks for data. This hides the network latency
+   for devices which continuously stream data, like serial adapters or
+   network dongles, but it may split or merge the transfers differently than
+   the device would, so only use it for endpoints where that does not matter.
+   ep must be a bulk endpoint in the current alt setting, and
+   bytes_per_transfer a multiple of its max packet size of at most 128 MiB,
+   otherwise usb_redir_inval is returned. The same goes for bulk-read-ahead
+   quirks, which get ignored (with a warning) when they do not fit.
+
+   Read-ahead is only used when the usb-guest does not support buffered bulk
+   receiving (usb_redir_cap_bulk_receiving), usb-guests which do support it
+   decide themselves when to use it.
+   Call this after usbredirhost_set_device, pass a transfer_count of 0 to
+   disable read-ahead again. This setting is reset when the device is
+   disconnected.
+
+   This function returns a usbredirproto.h status code (i.e. usb_redir_success)
+*/
+int usbredirhost_set_bulk_read_ahead(struct usbredirhost *host, uint8_t ep,
+    int transfer_count, int bytes_per_transfer);
+
+/* By default usbredirhost answers standard GET_DESCRIPTOR (device and
+   configuration), GET_CONFIGURATION and interface GET_STATUS requests from the
+   usb-guest from the descriptors it has already read, instead of sending them
+   to the device. Call this with enable set to 0 after usbredirhost_set_device
+   to always send these requests to the device for the current device, e.g.
+   for devices which return different descriptors when asked directly.
+   This setting is reset when the device is disconnected. Passing the
+   usbredirhost_fl_no_descriptor_cache flag to usbredirhost_open disables
+   the cache for all devices. Configuration descriptors are only answered
+   from the cache when libusb has configuration views
+   (LIBUSB_HAS_CONFIG_VIEW), otherwise they always go to the device.
+   The cache is also bypassed once the usb-guest itself sends a
+   SET_CONFIGURATION, SET_INTERFACE or SET_DESCRIPTOR request. After
+   usbredirhost_reconnect_guest it gets used again, unless the descriptors
+   were set or the device is no longer in the configuration it was in.
+   This function may be called from any thread.
+*/
+void usbredirhost_set_descriptor_cache(struct usbredirhost *host, int enable);
+
+/* usbredirhost keeps a jitter buffer for iso out streams, it starts a stream
+   once the usb-guest has queued latency_us worth of packets, and restarts
+   it the same way after an underrun. While the stream runs, single packets
+   get dropped or repeated to keep the buffer around this depth when the
+   usb-guest's and the device's clocks drift apart. By default the buffer is
+   kept half full, pass a latency_us of 0 to go back to that. The latency is
+   rounded to whole transfers as requested by the usb-guest, and takes effect
+   for streams started after this call.
+*/
+void usbredirhost_set_iso_out_latency(struct usbredirhost *host,
+    int latency_us);
+
+/* Load per device settings from a quirks file. These get applied by
+   usbredirhost_set_device, so to have them apply to the first device, pass
+   a NULL usb_dev_handle to usbredirhost_open and call
+   usbredirhost_set_device after this. Each line of the file has the form:
+
+   <vendor>:<product>[:<bcdDevice>[-<bcdDevice>]] <quirk> [<quirk> ...]
+
+   With the ids in hex. Without a bcdDevice (range) the line applies to all
+   versions of the device. Everything after a '#' is a comment. The quirks
+   are:
+
+   no-reset             do not reset the device, for devices which do not
+                        survive a reset
+   no-descriptor-cache  see usbredirhost_set_descriptor_cache
+   bulk-read-ahead=<ep>:<transfer_count>:<bytes_per_transfer>
+                        see usbredirhost_set_bulk_read_ahead, ep in hex
+   iso-transfers=<n>    use at least n transfers for iso streams, for more
+                        buffering than the usb-guest asks for (max 16)
+   interrupt-transfers=<n>
+                        keep n transfers posted for interrupt receiving
+                        instead of 5 (max 16)
+
+   When several lines match a device, all of them get applied, with the
+   settings of later lines overriding those of earlier ones. A few known
+   devices have built-in quirks, files add to those. If the file has an
+   error, none of its lines get used.
+
+   This function returns a usbredirproto.h status code (i.e. usb_redir_success)
+*/
+int usbredirhost_load_quirks(struct usbredirhost *host, const char *filename);
+
+/* Jitter buffer statistics of a started iso out stream, the depths are in
+   packets, the counters count from the start of the stream */
+struct usbredirhost_iso_out_stats {
+    uint32_t depth;          /* packets queued or in flight */
+    uint32_t target_depth;   /* depth the buffer is kept at */
+    uint64_t underruns;      /* times the device ran out of packets */
+    uint64_t overruns;       /* packets dropped because the buffer was full */
+    uint64_t dropped;        /* packets dropped to follow clock drift */
+    uint64_t duplicated;     /* packets repeated to follow clock drift */
+};
+
+/* Get the jitter buffer statistics of iso out endpoint ep, this returns
+   usb_redir_inval if no iso out stream is started on ep and
+   usb_redir_success otherwise */
+int usbredirhost_get_iso_out_stats(struct usbredirhost *host, uint8_t ep,
+    struct usbredirhost_iso_out_stats *stats);
+
+/* Runtime statistics of an endpoint of the current device, these count
+   from when the device was set with usbredirhost_set_device. Packets are
+   usbredir data packets to / from the usb-guest, for control endpoints the
+   direction is that of the request. */
+struct usbredirhost_ep_stats {
+    uint64_t packets;          /* data packets completed */
+    uint64_t bytes;            /* data bytes transferred by these */
+    uint64_t dropped;          /* stream packets dropped, because the
+                                  connection to the usb-guest is too slow or
+                                  the iso out buffer is full */
+    uint64_t stalls;           /* transfers or iso packets which stalled */
+    uint64_t cancels;          /* transfers cancelled */
+    uint64_t errors;           /* transfers or iso packets with other errors */
+    uint64_t transfers;        /* transfers completed (not cancelled) */
+    uint64_t latency_total_us; /* submit to completion time of these */
+    uint32_t latency_max_us;   /* longest submit to completion time */
+    uint32_t queue_depth;      /* transfers currently submitted */
+};
+
+/* Get the statistics of endpoint ep of the current device, this returns
+   usb_redir_inval if there is no device or ep does not exist, and
+   usb_redir_success otherwise */
+int usbredirhost_get_ep_stats(struct usbredirhost *host, uint8_t ep,
+    struct usbredirhost_ep_stats *stats);
+
+/* Summary of the endpoint statistics of the current device, plus the
+   state of the queue of packets waiting to be written to the usb-guest and
+   how long attaching the device in usbredirhost_set_device took */
+struct usbredirhost_stats {
+    uint64_t packets_in;       /* from the device to the usb-guest */
+    uint64_t bytes_in;
+    uint64_t packets_out;      /* from the usb-guest to the device */
+    uint64_t bytes_out;
+    uint64_t dropped;
+    uint64_t stalls;
+    uint64_t cancels;
+    uint64_t errors;
+    uint32_t queue_depth;      /* transfers submitted on all endpoints */
+    uint32_t write_queue_packets;
+    uint64_t write_queue_bytes;
+    uint32_t attach_descriptors_us; /* reading the descriptors */
+    uint32_t attach_claim_us;  /* detaching drivers, claiming interfaces */
+    uint32_t attach_reset_us;  /* the initial device reset */
+    uint32_t attach_connect_us; /* queuing the device info for the guest */
+};
+
+void usbredirhost_get_stats(struct usbredirhost *host,
+    struct usbredirhost_stats *stats);
+
 /* Call this whenever there is data ready for the usbredirhost to read from
    the usb-guest
    returns 0 on success, or an error code from the below enum on error.
@@ -158,6 +355,19 @@ enum {
 };
 int usbredirhost_write_guest_data(struct usbredirhost *host);
 
+/* Record the packets exchanged with the usb-guest into a trace, see the
+   tracing section of usbredirparser.h. usbredirhost_start_trace and
+   usbredirhost_stop_trace must be called from the thread calling
+   usbredirhost_read_guest_data (or before it is first called), and should
+   be called before the first usbredirhost_read_guest_data call for the
+   trace to be replayable. Call usbredirhost_trace_flush regularly to write
+   out the recorded packets. */
+int usbredirhost_start_trace(struct usbredirhost *host,
+    usbredirparser_trace_write trace_write_func, void *trace_priv,
+    size_t buffer_size, int flags);
+int usbredirhost_trace_flush(struct usbredirhost *host);
+void usbredirhost_stop_trace(struct usbredirhost *host);
+
 /* When passing the usbredirhost_fl_write_cb_owns_buffer flag to
    usbredirhost_open, this function must be called to free the data buffer
    passed to write_guest_data_func when done with this buffer. */
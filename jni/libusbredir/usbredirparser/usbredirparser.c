@@ -27,9 +27,14 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #include "usbredirproto-compat.h"
 #include "usbredirparser.h"
 #include "usbredirfilter.h"
+#include "usbredirprobes.h"
 
 /* Put *some* upper limit on bulk transfer sizes */
 #define MAX_BULK_TRANSFER_SIZE (128u * 1024u * 1024u)
@@ -39,6 +44,17 @@
  */
 #define MAX_PACKET_SIZE (1024u + MAX_BULK_TRANSFER_SIZE)
 
+/* Max number of iso packets usbredirparser_send_iso_packets puts in a single
+   write buffer */
+#define ISO_PACKETS_PER_WRITE_BUF 32
+
+/* Output queue priority classes, see usbredirparser_set_ep_priority */
+#define WRITE_PRIOS 3
+
+/* A queued write buffer gets passed over by buffers of higher priority
+   classes at most this many times in a row */
+#define WRITE_STARVE_LIMIT 8
+
 /* Locking convenience macros */
 #define LOCK(parser) \
     do { \
@@ -56,10 +72,36 @@ struct usbredirparser_buf {
     uint8_t *buf;
     int pos;
     int len;
+    int packets; /* usbredir packets in buf */
+    uint64_t seq; /* order in which the buffers were queued */
+    bool barrier; /* not for an endpoint, see usbredirparser_may_write */
 
     struct usbredirparser_buf *next;
 };
 
+/* Single producer, single consumer ring of trace records. head and tail
+   only ever increase, the producer owns head, the consumer owns tail. */
+struct usbredirparser_trace_ring {
+    uint8_t *buf;
+    uint64_t mask;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t dropped;   /* producer only */
+};
+
+struct usbredirparser_trace {
+    usbredirparser_trace_write write_func;
+    void *priv;
+    int flags;
+    int header_written;
+    uint64_t start;
+    uint64_t start_time;
+    /* Received packets are recorded by the do_read thread, sent packets
+       under the parser lock, so each ring has a single producer */
+    struct usbredirparser_trace_ring rx;
+    struct usbredirparser_trace_ring tx;
+};
+
 struct usbredirparser_priv {
     struct usbredirparser callb;
     int flags;
@@ -81,10 +123,20 @@ struct usbredirparser_priv {
     uint8_t *data;
     int data_len;
     int data_read;
+    bool data_provided; /* data is owned by the app, see get_data_buffer */
     int to_skip;
     int write_buf_count;
-    struct usbredirparser_buf *write_buf;
+    /* A fifo per priority class, see usbredirparser_do_write */
+    struct usbredirparser_buf *write_buf[WRITE_PRIOS];
+    struct usbredirparser_buf *write_buf_tail[WRITE_PRIOS];
+    int write_buf_skipped[WRITE_PRIOS];
+    int write_cur; /* class of the buffer being written, or -1 */
+    uint64_t write_seq;
+    uint64_t write_barrier_seq; /* of the oldest queued barrier */
     uint64_t write_buf_total_size;
+    int8_t ep_priority[32];
+    struct usbredirparser_trace *trace;
+    int verbose;
 };
 
 static void
@@ -99,18 +151,32 @@ va_log(struct usbredirparser_priv *parser, int verbose, const char *fmt, ...)
     va_list ap;
     int n;
 
-    n = sprintf(buf, "usbredirparser: ");
     va_start(ap, fmt);
+    if (parser->callb.log_va_func) {
+        parser->callb.log_va_func(parser->callb.priv, verbose,
+                                  "usbredirparser", fmt, ap);
+        va_end(ap);
+        return;
+    }
+    n = sprintf(buf, "usbredirparser: ");
     vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
     va_end(ap);
 
     parser->callb.log_func(parser->callb.priv, verbose, buf);
 }
 
-#define ERROR(...)   va_log(parser, usbredirparser_error, __VA_ARGS__)
-#define WARNING(...) va_log(parser, usbredirparser_warning, __VA_ARGS__)
-#define INFO(...)    va_log(parser, usbredirparser_info, __VA_ARGS__)
-#define DEBUG(...)    va_log(parser, usbredirparser_debug, __VA_ARGS__)
+/* Check the level before evaluating the arguments, so that disabled
+   messages cost no more than a compare */
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= parser->verbose) \
+            va_log(parser, (level), __VA_ARGS__); \
+    } while (0)
+
+#define ERROR(...)   LOG(usbredirparser_error, __VA_ARGS__)
+#define WARNING(...) LOG(usbredirparser_warning, __VA_ARGS__)
+#define INFO(...)    LOG(usbredirparser_info, __VA_ARGS__)
+#define DEBUG(...)   LOG(usbredirparser_debug, __VA_ARGS__)
 
 static inline void
 usbredirparser_assert_invariants(const struct usbredirparser_priv *parser)
@@ -126,45 +192,70 @@ usbredirparser_assert_invariants(const struct usbredirparser_priv *parser)
     assert(parser->data_len <= MAX_PACKET_SIZE);
     assert(parser->data_read >= 0);
     assert(parser->data_read <= parser->data_len);
-    assert((parser->data_len != 0) ^ (parser->data == NULL));
+    /* The data buffer gets allocated when the data is about to be read */
+    assert(parser->data_len != 0 || parser->data == NULL);
+    assert(parser->data != NULL || parser->data_read == 0);
+    assert(!parser->data_provided || parser->data != NULL);
 
     int write_buf_count = 0;
     uint64_t total_size = 0;
-    const struct usbredirparser_buf *write_buf = parser->write_buf;
-    for (; write_buf != NULL ; write_buf = write_buf->next) {
-        assert(write_buf->pos >= 0);
-        assert(write_buf->len >= 0);
-        assert(write_buf->pos <= write_buf->len);
-        assert(write_buf->len == 0 || write_buf->buf != NULL);
-        write_buf_count++;
-        total_size += write_buf->len;
+    for (int i = 0; i < WRITE_PRIOS; i++) {
+        const struct usbredirparser_buf *write_buf = parser->write_buf[i];
+        assert((write_buf == NULL) == (parser->write_buf_tail[i] == NULL));
+        for (; write_buf != NULL ; write_buf = write_buf->next) {
+            assert(write_buf->pos >= 0);
+            assert(write_buf->len >= 0);
+            assert(write_buf->pos <= write_buf->len);
+            assert(write_buf->len == 0 || write_buf->buf != NULL);
+            assert(write_buf->pos == 0 || parser->write_cur == i);
+            assert(write_buf->seq < parser->write_seq);
+            assert(!write_buf->barrier ||
+                   write_buf->seq >= parser->write_barrier_seq);
+            assert(write_buf->next != NULL ||
+                   write_buf == parser->write_buf_tail[i]);
+            write_buf_count += write_buf->packets;
+            total_size += write_buf->len;
+        }
     }
     assert(parser->write_buf_count == write_buf_count);
     assert(parser->write_buf_total_size == total_size);
 #endif
 }
 
+static void usbredirparser_free_write_bufs(struct usbredirparser_priv *parser)
+{
+    struct usbredirparser_buf *wbuf, *next_wbuf;
+    int i;
+
+    for (i = 0; i < WRITE_PRIOS; i++) {
+        wbuf = parser->write_buf[i];
+        while (wbuf) {
+            next_wbuf = wbuf->next;
+            free(wbuf->buf);
+            free(wbuf);
+            wbuf = next_wbuf;
+        }
+        parser->write_buf[i] = NULL;
+        parser->write_buf_tail[i] = NULL;
+    }
+    parser->write_buf_count = 0;
+    parser->write_buf_total_size = 0;
+    parser->write_cur = -1;
+    parser->write_barrier_seq = UINT64_MAX;
+}
+
 #if 0 /* Can be enabled and called from random place to test serialization */
 static void serialize_test(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf, *next_wbuf;
     uint8_t *data;
     int len;
 
     if (usbredirparser_serialize(parser_pub, &data, &len))
         return;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
-        next_wbuf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
-        wbuf = next_wbuf;
-    }
-    parser->write_buf = NULL;
-    parser->write_buf_count = 0;
+    usbredirparser_free_write_bufs(parser);
 
     free(parser->data);
     parser->data = NULL;
@@ -178,13 +269,55 @@ static void serialize_test(struct usbredirparser *parser_pub)
 
 static void usbredirparser_queue(struct usbredirparser *parser, uint32_t type,
     uint64_t id, void *type_header_in, uint8_t *data_in, int data_len);
+static void usbredirparser_queue_packets(struct usbredirparser *parser,
+    uint32_t type, uint64_t id, void *type_headers_in,
+    size_t type_header_stride, uint8_t **data_in, int *data_len, int count);
 static int usbredirparser_caps_get_cap(struct usbredirparser_priv *parser,
     uint32_t *caps, int cap);
 
 USBREDIR_VISIBLE
 struct usbredirparser *usbredirparser_create(void)
 {
-    return calloc(1, sizeof(struct usbredirparser_priv));
+    struct usbredirparser_priv *parser;
+
+    parser = calloc(1, sizeof(*parser));
+    if (!parser)
+        return NULL;
+
+    parser->verbose = usbredirparser_debug_data;
+    parser->write_cur = -1;
+    parser->write_barrier_seq = UINT64_MAX;
+    memset(parser->ep_priority, usbredirparser_prio_default,
+           sizeof(parser->ep_priority));
+    return &parser->callb;
+}
+
+USBREDIR_VISIBLE
+void usbredirparser_set_verbose(struct usbredirparser *parser_pub, int verbose)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    parser->verbose = verbose;
+}
+
+USBREDIR_VISIBLE
+int usbredirparser_set_ep_priority(struct usbredirparser *parser_pub,
+    uint8_t ep, int priority)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if ((ep & 0x70) || priority < usbredirparser_prio_default ||
+            priority > usbredirparser_prio_low) {
+        ERROR("error invalid endpoint priority %02X: %d", ep, priority);
+        return -1;
+    }
+
+    LOCK(parser);
+    parser->ep_priority[((ep & 0x80) >> 3) | (ep & 0x0f)] = priority;
+    UNLOCK(parser);
+    return 0;
 }
 
 static void usbredirparser_verify_caps(struct usbredirparser_priv *parser,
@@ -234,18 +367,14 @@ void usbredirparser_destroy(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf, *next_wbuf;
 
-    free(parser->data);
+    usbredirparser_stop_trace(parser_pub);
+
+    if (!parser->data_provided)
+        free(parser->data);
     parser->data = NULL;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
-        next_wbuf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
-        wbuf = next_wbuf;
-    }
+    usbredirparser_free_write_bufs(parser);
 
     if (parser->lock)
         parser->callb.free_lock_func(parser->lock);
@@ -1009,6 +1138,316 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub,
     }
 }
 
+/* Tracing */
+
+#define TRACE_ALIGN(len) (((len) + 7) & ~(uint64_t)7)
+#define TRACE_MIN_BUFFER_SIZE 4096
+
+static uint64_t usbredirparser_trace_clock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+           (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 /
+           freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void usbredirparser_trace_copy_in(struct usbredirparser_trace_ring *ring,
+    uint64_t pos, const void *src, size_t len)
+{
+    size_t off = pos & ring->mask;
+    size_t n = ring->mask + 1 - off;
+
+    if (len == 0)
+        return;
+    if (n > len)
+        n = len;
+    memcpy(ring->buf + off, src, n);
+    memcpy(ring->buf, (const uint8_t *)src + n, len - n);
+}
+
+static void usbredirparser_trace_copy_out(
+    struct usbredirparser_trace_ring *ring, uint64_t pos, void *dest,
+    size_t len)
+{
+    size_t off = pos & ring->mask;
+    size_t n = ring->mask + 1 - off;
+
+    if (n > len)
+        n = len;
+    memcpy(dest, ring->buf + off, n);
+    memcpy((uint8_t *)dest + n, ring->buf, len - n);
+}
+
+/* Must be called from the do_read thread for received packets, and with the
+   parser lock held for sent packets */
+static void usbredirparser_trace_packet(struct usbredirparser_priv *parser,
+    uint8_t direction, uint32_t type, uint64_t id, int using_32bits_ids,
+    const void *type_header, int type_header_len,
+    const uint8_t *data, int data_len)
+{
+    static const uint8_t padding[8];
+    struct usbredirparser_trace *trace;
+    struct usbredirparser_trace_ring *ring;
+    struct usbredirparser_trace_record rec;
+    uint64_t pos, tail, len;
+    int payload_len;
+
+    trace = __atomic_load_n(&parser->trace, __ATOMIC_ACQUIRE);
+    if (!trace)
+        return;
+
+    ring = (direction == usbredirparser_trace_received) ? &trace->rx
+                                                        : &trace->tx;
+    /* The data of control packets, like the capabilities in hello packets,
+       is always needed for replaying */
+    payload_len = (type < usb_redir_control_packet ||
+                   (trace->flags & usbredirparser_trace_fl_payload)) ?
+                  data_len : 0;
+    len = sizeof(rec) + type_header_len + payload_len;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (TRACE_ALIGN(len) > ring->mask + 1 - (ring->head - tail)) {
+        ring->dropped++;
+        return;
+    }
+
+    rec.timestamp = usbredirparser_trace_clock() - trace->start;
+    rec.id = id;
+    rec.type = type;
+    rec.data_len = data_len;
+    rec.dropped = ring->dropped;
+    rec.type_header_len = type_header_len;
+    rec.direction = direction;
+    rec.flags = (payload_len ? usbredirparser_trace_payload : 0) |
+                (using_32bits_ids ? usbredirparser_trace_32bits_ids : 0);
+
+    pos = ring->head;
+    usbredirparser_trace_copy_in(ring, pos, &rec, sizeof(rec));
+    pos += sizeof(rec);
+    usbredirparser_trace_copy_in(ring, pos, type_header, type_header_len);
+    pos += type_header_len;
+    usbredirparser_trace_copy_in(ring, pos, data, payload_len);
+    pos += payload_len;
+    usbredirparser_trace_copy_in(ring, pos, padding, TRACE_ALIGN(len) - len);
+
+    ring->dropped = 0;
+    __atomic_store_n(&ring->head, ring->head + TRACE_ALIGN(len),
+                     __ATOMIC_RELEASE);
+}
+
+static int usbredirparser_trace_write_record(struct usbredirparser_trace *trace,
+    struct usbredirparser_trace_ring *ring, uint64_t *len)
+{
+    struct usbredirparser_trace_record rec;
+    size_t off, n;
+
+    usbredirparser_trace_copy_out(ring, ring->tail, &rec, sizeof(rec));
+    *len = TRACE_ALIGN(sizeof(rec) + rec.type_header_len +
+                       ((rec.flags & usbredirparser_trace_payload) ?
+                        rec.data_len : 0));
+
+    /* The record may wrap around the end of the buffer */
+    off = ring->tail & ring->mask;
+    n = ring->mask + 1 - off;
+    if (n > *len)
+        n = *len;
+    if (trace->write_func(trace->priv, ring->buf + off, n))
+        return -1;
+    if (n < *len &&
+        trace->write_func(trace->priv, ring->buf, *len - n))
+        return -1;
+
+    return 0;
+}
+
+static int usbredirparser_trace_flush_records(
+    struct usbredirparser_priv *parser, struct usbredirparser_trace *trace)
+{
+    struct usbredirparser_trace_ring *ring;
+    uint64_t rx_head, tx_head, rx_ts, tx_ts, len;
+
+    /* Written here rather than when starting, so that it has the flags of
+       usbredirparser_init even if the trace was started before it */
+    if (!trace->header_written) {
+        struct usbredirparser_trace_header header = { { 0 }, };
+
+        memcpy(header.magic, USBREDIRPARSER_TRACE_MAGIC,
+               sizeof(USBREDIRPARSER_TRACE_MAGIC));
+        header.version = USBREDIRPARSER_TRACE_VERSION;
+        header.flags = parser->flags;
+        header.start_time = trace->start_time;
+        if (trace->write_func(trace->priv, (uint8_t *)&header,
+                              sizeof(header))) {
+            ERROR("error writing trace");
+            return -1;
+        }
+        trace->header_written = 1;
+    }
+
+    /* Only write what is there now, so that this terminates under load */
+    rx_head = __atomic_load_n(&trace->rx.head, __ATOMIC_ACQUIRE);
+    tx_head = __atomic_load_n(&trace->tx.head, __ATOMIC_ACQUIRE);
+
+    while (trace->rx.tail != rx_head || trace->tx.tail != tx_head) {
+        /* Merge both directions in timestamp order */
+        if (trace->rx.tail == rx_head) {
+            ring = &trace->tx;
+        } else if (trace->tx.tail == tx_head) {
+            ring = &trace->rx;
+        } else {
+            usbredirparser_trace_copy_out(&trace->rx, trace->rx.tail,
+                                          &rx_ts, sizeof(rx_ts));
+            usbredirparser_trace_copy_out(&trace->tx, trace->tx.tail,
+                                          &tx_ts, sizeof(tx_ts));
+            ring = (rx_ts <= tx_ts) ? &trace->rx : &trace->tx;
+        }
+
+        if (usbredirparser_trace_write_record(trace, ring, &len)) {
+            ERROR("error writing trace");
+            return -1;
+        }
+        __atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static int usbredirparser_trace_ring_init(
+    struct usbredirparser_trace_ring *ring, size_t size)
+{
+    ring->buf = malloc(size);
+    ring->mask = size - 1;
+    return ring->buf ? 0 : -1;
+}
+
+USBREDIR_VISIBLE
+int usbredirparser_start_trace(struct usbredirparser *parser_pub,
+    usbredirparser_trace_write trace_write_func, void *trace_priv,
+    size_t buffer_size, int flags)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_trace *trace;
+    size_t size = TRACE_MIN_BUFFER_SIZE;
+
+    if (parser->trace || !trace_write_func)
+        return -1;
+
+    /* Each direction gets half of the buffer */
+    while (size * 2 <= buffer_size / 2)
+        size *= 2;
+
+    trace = calloc(1, sizeof(*trace));
+    if (!trace ||
+        usbredirparser_trace_ring_init(&trace->rx, size) ||
+        usbredirparser_trace_ring_init(&trace->tx, size)) {
+        ERROR("Out of memory allocating trace buffer");
+        goto error;
+    }
+    trace->write_func = trace_write_func;
+    trace->priv = trace_priv;
+    trace->flags = flags;
+    trace->start_time = (uint64_t)time(NULL) * 1000000000;
+    trace->start = usbredirparser_trace_clock();
+
+    LOCK(parser);
+    __atomic_store_n(&parser->trace, trace, __ATOMIC_RELEASE);
+    UNLOCK(parser);
+    return 0;
+
+error:
+    if (trace) {
+        free(trace->rx.buf);
+        free(trace->tx.buf);
+        free(trace);
+    }
+    return -1;
+}
+
+USBREDIR_VISIBLE
+int usbredirparser_trace_flush(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_trace *trace;
+
+    trace = __atomic_load_n(&parser->trace, __ATOMIC_ACQUIRE);
+    if (!trace)
+        return 0;
+
+    return usbredirparser_trace_flush_records(parser, trace);
+}
+
+USBREDIR_VISIBLE
+void usbredirparser_stop_trace(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_trace *trace = parser->trace;
+
+    if (!trace)
+        return;
+
+    /* Sent packets are recorded with the lock held */
+    LOCK(parser);
+    __atomic_store_n(&parser->trace, NULL, __ATOMIC_RELEASE);
+    UNLOCK(parser);
+
+    usbredirparser_trace_flush_records(parser, trace);
+    free(trace->rx.buf);
+    free(trace->tx.buf);
+    free(trace);
+}
+
+/* Get the buffer to read the data of the current packet into, from the app's
+   get_data_buffer callback for data packets, or else by allocating it */
+static int usbredirparser_alloc_data(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint64_t id;
+
+    if (parser->callb.get_data_buffer_func &&
+            parser->header.type >= usb_redir_control_packet) {
+        /* For data packets this only checks the headers and data_len */
+        if (!usbredirparser_verify_type_header(parser_pub,
+                 parser->header.type, parser->type_header,
+                 NULL, parser->data_len, 0)) {
+            return 0;
+        }
+
+        if (usbredirparser_using_32bits_ids(parser_pub))
+            id = parser->header_32bit_id.id;
+        else
+            id = parser->header.id;
+
+        parser->data = parser->callb.get_data_buffer_func(parser->callb.priv,
+                           parser->header.type, id, parser->type_header,
+                           parser->data_len);
+        if (parser->data) {
+            parser->data_provided = true;
+            return 1;
+        }
+    }
+
+    parser->data = malloc(parser->data_len);
+    if (!parser->data) {
+        ERROR("Out of memory allocating data buffer");
+        return 0;
+    }
+    return 1;
+}
+
 USBREDIR_VISIBLE
 int usbredirparser_do_read(struct usbredirparser *parser_pub)
 {
@@ -1042,6 +1481,16 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
             r = parser->type_header_len - parser->type_header_read;
             dest = parser->type_header + parser->type_header_read;
         } else {
+            if (parser->data_len && !parser->data &&
+                    !usbredirparser_alloc_data(parser_pub)) {
+                parser->to_skip = parser->data_len;
+                parser->header_read = 0;
+                parser->type_header_len  = 0;
+                parser->type_header_read = 0;
+                parser->data_len = 0;
+                usbredirparser_assert_invariants(parser);
+                return usbredirparser_read_parse_error;
+            }
             r = parser->data_len - parser->data_read;
             dest = parser->data + parser->data_read;
         }
@@ -1095,16 +1544,6 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
                     return usbredirparser_read_parse_error;
                 }
                 data_len = parser->header.length - type_header_len;
-                if (data_len) {
-                    parser->data = malloc(data_len);
-                    if (!parser->data) {
-                        ERROR("Out of memory allocating data buffer");
-                        parser->to_skip = parser->header.length;
-                        parser->header_read = 0;
-                        usbredirparser_assert_invariants(parser);
-                        return usbredirparser_read_parse_error;
-                    }
-                }
                 parser->type_header_len = type_header_len;
                 parser->data_len = data_len;
             }
@@ -1113,11 +1552,27 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
         } else {
             parser->data_read += r;
             if (parser->data_read == parser->data_len) {
-                r = usbredirparser_verify_type_header(parser_pub,
+                int using_32bits_ids =
+                    usbredirparser_using_32bits_ids(parser_pub);
+
+                usbredirparser_trace_packet(parser,
+                    usbredirparser_trace_received, parser->header.type,
+                    using_32bits_ids ? parser->header_32bit_id.id
+                                     : parser->header.id,
+                    using_32bits_ids, parser->type_header,
+                    parser->type_header_len, parser->data, parser->data_len);
+                /* App provided buffers are verified before reading into them */
+                r = parser->data_provided ||
+                    usbredirparser_verify_type_header(parser_pub,
                          parser->header.type, parser->type_header,
                          parser->data, parser->data_len, 0);
-                data_ownership_transferred = false;
+                data_ownership_transferred = parser->data_provided;
                 if (r) {
+                    USBREDIR_PROBE(usbredirparser, packet_parsed,
+                        parser->header.type,
+                        using_32bits_ids ? parser->header_32bit_id.id
+                                         : parser->header.id,
+                        parser->data_len);
                     usbredirparser_call_type_func(parser_pub,
                                                   &data_ownership_transferred);
                 }
@@ -1130,6 +1585,7 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
                 parser->data_len  = 0;
                 parser->data_read = 0;
                 parser->data = NULL;
+                parser->data_provided = false;
                 if (!r) {
                     usbredirparser_assert_invariants(parser);
                     return usbredirparser_read_parse_error;
@@ -1149,21 +1605,95 @@ int usbredirparser_has_data_to_write(struct usbredirparser *parser_pub)
     return parser->write_buf_count;
 }
 
+/* Packets which are not for a specific endpoint are barriers: they only get
+   written once everything queued before them has been written, and nothing
+   queued after them gets written before them. Packets for endpoints only
+   get reordered relative to those of other endpoints, which the usb-guest /
+   usb-host can not tell apart from the transfers having taken a bit more or
+   less time. Note caller must hold the parser lock. */
+static bool usbredirparser_may_write(struct usbredirparser_priv *parser,
+    struct usbredirparser_buf *wbuf)
+{
+    int i;
+
+    if (!wbuf->barrier)
+        return wbuf->seq < parser->write_barrier_seq;
+
+    for (i = 0; i < WRITE_PRIOS; i++) {
+        if (parser->write_buf[i] && parser->write_buf[i]->seq < wbuf->seq)
+            return false;
+    }
+    return true;
+}
+
+/* Pick the priority class to write the next buffer from, or -1 if the queue
+   is empty. This is the highest class with a buffer which may be written,
+   unless a lower class has been passed over WRITE_STARVE_LIMIT times.
+   Once picked, a buffer gets written completely before the next pick.
+   Note caller must hold the parser lock. */
+static int usbredirparser_next_write_prio(struct usbredirparser_priv *parser)
+{
+    int i, prio = -1;
+
+    if (parser->write_cur != -1)
+        return parser->write_cur;
+
+    for (i = 0; i < WRITE_PRIOS; i++) {
+        if (!parser->write_buf[i] ||
+                !usbredirparser_may_write(parser, parser->write_buf[i]))
+            continue;
+        if (prio == -1) {
+            prio = i;
+        } else if (parser->write_buf_skipped[i] >= WRITE_STARVE_LIMIT) {
+            prio = i;
+            break;
+        }
+    }
+
+    for (i = 0; i < WRITE_PRIOS; i++) {
+        if (i == prio)
+            parser->write_buf_skipped[i] = 0;
+        else if (parser->write_buf[i])
+            parser->write_buf_skipped[i]++;
+    }
+    parser->write_cur = prio;
+    return prio;
+}
+
+/* The oldest queued barrier is always in the high priority class, as
+   barriers are not for an endpoint. Note caller must hold the parser lock */
+static void usbredirparser_update_barrier_seq(
+    struct usbredirparser_priv *parser)
+{
+    struct usbredirparser_buf *wbuf;
+
+    parser->write_barrier_seq = UINT64_MAX;
+    for (wbuf = parser->write_buf[usbredirparser_prio_high]; wbuf;
+            wbuf = wbuf->next) {
+        if (wbuf->barrier) {
+            parser->write_barrier_seq = wbuf->seq;
+            break;
+        }
+    }
+}
+
 USBREDIR_VISIBLE
 int usbredirparser_do_write(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
     struct usbredirparser_buf* wbuf;
-    int w, ret = 0;
+    int w, prio, ret = 0;
 
     LOCK(parser);
-    assert((parser->write_buf_count != 0) ^ (parser->write_buf == NULL));
+    assert((parser->write_buf_count != 0) ^
+           (parser->write_buf_total_size == 0));
 
     for (;;) {
-        wbuf = parser->write_buf;
-        if (!wbuf)
+        prio = usbredirparser_next_write_prio(parser);
+        if (prio == -1)
             break;
+        wbuf = parser->write_buf[prio];
 
         w = wbuf->len - wbuf->pos;
         w = parser->callb.write_func(parser->callb.priv,
@@ -1178,14 +1708,20 @@ int usbredirparser_do_write(struct usbredirparser *parser_pub)
                 w != wbuf->len)
             abort();
 
+        USBREDIR_PROBE(usbredirparser, write, w);
         wbuf->pos += w;
         if (wbuf->pos == wbuf->len) {
-            parser->write_buf = wbuf->next;
+            parser->write_buf[prio] = wbuf->next;
+            if (!wbuf->next)
+                parser->write_buf_tail[prio] = NULL;
+            parser->write_cur = -1;
+            if (wbuf->barrier)
+                usbredirparser_update_barrier_seq(parser);
             if (!(parser->flags & usbredirparser_fl_write_cb_owns_buffer))
                 free(wbuf->buf);
 
             parser->write_buf_total_size -= wbuf->len;
-            parser->write_buf_count--;
+            parser->write_buf_count -= wbuf->packets;
             free(wbuf);
         }
     }
@@ -1207,16 +1743,115 @@ void usbredirparser_free_packet_data(struct usbredirparser *parser,
     free(data);
 }
 
-static void usbredirparser_queue(struct usbredirparser *parser_pub,
-    uint32_t type, uint64_t id, void *type_header_in,
-    uint8_t *data_in, int data_len)
+/* Queue count packets of the same type with consecutive ids starting at id
+   in a single write buffer. The type header of packet i is at
+   type_headers_in + i * type_header_stride, its data_len[i] bytes of data
+   are at data_in[i]. */
+static uint8_t *usbredirparser_nth_type_header(void *type_headers,
+    size_t type_header_stride, int i)
+{
+    /* Packet types without a type header get passed NULL */
+    if (!type_headers)
+        return NULL;
+    return (uint8_t *)type_headers + i * type_header_stride;
+}
+
+/* Get the output queue priority class for a packet, and whether it is a
+   barrier, see usbredirparser_may_write */
+static int usbredirparser_packet_priority(struct usbredirparser_priv *parser,
+    uint32_t type, void *type_header, bool *barrier)
+{
+    int ep, prio;
+
+    *barrier = false;
+    switch (type) {
+    case usb_redir_control_packet:
+        ep = ((struct usb_redir_control_packet_header *)type_header)->endpoint;
+        prio = usbredirparser_prio_high;
+        break;
+    case usb_redir_interrupt_packet:
+        ep = ((struct usb_redir_interrupt_packet_header *)type_header)->endpoint;
+        prio = usbredirparser_prio_high;
+        break;
+    case usb_redir_start_interrupt_receiving:
+        ep = ((struct usb_redir_start_interrupt_receiving_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_high;
+        break;
+    case usb_redir_stop_interrupt_receiving:
+        ep = ((struct usb_redir_stop_interrupt_receiving_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_high;
+        break;
+    case usb_redir_interrupt_receiving_status:
+        ep = ((struct usb_redir_interrupt_receiving_status_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_high;
+        break;
+    case usb_redir_iso_packet:
+        ep = ((struct usb_redir_iso_packet_header *)type_header)->endpoint;
+        prio = usbredirparser_prio_medium;
+        break;
+    case usb_redir_start_iso_stream:
+        ep = ((struct usb_redir_start_iso_stream_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_medium;
+        break;
+    case usb_redir_stop_iso_stream:
+        ep = ((struct usb_redir_stop_iso_stream_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_medium;
+        break;
+    case usb_redir_iso_stream_status:
+        ep = ((struct usb_redir_iso_stream_status_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_medium;
+        break;
+    case usb_redir_bulk_packet:
+        ep = ((struct usb_redir_bulk_packet_header *)type_header)->endpoint;
+        prio = usbredirparser_prio_low;
+        break;
+    case usb_redir_buffered_bulk_packet:
+        ep = ((struct usb_redir_buffered_bulk_packet_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_low;
+        break;
+    case usb_redir_start_bulk_receiving:
+        ep = ((struct usb_redir_start_bulk_receiving_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_low;
+        break;
+    case usb_redir_stop_bulk_receiving:
+        ep = ((struct usb_redir_stop_bulk_receiving_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_low;
+        break;
+    case usb_redir_bulk_receiving_status:
+        ep = ((struct usb_redir_bulk_receiving_status_header *)
+              type_header)->endpoint;
+        prio = usbredirparser_prio_low;
+        break;
+    default:
+        *barrier = true;
+        return usbredirparser_prio_high;
+    }
+
+    ep = ((ep & 0x80) >> 3) | (ep & 0x0f);
+    if (parser->ep_priority[ep] != usbredirparser_prio_default)
+        prio = parser->ep_priority[ep];
+    return prio;
+}
+
+static void usbredirparser_queue_packets(struct usbredirparser *parser_pub,
+    uint32_t type, uint64_t id, void *type_headers_in,
+    size_t type_header_stride, uint8_t **data_in, int *data_len, int count)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    uint8_t *buf, *type_header_out, *data_out;
+    uint8_t *buf, *pos, *type_header_in;
     struct usb_redir_header *header;
-    struct usbredirparser_buf *wbuf, *new_wbuf;
-    int header_len, type_header_len, total_size;
+    struct usbredirparser_buf *new_wbuf;
+    int i, prio, header_len, type_header_len, total_size, using_32bits_ids;
 
     header_len = usbredirparser_get_header_len(parser_pub);
     type_header_len = usbredirparser_get_type_header_len(parser_pub, type, 1);
@@ -1225,13 +1860,19 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
         return;
     }
 
-    if (!usbredirparser_verify_type_header(parser_pub, type, type_header_in,
-                                           data_in, data_len, 1)) {
-        ERROR("error usbredirparser_send_* call invalid params, please report!!");
-        return;
+    total_size = 0;
+    for (i = 0; i < count; i++) {
+        type_header_in = usbredirparser_nth_type_header(type_headers_in,
+                                                        type_header_stride, i);
+        if (!usbredirparser_verify_type_header(parser_pub, type,
+                                               type_header_in, data_in[i],
+                                               data_len[i], 1)) {
+            ERROR("error usbredirparser_send_* call invalid params, please report!!");
+            return;
+        }
+        total_size += header_len + type_header_len + data_len[i];
     }
 
-    total_size = header_len + type_header_len + data_len;
     new_wbuf = calloc(1, sizeof(*new_wbuf));
     buf = malloc(total_size);
     if (!new_wbuf || !buf) {
@@ -1242,36 +1883,62 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
 
     new_wbuf->buf = buf;
     new_wbuf->len = total_size;
-
-    header = (struct usb_redir_header *)buf;
-    type_header_out = buf + header_len;
-    data_out = type_header_out + type_header_len;
-
-    header->type   = type;
-    header->length = type_header_len + data_len;
-    if (usbredirparser_using_32bits_ids(parser_pub))
-        ((struct usb_redir_header_32bit_id *)header)->id = id;
-    else
-        header->id = id;
-    memcpy(type_header_out, type_header_in, type_header_len);
-    memcpy(data_out, data_in, data_len);
+    new_wbuf->packets = count;
+
+    using_32bits_ids = usbredirparser_using_32bits_ids(parser_pub);
+    pos = buf;
+    for (i = 0; i < count; i++) {
+        type_header_in = usbredirparser_nth_type_header(type_headers_in,
+                                                        type_header_stride, i);
+        header = (struct usb_redir_header *)pos;
+        header->type   = type;
+        header->length = type_header_len + data_len[i];
+        if (using_32bits_ids)
+            ((struct usb_redir_header_32bit_id *)header)->id = id + i;
+        else
+            header->id = id + i;
+        pos += header_len;
+        memcpy(pos, type_header_in, type_header_len);
+        pos += type_header_len;
+        memcpy(pos, data_in[i], data_len[i]);
+        pos += data_len[i];
+    }
 
     LOCK(parser);
-    if (!parser->write_buf) {
-        parser->write_buf = new_wbuf;
-    } else {
-        /* limiting the write_buf's stack depth is our users responsibility */
-        wbuf = parser->write_buf;
-        while (wbuf->next)
-            wbuf = wbuf->next;
-
-        wbuf->next = new_wbuf;
-    }
+    /* All packets of a buffer are for the same endpoint */
+    prio = usbredirparser_packet_priority(parser, type, type_headers_in,
+                                          &new_wbuf->barrier);
+    new_wbuf->seq = parser->write_seq++;
+    if (new_wbuf->barrier && parser->write_barrier_seq == UINT64_MAX)
+        parser->write_barrier_seq = new_wbuf->seq;
+    /* limiting the write_buf's stack depth is our users responsibility */
+    if (parser->write_buf_tail[prio])
+        parser->write_buf_tail[prio]->next = new_wbuf;
+    else
+        parser->write_buf[prio] = new_wbuf;
+    parser->write_buf_tail[prio] = new_wbuf;
     parser->write_buf_total_size += total_size;
-    parser->write_buf_count++;
+    parser->write_buf_count += count;
+    for (i = 0; i < count; i++) {
+        USBREDIR_PROBE(usbredirparser, packet_queued, type, id + i,
+                       data_len[i]);
+        usbredirparser_trace_packet(parser, usbredirparser_trace_sent, type,
+            id + i, using_32bits_ids,
+            usbredirparser_nth_type_header(type_headers_in,
+                                           type_header_stride, i),
+            type_header_len, data_in[i], data_len[i]);
+    }
     UNLOCK(parser);
 }
 
+static void usbredirparser_queue(struct usbredirparser *parser_pub,
+    uint32_t type, uint64_t id, void *type_header_in,
+    uint8_t *data_in, int data_len)
+{
+    usbredirparser_queue_packets(parser_pub, type, id, type_header_in, 0,
+                                 &data_in, &data_len, 1);
+}
+
 USBREDIR_VISIBLE
 void usbredirparser_send_device_connect(struct usbredirparser *parser,
     struct usb_redir_device_connect_header *device_connect)
@@ -1538,6 +2205,29 @@ void usbredirparser_send_iso_packet(struct usbredirparser *parser,
                          data, data_len);
 }
 
+USBREDIR_VISIBLE
+void usbredirparser_send_iso_packets(struct usbredirparser *parser,
+    uint64_t id, struct usb_redir_iso_packet_header *iso_headers,
+    uint8_t **data, int count)
+{
+    int i, n, data_len[ISO_PACKETS_PER_WRITE_BUF];
+
+    while (count > 0) {
+        n = (count < ISO_PACKETS_PER_WRITE_BUF) ?
+            count : ISO_PACKETS_PER_WRITE_BUF;
+        for (i = 0; i < n; i++) {
+            data_len[i] = iso_headers[i].length;
+        }
+        usbredirparser_queue_packets(parser, usb_redir_iso_packet, id,
+                                     iso_headers, sizeof(*iso_headers),
+                                     data, data_len, n);
+        id += n;
+        iso_headers += n;
+        data += n;
+        count -= n;
+    }
+}
+
 USBREDIR_VISIBLE
 void usbredirparser_send_interrupt_packet(struct usbredirparser *parser,
     uint64_t id,
@@ -1719,10 +2409,11 @@ int usbredirparser_serialize(struct usbredirparser *parser_pub,
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf;
+    struct usbredirparser_buf *wbuf, *wbufs[WRITE_PRIOS];
     uint8_t *state = NULL, *pos = NULL;
     uint32_t write_buf_count = 0, len, remain = 0;
     ptrdiff_t write_buf_count_pos;
+    int i, prio;
 
     *state_dest = NULL;
     *state_len = 0;
@@ -1772,14 +2463,28 @@ int usbredirparser_serialize(struct usbredirparser *parser_pub,
     if (serialize_int(parser, &state, &pos, &remain, 0, "write_buf_count"))
         return -1;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
+    /* The rest of the buffer being written must go first, then the others
+       in the order in which they were queued */
+    memcpy(wbufs, parser->write_buf, sizeof(wbufs));
+    prio = parser->write_cur;
+    for (;;) {
+        if (prio == -1) {
+            for (i = 0; i < WRITE_PRIOS; i++) {
+                if (wbufs[i] && (prio == -1 || wbufs[i]->seq < wbufs[prio]->seq))
+                    prio = i;
+            }
+            if (prio == -1)
+                break;
+        }
+        wbuf = wbufs[prio];
+        wbufs[prio] = wbuf->next;
+        prio = -1;
+
         if (serialize_data(parser, &state, &pos, &remain,
                            wbuf->buf + wbuf->pos, wbuf->len - wbuf->pos,
                            "write-buf"))
             return -1;
         write_buf_count++;
-        wbuf = wbuf->next;
     }
     /* Patch in write_buf_count */
     memcpy(state + write_buf_count_pos, &write_buf_count, sizeof(int32_t));
@@ -1802,6 +2507,7 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         (struct usbredirparser_priv *)parser_pub;
     struct usbredirparser_buf *wbuf, **next;
     uint32_t orig_caps[USB_REDIR_CAPS_SIZE];
+    const int prio = usbredirparser_prio_high;
     uint8_t *data;
     uint32_t i, l, header_len, remain = len;
 
@@ -1816,7 +2522,7 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         return -1;
     }
 
-    if (!(parser->write_buf_count == 0 && parser->write_buf == NULL &&
+    if (!(parser->write_buf_count == 0 &&
           parser->write_buf_total_size == 0 &&
           parser->data == NULL && parser->header_read == 0 &&
           parser->type_header_read == 0 && parser->data_read == 0)) {
@@ -1955,7 +2661,9 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         usbredirparser_assert_invariants(parser);
         return -1;
     }
-    next = &parser->write_buf;
+    /* What the packets were for is not known anymore, so they are restored
+       as barriers, to be written in order */
+    next = &parser->write_buf[prio];
     usbredirparser_assert_invariants(parser);
     while (i) {
         uint8_t *buf = NULL;
@@ -1982,8 +2690,15 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         }
         wbuf->buf = buf;
         wbuf->len = l;
+        /* Packets queued together get restored as one */
+        wbuf->packets = 1;
+        wbuf->seq = parser->write_seq++;
+        wbuf->barrier = true;
+        if (parser->write_barrier_seq == UINT64_MAX)
+            parser->write_barrier_seq = wbuf->seq;
         *next = wbuf;
         next = &wbuf->next;
+        parser->write_buf_tail[prio] = wbuf;
         parser->write_buf_total_size += wbuf->len;
         parser->write_buf_count++;
         i--;
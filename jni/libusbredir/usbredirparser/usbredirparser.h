@@ -20,6 +20,8 @@
 */
 #pragma once
 
+#include <stdarg.h>
+#include <stddef.h>
 #include "usbredirproto.h"
 
 #define USBREDIRPARSER_SERIALIZE_MAGIC 0x55525031
@@ -36,6 +38,14 @@ enum { usbredirparser_none, usbredirparser_error, usbredirparser_warning,
        usbredirparser_info, usbredirparser_debug, usbredirparser_debug_data };
 typedef void (*usbredirparser_log)(void *priv, int level, const char *msg);
 
+/* Structured variant of usbredirparser_log, when set it gets called instead
+   of usbredirparser_log with the unformatted message, so that the message only
+   gets formatted when the app actually wants it. domain is the name of the
+   library logging the message ("usbredirparser" or "usbredirhost"), fmt and
+   args are as for vprintf; args may only be used once. */
+typedef void (*usbredirparser_log_va)(void *priv, int level,
+    const char *domain, const char *fmt, va_list args);
+
 /* Called by a usbredirparser to read/write data to its peer.
    Must return the amount of bytes read/written, 0 when the read/write would
    block (and this is undesirable) and -1 on error.
@@ -138,6 +148,21 @@ typedef void (*usbredirparser_buffered_bulk_packet)(void *priv, uint64_t id,
     struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
     uint8_t *data, int data_len);
 
+/* Optional data destination callback, called when the packet-type-specific
+   header of a data packet carrying data_len > 0 bytes of data has been
+   received and verified, before its data gets read.
+
+   The callback may return a buffer of at least data_len bytes, the parser
+   then reads the packet data straight into this buffer instead of into a
+   buffer it allocates itself. In this case the data packet complete callback
+   is guaranteed to be called next (unless the parser gets destroyed first),
+   with data pointing to the returned buffer, which remains owned by the app
+   and must *not* be passed to usbredirparser_free_packet_data.
+
+   Returning NULL makes the parser allocate the buffer as usual. */
+typedef uint8_t *(*usbredirparser_get_data_buffer)(void *priv, int type,
+    uint64_t id, void *type_header, int data_len);
+
 
 /* Public part of the data allocated by usbredirparser_alloc, *never* allocate
    a usbredirparser struct yourself, it may be extended in the future to add
@@ -195,6 +220,9 @@ struct usbredirparser {
     usbredirparser_bulk_receiving_status bulk_receiving_status_func;
     /* usbredir 0.6 new data packet complete callbacks */
     usbredirparser_buffered_bulk_packet buffered_bulk_packet_func;
+    /* usbredir 0.13 new non packet callbacks */
+    usbredirparser_get_data_buffer get_data_buffer_func;
+    usbredirparser_log_va log_va_func;
 };
 
 /* Allocate a usbredirparser, after this the app should set the callback app
@@ -221,6 +249,34 @@ void usbredirparser_init(struct usbredirparser *parser,
 
 void usbredirparser_destroy(struct usbredirparser *parser);
 
+/* Set the log level of the parser, messages with a level above verbose
+   are not generated at all, instead of being formatted and then passed to
+   log_func. The default is usbredirparser_debug_data, which logs everything. */
+void usbredirparser_set_verbose(struct usbredirparser *parser, int verbose);
+
+/* Priority classes of the output queue. Queued packets of a higher class
+   get written before those of lower classes, so that e.g. HID reports do not
+   have to wait for a burst of mass storage data to be sent first. A lower
+   class still gets a turn after being passed over a couple of times.
+
+   By default control and interrupt endpoints are high, iso endpoints medium
+   and bulk endpoints low priority. Packets of the same endpoint are always
+   written in order, and packets which are not for an endpoint, like
+   device_connect or configuration_status, in order with all others. */
+enum {
+    usbredirparser_prio_default = -1,
+    usbredirparser_prio_high,
+    usbredirparser_prio_medium,
+    usbredirparser_prio_low,
+};
+
+/* Set the output queue priority class for the packets of endpoint ep,
+   usbredirparser_prio_default goes back to the class by endpoint type.
+   This only applies to packets queued after the call, so it should be done
+   before ep is used. Returns 0 on success, -1 on invalid arguments. */
+int usbredirparser_set_ep_priority(struct usbredirparser *parser,
+    uint8_t ep, int priority);
+
 /* See if our side has a certain cap (checks the caps passed into _init) */
 int usbredirparser_have_cap(struct usbredirparser *parser, int cap);
 
@@ -362,7 +418,96 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
     uint64_t id,
     struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
     uint8_t *data, int data_len);
+/* Queue count iso packets with ids id up to id + count - 1 in one go, packet
+   i having header iso_headers[i] and iso_headers[i].length bytes of data at
+   data[i]. This puts the same packets on the wire as count calls to
+   usbredirparser_send_iso_packet, but allocates a single write buffer and
+   takes the lock only once, which is useful for sending all packets of
+   a completed iso transfer. */
+void usbredirparser_send_iso_packets(struct usbredirparser *parser,
+    uint64_t id, struct usb_redir_iso_packet_header *iso_headers,
+    uint8_t **data, int count);
+
+
+/* Tracing */
+
+/* A trace records the packets sent and received by a parser in a compact
+   binary format, so that a session can be replayed later. It starts with a
+   usbredirparser_trace_header, followed by one usbredirparser_trace_record
+   per packet. Each record is followed by the packet's type header, then by
+   the packet's data if usbredirparser_trace_payload is set in its flags, and
+   is padded with zeros to a multiple of 8 bytes. All fields are in host
+   byte order, like the usbredir protocol itself. */
+#define USBREDIRPARSER_TRACE_MAGIC "URTRACE"
+#define USBREDIRPARSER_TRACE_VERSION 1
+
+struct usbredirparser_trace_header {
+    char magic[8];          /* USBREDIRPARSER_TRACE_MAGIC */
+    uint32_t version;       /* USBREDIRPARSER_TRACE_VERSION */
+    uint32_t flags;         /* flags passed to usbredirparser_init */
+    uint64_t start_time;    /* wall clock time in ns since the epoch */
+};
+
+enum {
+    usbredirparser_trace_received,
+    usbredirparser_trace_sent,
+};
+
+/* usbredirparser_trace_record flags */
+enum {
+    usbredirparser_trace_payload = 0x01,    /* packet data follows */
+    usbredirparser_trace_32bits_ids = 0x02, /* sent with a 32 bit id */
+};
+
+struct usbredirparser_trace_record {
+    uint64_t timestamp;     /* ns since the start of the trace */
+    uint64_t id;
+    uint32_t type;
+    uint32_t data_len;      /* length of the data of the packet */
+    uint32_t dropped;       /* records lost before this one */
+    uint16_t type_header_len;
+    uint8_t direction;      /* usbredirparser_trace_received / _sent */
+    uint8_t flags;
+};
+
+/* Called from usbredirparser_trace_flush to write out the trace, this
+   should return 0 on success or -1 on error. */
+typedef int (*usbredirparser_trace_write)(void *priv, const uint8_t *data,
+    int count);
+
+/* usbredirparser_start_trace flags */
+enum {
+    /* also record the data of data packets, the data of control packets
+       is always recorded */
+    usbredirparser_trace_fl_payload = 0x01,
+};
+
+/* Start recording packets. Recording itself only copies the packet into a
+   lock-free buffer of buffer_size bytes, without calling trace_write_func,
+   so it can stay enabled in production. Records which do not fit into the
+   buffer are dropped and accounted for in the next record.
+
+   This must be called from the thread which calls usbredirparser_do_read,
+   or before reading starts. Call it before usbredirparser_init to also
+   record our hello packet, a trace can only be replayed if it contains the
+   usb-guest's hello packet.
+
+   Returns 0 on success, -1 on error (a trace is already running, or out of
+   memory). */
+int usbredirparser_start_trace(struct usbredirparser *parser,
+    usbredirparser_trace_write trace_write_func, void *trace_priv,
+    size_t buffer_size, int flags);
+
+/* Write out all buffered records through the trace_write_func. Call this
+   regularly, from any thread, but only from one thread at a time and not
+   concurrently with usbredirparser_stop_trace.
+
+   Returns 0 on success, -1 if trace_write_func failed. */
+int usbredirparser_trace_flush(struct usbredirparser *parser);
 
+/* Flush and stop recording, with the same threading restrictions as
+   usbredirparser_start_trace. This is also done by usbredirparser_destroy. */
+void usbredirparser_stop_trace(struct usbredirparser *parser);
 
 /* Serialization */
 
@@ -0,0 +1,40 @@
+/* usbredirprobes.h static tracepoints for usbredirparser and usbredirhost
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/* USDT probes for perf / bpftrace, enabled with the usdt meson option.
+   Without it these compile to nothing, with it a probe nobody is attached
+   to is a single nop. See tools/usbredir-latency.bt for an example.
+
+   usbredirparser provider:
+     packet_parsed(type, id, data_len): a packet from the peer is about to
+       be handed to its callback
+     packet_queued(type, id, data_len): a packet got queued for writing
+     write(len): len bytes of queued packets got written
+
+   usbredirhost provider:
+     transfer_submitted(ep, id): a transfer got submitted to libusb
+     transfer_done(ep, status, latency_us): the completion callback of a
+       transfer runs, status is the libusb_transfer_status and latency_us
+       the time since it got submitted, cancelled transfers are skipped
+*/
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define USBREDIR_PROBE(provider, name, ...) \
+    STAP_PROBEV(provider, name, __VA_ARGS__)
+#else
+#define USBREDIR_PROBE(provider, name, ...) do { } while (0)
+#endif
@@ -54,6 +54,10 @@ static int verbose = usbredirparser_info;
 static int client_fd, running = 1;
 static libusb_context *ctx;
 static struct usbredirhost *host;
+static const char *trace_filename;
+static const char *quirks_filename;
+static int trace_flags;
+static FILE *trace_file;
 
 static const struct option longopts[] = {
     { "port", required_argument, NULL, 'p' },
@@ -61,6 +65,10 @@ static const struct option longopts[] = {
     { "ipv4", required_argument, NULL, '4' },
     { "ipv6", required_argument, NULL, '6' },
     { "keepalive", required_argument, NULL, 'k' },
+    { "trace", required_argument, NULL, 't' },
+    { "trace-payload", no_argument, NULL, 'P' },
+    { "resume-window", required_argument, NULL, 'r' },
+    { "quirks", required_argument, NULL, 'q' },
     { "help", no_argument, NULL, 'h' },
     { NULL, 0, NULL, 0 }
 };
@@ -86,6 +94,12 @@ static int usbredirserver_read(void *priv, uint8_t *data, int count)
     return r;
 }
 
+static int usbredirserver_write_trace(void *priv, const uint8_t *data,
+    int count)
+{
+    return fwrite(data, 1, count, trace_file) == (size_t)count ? 0 : -1;
+}
+
 static int usbredirserver_write(void *priv, uint8_t *data, int count)
 {
     int r = write(client_fd, data, count);
@@ -108,6 +122,9 @@ static void usage(int exit_code, char *argv0)
         "Usage: %s [-p|--port <port>] [-v|--verbose <0-5>] "
         "[[-4|--ipv4 ipaddr]|[-6|--ipv6 ipaddr]] "
         "[-k|--keepalive seconds] "
+        "[-t|--trace file [--trace-payload]] "
+        "[-r|--resume-window seconds] "
+        "[-q|--quirks file] "
         "<busnum-devnum|vendorid:prodid>\n",
         argv0);
     exit(exit_code);
@@ -119,11 +136,12 @@ static void invalid_usb_device_id(char *usb_device_id, char *argv0)
     usage(1, argv0);
 }
 
-static void run_main_loop(void)
+/* Returns 1 if the loop ended because the client disconnected */
+static int run_main_loop(void)
 {
     const struct libusb_pollfd **pollfds = NULL;
     fd_set readfds, writefds;
-    int i, n, nfds;
+    int i, n, nfds, client_lost = 0;
     struct timeval timeout, *timeout_p;
 
     while (running && client_fd != -1) {
@@ -190,12 +208,80 @@ static void run_main_loop(void)
                 break;
             }
         }
+
+        if (trace_file && usbredirhost_trace_flush(host)) {
+            break;
+        }
     }
     if (client_fd != -1) { /* Broken out of the loop because of an error ? */
         close(client_fd);
         client_fd = -1;
+    } else {
+        client_lost = running;
     }
     free(pollfds);
+    return client_lost;
+}
+
+static libusb_device_handle *open_usb_device(int usbbus, int usbaddr,
+    int usbvendor, int usbproduct)
+{
+    libusb_device_handle *handle = NULL;
+
+    if (usbvendor != -1) {
+        handle = libusb_open_device_with_vid_pid(ctx, usbvendor,
+                                                 usbproduct);
+        if (!handle) {
+            fprintf(stderr,
+                "Could not open an usb-device with vid:pid %04x:%04x\n",
+                usbvendor, usbproduct);
+        } else if (verbose >= usbredirparser_info) {
+            libusb_device *dev;
+            dev = libusb_get_device(handle);
+            fprintf(stderr, "Open a usb-device with vid:pid %04x:%04x on "
+                    "bus %03x device %03x\n",
+                    usbvendor, usbproduct,
+                    libusb_get_bus_number(dev),
+                    libusb_get_device_address(dev));
+        }
+    } else {
+        libusb_device **list = NULL;
+        ssize_t i, n;
+
+        n = libusb_get_device_list(ctx, &list);
+        for (i = 0; i < n; i++) {
+            if (libusb_get_bus_number(list[i]) == usbbus &&
+                    libusb_get_device_address(list[i]) == usbaddr)
+                break;
+        }
+        if (i < n) {
+            if (libusb_open(list[i], &handle) != 0) {
+                fprintf(stderr,
+                    "Could not open usb-device at busnum-devnum %d-%d\n",
+                    usbbus, usbaddr);
+            }
+        } else {
+            fprintf(stderr,
+                "Could not find an usb-device at busnum-devnum %d-%d\n",
+                usbbus, usbaddr);
+        }
+        libusb_free_device_list(list, 1);
+    }
+    return handle;
+}
+
+/* Wait up to resume_window seconds for a new client, returns 1 if one is
+   ready to be accepted */
+static int wait_for_client(int server_fd, int resume_window)
+{
+    struct pollfd pfd = { .fd = server_fd, .events = POLLIN };
+    int r;
+
+    do {
+        r = poll(&pfd, 1, resume_window * 1000);
+    } while (r == -1 && errno == EINTR && running);
+
+    return r == 1;
 }
 
 static void quit_handler(int sig)
@@ -205,7 +291,7 @@ static void quit_handler(int sig)
 
 int main(int argc, char *argv[])
 {
-    int o, flags, server_fd = -1;
+    int o, flags, server_fd = -1, client_lost;
     char *endptr, *delim;
     int port       = 4000;
     int usbbus     = -1;
@@ -214,6 +300,7 @@ int main(int argc, char *argv[])
     int usbproduct = -1;
     int on = 1;
     int keepalive  = -1;
+    int resume_window = 0;
     char *ipv4_addr = NULL, *ipv6_addr = NULL;
     union {
         struct sockaddr_in v4;
@@ -222,7 +309,7 @@ int main(int argc, char *argv[])
     struct sigaction act;
     libusb_device_handle *handle = NULL;
 
-    while ((o = getopt_long(argc, argv, "hp:v:4:6:k:", longopts, NULL)) != -1) {
+    while ((o = getopt_long(argc, argv, "hp:v:4:6:k:t:r:q:", longopts, NULL)) != -1) {
         switch (o) {
         case 'p':
             port = strtol(optarg, &endptr, 10);
@@ -251,6 +338,23 @@ int main(int argc, char *argv[])
                 usage(1, argv[0]);
             }
             break;
+        case 't':
+            trace_filename = optarg;
+            break;
+        case 'P':
+            trace_flags |= usbredirparser_trace_fl_payload;
+            break;
+        case 'q':
+            quirks_filename = optarg;
+            break;
+        case 'r':
+            resume_window = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || resume_window < 0) {
+                fprintf(stderr, "Invalid value for --resume-window: '%s'\n",
+                        optarg);
+                usage(1, argv[0]);
+            }
+            break;
         case '?':
         case 'h':
             usage(o == '?', argv[0]);
@@ -361,6 +465,17 @@ int main(int argc, char *argv[])
     }
 
     while (running) {
+        /* Keep the device claimed for a client coming back, but not forever */
+        if (host && !wait_for_client(server_fd, resume_window)) {
+            if (running && verbose >= usbredirparser_info) {
+                fprintf(stderr, "No client within the resume window, "
+                        "releasing the usb-device\n");
+            }
+            usbredirhost_close(host);
+            host = NULL;
+            continue;
+        }
+
         client_fd = accept(server_fd, NULL, 0);
         if (client_fd == -1) {
             if (errno == EINTR) {
@@ -413,61 +528,59 @@ int main(int argc, char *argv[])
             break;
         }
 
-        /* Try to find the specified usb device */
-        if (usbvendor != -1) {
-            handle = libusb_open_device_with_vid_pid(ctx, usbvendor,
-                                                     usbproduct);
+        if (!host) {
+            /* Try to find the specified usb device */
+            handle = open_usb_device(usbbus, usbaddr, usbvendor, usbproduct);
             if (!handle) {
-                fprintf(stderr,
-                    "Could not open an usb-device with vid:pid %04x:%04x\n",
-                    usbvendor, usbproduct);
-            } else if (verbose >= usbredirparser_info) {
-                libusb_device *dev;
-                dev = libusb_get_device(handle);
-                fprintf(stderr, "Open a usb-device with vid:pid %04x:%04x on "
-                        "bus %03x device %03x\n",
-                        usbvendor, usbproduct,
-                        libusb_get_bus_number(dev),
-                        libusb_get_device_address(dev));
+                close(client_fd);
+                continue;
             }
-        } else {
-            libusb_device **list = NULL;
-            ssize_t i, n;
 
-            n = libusb_get_device_list(ctx, &list);
-            for (i = 0; i < n; i++) {
-                if (libusb_get_bus_number(list[i]) == usbbus &&
-                        libusb_get_device_address(list[i]) == usbaddr)
-                    break;
+            /* The device gets set after loading the quirks, which apply
+               from usbredirhost_set_device on */
+            host = usbredirhost_open(ctx, NULL, usbredirserver_log,
+                                     usbredirserver_read, usbredirserver_write,
+                                     NULL, SERVER_VERSION, verbose, 0);
+            if (!host)
+                exit(1);
+            if (quirks_filename &&
+                    usbredirhost_load_quirks(host, quirks_filename) !=
+                        usb_redir_success)
+                exit(1);
+            if (usbredirhost_set_device(host, handle) != usb_redir_success)
+                exit(1);
+        }
+        if (trace_filename) {
+            trace_file = fopen(trace_filename, "wb");
+            if (!trace_file) {
+                perror("Error opening trace file");
+                exit(1);
             }
-            if (i < n) {
-                if (libusb_open(list[i], &handle) != 0) {
-                    fprintf(stderr,
-                        "Could not open usb-device at busnum-devnum %d-%d\n",
-                        usbbus, usbaddr);
-                }
-            } else {
-                fprintf(stderr,
-                    "Could not find an usb-device at busnum-devnum %d-%d\n",
-                    usbbus, usbaddr);
+            if (usbredirhost_start_trace(host, usbredirserver_write_trace,
+                                         NULL, 4 * 1024 * 1024, trace_flags)) {
+                fprintf(stderr, "Could not start trace\n");
+                exit(1);
             }
-            libusb_free_device_list(list, 1);
         }
-        if (!handle) {
-            close(client_fd);
-            continue;
+        client_lost = run_main_loop();
+        if (trace_file) {
+            usbredirhost_stop_trace(host);
+            fclose(trace_file);
+            trace_file = NULL;
+        }
+        /* On a lost connection get the host ready for the client to come
+           back, it then gets the device without it being released, claimed
+           and reset again */
+        if (!(client_lost && resume_window > 0 &&
+              usbredirhost_reconnect_guest(host) == usb_redir_success)) {
+            usbredirhost_close(host);
+            host = NULL;
         }
-
-        host = usbredirhost_open(ctx, handle, usbredirserver_log,
-                                 usbredirserver_read, usbredirserver_write,
-                                 NULL, SERVER_VERSION, verbose, 0);
-        if (!host)
-            exit(1);
-        run_main_loop();
-        usbredirhost_close(host);
         handle = NULL;
     }
 
+    if (host)
+        usbredirhost_close(host);
     close(server_fd);
     libusb_exit(ctx);
     exit(0);
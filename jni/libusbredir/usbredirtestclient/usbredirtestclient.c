@@ -291,6 +291,7 @@ int main(int argc, char *argv[])
     if (!parser) {
         exit(1);
     }
+    usbredirparser_set_verbose(parser, verbose);
     parser->log_func = usbredirtestclient_log;
     parser->read_func = usbredirtestclient_read;
     parser->write_func = usbredirtestclient_write;